@@ -34,7 +34,7 @@ void listEmpty(list *list)
     while(len--) { ///通过len == 0来判断是否移除元素完毕
         next = current->next;
         if (list->free) list->free(current->value); ///调用list的free函数来释放当前节点的值
-        zfree(current); ///释放值后，还需要释放当前节点占用的内存
+        zslab_free(current); ///释放值后，还需要释放当前节点占用的内存
         current = next; ///将指针指向下一个节点
     }
     list->head = list->tail = NULL; ///将头节点和尾节点置空
@@ -58,7 +58,7 @@ list *listAddNodeHead(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL)///申请内存空间
+    if ((node = zslab_alloc(sizeof(*node))) == NULL)///申请内存空间，节点大小固定，从slab分配器分配
         return NULL;
     node->value = value; ///为节点赋值
     if (list->len == 0) { ///如果当前链表中还没有原属，list的hhead和tail均指向node
@@ -86,7 +86,7 @@ list *listAddNodeTail(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL)
+    if ((node = zslab_alloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -106,7 +106,7 @@ list *listAddNodeTail(list *list, void *value)
 list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL) ///为新的节点元素申请内存空间
+    if ((node = zslab_alloc(sizeof(*node))) == NULL) ///为新的节点元素申请内存空间
         return NULL;
     node->value = value; ///设置该节点的值
     if (after) { ///如果after > 0，表示在old_node后面添加一新的原属
@@ -148,7 +148,7 @@ void listDelNode(list *list, listNode *node)
     else///如果是尾节点，就直接更新尾节点指针即可
         list->tail = node->prev;
     if (list->free) list->free(node->value); ///释放当前节点值
-    zfree(node); ///释放节点内存
+    zslab_free(node); ///释放节点内存
     list->len--; ///将节点计算 -1
 }
 
@@ -1,6 +1,7 @@
 /*
  * redis中字典操作的实现
  */
+#define ZMALLOC_TAG ZMALLOC_TAG_DICT ///分配分析中记为dict，见zmalloc.h
 #include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,9 +10,15 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "dict.h"
 #include "zmalloc.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DICT_HAVE_X86_SIMD 1 ///可以在运行时选择SSE2/AVX2实现的tag匹配
+#endif
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
 #else
@@ -29,8 +36,56 @@ static unsigned int dict_force_resize_ratio = 5;///如果used / size 大于了di
 ///一些私有的方法
 static int _dictExpandIfNeeded(dict *ht); ///将字典ht进行扩展操作
 static unsigned long _dictNextPower(unsigned long size);  ///用来表示一个hash表数组大小的值，它为2的n次方并且大于size
+static unsigned long _dictNextBucketPower(unsigned long size); ///桶模式下能容纳size个元素的hash桶个数，它为2的n次方
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing); ///获取key对应的hash表中的索引
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr); ///初始化hash表
+static dictEntry *_dictAddRaw(dict *d, void *key, uint64_t hash, dictEntry **existing); ///dictAddRaw的实现
+static dictEntry *_dictChainFind(dict *d, const void *key, uint64_t h); ///链表模式下查找key
+static dictEntry *_dictChainDelete(dict *d, const void *key, uint64_t h, int nofree); ///链表模式下删除key
+static dictEntry *_dictBucketFindKey(dict *d, const void *key, uint64_t h); ///桶模式下查找key
+static dictEntry *_dictBucketFindPtr(dict *d, const void *oldptr, uint64_t h); ///桶模式下按key指针查找节点
+static dictEntry *_dictBucketDelete(dict *d, const void *key, uint64_t h, int nofree); ///桶模式下删除key
+static dictEntry *_dictBucketNext(dictIterator *iter); ///桶模式下迭代器的遍历
+static dictEntry *_dictBucketGetRandomKey(dict *d); ///桶模式下随机获取一个key
+static void _dictBucketScan(dictBucket *b, dictScanFunction *fn, void *privdata); ///桶模式下遍历一个桶链
+static void _dictRehashFinish(dict *d); ///rehash完成后的收尾工作
+static void *_dictAllocTable(dict *d, unsigned long size); ///为hash表申请数组
+static void _dictFreeTable(dict *d, dictht *ht); ///释放hash表的数组
+static int _dictBgEnter(dict *d, const uint64_t *hash); ///后台rehash期间，前台线程操作字典之前加锁
+static void _dictBgLeave(dict *d, int locked); ///前台线程操作字典之后解锁
+static void _dictBgCancel(dict *d); ///取消后台rehash，等待后台线程放下这个字典
+static void _dictIteratorStart(dictIterator *iter); ///迭代器开始遍历
+static void _dictPauseRehash(dict *d); ///暂停字典的rehash
+static void _dictResumeRehash(dict *d); ///恢复字典的rehash
+static dictEntry *_dictGetRandomKey(dict *d); ///dictGetRandomKey的实现
+static unsigned int _dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count); ///dictGetSomeKeys的实现
+static dictEntry **_dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+long long dictFingerprint(dict *d);
+
+/* 后台rehash的状态，只有调用过dictEnableBackgroundRehash()的字典才会分配，详细说明见“后台rehash”一节 */
+typedef struct dictBgRehash {
+    pthread_mutex_t lock; ///保护下面的状态，后台rehash期间前台线程操作字典时也需要持有
+    pthread_cond_t cond; ///后台线程归还一批hash桶时通知等待的前台线程
+    int pending; ///dictExpand开始了一次扩容，等待下一次操作字典时交给后台线程
+    int active; ///当前的rehash由后台线程负责（只由前台线程修改）
+    int busy; ///后台线程正在迁移[lo,hi)范围内的hash桶
+    int done; ///后台线程已经迁移完所有的hash桶，等待前台线程收尾
+    unsigned long lo, hi; ///后台线程当前认领的ht[0]下标范围
+    unsigned long moved; ///后台线程已经迁移但还没有合并到used中的节点数
+    int waiting; ///后台线程正在等待字典的锁（原子访问）
+    int paused; ///字典上有迭代器，后台线程已经放下它并移出了任务队列（原子访问，修改时同时持有字典的锁和bg_mutex）
+    int queued; ///是否在后台线程的任务队列中（以下字段由bg_mutex保护）
+    unsigned long epoch; ///每次交给后台线程时加一，用来识别同一个字典的不同任务
+    struct dict *next; ///任务队列中的下一个字典
+} dictBgRehash;
+
+///当前的rehash是否由后台线程负责，active只由前台线程修改，所以前台线程可以不加锁读取
+#define _dictBgActive(d) ((d)->bg && (d)->bg->active)
+
+/// 桶模式下key的hash指纹：hash值的高7位并将最高位置1，这样0就可以表示空槽位
+#define DICT_BUCKET_TAG(h) ((uint8_t)(0x80 | ((h) >> 57)))
+/// 桶头16个字节中前15个是tag，最后一个是used计数，匹配结果需要屏蔽掉used所在的位
+#define DICT_BUCKET_LANE_MASK ((1U<<DICT_BUCKET_SLOTS)-1)
 
 /***************************begin : 一系列关于hash的函数***********************************/
 static uint8_t dict_hash_function_seed[16];
@@ -68,6 +123,23 @@ static void _dictReset(dictht *ht)
     ht->size = 0;  ///将数组大小变为0
     ht->sizemask = 0; /// 将偏移量置为零
     ht->used = 0; ///将整个hash表中的元素个数置为零
+    ht->overflow = 0; ///将溢出桶的数量置为零
+}
+
+///hash表中数组占用的字节数
+static size_t _dictTableBytes(dict *d, unsigned long size) {
+    return size * (dictIsBucketed(d) ? sizeof(dictBucket) : sizeof(dictEntry*));
+}
+
+/* 为hash表申请一个有size个元素的数组，内容初始化为0。
+ * 很大的数组通过zcalloc_huge()单独映射并放在当前的NUMA节点上，减少首次访问时的缺页，开启透明大页时还能减少查找时的TLB miss。 */
+static void *_dictAllocTable(dict *d, unsigned long size) {
+    return zcalloc_huge(_dictTableBytes(d,size));
+}
+
+///释放hash表的数组
+static void _dictFreeTable(dict *d, dictht *ht) {
+    zfree_huge(ht->table,_dictTableBytes(d,ht->size));
 }
 
 ///创建一个新的hash表
@@ -79,6 +151,19 @@ dict *dictCreate(dictType *type, void *privDataPtr)
     return d;
 }
 
+/* 创建一个使用桶模式的hash表，除了节点指针的有效期之外，API和链表模式完全相同：节点保存在hash桶中，
+ * rehash时会被拷贝，所以节点指针只在下一次写字典之前有效。
+ * 目前还没有服务器的字典使用桶模式，这里只是库的一部分。数据库的字典（server.c中initServer()创建的db->dict）
+ * 要改用桶模式，需要先确认db.c、过期、淘汰和碎片整理的代码都不会在写字典之后继续使用之前得到的节点指针，
+ * 这些文件都不在这棵代码树中。 */
+dict *dictCreateBucketed(dictType *type, void *privDataPtr)
+{
+    dict *d = dictCreate(type,privDataPtr);
+
+    d->flags |= DICT_FLAG_BUCKETED;
+    return d;
+}
+
 ///初始化hash表的函数
 int _dictInit(dict *d, dictType *type, oid *privDataPtr)
 {
@@ -88,6 +173,8 @@ int _dictInit(dict *d, dictType *type, oid *privDataPtr)
     d->privdata = privDataPtr; ///私有数据的指针
     d->rehashidx = -1; ///设置是否正在进行rehash操作，-1表示没有进行
     d->iterators = 0; ///设置正在迭代的迭代器的数量
+    d->flags = 0; ///默认使用链表模式
+    d->bg = NULL; ///默认不开启后台rehash
     return DICT_OK; ///返回操作成功
 }
 
@@ -115,7 +202,13 @@ int dictExpand(dict *d, unsigned long size)
         return DICT_ERR;
 
     dictht n; ///定义一个新的hash表
-    unsigned long realsize = _dictNextPower(size); ///计算出适合的扩容的大小（2的指数）
+    unsigned long realsize; ///计算出适合的扩容的大小（2的指数）
+
+    ///桶模式下每个hash桶可以存放多个节点，数组大小按照负载因子换算成hash桶的个数
+    if (dictIsBucketed(d))
+        realsize = _dictNextBucketPower(size);
+    else
+        realsize = _dictNextPower(size);
 
     ///如果计算出realsize大小刚好和字典中的元素个数相等，就直接返回DICT_ERR
     if (realsize == d->ht[0].size) return DICT_ERR;
@@ -123,8 +216,9 @@ int dictExpand(dict *d, unsigned long size)
     ///初始化这个新的hash表的各个成员数据
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*)); ///为这个hash表中的数组申请内存空间
+    n.table = _dictAllocTable(d,realsize); ///为这个hash表中的数组申请内存空间
     n.used = 0;
+    n.overflow = 0;
 
     ///如果是第一次hash进行hash操作，表示ht[0]里面没有任何元素，我们就直接将字典的ht[0]指向n
     if (d->ht[0].table == NULL) {
@@ -134,9 +228,227 @@ int dictExpand(dict *d, unsigned long size)
 
     d->ht[1] = n; ///如果不是第一次hash操作，我们只能将字典的ht[1]指向n
     d->rehashidx = 0;///并且设置rehashidx，表示正在进行rehash操作
+    ///开启了后台rehash的字典在扩容时交给后台线程。dictExpand可能是在某个操作的中间被调用的，所以等到下一次操作字典时再交接
+    if (d->bg && realsize > d->ht[0].size) d->bg->pending = 1;
     return DICT_OK; /// 返回操作成功
 }
 
+/* ----------------------- 桶模式下hash桶的操作 ----------------------- */
+
+/* 桶头的tag匹配。
+ * 匹配函数一次处理桶b和它的第一个溢出桶b->child，返回一个位图：第0~14位对应b中匹配的槽位，
+ * 第16~30位对应b->child中匹配的槽位。桶头是连续的16个字节，正好可以用一条SSE2指令比较，
+ * AVX2则可以把两个桶头放在一个256位寄存器中一次比较32个tag。
+ * 具体使用哪一种实现在第一次调用时根据CPU的支持情况确定，不支持SIMD的平台使用SWAR的标量实现。
+ */
+typedef uint32_t (dictTagMatchFunction)(const dictBucket *b, uint8_t tag);
+
+///SWAR：返回x中值为0的字节组成的8位位图（第i位对应第i个字节）
+static inline uint32_t _dictSwarZeroBytes(uint64_t x) {
+    const uint64_t m = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t z = ~(((x & m) + m) | x | m); ///只有值为0的字节最高位为1，不会因为借位产生误判
+
+    return (uint32_t)(((z >> 7) * 0x0102040810204080ULL) >> 56); ///将每个字节的最高位收集到最高字节
+}
+
+///标量实现：将16字节的桶头当作两个64位整数，用SWAR的方式比较
+static uint32_t _dictTagMatch16Scalar(const dictBucket *b, uint8_t tag) {
+    uint64_t lo, hi, pattern = 0x0101010101010101ULL * tag;
+
+    memcpy(&lo,b->tags,sizeof(lo));
+    memcpy(&hi,b->tags+sizeof(lo),sizeof(hi));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap64(lo);
+    hi = __builtin_bswap64(hi);
+#endif
+    return (_dictSwarZeroBytes(lo ^ pattern) |
+            (_dictSwarZeroBytes(hi ^ pattern) << 8)) & DICT_BUCKET_LANE_MASK;
+}
+
+static uint32_t _dictTagMatchScalar(const dictBucket *b, uint8_t tag) {
+    uint32_t mask = _dictTagMatch16Scalar(b,tag);
+
+    if (b->child) mask |= _dictTagMatch16Scalar(b->child,tag) << 16;
+    return mask;
+}
+
+#ifdef DICT_HAVE_X86_SIMD
+///SSE2实现：每个桶头一次比较16个字节
+__attribute__((target("sse2")))
+static uint32_t _dictTagMatchSSE2(const dictBucket *b, uint8_t tag) {
+    __m128i pattern = _mm_set1_epi8((char)tag);
+    uint32_t mask;
+
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)b->tags),pattern));
+    mask &= DICT_BUCKET_LANE_MASK;
+    if (b->child) {
+        uint32_t cmask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*)b->child->tags),pattern));
+        mask |= (cmask & DICT_BUCKET_LANE_MASK) << 16;
+    }
+    return mask;
+}
+
+///AVX2实现：桶b和它的溢出桶的桶头放在同一个寄存器中，一次比较32个字节
+__attribute__((target("avx2")))
+static uint32_t _dictTagMatchAVX2(const dictBucket *b, uint8_t tag) {
+    const dictBucket *c = b->child ? b->child : b;
+    __m256i heads = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)b->tags)),
+        _mm_loadu_si128((const __m128i*)c->tags),1);
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(heads,_mm256_set1_epi8((char)tag)));
+
+    if (b->child) return mask & (DICT_BUCKET_LANE_MASK | (DICT_BUCKET_LANE_MASK << 16));
+    return mask & DICT_BUCKET_LANE_MASK;
+}
+#endif
+
+static uint32_t _dictTagMatchResolve(const dictBucket *b, uint8_t tag);
+static dictTagMatchFunction *dictTagMatch = _dictTagMatchResolve; ///当前使用的tag匹配实现
+
+///第一次调用时根据CPU支持的指令集选择tag匹配的实现，多个线程同时选择的结果是一样的，不需要加锁
+static uint32_t _dictTagMatchResolve(const dictBucket *b, uint8_t tag) {
+    dictTagMatchFunction *fn = _dictTagMatchScalar;
+
+#ifdef DICT_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fn = _dictTagMatchAVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        fn = _dictTagMatchSSE2;
+#endif
+    dictTagMatch = fn;
+    return fn(b,tag);
+}
+
+/* 在以b开头的桶链中查找tag和key都匹配的节点，找到返回节点的地址，否则返回NULL。
+ * 桶链每次前进两个桶，只有tag匹配的槽位才需要调用keyCompare比较key。
+ * 如果ownerptr不为NULL，则设置为节点所在的桶；如果prevptr不为NULL，则设置为桶链中该桶的前一个桶（头桶为NULL）。
+ */
+static dictEntry *_dictBucketFind(dict *d, dictBucket *b, const void *key, uint8_t tag,
+                                  dictBucket **ownerptr, dictBucket **prevptr) {
+    dictBucket *prev = NULL;
+
+    while (b) {
+        dictBucket *child = b->child;
+        uint32_t mask = dictTagMatch(b,tag);
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            dictBucket *owner = (bit < 16) ? b : child;
+            dictEntry *he = &owner->entries[bit & 15];
+
+            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+                if (ownerptr) *ownerptr = owner;
+                if (prevptr) *prevptr = (owner == b) ? prev : b;
+                return he;
+            }
+            mask &= mask-1; ///tag相同但key不同，继续比较下一个匹配的槽位
+        }
+        if (child == NULL) break;
+        prev = child;
+        b = child->child;
+    }
+    return NULL;
+}
+
+/* 在以b开头的桶链中占用一个空槽位，所有的桶都满了就挂接一个新的溢出桶，返回这个槽位的节点地址。
+ * overflow指向溢出桶的计数，前台线程传入hash表的overflow字段，后台rehash线程传入自己的计数。 */
+static dictEntry *_dictBucketInsert(dictBucket *b, uint8_t tag, unsigned long *overflow) {
+    dictEntry *he;
+    int i;
+
+    while (b->used == DICT_BUCKET_SLOTS) {
+        if (b->child == NULL) {
+            b->child = zcalloc(sizeof(*b));
+            (*overflow)++;
+        }
+        b = b->child;
+    }
+    for (i = 0; i < DICT_BUCKET_SLOTS; i++)
+        if (b->tags[i] == 0) break;
+    b->tags[i] = tag;
+    b->used++;
+    he = &b->entries[i];
+    he->next = NULL;
+    return he;
+}
+
+///释放hash桶b后面挂接的所有溢出桶，overflow的含义同_dictBucketInsert
+static void _dictBucketFreeChildren(dictBucket *b, unsigned long *overflow) {
+    dictBucket *child = b->child, *next;
+
+    while (child) {
+        next = child->child;
+        zfree(child);
+        (*overflow)--;
+        child = next;
+    }
+    b->child = NULL;
+}
+
+///返回以b开头的桶链中的节点数
+static unsigned long _dictBucketChainLen(dictBucket *b) {
+    unsigned long len = 0;
+
+    for (; b; b = b->child) len += b->used;
+    return len;
+}
+
+///hash表ht中下标为idx的hash桶是否为空
+static int _dictIndexIsEmpty(dict *d, dictht *ht, unsigned long idx) {
+    if (dictIsBucketed(d))
+        return ht->buckets[idx].used == 0 && ht->buckets[idx].child == NULL;
+    return ht->table[idx] == NULL;
+}
+
+/* 将ht[0]中下标为idx的hash桶中的所有节点迁移到ht[1]中，返回迁移的节点数。
+ * 这个函数不会修改两个hash表的used，由调用方根据返回值更新，这样后台rehash线程也可以使用它，
+ * overflow0、overflow1分别是ht[0]、ht[1]溢出桶的计数（见_dictBucketInsert）。
+ */
+static unsigned long _dictRehashBucket(dict *d, unsigned long idx,
+                                       unsigned long *overflow0, unsigned long *overflow1) {
+    unsigned long moved = 0;
+
+    if (dictIsBucketed(d)) {
+        dictBucket *head = &d->ht[0].buckets[idx], *b;
+        int i;
+
+        for (b = head; b; b = b->child) {
+            for (i = 0; i < DICT_BUCKET_SLOTS; i++) {
+                uint64_t h;
+                dictEntry *de;
+
+                if (b->tags[i] == 0) continue;
+                h = dictHashKey(d, b->entries[i].key) & d->ht[1].sizemask;
+                ///tag只和hash值有关，可以直接沿用
+                de = _dictBucketInsert(&d->ht[1].buckets[h],b->tags[i],overflow1);
+                *de = b->entries[i]; ///节点按值拷贝到新的hash桶中
+                moved++;
+            }
+        }
+        _dictBucketFreeChildren(head,overflow0);
+        memset(head->tags,0,sizeof(head->tags));
+        head->used = 0;
+    } else {
+        dictEntry *de = d->ht[0].table[idx], *nextde; ///获取ht[0]中hash表中下标为idx处的元素
+
+        while(de) {
+            uint64_t h;
+
+            nextde = de->next; ///获取该元素的下一个元素
+            h = dictHashKey(d, de->key) & d->ht[1].sizemask; ///获取该元素在新的hash中数组的位置，求出其下标
+            de->next = d->ht[1].table[h]; ///采用头插入的方式，讲这个元素插入到对应的链表的表头
+            d->ht[1].table[h] = de;///讲这个元素插入到数组对应的下标处
+            moved++; ///迁移的节点数加一
+            de = nextde; ///指向下一个要处理的元素
+        }
+        d->ht[0].table[idx] = NULL; ///将ht[0]中链表对应数组下标处的内容置空
+    }
+    return moved;
+}
+
 /* 执行N步渐步式哈希。 如果仍有从ht[0]移动到ht[1]的键，则返回1，否则返回0。
  *
  * 请注意，每次进行rehash操作是以一个hash表的索引为单位，也就是一个数组中对应的hash桶，这个hash有的元素很多，有的可能没有元素。
@@ -147,39 +459,32 @@ int dictRehash(dict *d, int n) {
     int empty_visits = n*10; ///最多访问的hash桶数量
     if (!dictIsRehashing(d)) return 0; ///如果此时没有进行rehash操作，直接返回0.
 
+    ///由后台线程负责迁移时，前台线程不迁移任何节点，只在后台线程完成后进行收尾
+    if (_dictBgActive(d)) {
+        _dictBgLeave(d,_dictBgEnter(d,NULL));
+        return dictIsRehashing(d);
+    }
+
 	///n步渐式hash，分n步进行
     while(n-- && d->ht[0].used != 0) { ///如果还在n步范围内，并且原hash表中还有元素，也就是ht[0]中的used不为0，则可以进行下面操作
-        dictEntry *de, *nextde;
+        unsigned long moved;
 
         /// 请注意rehashidx不会溢出，因为我们确定还有更多元素，因为ht[0].used！= 0 
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
-        while(d->ht[0].table[d->rehashidx] == NULL) {
+        while(_dictIndexIsEmpty(d,&d->ht[0],d->rehashidx)) {
             d->rehashidx++; 
             if (--empty_visits == 0) return 1; ///如果hash桶访问完了，就直接返回了
         }
-        de = d->ht[0].table[d->rehashidx]; ///获取ht[0]中hash表中下标为d->rehashinx出的元素
-       ///将该处hash桶中的元素移动到新的hash表中
-        while(de) {
-            uint64_t h;
-
-            nextde = de->next; ///获取该元素的下一个元素
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask; ///获取该元素在新的hash中数组的位置，求出其下标
-            de->next = d->ht[1].table[h]; ///采用头插入的方式，讲这个元素插入到对应的链表的表头
-            d->ht[1].table[h] = de;///讲这个元素插入到数组对应的下标处
-            d->ht[0].used--; ///ht[0]中的元素个数减一
-            d->ht[1].used++; ///ht[1]中的元素个数加一
-            de = nextde; ///指向下一个要处理的元素
-        }
-        d->ht[0].table[d->rehashidx] = NULL; ///将ht[0]中链表对应数组下标处的内容置空
+        ///将该处hash桶中的元素移动到新的hash表中
+        moved = _dictRehashBucket(d,d->rehashidx,&d->ht[0].overflow,&d->ht[1].overflow);
+        d->ht[0].used -= moved; ///ht[0]中的元素个数减少
+        d->ht[1].used += moved; ///ht[1]中的元素个数增加
         d->rehashidx++; ///更新rehashidx，将访问数组中下一个元素
     }
     
     ///检测我们是否已经已经完成了整个hash表的rehash操作
     if (d->ht[0].used == 0) { ///如果ht[0]中元素个数为0，表示已经进行完毕了
-        zfree(d->ht[0].table); ///释放ht[0]的内存
-        d->ht[0] = d->ht[1]; ///因为我们经常使用的ht[0],所以在完成rehash操作后，讲ht[0]指向ht[1]
-        _dictReset(&d->ht[1]); ///重置ht[1]
-        d->rehashidx = -1; ///将rehash标志设置为-1，表示未进行rehash操作
+        _dictRehashFinish(d);
         return 0;
     }
 
@@ -187,6 +492,20 @@ int dictRehash(dict *d, int n) {
     return 1; ///表示有更多的节点需要进行rehash操作
 }
 
+///rehash完成后释放ht[0]，并让ht[0]指向新的hash表
+static void _dictRehashFinish(dict *d) {
+    ///桶模式下rehashidx之后可能还残留着空的溢出桶（迭代期间删除节点时不会释放溢出桶），需要一并释放
+    if (dictIsBucketed(d) && d->ht[0].overflow) {
+        unsigned long i;
+        for (i = d->rehashidx; i < d->ht[0].size; i++)
+            _dictBucketFreeChildren(&d->ht[0].buckets[i],&d->ht[0].overflow);
+    }
+    _dictFreeTable(d,&d->ht[0]); ///释放ht[0]的内存
+    d->ht[0] = d->ht[1]; ///因为我们经常使用的ht[0],所以在完成rehash操作后，讲ht[0]指向ht[1]
+    _dictReset(&d->ht[1]); ///重置ht[1]
+    d->rehashidx = -1; ///将rehash标志设置为-1，表示未进行rehash操作
+}
+
 ///返回时间戳，单位为毫秒
 long long timeInMilliseconds(void) {
     struct timeval tv;
@@ -200,6 +519,12 @@ int dictRehashMilliseconds(dict *d, int ms) {
     long long start = timeInMilliseconds(); ///记录开始时间
     int rehashes = 0;
 
+    ///由后台线程负责迁移时不需要在前台花费时间，只检查后台线程是否已经完成
+    if (_dictBgActive(d)) {
+        dictRehash(d,1);
+        return 0;
+    }
+
     while(dictRehash(d,100)) {  ///rehash操作
         rehashes += 100; 
         if (timeInMilliseconds()-start > ms) break; ///到达指定的之间后，停止操作
@@ -211,9 +536,321 @@ int dictRehashMilliseconds(dict *d, int ms) {
  * 否则某些元素可能会丢失或重复。 通过字典中的常见查找或更新操作调用此函数，以便在活跃使用哈希表时将其自动从H1迁移到H2。 
  */
 static void _dictRehashStep(dict *d) {
+    if (_dictBgActive(d)) return; ///后台线程负责迁移时，前台的查找和更新操作不再附带rehash工作
     if (d->iterators == 0) dictRehash(d,1); ///如果没有迭代器，就进行1步rehash操作
 }
 
+/* ------------------------- 后台rehash ------------------------------ */
+
+/* 对于元素非常多的字典，扩容时的渐进式rehash会在很长一段时间里给每个前台操作附带额外的工作，
+ * 用dictEnableBackgroundRehash()开启后台rehash之后，扩容时由一个全局的后台线程负责把ht[0]中的节点迁移到ht[1]中。
+ *
+ * 后台线程每次从rehashidx开始认领一批hash桶[lo,hi)，认领和归还都在字典的锁中进行，迁移本身不持有锁。
+ * 扩容时ht[1]中下标为x的hash桶只会接收ht[0]中下标为(x & ht[0].sizemask)的hash桶中的节点，所以hash值为h的key
+ * 涉及的两个hash桶都属于ht[0]中的下标(h & ht[0].sizemask)：前台线程对这个key的操作只有在这个下标正好落在后台线程
+ * 认领的范围内时才需要等待这一批迁移完成，其他情况下可以和后台线程并发执行。
+ * 不针对单个key的操作（迭代器、dictScan、随机取key等）需要等待当前批次结束，迭代器存在期间后台线程暂停：
+ * 后台线程把字典移出任务队列并设置paused，最后一个迭代器释放时由前台线程放回队列并唤醒后台线程。
+ * paused期间后台线程不会访问这个字典，前台线程操作字典时不需要加锁。
+ *
+ * 后台线程不修改hash表的used，而是把迁移的节点数累加到moved中，由前台线程加锁时合并，所以dictSize()始终正确。
+ * 全部迁移完成后，由前台线程在下一次操作字典时释放ht[0]。缩容时hash桶之间没有上面的对应关系，仍然使用前台渐进式rehash。
+ *
+ * 只有链表模式的字典可以开启后台rehash：链表模式迁移的是节点指针，前台线程拿到的dictEntry*始终有效；
+ * 桶模式迁移时把节点按值拷贝到ht[1]并释放ht[0]的溢出桶，前台线程手中的dictEntry*会失效或者指向旧的拷贝。
+ */
+#define DICT_BG_REHASH_BATCH 256 ///后台线程每一批认领的hash桶数，桶模式下按照负载因子折算
+
+#define DICT_BG_IDLE 0 ///这个字典不需要后台线程处理
+#define DICT_BG_WORKED 1 ///迁移了一批hash桶
+#define DICT_BG_PAUSED 2 ///字典上有迭代器，暂停迁移
+#define DICT_BG_DONE 3 ///所有的hash桶都已经迁移完成
+
+static pthread_mutex_t bg_mutex = PTHREAD_MUTEX_INITIALIZER; ///保护后台线程的任务队列
+static pthread_cond_t bg_cond = PTHREAD_COND_INITIALIZER; ///队列中有新任务，或者后台线程放下了一个字典
+static dict *bg_queue = NULL; ///需要后台rehash的字典队列
+static dict *bg_current = NULL; ///后台线程当前正在处理的字典
+static int bg_thread_started = 0; ///后台线程是否已经创建
+static int bg_forking = 0; ///正在fork，后台线程不再认领新的批次
+static int bg_atfork = 0; ///是否已经注册了fork的处理函数
+
+///将字典加入任务队列的尾部，调用方需要持有bg_mutex
+static void _dictBgEnqueue(dict *d) {
+    dict **p = &bg_queue;
+
+    while (*p) p = &(*p)->bg->next;
+    *p = d;
+    d->bg->next = NULL;
+    d->bg->queued = 1;
+}
+
+///将字典从任务队列中移除，调用方需要持有bg_mutex
+static void _dictBgDequeue(dict *d) {
+    dict **p = &bg_queue;
+
+    while (*p && *p != d) p = &(*p)->bg->next;
+    if (*p) *p = d->bg->next;
+    d->bg->next = NULL;
+    d->bg->queued = 0;
+}
+
+///将后台线程迁移的节点数合并到两个hash表中，调用方需要持有字典的锁，或者确定后台线程不会再访问这个字典
+static void _dictBgFold(dict *d) {
+    dictBgRehash *bg = d->bg;
+
+    d->ht[0].used -= bg->moved;
+    d->ht[1].used += bg->moved;
+    bg->moved = 0;
+}
+
+/* 后台线程获取字典的锁。前台线程对字典的操作很密集，刚释放锁马上又会加锁，后台线程被唤醒时锁往往已经被拿走了，
+ * 所以先设置waiting，前台线程释放锁时看到waiting就主动让出CPU。 */
+static void _dictBgLock(dict *d) {
+    __atomic_add_fetch(&d->bg->waiting,1,__ATOMIC_RELAXED);
+    pthread_mutex_lock(&d->bg->lock);
+    __atomic_sub_fetch(&d->bg->waiting,1,__ATOMIC_RELAXED);
+}
+
+///后台线程每一次处理一个字典：认领一批hash桶，在不持有锁的情况下迁移，然后归还
+static int _dictBgRehashBatch(dict *d) {
+    dictBgRehash *bg = d->bg;
+    unsigned long lo, hi, idx, moved = 0;
+    int ret;
+
+    _dictBgLock(d);
+    if (!bg->active || bg->done) {
+        ret = bg->done ? DICT_BG_DONE : DICT_BG_IDLE;
+        pthread_mutex_unlock(&bg->lock);
+        return ret;
+    }
+    if (d->iterators) { ///有迭代器或者dictScan正在进行时不能移动节点，移出任务队列，等_dictResumeRehash()放回
+        pthread_mutex_lock(&bg_mutex);
+        if (bg->queued) _dictBgDequeue(d);
+        __atomic_store_n(&bg->paused,1,__ATOMIC_RELEASE);
+        pthread_mutex_unlock(&bg_mutex);
+        pthread_mutex_unlock(&bg->lock);
+        return DICT_BG_PAUSED;
+    }
+    lo = d->rehashidx;
+    hi = lo + DICT_BG_REHASH_BATCH;
+    if (hi > d->ht[0].size) hi = d->ht[0].size;
+    bg->lo = lo;
+    bg->hi = hi;
+    bg->busy = 1;
+    pthread_mutex_unlock(&bg->lock);
+
+    ///[lo,hi)范围内的hash桶以及它们在ht[1]中对应的hash桶现在只有后台线程会访问
+    for (idx = lo; idx < hi; idx++) {
+        if (_dictIndexIsEmpty(d,&d->ht[0],idx)) continue;
+        moved += _dictRehashBucket(d,idx,NULL,NULL); ///链表模式不使用溢出桶计数
+    }
+
+    _dictBgLock(d);
+    d->rehashidx = hi;
+    bg->moved += moved;
+    bg->busy = 0;
+    if (hi == d->ht[0].size) bg->done = 1;
+    ret = bg->done ? DICT_BG_DONE : DICT_BG_WORKED;
+    pthread_cond_broadcast(&bg->cond);
+    pthread_mutex_unlock(&bg->lock);
+    return ret;
+}
+
+///后台线程的主循环：轮流处理任务队列中的字典，每次一批
+static void *_dictBgRehashMain(void *arg) {
+    DICT_NOTUSED(arg);
+
+    pthread_mutex_lock(&bg_mutex);
+    while (1) {
+        dict *d;
+        unsigned long epoch;
+        int ret;
+
+        while (bg_queue == NULL || bg_forking) pthread_cond_wait(&bg_cond,&bg_mutex);
+        d = bg_queue;
+        _dictBgDequeue(d); ///移到队尾，多个字典轮流处理
+        _dictBgEnqueue(d);
+        epoch = d->bg->epoch;
+        bg_current = d;
+        pthread_mutex_unlock(&bg_mutex);
+
+        ret = _dictBgRehashBatch(d);
+
+        pthread_mutex_lock(&bg_mutex);
+        ///在放下字典之前检查epoch：前台线程可能已经收尾并且开始了下一次扩容，这时不能把新的任务移除
+        if (ret == DICT_BG_DONE && d->bg->queued && d->bg->epoch == epoch)
+            _dictBgDequeue(d);
+        bg_current = NULL;
+        pthread_cond_broadcast(&bg_cond);
+    }
+    return NULL;
+}
+
+/* fork之前等待后台线程做完当前这一批并放下字典：迁移到一半的hash桶如果出现在子进程（比如BGSAVE）中，
+ * 子进程看到的字典就是不完整的。bg_forking让后台线程暂时不再认领新的批次，fork之后在父进程中恢复。
+ * 子进程中没有后台线程，队列中的字典停在rehash的中间状态，查找和遍历仍然正确；
+ * 子进程中再有字典交给后台线程时重新创建线程，处理整个队列。 */
+static void _dictBgAtforkPrepare(void) {
+    pthread_mutex_lock(&bg_mutex);
+    bg_forking = 1;
+    while (bg_current) pthread_cond_wait(&bg_cond,&bg_mutex);
+}
+
+static void _dictBgAtforkParent(void) {
+    bg_forking = 0;
+    pthread_cond_broadcast(&bg_cond);
+    pthread_mutex_unlock(&bg_mutex);
+}
+
+static void _dictBgAtforkChild(void) {
+    bg_forking = 0;
+    bg_thread_started = 0;
+    pthread_mutex_unlock(&bg_mutex);
+}
+
+///把当前的扩容交给后台线程，调用方需要持有字典的锁。创建线程失败时继续使用前台渐进式rehash
+static void _dictBgStart(dict *d) {
+    dictBgRehash *bg = d->bg;
+
+    pthread_mutex_lock(&bg_mutex);
+    if (!bg_thread_started) {
+        pthread_t tid;
+
+        if (!bg_atfork) {
+            pthread_atfork(_dictBgAtforkPrepare,_dictBgAtforkParent,_dictBgAtforkChild);
+            bg_atfork = 1;
+        }
+        if (pthread_create(&tid,NULL,_dictBgRehashMain,NULL) != 0) {
+            pthread_mutex_unlock(&bg_mutex);
+            return;
+        }
+        pthread_detach(tid);
+        bg_thread_started = 1;
+    }
+    bg->active = 1;
+    bg->done = 0;
+    __atomic_store_n(&bg->paused,0,__ATOMIC_RELAXED);
+    bg->epoch++;
+    _dictBgEnqueue(d);
+    pthread_cond_broadcast(&bg_cond);
+    pthread_mutex_unlock(&bg_mutex);
+}
+
+///后台线程迁移完成后由前台线程收尾，调用方需要持有字典的锁
+static void _dictBgFinish(dict *d) {
+    dictBgRehash *bg = d->bg;
+
+    assert(d->ht[0].used == 0);
+    _dictRehashFinish(d);
+    bg->active = 0;
+    bg->done = 0;
+    pthread_mutex_lock(&bg_mutex);
+    if (bg->queued) _dictBgDequeue(d);
+    pthread_mutex_unlock(&bg_mutex);
+}
+
+/* 前台线程操作字典之前调用。hash不为NULL时表示只访问这个hash值对应的hash桶，只有当它正好在后台线程认领的范围内时
+ * 才需要等待；hash为NULL时表示要访问整个字典，需要等待后台线程的当前批次结束。
+ * 如果加了锁返回1，调用方操作完成之后需要用同样的返回值调用_dictBgLeave()。
+ */
+static int _dictBgEnter(dict *d, const uint64_t *hash) {
+    dictBgRehash *bg = d->bg;
+
+    if (bg == NULL || !(bg->active || bg->pending)) return 0;
+    ///后台线程因为迭代器暂停时不会访问这个字典，它之前写入的moved在paused之前可见，不需要加锁
+    if (!bg->pending && __atomic_load_n(&bg->paused,__ATOMIC_ACQUIRE)) {
+        _dictBgFold(d);
+        return 0;
+    }
+    pthread_mutex_lock(&bg->lock);
+    if (bg->pending) { ///dictExpand开始的扩容在这里交给后台线程，此时没有正在进行的操作
+        bg->pending = 0;
+        if (dictIsRehashing(d)) _dictBgStart(d);
+    }
+    if (hash) {
+        unsigned long idx = *hash & d->ht[0].sizemask;
+        while (bg->busy && idx >= bg->lo && idx < bg->hi)
+            pthread_cond_wait(&bg->cond,&bg->lock);
+    } else {
+        while (bg->busy) pthread_cond_wait(&bg->cond,&bg->lock);
+    }
+    _dictBgFold(d);
+    if (bg->done) _dictBgFinish(d);
+    return 1;
+}
+
+static void _dictBgLeave(dict *d, int locked) {
+    if (!locked) return;
+    pthread_mutex_unlock(&d->bg->lock);
+    if (__atomic_load_n(&d->bg->waiting,__ATOMIC_RELAXED)) sched_yield(); ///让后台线程拿到锁，见_dictBgLock()
+}
+
+///取消后台rehash并等待后台线程放下这个字典，之后前台线程可以直接操作字典。已经迁移的节点仍然有效，rehash状态保持不变
+static void _dictBgCancel(dict *d) {
+    dictBgRehash *bg = d->bg;
+
+    if (bg == NULL) return;
+    pthread_mutex_lock(&bg_mutex);
+    if (bg->queued) _dictBgDequeue(d);
+    while (bg_current == d) pthread_cond_wait(&bg_cond,&bg_mutex);
+    pthread_mutex_unlock(&bg_mutex);
+    _dictBgFold(d);
+    bg->pending = bg->active = bg->busy = bg->done = 0;
+    __atomic_store_n(&bg->paused,0,__ATOMIC_RELAXED);
+}
+
+///暂停字典的rehash：增加迭代器计数，后台线程在计数不为0时不会迁移节点
+static void _dictPauseRehash(dict *d) {
+    int locked = _dictBgEnter(d,NULL);
+
+    d->iterators++;
+    _dictBgLeave(d,locked);
+}
+
+///最后一个迭代器释放时把暂停的字典放回任务队列并唤醒后台线程，调用方需要持有字典的锁
+static void _dictBgWake(dict *d) {
+    pthread_mutex_lock(&bg_mutex);
+    __atomic_store_n(&d->bg->paused,0,__ATOMIC_RELAXED);
+    if (!d->bg->queued) _dictBgEnqueue(d);
+    pthread_cond_broadcast(&bg_cond);
+    pthread_mutex_unlock(&bg_mutex);
+}
+
+///恢复字典的rehash
+static void _dictResumeRehash(dict *d) {
+    if (d->bg) {
+        pthread_mutex_lock(&d->bg->lock);
+        if (--d->iterators == 0 && d->bg->paused) _dictBgWake(d);
+        pthread_mutex_unlock(&d->bg->lock);
+    } else {
+        d->iterators--;
+    }
+}
+
+/* 迭代器第一次调用dictNext时调用：安全迭代器增加字典的迭代器计数，不安全的迭代器计算fingerprint。
+ * 开启了后台rehash的字典，不安全的迭代器同样要增加迭代器计数，让后台线程在迭代期间暂停。 */
+static void _dictIteratorStart(dictIterator *iter) {
+    dict *d = iter->d;
+    int locked = _dictBgEnter(d,NULL);
+
+    if (iter->safe || d->bg) d->iterators++;
+    if (!iter->safe) iter->fingerprint = dictFingerprint(d);
+    _dictBgLeave(d,locked);
+}
+
+///为字典开启后台rehash，之后这个字典的扩容由后台线程完成。必须在字典上没有迭代器的时候调用，不支持桶模式的字典
+void dictEnableBackgroundRehash(dict *d) {
+    dictBgRehash *bg;
+
+    if (d->bg) return;
+    assert(d->iterators == 0);
+    assert(!dictIsBucketed(d)); ///桶模式下节点会被拷贝，见“后台rehash”一节
+    bg = zcalloc(sizeof(*bg));
+    pthread_mutex_init(&bg->lock,NULL);
+    pthread_cond_init(&bg->cond,NULL);
+    d->bg = bg;
+}
+
 ///在字典中新增一个键值对
 int dictAdd(dict *d, void *key, void *val)
 {
@@ -236,6 +873,17 @@ int dictAdd(dict *d, void *key, void *val)
   *如果添加了键，则哈希条目将返回以由调用方进行操作。
   */
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
+{
+    uint64_t hash = dictHashKey(d,key);
+    int locked = _dictBgEnter(d,&hash); ///后台rehash期间需要加锁
+    dictEntry *entry = _dictAddRaw(d,key,hash,existing);
+
+    _dictBgLeave(d,locked);
+    return entry;
+}
+
+///dictAddRaw的实现，hash为key的hash值
+static dictEntry *_dictAddRaw(dict *d, void *key, uint64_t hash, dictEntry **existing)
 {
     long index;
     dictEntry *entry;
@@ -245,14 +893,19 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     ///根据key计算出该key在hash表中对应的数组下表，如果说key已经存在了，直接返回-1
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    if ((index = _dictKeyIndex(d, key, hash, existing)) == -1)
         return NULL;
 
     ///分配内存并存储新的键值对。 假设在数据库系统中更有可能更频繁地访问最近添加的键值对，则将元素插入顶部。
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0]; ///如果正在进行rehash操作，则将这个元素放到h[1]中，否则放到h[0]中
-    entry = zmalloc(sizeof(*entry)); ///申请一个节点的内存空间
-    entry->next = ht->table[index]; ///采用头插入的方式，将这个节点加入到链表的头部
-    ht->table[index] = entry; ///讲这个节点放入到对应的数组下标的位置
+    if (dictIsBucketed(d)) {
+        ///桶模式下直接占用hash桶中的一个槽位
+        entry = _dictBucketInsert(&ht->buckets[index],DICT_BUCKET_TAG(hash),&ht->overflow);
+    } else {
+        entry = zslab_alloc(sizeof(*entry)); ///申请一个节点的内存空间，节点大小固定，从slab分配器分配
+        entry->next = ht->table[index]; ///采用头插入的方式，将这个节点加入到链表的头部
+        ht->table[index] = entry; ///讲这个节点放入到对应的数组下标的位置
+    }
     ht->used++; ///更新ht中的元素个数
 
     /* Set the hash entry fields. */
@@ -292,13 +945,28 @@ dictEntry *dictAddOrFind(dict *d, void *key) {
 ///搜索并删除一个元素。 这是dictDelete（）和dictUnlink（）的辅助函数
 ///nofree表示是否要释放key和value
 static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
-    uint64_t h, idx; 
+    uint64_t h;
+    dictEntry *he;
+    int locked;
+
+    if (d->ht[0].used == 0 && d->ht[1].used == 0) return NULL; ///如果是一个空字典，则直接返回
+    h = dictHashKey(d, key); ///计算key对应的hash值
+    locked = _dictBgEnter(d,&h); ///后台rehash期间需要加锁
+    if (dictIsBucketed(d)) ///桶模式下单独处理
+        he = _dictBucketDelete(d,key,h,nofree);
+    else
+        he = _dictChainDelete(d,key,h,nofree);
+    _dictBgLeave(d,locked);
+    return he;
+}
+
+///链表模式下删除key，h为key的hash值
+static dictEntry *_dictChainDelete(dict *d, const void *key, uint64_t h, int nofree) {
+    uint64_t idx;
     dictEntry *he, *prevHe;
     int table;
 
-    if (d->ht[0].used == 0 && d->ht[1].used == 0) return NULL; ///如果是一个空字典，则直接返回
     if (dictIsRehashing(d)) _dictRehashStep(d); ///如果字典正在进行rehash操作，则让它进行1步rehash
-    h = dictHashKey(d, key); ///计算key对应的hash值
 
     for (table = 0; table <= 1; table++) { 
         idx = h & d->ht[table].sizemask; //获取元素在数组中对应的下标
@@ -313,7 +981,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                 if (!nofree) { ///如果说要释放key和val
                     dictFreeKey(d, he);  ///释放key
                     dictFreeVal(d, he);  ///释放val
-                    zfree(he); ///释放这个节点
+                    zslab_free(he); ///释放这个节点
                 }
                 d->ht[table].used--; ///字典中的节点数减一
                 return he; ///返回删除的节点
@@ -354,13 +1022,35 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
     if (he == NULL) return;
     dictFreeKey(d, he); ///释放key
     dictFreeVal(d, he); ///释放val
-    zfree(he); ///释放节点
+    zslab_free(he); ///释放节点
 }
 
 ///销毁这个字典
 int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
 
+    ///桶模式下节点内联在hash桶中，只需要释放key、value和溢出桶
+    if (dictIsBucketed(d)) {
+        for (i = 0; i < ht->size && (ht->used > 0 || ht->overflow > 0); i++) {
+            dictBucket *b;
+            int j;
+
+            if (callback && (i & 65535) == 0) callback(d->privdata);
+            for (b = &ht->buckets[i]; b; b = b->child) {
+                for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+                    if (b->tags[j] == 0) continue;
+                    dictFreeKey(d, &b->entries[j]);
+                    dictFreeVal(d, &b->entries[j]);
+                    ht->used--;
+                }
+            }
+            _dictBucketFreeChildren(&ht->buckets[i],&ht->overflow);
+        }
+        _dictFreeTable(d,ht);
+        _dictReset(ht);
+        return DICT_OK;
+    }
+
     ///释放所有的数据节点
     for (i = 0; i < ht->size && ht->used > 0; i++) { ///遍历整个链表
         dictEntry *he, *nextHe; 
@@ -372,13 +1062,13 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
             nextHe = he->next; ///获取下一个节点
             dictFreeKey(d, he); ///释放key
             dictFreeVal(d, he); ///释放value
-            zfree(he); ///释放这个节点
+            zslab_free(he); ///释放这个节点
             ht->used--; ///可用节点数减一
             he = nextHe; ///指向先一个接节点
         }
     }
     ///释放hash表
-    zfree(ht->table);
+    _dictFreeTable(d,ht);
     ///重置整个字典
     _dictReset(ht);
     return DICT_OK; ///因为为不会失败，直接返回操作成功
@@ -387,8 +1077,14 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
 ///清除和释放hash表
 void dictRelease(dict *d)
 {
+    _dictBgCancel(d); ///等待后台线程放下这个字典
     _dictClear(d,&d->ht[0],NULL); ///清除ht[0]
     _dictClear(d,&d->ht[1],NULL); ///清除ht[1]
+    if (d->bg) { ///释放后台rehash的状态
+        pthread_mutex_destroy(&d->bg->lock);
+        pthread_cond_destroy(&d->bg->cond);
+        zfree(d->bg);
+    }
     zfree(d); ///释放字典
 }
 
@@ -396,11 +1092,27 @@ void dictRelease(dict *d)
 dictEntry *dictFind(dict *d, const void *key)
 {
     dictEntry *he;
-    uint64_t h, idx, table;
+    uint64_t h;
+    int locked;
 
     if (dictSize(d) == 0) return NULL; ///如果字典为空，直接返回NUL
-    if (dictIsRehashing(d)) _dictRehashStep(d); ///如果字典正在进行rehash操作，则直接将其转变为一步rehash
     h = dictHashKey(d, key); ///获取hash值
+    locked = _dictBgEnter(d,&h); ///后台rehash期间需要加锁
+    if (dictIsBucketed(d)) ///桶模式下单独处理
+        he = _dictBucketFindKey(d,key,h);
+    else
+        he = _dictChainFind(d,key,h);
+    _dictBgLeave(d,locked);
+    return he;
+}
+
+///链表模式下查找key，h为key的hash值
+static dictEntry *_dictChainFind(dict *d, const void *key, uint64_t h)
+{
+    dictEntry *he;
+    uint64_t idx, table;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d); ///如果字典正在进行rehash操作，则直接将其转变为一步rehash
     for (table = 0; table <= 1; table++) { ///在hash表中进行查找
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
@@ -422,6 +1134,120 @@ void *dictFetchValue(dict *d, const void *key) {
     return he ? dictGetVal(he) : NULL; ///如果key存在，再获取val，否则返回NULL
 }
 
+/* 批量查找时，返回hash值为h的key当前所在的hash表下标。rehash期间rehashidx之前的hash桶已经迁移到了ht[1]中 */
+static int _dictBatchTable(dict *d, uint64_t h) {
+    if (dictIsRehashing(d) && (h & d->ht[0].sizemask) < (unsigned long)d->rehashidx) return 1;
+    return 0;
+}
+
+/* 批量查找时，返回hash值为h的key最可能对应的节点：链表模式下是链表的第一个节点，
+ * 桶模式下是第一个tag匹配的槽位。只用于预取，不保证就是要找的节点 */
+static dictEntry *_dictBatchCandidate(dict *d, uint64_t h) {
+    dictht *ht = &d->ht[_dictBatchTable(d,h)];
+
+    if (dictIsBucketed(d)) {
+        dictBucket *b = &ht->buckets[h & ht->sizemask];
+        uint32_t mask = dictTagMatch(b,DICT_BUCKET_TAG(h));
+        int bit;
+
+        if (mask == 0) return NULL;
+        bit = __builtin_ctz(mask);
+        return &((bit < 16) ? b : b->child)->entries[bit & 15];
+    }
+    return ht->table[h & ht->sizemask];
+}
+
+/* 批量查找和批量预取的前三个阶段：hashes中是一组n个key的hash值，依次预取这n个key的hash桶、候选节点、候选节点的key，
+ * 同一组key的缓存缺失可以重叠在一起。调用方需要持有后台rehash的锁。 */
+static void _dictBatchPrefetch(dict *d, const uint64_t *hashes, unsigned long n) {
+    unsigned long j;
+
+    ///第一阶段：预取hash桶（链表模式下是数组中的指针，桶模式下是桶头的tag）
+    for (j = 0; j < n; j++) {
+        dictht *ht = &d->ht[_dictBatchTable(d,hashes[j])];
+        unsigned long idx = hashes[j] & ht->sizemask;
+
+        if (dictIsBucketed(d))
+            __builtin_prefetch(&ht->buckets[idx]);
+        else
+            __builtin_prefetch(&ht->table[idx]);
+    }
+    ///第二阶段：预取候选节点
+    for (j = 0; j < n; j++) {
+        dictEntry *he = _dictBatchCandidate(d,hashes[j]);
+        if (he) __builtin_prefetch(he);
+    }
+    ///第三阶段：预取候选节点的key，比较key时需要访问它
+    for (j = 0; j < n; j++) {
+        dictEntry *he = _dictBatchCandidate(d,hashes[j]);
+        if (he) __builtin_prefetch(he->key);
+    }
+}
+
+/* 批量查找count个key，第i个key对应的节点写入entries[i]（key不存在时为NULL），返回找到的key的个数。
+ * 逐个调用dictFind时，hash桶、节点、key依次从内存中加载，前一次查找的缓存缺失结束之后下一次才开始。
+ * 这里每DICT_FIND_BATCH个key一组分阶段进行：先计算这一组key的hash值并预取hash桶，再预取候选节点，
+ * 然后预取候选节点的key，最后才逐个比较key，这样同一组key的缓存缺失可以重叠在一起。
+ * 和dictFind一样，返回的节点在下一次修改字典之前有效。 */
+unsigned long dictFindBatch(dict *d, const void **keys, unsigned long count, dictEntry **entries) {
+    uint64_t hashes[DICT_FIND_BATCH];
+    unsigned long found = 0, i, j, n;
+
+    for (i = 0; i < count; i += n) {
+        int locked;
+
+        n = (count-i < DICT_FIND_BATCH) ? count-i : DICT_FIND_BATCH;
+        if (dictSize(d) == 0) { ///字典为空，剩下的key都不存在
+            for (j = i; j < count; j++) entries[j] = NULL;
+            break;
+        }
+        for (j = 0; j < n; j++) hashes[j] = dictHashKey(d,keys[i+j]);
+        locked = _dictBgEnter(d,NULL); ///后台rehash期间需要等待当前批次结束
+        _dictBatchPrefetch(d,hashes,n);
+        ///第四阶段：逐个查找，这时需要的数据大多已经在缓存中了
+        for (j = 0; j < n; j++) {
+            if (dictIsBucketed(d))
+                entries[i+j] = _dictBucketFindKey(d,keys[i+j],hashes[j]);
+            else
+                entries[i+j] = _dictChainFind(d,keys[i+j],hashes[j]);
+            if (entries[i+j]) found++;
+        }
+        _dictBgLeave(d,locked);
+    }
+    return found;
+}
+
+/* 只预取不查找：和dictFindBatch一样分阶段预取count个key的hash桶、候选节点和候选节点的key，
+ * 最后再预取候选节点的值，但是不比较key。用于调用方之后还会逐个查找这些key的场景（例如多key命令），
+ * 这样每个key只比较一次。vals不为NULL时，vals[i]设置为第i个key的候选节点的值，没有候选节点时为NULL。
+ * 候选节点不一定就是这个key的节点，所以vals只能用来预取，不能当作查找结果使用。 */
+void dictPrefetch(dict *d, const void **keys, unsigned long count, void **vals) {
+    uint64_t hashes[DICT_FIND_BATCH];
+    unsigned long i, j, n;
+
+    for (i = 0; i < count; i += n) {
+        int locked;
+
+        n = (count-i < DICT_FIND_BATCH) ? count-i : DICT_FIND_BATCH;
+        if (dictSize(d) == 0) {
+            if (vals) for (j = i; j < count; j++) vals[j] = NULL;
+            break;
+        }
+        for (j = 0; j < n; j++) hashes[j] = dictHashKey(d,keys[i+j]);
+        locked = _dictBgEnter(d,NULL);
+        _dictBatchPrefetch(d,hashes,n);
+        ///第四阶段：预取候选节点的值
+        for (j = 0; j < n; j++) {
+            dictEntry *he = _dictBatchCandidate(d,hashes[j]);
+            void *val = he ? dictGetVal(he) : NULL;
+
+            if (val) __builtin_prefetch(val);
+            if (vals) vals[i+j] = val;
+        }
+        _dictBgLeave(d,locked);
+    }
+}
+
 /* fingerprint是一个64位数字，代表给定时间的字典状态，它只是将dict属性固定在一起的结果。
  * 初始化不安全的迭代器后，我们将获得dictfingerprint，并在释放迭代器时再次检查fingerprint。
  * 如果两个fingerprint不同，则意味着迭代器的用户在迭代时对字典执行了禁止的操作。 
@@ -470,6 +1296,8 @@ dictIterator *dictGetIterator(dict *d)
     iter->safe = 0; ///是否安全,默认不安全
     iter->entry = NULL; ///
     iter->nextEntry = NULL; ///
+    iter->bucket = NULL; ///
+    iter->slot = 0; ///
     return iter;
 }
 
@@ -484,15 +1312,12 @@ dictIterator *dictGetSafeIterator(dict *d) {
 ///返回迭代器当前指向的节点
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (dictIsBucketed(iter->d)) return _dictBucketNext(iter); ///桶模式下单独处理
     while (1) { ///
         if (iter->entry == NULL) { ///如果迭代器指向位置的节点元素为NULL
             dictht *ht = &iter->d->ht[iter->table]; ///获取迭代器的hash表
-            if (iter->index == -1 && iter->table == 0) { ///如果迭代器指向数组下标为-1，并且指向的是ht[0]这个hash表
-                if (iter->safe) ///如果是安全迭代器
-                    iter->d->iterators++; ///让字典表的迭代器数据加一
-                else
-                    iter->fingerprint = dictFingerprint(iter->d); ///如果是不全的，就需要计算fingerprint 
-            }
+            if (iter->index == -1 && iter->table == 0) ///如果迭代器指向数组下标为-1，并且指向的是ht[0]这个hash表
+                _dictIteratorStart(iter); ///安全迭代器让字典表的迭代器数据加一，不安全的就需要计算fingerprint
             iter->index++; //将迭代器指向数组中的下一个元素
             if (iter->index >= (long) ht->size) { ///如果迭代器的index没有越界
                 if (dictIsRehashing(iter->d) && iter->table == 0) { ///如果字典正在进行rehash操作，并且ht[0]中没有元素
@@ -520,9 +1345,9 @@ dictEntry *dictNext(dictIterator *iter)
 void dictReleaseIterator(dictIterator *iter)
 {
     if (!(iter->index == -1 && iter->table == 0)) {
-        if (iter->safe)  ///如果是安全迭代器，只要讲字典的迭代器数量减一即可
-            iter->d->iterators--;
-        else ///如果是非安全的，就要判断fingerprint是否相等
+        if (iter->safe || iter->d->bg)  ///如果是安全迭代器，只要讲字典的迭代器数量减一即可
+            _dictResumeRehash(iter->d);
+        if (!iter->safe) ///如果是非安全的，就要判断fingerprint是否相等
             assert(iter->fingerprint == dictFingerprint(iter->d));
     }
     zfree(iter); ///释放迭代器
@@ -530,12 +1355,23 @@ void dictReleaseIterator(dictIterator *iter)
 
 ///从哈希表返回一个随机键值对。 有助于实现随机算法
 dictEntry *dictGetRandomKey(dict *d)
+{
+    int locked = _dictBgEnter(d,NULL); ///后台rehash期间需要等待当前批次结束
+    dictEntry *he = _dictGetRandomKey(d);
+
+    _dictBgLeave(d,locked);
+    return he;
+}
+
+///dictGetRandomKey的实现
+static dictEntry *_dictGetRandomKey(dict *d)
 {
     dictEntry *he, *orighe;
     unsigned long h;
     int listlen, listele;
 
     if (dictSize(d) == 0) return NULL; ///如果字典的大小为0，则直接返回NULL
+    if (dictIsBucketed(d)) return _dictBucketGetRandomKey(d); ///桶模式下单独处理
     if (dictIsRehashing(d)) _dictRehashStep(d); ///如果此时正在进行rehash操作，则进行一步rehash操作
     if (dictIsRehashing(d)) {//如果正在进行rehash操作
         do {
@@ -577,6 +1413,15 @@ dictEntry *dictGetRandomKey(dict *d)
  * 但是，该函数在生成N个元素时比dictGetRandomKey（）快得多。 
  */
 unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
+    int locked = _dictBgEnter(d,NULL); ///后台rehash期间需要等待当前批次结束
+    unsigned int stored = _dictGetSomeKeys(d,des,count);
+
+    _dictBgLeave(d,locked);
+    return stored;
+}
+
+///dictGetSomeKeys的实现
+static unsigned int _dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
     unsigned long j; /*内部哈希表ID，0或1。*/
     unsigned long tables; ///用来记录需要访问的hash表的数量，1或者2
     unsigned long stored = 0, maxsizemask;
@@ -586,7 +1431,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
     maxsteps = count*10;
 
     /* Try to do a rehashing work proportional to 'count'. */
-    for (j = 0; j < count; j++) {
+    for (j = 0; j < count && !dictIsBucketed(d); j++) { ///桶模式下读操作不推进rehash
         if (dictIsRehashing(d)) ///如果正在进行rehash操作
             _dictRehashStep(d); ///进行一步rehash操作
         else ///如果没有, 就直接跳出循环
@@ -614,6 +1459,30 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                     continue;
             }
             if (i >= d->ht[j].size) continue; ///如果i大于了当前hash的大小，则已经越界了
+            if (dictIsBucketed(d)) { ///桶模式下依次取出桶链中的所有节点
+                dictBucket *b;
+                int k;
+
+                if (_dictIndexIsEmpty(d,&d->ht[j],i)) {
+                    emptylen++;
+                    if (emptylen >= 5 && emptylen > count) {
+                        i = random() & maxsizemask;
+                        emptylen = 0;
+                    }
+                    continue;
+                }
+                emptylen = 0;
+                for (b = &d->ht[j].buckets[i]; b; b = b->child) {
+                    for (k = 0; k < DICT_BUCKET_SLOTS; k++) {
+                        if (b->tags[k] == 0) continue;
+                        *des = &b->entries[k];
+                        des++;
+                        stored++;
+                        if (stored == count) return stored;
+                    }
+                }
+                continue;
+            }
             dictEntry *he = d->ht[j].table[i]; ///查询的hash桶
 			
             if (he == NULL) { ///如果hash桶为空
@@ -702,6 +1571,9 @@ static unsigned long rev(unsigned long v) {
  * 1）我们可能不止一次返回元素。 但是，这通常在应用程序级别很容易处理。
  * 2）迭代器必须在每次调用时返回多个元素，因为它需要始终返回在给定存储桶中链接的所有键以及所有扩展，因此我们确保在散列过程中不会丢失键移动。
  * 3）刚开始时，反向光标有些难以理解，但是应该可以使用此注释。
+ *
+ * 桶模式下游标的含义完全相同（游标对应的是hash桶的下标），因此上面的保证依然成立。
+ * 但是桶模式的节点内联在hash桶中，不能被单独重新分配内存，所以不会调用bucketfn。
  */
 unsigned long dictScan(dict *d,
                        unsigned long v,
@@ -716,19 +1588,24 @@ unsigned long dictScan(dict *d,
     if (dictSize(d) == 0) return 0; ///如果字典为空，则直接返回
 
     ///拥有安全的迭代器意味着无法进行任何重新哈希处理，请参见_dictRehashStep。 如果扫描回调试图执行dictFind或类似操作，则需要此方法。
-    d->iterators++;
+    ///开启了后台rehash的字典，这里还会等待后台线程的当前批次结束，扫描期间后台线程暂停
+    _dictPauseRehash(d);
 
     if (!dictIsRehashing(d)) { ///如果没有进行rehash操作，则所有的数据都存在一个hash表中(ht[0]中）
         t0 = &(d->ht[0]);  ///t0指向ht[0]
         m0 = t0->sizemask; ///偏移量设置为t0的数组大小
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]); ///如果有定义bucketfn这个函数，则调用这个函数，查询对应的hash桶
-        de = t0->table[v & m0]; ///指向一个hash桶
-        while (de) { ///遍历这个hash桶
-            next = de->next; 
-            fn(privdata, de); ///调用fn函数， privdata作为他的第一个参数，de第二个参数
-            de = next;
+        if (dictIsBucketed(d)) {
+            _dictBucketScan(&t0->buckets[v & m0],fn,privdata); ///桶模式下遍历整个桶链
+        } else {
+            if (bucketfn) bucketfn(privdata, &t0->table[v & m0]); ///如果有定义bucketfn这个函数，则调用这个函数，查询对应的hash桶
+            de = t0->table[v & m0]; ///指向一个hash桶
+            while (de) { ///遍历这个hash桶
+                next = de->next; 
+                fn(privdata, de); ///调用fn函数， privdata作为他的第一个参数，de第二个参数
+                de = next;
+            }
         }
 
         ///设置未屏蔽的位，以便使反向光标递增对屏蔽的位进行操作
@@ -753,23 +1630,31 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         ///然后进行上面一样的操作
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
+        if (dictIsBucketed(d)) {
+            _dictBucketScan(&t0->buckets[v & m0],fn,privdata);
+        } else {
+            if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
+            de = t0->table[v & m0];
+            while (de) {
+                next = de->next;
+                fn(privdata, de);
+                de = next;
+            }
         }
 
         ///迭代较大表中的索引，这些索引是较小表中光标指向的索引的扩展
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            de = t1->table[v & m1]; ///获取哈希桶
-            while (de) { ///遍历整个链表
-                next = de->next;
-                fn(privdata, de); ///调用fu函数
-                de = next;
+            if (dictIsBucketed(d)) {
+                _dictBucketScan(&t1->buckets[v & m1],fn,privdata);
+            } else {
+                if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
+                de = t1->table[v & m1]; ///获取哈希桶
+                while (de) { ///遍历整个链表
+                    next = de->next;
+                    fn(privdata, de); ///调用fu函数
+                    de = next;
+                }
             }
 
             /* Increment the reverse cursor not covered by the smaller mask.*/
@@ -783,7 +1668,7 @@ unsigned long dictScan(dict *d,
     }
 
     ///减少安全迭代器的数量
-    d->iterators--;
+    _dictResumeRehash(d);
 	///返回查询的结果
     return v;
 }
@@ -800,9 +1685,12 @@ static int _dictExpandIfNeeded(dict *d)
     if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
 
     ///如果达到1：1的比例，并且允许我们调整哈希表的大小（全局设置），或者应避免使用该哈希表，但是元素/存储桶之间的比率超过“安全”阈值，则我们将大小调整为原来的2倍。
-    if (d->ht[0].used >= d->ht[0].size &&  ///达到1：1的比例
+    ///桶模式下每个hash桶可以容纳DICT_BUCKET_LOAD个元素
+    unsigned long capacity = d->ht[0].size;
+    if (dictIsBucketed(d)) capacity *= DICT_BUCKET_LOAD;
+    if (d->ht[0].used >= capacity &&  ///达到1：1的比例
         (dict_can_resize || ///允许调整哈希表的大小
-         d->ht[0].used/d->ht[0].size > dict_force_resize_ratio)) ///元素/存储桶之间的比率超过“安全”阈值
+         d->ht[0].used/capacity > dict_force_resize_ratio)) ///元素/存储桶之间的比率超过“安全”阈值
     {
         return dictExpand(d, d->ht[0].used*2); ///进行字典扩容操作
     }
@@ -821,6 +1709,17 @@ static unsigned long _dictNextPower(unsigned long size)
     }
 }
 
+///桶模式下hash桶的个数同样是2的指数，但是按照DICT_BUCKET_LOAD换算，最少只需要1个hash桶
+static unsigned long _dictNextBucketPower(unsigned long size)
+{
+    unsigned long i = 1;
+    unsigned long n = size/DICT_BUCKET_LOAD + (size % DICT_BUCKET_LOAD != 0);
+
+    if (n >= LONG_MAX) return LONG_MAX + 1LU;
+    while (i < n) i *= 2;
+    return i;
+}
+
  /* 返回可用插槽的索引，该插槽可以用给定“键”的哈希条目填充。
   * 如果键已经存在，则返回-1，并且可以填写可选的输出参数。
   *
@@ -836,6 +1735,19 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     /* Expand the hash table if needed */
     if (_dictExpandIfNeeded(d) == DICT_ERR) ///插入前如果需要进行扩容操作，则直接返回-1
         return -1;
+    if (dictIsBucketed(d)) { ///桶模式下在桶链中查找
+        uint8_t tag = DICT_BUCKET_TAG(hash);
+        for (table = 0; table <= 1; table++) {
+            idx = hash & d->ht[table].sizemask;
+            he = _dictBucketFind(d,&d->ht[table].buckets[idx],key,tag,NULL,NULL);
+            if (he) {
+                if (existing) *existing = he;
+                return -1;
+            }
+            if (!dictIsRehashing(d)) break;
+        }
+        return idx;
+    }
     for (table = 0; table <= 1; table++) { //遍历ht[0]、ht[1]
         idx = hash & d->ht[table].sizemask; ///获取key所在的数组下标
         he = d->ht[table].table[idx]; ///判断对应的hash桶中是否包含有该key
@@ -853,6 +1765,7 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
 
 ///清空字典中的两个hash表，并重置字典
 void dictEmpty(dict *d, void(callback)(void*)) {
+    _dictBgCancel(d); ///等待后台线程放下这个字典
     _dictClear(d,&d->ht[0],callback); ///清空ht[0]
     _dictClear(d,&d->ht[1],callback); ///清空ht[1]
     d->rehashidx = -1; ///重置rehashidx
@@ -878,10 +1791,39 @@ uint64_t dictGetHash(dict *d, const void *key) {
  * 返回值是对dictEntry的引用（如果找到），否则为NULL。 
  */
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
+    int locked = _dictBgEnter(d,&hash); ///后台rehash期间需要加锁
+    dictEntry **heref = _dictFindEntryRefByPtrAndHash(d,oldptr,hash);
+
+    _dictBgLeave(d,locked);
+    return heref;
+}
+
+/* 和dictFindEntryRefByPtrAndHash相同，但是返回节点本身，链表模式和桶模式的字典都可以使用，找不到返回NULL。
+ * 调用方只能替换节点的key或者value指针（例如active defrag移动了key的SDS之后），不能重新分配节点本身。
+ * 桶模式下dictFindEntryRefByPtrAndHash总是返回NULL，需要改用这个函数，见dict.h。
+ */
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
+    int locked = _dictBgEnter(d,&hash);
+    dictEntry *he = NULL, **heref;
+
+    if (dictIsBucketed(d)) {
+        he = _dictBucketFindPtr(d,oldptr,hash);
+    } else {
+        heref = _dictFindEntryRefByPtrAndHash(d,oldptr,hash);
+        if (heref) he = *heref;
+    }
+    _dictBgLeave(d,locked);
+    return he;
+}
+
+///dictFindEntryRefByPtrAndHash的实现
+static dictEntry **_dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
     dictEntry *he, **heref;
     unsigned long idx, table;
 
     if (dictSize(d) == 0) return NULL; ///字典为空，则直接返回NULL
+    ///桶模式下节点内联在hash桶中，不存在指向节点的引用，调用方不能替换节点，所以直接返回NULL，桶模式使用dictFindEntryByPtrAndHash
+    if (dictIsBucketed(d)) return NULL;
     for (table = 0; table <= 1; table++) { ///遍历一张或者两张表
         idx = hash & d->ht[table].sizemask; ///获取该key在hash表中的数组下标
         heref = &d->ht[table].table[idx]; ///找到对应的hash桶
@@ -897,10 +1839,179 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     return NULL;
 }
 
+/* ------------------------- 桶模式的私有方法 ------------------------------ */
+
+/* 桶模式下查找key，h为key的hash值。
+ * 和链表模式不同，桶模式下查找不会推进渐进式rehash：rehash会移动节点，只让写操作推进rehash，
+ * 就可以保证dictFind返回的节点地址在下一次写操作之前一直有效。
+ */
+static dictEntry *_dictBucketFindKey(dict *d, const void *key, uint64_t h) {
+    uint8_t tag = DICT_BUCKET_TAG(h);
+    dictEntry *he;
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        he = _dictBucketFind(d,&d->ht[table].buckets[h & d->ht[table].sizemask],key,tag,NULL,NULL);
+        if (he || !dictIsRehashing(d)) return he;
+    }
+    return NULL;
+}
+
+/* 桶模式下查找key指针等于oldptr的节点，h为key的hash值。和_dictBucketFindKey一样先比较tag，但是只比较指针，不调用keyCompare。 */
+static dictEntry *_dictBucketFindPtr(dict *d, const void *oldptr, uint64_t h) {
+    uint8_t tag = DICT_BUCKET_TAG(h);
+    int table;
+
+    if (dictSize(d) == 0) return NULL;
+    for (table = 0; table <= 1; table++) {
+        dictBucket *b = &d->ht[table].buckets[h & d->ht[table].sizemask];
+
+        while (b) {
+            dictBucket *child = b->child;
+            uint32_t mask = dictTagMatch(b,tag);
+
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                dictEntry *he = &((bit < 16) ? b : child)->entries[bit & 15];
+
+                if (he->key == oldptr) return he;
+                mask &= mask-1;
+            }
+            if (child == NULL) break;
+            b = child->child;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+/* 桶模式下删除key，h为key的hash值，nofree的含义和dictGenericDelete相同。
+ * 删除只是清空对应槽位的tag，不会移动其他节点，所以安全迭代器可以在迭代的过程中删除节点。
+ */
+static dictEntry *_dictBucketDelete(dict *d, const void *key, uint64_t h, int nofree) {
+    uint8_t tag;
+    int table;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d); ///删除是写操作，可以推进rehash
+    tag = DICT_BUCKET_TAG(h);
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        dictBucket *b, *prev;
+        dictEntry *he;
+
+        he = _dictBucketFind(d,&ht->buckets[h & ht->sizemask],key,tag,&b,&prev);
+        if (he) {
+            int slot = he - b->entries;
+
+            if (nofree) {
+                ///槽位马上就可能被复用，所以把节点拷贝一份交给调用方，之后由dictFreeUnlinkedEntry释放
+                dictEntry *copy = zslab_alloc(sizeof(*copy));
+                *copy = *he;
+                he = copy;
+            } else {
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+            }
+            b->tags[slot] = 0;
+            b->used--;
+            ht->used--;
+            ///溢出桶空了就释放掉。有安全迭代器时迭代器可能正指向这个溢出桶，只能等到rehash或者清空时再释放
+            if (b->used == 0 && prev && d->iterators == 0) {
+                prev->child = b->child;
+                zfree(b);
+                ht->overflow--;
+            }
+            return he; ///nofree为0时返回值只用来表示删除成功，不能再访问
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+///桶模式下迭代器的遍历，按照hash桶的下标、桶链、槽位的顺序依次返回节点
+static dictEntry *_dictBucketNext(dictIterator *iter) {
+    dict *d = iter->d;
+
+    while (1) {
+        if (iter->bucket == NULL) { ///当前的桶链已经访问完了，访问下一个hash桶
+            dictht *ht = &d->ht[iter->table];
+            if (iter->index == -1 && iter->table == 0)
+                _dictIteratorStart(iter);
+            iter->index++;
+            if (iter->index >= (long) ht->size) {
+                if (dictIsRehashing(d) && iter->table == 0) {
+                    iter->table++;
+                    iter->index = 0;
+                    ht = &d->ht[1];
+                } else {
+                    break;
+                }
+            }
+            iter->bucket = &ht->buckets[iter->index];
+            iter->slot = 0;
+        }
+        ///迭代器记录的是槽位而不是节点，所以用户删除返回的节点不会影响后续的遍历
+        while (iter->bucket) {
+            while (iter->slot < DICT_BUCKET_SLOTS) {
+                int slot = iter->slot++;
+                if (iter->bucket->tags[slot]) {
+                    iter->entry = &iter->bucket->entries[slot];
+                    return iter->entry;
+                }
+            }
+            iter->bucket = iter->bucket->child;
+            iter->slot = 0;
+        }
+    }
+    return NULL;
+}
+
+///桶模式下随机获取一个key：先随机选择一个非空的hash桶，再在整个桶链中随机选择一个节点
+static dictEntry *_dictBucketGetRandomKey(dict *d) {
+    dictBucket *head, *b;
+    unsigned long h, len, ele;
+    int i;
+
+    do {
+        if (dictIsRehashing(d)) {
+            ///我们确定从0到rehashidx-1的索引中没有元素
+            h = d->rehashidx + (random() % (d->ht[0].size +
+                                            d->ht[1].size -
+                                            d->rehashidx));
+            head = (h >= d->ht[0].size) ? &d->ht[1].buckets[h - d->ht[0].size] :
+                                          &d->ht[0].buckets[h];
+        } else {
+            head = &d->ht[0].buckets[random() & d->ht[0].sizemask];
+        }
+        len = _dictBucketChainLen(head);
+    } while(len == 0);
+
+    ele = random() % len;
+    for (b = head; b; b = b->child) {
+        for (i = 0; i < DICT_BUCKET_SLOTS; i++) {
+            if (b->tags[i] == 0) continue;
+            if (ele-- == 0) return &b->entries[i];
+        }
+    }
+    return NULL; /* 不会执行到这里 */
+}
+
+///桶模式下对一个桶链中的所有节点调用fn
+static void _dictBucketScan(dictBucket *b, dictScanFunction *fn, void *privdata) {
+    int i;
+
+    for (; b; b = b->child) {
+        for (i = 0; i < DICT_BUCKET_SLOTS; i++)
+            if (b->tags[i]) fn(privdata, &b->entries[i]);
+    }
+}
+
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
-size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
+size_t _dictGetStatsHt(char *buf, size_t bufsize, dict *d, dictht *ht, int tableid) {
+    int bucketed = dictIsBucketed(d) != 0;
+    zmallocHugeInfo info;
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
     unsigned long totchainlen = 0;
     unsigned long clvector[DICT_STATS_VECTLEN];
@@ -916,17 +2027,23 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     for (i = 0; i < ht->size; i++) {
         dictEntry *he;
 
-        if (ht->table[i] == NULL) {
+        if (bucketed ? ht->buckets[i].used == 0 && ht->buckets[i].child == NULL :
+                       ht->table[i] == NULL) {
             clvector[0]++;
             continue;
         }
         slots++;
         /* For each hash entry on this slot... */
-        chainlen = 0;
-        he = ht->table[i];
-        while(he) {
-            chainlen++;
-            he = he->next;
+        if (bucketed) {
+            ///桶模式下的链长是整个桶链中的节点数
+            chainlen = _dictBucketChainLen(&ht->buckets[i]);
+        } else {
+            chainlen = 0;
+            he = ht->table[i];
+            while(he) {
+                chainlen++;
+                he = he->next;
+            }
         }
         clvector[(chainlen < DICT_STATS_VECTLEN) ? chainlen : (DICT_STATS_VECTLEN-1)]++;
         if (chainlen > maxchainlen) maxchainlen = chainlen;
@@ -941,11 +2058,25 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
         " different slots: %ld\n"
         " max chain length: %ld\n"
         " avg chain length (counted): %.02f\n"
-        " avg chain length (computed): %.02f\n"
-        " Chain length distribution:\n",
+        " avg chain length (computed): %.02f\n",
         tableid, (tableid == 0) ? "main hash table" : "rehashing target",
         ht->size, ht->used, slots, maxchainlen,
         (float)totchainlen/slots, (float)ht->used/slots);
+    if (bucketed && l < bufsize) {
+        l += snprintf(buf+l,bufsize-l,
+            " bucketed layout: %d slots per bucket, %ld overflow buckets\n",
+            DICT_BUCKET_SLOTS, ht->overflow);
+    }
+    ///hash表数组的内存：很大的数组是单独映射的，显示映射时记录的透明大页和NUMA节点
+    zmalloc_huge_get_info(ht->table,_dictTableBytes(d,ht->size),&info);
+    if (info.mapped && l < bufsize) {
+        l += snprintf(buf+l,bufsize-l,
+            " table memory: %zu bytes mapped, huge pages %s, NUMA node %d\n",
+            info.size, info.hugepage ? "advised" : "not advised", info.node);
+    } else if (l < bufsize) {
+        l += snprintf(buf+l,bufsize-l," table memory: %zu bytes from the heap\n",info.size);
+    }
+    if (l < bufsize) l += snprintf(buf+l,bufsize-l," Chain length distribution:\n");
 
     for (i = 0; i < DICT_STATS_VECTLEN-1; i++) {
         if (clvector[i] == 0) continue;
@@ -965,13 +2096,15 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     size_t l;
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
+    int locked = _dictBgEnter(d,NULL); ///后台rehash期间需要等待当前批次结束
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    l = _dictGetStatsHt(buf,bufsize,d,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        _dictGetStatsHt(buf,bufsize,d,&d->ht[1],1);
     }
+    _dictBgLeave(d,locked);
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
 }
@@ -981,6 +2114,7 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
 #ifdef DICT_BENCHMARK_MAIN
 
 #include "sds.h"
+#include <time.h>
 
 uint64_t hashCallback(const void *key) {
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
@@ -1017,18 +2151,11 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
-int main(int argc, char **argv) {
+///对一个字典运行整套基准测试，结束后释放这个字典
+void benchmarkDict(dict *dict, long count) {
     long j;
     long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
-    long count = 0;
-
-    if (argc == 2) {
-        count = strtol(argv[1],NULL,10);
-    } else {
-        count = 5000000;
-    }
+    size_t mem = zmalloc_used_memory();
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1037,6 +2164,9 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Inserting");
     assert((long)dictSize(dict) == count);
+    mem = zmalloc_used_memory()-mem;
+    printf("Memory used: %zu bytes (%.02f bytes per item)\n",
+        mem, (double)mem/count);
 
     /* Wait for rehashing. */
     while (dictIsRehashing(dict)) {
@@ -1061,6 +2191,15 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Linear access of existing elements (2nd round)");
 
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        dictEntry *de = dictFind(dict,key);
+        assert(dictFindEntryByPtrAndHash(dict,dictGetKey(de),dictGetHash(dict,key)) == de);
+        sdsfree(key);
+    }
+    end_benchmark("Lookup by key pointer");
+
     start_benchmark();
     for (j = 0; j < count; j++) {
         sds key = sdsfromlonglong(rand() % count);
@@ -1080,6 +2219,32 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Accessing missing");
 
+    ///和MGET一样每次查找100个随机的key，对比逐个调用dictFind和使用dictFindBatch。key事先生成好
+    {
+        sds *keys = zmalloc(sizeof(sds)*count);
+        dictEntry *entries[100];
+        long k;
+
+        for (j = 0; j < count; j++) keys[j] = sdsfromlonglong(rand() % count);
+        start_benchmark();
+        for (j = 0; j+100 <= count; j += 100) {
+            for (k = 0; k < 100; k++) {
+                dictEntry *de = dictFind(dict,keys[j+k]);
+                assert(de != NULL);
+            }
+        }
+        end_benchmark("Random access, 100 keys one by one");
+
+        start_benchmark();
+        for (j = 0; j+100 <= count; j += 100) {
+            unsigned long found = dictFindBatch(dict,(const void**)keys+j,100,entries);
+            assert(found == 100);
+        }
+        end_benchmark("Random access, 100 keys with dictFindBatch");
+        for (j = 0; j < count; j++) sdsfree(keys[j]);
+        zfree(keys);
+    }
+
     start_benchmark();
     for (j = 0; j < count; j++) {
         sds key = sdsfromlonglong(j);
@@ -1090,5 +2255,240 @@ int main(int argc, char **argv) {
         assert(retval == DICT_OK);
     }
     end_benchmark("Removing and adding");
+    dictRelease(dict);
+}
+
+/* MGET的访问模式：值是指向字符串的对象（相当于robj），每次MGET查找100个随机的key，读出每个值的字符串。
+ * 对比直接逐个查找、先dictFindBatch再逐个查找（查找做了两遍）、先dictPrefetch再逐个查找（只预取）这三种方式，
+ * 后两种和dbPrefetchKeys()之后lookupKeyRead()的过程相同。 */
+typedef struct benchmarkObj {
+    int type;
+    sds ptr;
+} benchmarkObj;
+
+void freeObjCallback(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+
+    sdsfree(((benchmarkObj*)val)->ptr);
+    zfree(val);
+}
+
+dictType BenchmarkObjDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    freeObjCallback
+};
+
+#define MGET_KEYS 100
+
+void benchmarkMget(dict *dict, long count) {
+    sds *keys = zmalloc(sizeof(sds)*count);
+    const void **batch;
+    dictEntry *entries[MGET_KEYS];
+    void *vals[MGET_KEYS];
+    long long start, elapsed;
+    size_t total;
+    long j, k;
+
+    for (j = 0; j < count; j++) {
+        benchmarkObj *o = zmalloc(sizeof(*o));
+
+        o->type = 0;
+        o->ptr = sdscatprintf(sdsempty(),"value:%ld:%032ld",j,j);
+        dictAdd(dict,sdscatprintf(sdsempty(),"key:%ld",j),o);
+    }
+    while (dictIsRehashing(dict)) dictRehashMilliseconds(dict,100);
+    for (j = 0; j < count; j++) keys[j] = sdscatprintf(sdsempty(),"key:%ld",rand() % count);
+    batch = (const void**)keys;
+
+    total = 0;
+    start_benchmark();
+    for (j = 0; j+MGET_KEYS <= count; j += MGET_KEYS) {
+        for (k = 0; k < MGET_KEYS; k++) {
+            benchmarkObj *o = dictGetVal(dictFind(dict,keys[j+k]));
+            total += sdslen(o->ptr)+o->ptr[0];
+        }
+    }
+    end_benchmark("MGET 100 keys, lookups only");
+
+    start_benchmark();
+    for (j = 0; j+MGET_KEYS <= count; j += MGET_KEYS) {
+        dictFindBatch(dict,batch+j,MGET_KEYS,entries);
+        for (k = 0; k < MGET_KEYS; k++) __builtin_prefetch(dictGetVal(entries[k]));
+        for (k = 0; k < MGET_KEYS; k++) __builtin_prefetch(((benchmarkObj*)dictGetVal(entries[k]))->ptr);
+        for (k = 0; k < MGET_KEYS; k++) {
+            benchmarkObj *o = dictGetVal(dictFind(dict,keys[j+k]));
+            total += sdslen(o->ptr)+o->ptr[0];
+        }
+    }
+    end_benchmark("MGET 100 keys, dictFindBatch then lookups");
+
+    start_benchmark();
+    for (j = 0; j+MGET_KEYS <= count; j += MGET_KEYS) {
+        dictPrefetch(dict,batch+j,MGET_KEYS,vals);
+        for (k = 0; k < MGET_KEYS; k++) if (vals[k]) __builtin_prefetch(((benchmarkObj*)vals[k])->ptr);
+        for (k = 0; k < MGET_KEYS; k++) {
+            benchmarkObj *o = dictGetVal(dictFind(dict,keys[j+k]));
+            total += sdslen(o->ptr)+o->ptr[0];
+        }
+    }
+    end_benchmark("MGET 100 keys, dictPrefetch then lookups");
+    if (total == 0) printf("(unreachable)\n"); ///使用total，避免读取值的循环被优化掉
+
+    for (j = 0; j < count; j++) sdsfree(keys[j]);
+    zfree(keys);
+    dictRelease(dict);
+}
+
+/* 分别使用每一种tag匹配的实现，测试桶模式下查找命中和未命中的耗时。
+ * 查找用的key事先生成好，这样测出来的主要是查找本身的开销。 */
+void benchmarkTagMatch(long count) {
+    struct {
+        const char *name;
+        dictTagMatchFunction *fn;
+    } impl[3];
+    int n = 0, i;
+    long j;
+    long long start, elapsed;
+    dict *dict = dictCreateBucketed(&BenchmarkDictType,NULL);
+    sds *hits = zmalloc(sizeof(sds)*count);
+    sds *misses = zmalloc(sizeof(sds)*count);
+
+    impl[n].name = "scalar";
+    impl[n++].fn = _dictTagMatchScalar;
+#ifdef DICT_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        impl[n].name = "SSE2";
+        impl[n++].fn = _dictTagMatchSSE2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impl[n].name = "AVX2";
+        impl[n++].fn = _dictTagMatchAVX2;
+    }
+#endif
+
+    for (j = 0; j < count; j++) {
+        int retval = dictAdd(dict,sdsfromlonglong(j),(void*)j);
+        assert(retval == DICT_OK);
+    }
+    while (dictIsRehashing(dict)) {
+        dictRehashMilliseconds(dict,100);
+    }
+    for (j = 0; j < count; j++) {
+        hits[j] = sdsfromlonglong(rand() % count);
+        misses[j] = sdsfromlonglong(rand() % count);
+        misses[j][0] = 'X';
+    }
+
+    for (i = 0; i < n; i++) {
+        dictTagMatch = impl[i].fn;
+        printf("-- Tag matching: %s --\n", impl[i].name);
+
+        start_benchmark();
+        for (j = 0; j < count; j++) {
+            dictEntry *de = dictFind(dict,hits[j]);
+            assert(de != NULL);
+        }
+        end_benchmark("Random access of existing elements");
+
+        start_benchmark();
+        for (j = 0; j < count; j++) {
+            dictEntry *de = dictFind(dict,misses[j]);
+            assert(de == NULL);
+        }
+        end_benchmark("Accessing missing");
+    }
+    dictTagMatch = _dictTagMatchResolve;
+
+    for (j = 0; j < count; j++) {
+        sdsfree(hits[j]);
+        sdsfree(misses[j]);
+    }
+    zfree(hits);
+    zfree(misses);
+    dictRelease(dict);
+}
+
+static int compareLatency(const void *a, const void *b) {
+    long long la = *(const long long*)a, lb = *(const long long*)b;
+    return (la > lb) - (la < lb);
+}
+
+/* 记录每一次dictAdd的耗时，输出延迟分布。background为1时开启后台rehash，
+ * 用来对比前台渐进式rehash和后台rehash对尾延迟的影响。
+ * iterating为1时在中间一半的插入期间保持一个安全迭代器打开，这段时间rehash暂停，后台线程等待迭代器释放。 */
+void benchmarkRehashLatency(long count, int background, int iterating) {
+    dict *dict = dictCreate(&BenchmarkDictType,NULL);
+    long long *lat = zmalloc(sizeof(long long)*count);
+    dictIterator *iter = NULL;
+    struct timespec t0, t1;
+    long long start, elapsed;
+    long j;
+
+    if (background) dictEnableBackgroundRehash(dict);
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        if (iterating && j == count/4) {
+            iter = dictGetSafeIterator(dict);
+            dictNext(iter);
+        } else if (iter && j == count/4*3) {
+            dictReleaseIterator(iter);
+            iter = NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC,&t0);
+        int retval = dictAdd(dict,key,(void*)j);
+        clock_gettime(CLOCK_MONOTONIC,&t1);
+        assert(retval == DICT_OK);
+        lat[j] = (t1.tv_sec-t0.tv_sec)*1000000000LL+(t1.tv_nsec-t0.tv_nsec);
+    }
+    if (background && iterating) {
+        end_benchmark("Inserting (background rehash, safe iterator open)");
+    } else if (background) {
+        end_benchmark("Inserting (background rehash)");
+    } else if (iterating) {
+        end_benchmark("Inserting (incremental rehash, safe iterator open)");
+    } else {
+        end_benchmark("Inserting (incremental rehash)");
+    }
+
+    qsort(lat,count,sizeof(long long),compareLatency);
+    printf("dictAdd latency ns: p50 %lld, p99 %lld, p99.9 %lld, max %lld\n",
+        lat[count/2], lat[count*99/100], lat[count*999/1000], lat[count-1]);
+    zfree(lat);
+    dictRelease(dict);
+}
+
+/* dict-benchmark [count]
+ * 分别对链表模式和桶模式运行同一套基准测试，便于对比两种布局，然后对比桶模式下不同的tag匹配实现。 */
+int main(int argc, char **argv) {
+    long count = 0;
+
+    if (argc == 2) {
+        count = strtol(argv[1],NULL,10);
+    } else {
+        count = 5000000;
+    }
+
+    printf("== Chained layout ==\n");
+    benchmarkDict(dictCreate(&BenchmarkDictType,NULL),count);
+    printf("\n== Bucketed layout ==\n");
+    benchmarkDict(dictCreateBucketed(&BenchmarkDictType,NULL),count);
+    printf("\n== Bucketed layout, tag matching ==\n");
+    benchmarkTagMatch(count);
+    printf("\n== MGET access pattern, chained layout ==\n");
+    benchmarkMget(dictCreate(&BenchmarkObjDictType,NULL),count);
+    printf("\n== MGET access pattern, bucketed layout ==\n");
+    benchmarkMget(dictCreateBucketed(&BenchmarkObjDictType,NULL),count);
+    printf("\n== Rehash latency ==\n");
+    benchmarkRehashLatency(count,0,0);
+    benchmarkRehashLatency(count,1,0);
+    benchmarkRehashLatency(count,0,1);
+    benchmarkRehashLatency(count,1,1);
+    return 0;
 }
 #endif
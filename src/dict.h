@@ -34,13 +34,35 @@ typedef struct dictType {
     void (*valDestructor)(void *privdata, void *obj); ///函数指针，用来释放value
 } dictType;
 
+/// 桶模式下每个hash桶内联存放的节点数。桶头16字节（15个tag+1个计数），加上溢出指针和15个dictEntry，
+/// 整个桶正好是384字节，也就是6条64字节的缓存行
+#define DICT_BUCKET_SLOTS 15
+/// 桶模式下的负载因子：平均每个hash桶中的节点数达到这个值时进行扩容
+#define DICT_BUCKET_LOAD 10
+
+/* 桶模式（类似Swiss table/F14）的hash桶定义。
+ * 节点不再单独申请内存并通过next串成链表，而是直接内联存放在桶中，桶头保存每个槽位的hash指纹（tag），
+ * 查找时先比较tag，只有tag相同时才调用keyCompare比较key。一个桶放满之后，通过child挂接溢出桶。
+ * 注意：桶模式下节点会在rehash时被移动，所以dictEntry指针只在下一次对字典进行写操作之前有效。
+ */
+typedef struct dictBucket {
+    uint8_t tags[DICT_BUCKET_SLOTS]; ///每个槽位的hash指纹，0表示空槽位，否则为0x80|hash值的高7位
+    uint8_t used; ///这个桶中已经使用的槽位数
+    struct dictBucket *child; ///桶满之后挂接的溢出桶
+    dictEntry entries[DICT_BUCKET_SLOTS]; ///内联存放的节点，节点的next字段不使用，始终为NULL
+} dictBucket;
+
 /// 这是我们的哈希表结构。 对于我们的旧表到新表，在实现增量重新哈希处理时，每个字典都有两个。
 /// 这个是hash表定义的数据结构
 typedef struct dictht {
-    dictEntry **table; ///用来保存dictEntry的数组
+    union {
+        dictEntry **table; ///用来保存dictEntry的数组（链表模式）
+        dictBucket *buckets; ///用来保存hash桶的数组（桶模式）
+    };
     unsigned long size;  ///这个数组的长度
     unsigned long sizemask; ///这个是用来计算key在数组中的索引，它的值为size -1
     unsigned long used; ///用来记录dict中节点的数量
+    unsigned long overflow; ///桶模式下溢出桶的数量
 } dictht;
 
 ///redis中dict数据结构的的定义
@@ -50,8 +72,12 @@ typedef struct dict {
     dictht ht[2];  ///一个dict中有两张哈希表
     long rehashidx; ///如果rehashidx == -1，则没有进行重新哈希
     unsigned long iterators;///当前正在运行的迭代器数
+    unsigned int flags; ///字典的模式标志，例如DICT_FLAG_BUCKETED
+    struct dictBgRehash *bg; ///后台rehash的状态，没有开启后台rehash时为NULL
 } dict;
 
+#define DICT_FLAG_BUCKETED (1<<0) ///使用桶模式的hash表布局
+
 /* 如果将safe设置为1，则这是一个安全的迭代器，这意味着，即使在迭代时，也可以针对字典调用dictAdd，dictFind和其他函数。
  * 否则，它是不安全的迭代器，并且在迭代时仅应调用dictNext（）。
  */
@@ -60,6 +86,8 @@ typedef struct dictIterator {
     long index; ///当前遍历dict中hash表中的数组下标
     int table, safe; //table表示迭代的hash表，就是dict[0]、dict[1]中的一个，safe表示这个迭代器是否为安全的
     dictEntry *entry, *nextEntry; ///entry 表示iterator指向的当前节点，nextEntity为当前节点的下一个节点
+    dictBucket *bucket; ///桶模式下当前遍历的hash桶
+    int slot; ///桶模式下在当前hash桶中下一个要访问的槽位
     long long fingerprint;///不安全的迭代器指纹，用于滥用检测。
 } dictIterator;
 
@@ -69,6 +97,9 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref); //
 ///hash表中，数组的初始化大小，默认为4
 #define DICT_HT_INITIAL_SIZE     4
 
+///dictFindBatch和dictPrefetch每一组同时预取的key的个数
+#define DICT_FIND_BATCH 16
+
 ///一系列的宏定义操作
 #define dictFreeVal(d, entry) \    ///释放hash表中的节点值
     if ((d)->type->valDestructor) \ ///如果hash表中有定义节点值的销毁函数
@@ -115,9 +146,12 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref); //
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size) ///定义获取dict中hash数组大小的方法
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used) ///定义获取dict中元素个数的方法
 #define dictIsRehashing(d) ((d)->rehashidx != -1) ///定义获取是正在进行rehash操作的方法
+#define dictIsBucketed(d) ((d)->flags & DICT_FLAG_BUCKETED) ///字典是否使用桶模式
 
 /* API 定义*/
 dict *dictCreate(dictType *type, void *privDataPtr); ///构建一个新的字典
+dict *dictCreateBucketed(dictType *type, void *privDataPtr); ///构建一个使用桶模式的新字典
+void dictEnableBackgroundRehash(dict *d); ///开启字典的后台rehash，扩容时由后台线程迁移节点，只支持链表模式的字典
 int dictExpand(dict *d, unsigned long size); ///扩展或者创建字典
 int dictAdd(dict *d, void *key, void *val); ///向字典中新添加一个键值对
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing); ///在字典中添加键值对，但是不直接吸入值，而是返回key对应的内存地址，其他函数进行值写入
@@ -129,6 +163,8 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he); ///释放由dictUnlink函数
 void dictRelease(dict *d); ///清除并释放字典
 dictEntry * dictFind(dict *d, const void *key); ///在字典中查询key是否存在，存在则返回对应的地址
 void *dictFetchValue(dict *d, const void *key); ///在字典中查询key对应的value
+unsigned long dictFindBatch(dict *d, const void **keys, unsigned long count, dictEntry **entries); ///批量查找多个key，使用预取隐藏缓存缺失
+void dictPrefetch(dict *d, const void **keys, unsigned long count, void **vals); ///只预取多个key所在的hash桶、节点和值，不进行查找
 int dictResize(dict *d); ///对字典进行扩容操作
 dictIterator *dictGetIterator(dict *d); ///创建字典的迭代器，默认是非安全的迭代器
 dictIterator *dictGetSafeIterator(dict *d); ///创建字典的安全迭代器
@@ -149,7 +185,11 @@ void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void); ///
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata); ///遍历整个字典
 uint64_t dictGetHash(dict *d, const void *key); ///找到key对应的hash值
-dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash); ///通过使用指针和预先预算的hash值查找节点
+/* 通过key指针和预先计算的hash值查找节点，不比较key的内容，主要给active defrag使用。
+ * 桶模式下节点内联在hash桶中，不能单独重新分配，dictFindEntryRefByPtrAndHash总是返回NULL，dictScan的bucketfn也不会被调用。
+ * 桶模式的字典需要用dictFindEntryByPtrAndHash找到节点后直接替换key指针，节点本身不需要也不能defrag。 */
+dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash); ///返回节点的引用，调用方可以重新分配节点，只支持链表模式
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash); ///返回节点本身，两种模式都支持
 
 ///hash表的类型，这三个函数在dict.c文件中有定义
 extern dictType dictTypeHeapStringCopyKey;
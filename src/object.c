@@ -12,7 +12,9 @@
 ///#define OBJ_ENCODING_EMBSTR 8      表示为动态字符串类型
 ///#define OBJ_ENCODING_QUICKLIST 9   表示为快表类型
 ///#define OBJ_ENCODING_STREAM 10     /* Encoded as a radix tree of listpacks */
+///#define OBJ_ENCODING_PACKLIST 11   表示为紧凑列表类型，快表的节点和小的有序集合使用
 
+#define ZMALLOC_TAG ZMALLOC_TAG_ROBJ ///分配分析中记为robj，见zmalloc.h
 #include "server.h"
 #include <math.h>
 #include <ctype.h>
@@ -24,7 +26,7 @@
 /* ===================== redis Object的创建和解析 ==================== */
 ///创建一个新的Object
 robj *createObject(int type, void *ptr) { ///参数需要传入Object的类型和对应Object值的指针
-    robj *o = zmalloc(sizeof(*o));        ///为这个对象申请内存空间
+    robj *o = zslab_alloc(sizeof(*o));    ///为这个对象申请内存空间，robj大小固定，从slab分配器分配
     o->type = type;                       ///对对象的type进行初始化
     o->encoding = OBJ_ENCODING_RAW;       ///对对象的编码格式进行初始化， 默认为原始类型
     o->ptr = ptr;                         ///为对象的值进行赋值操作
@@ -69,8 +71,9 @@ robj *createRawStringObject(const char *ptr, size_t len) {
 ///创建一个编码为OBJ_ENCODING_EMBSTR的字符串对象，该对象是sds字符串实际上是与该对象本身分配在同一块中的不可修改的字符串。 
 robj *createEmbeddedStringObject(const char *ptr, size_t len) {
 
-	///先分配所需要的内存空间，大小为对象大小以及sds字符串（head（sds头） + len + 1(结尾标识符)）需要占用的空间
-    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1); 
+	///先分配所需要的内存空间，大小为对象大小以及sds字符串（head（sds头） + len + 1(结尾标识符)）需要占用的空间。
+	///最大只有64字节，和createObject()一样从slab分配器分配，decrRefCount()释放时不需要区分编码
+    robj *o = zslab_alloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1); 
     struct sdshdr8 *sh = (void*)(o+1); ///获取sds动态字符串的对象头地址
 
     o->type = OBJ_STRING; ///设置对象的type，为字符串类型
@@ -257,12 +260,12 @@ robj *createZsetObject(void) {
     return o;
 }
 
-///创建一个有序集合，编码格式为ziplist
-robj *createZsetZiplistObject(void) { 
+///创建一个有序集合，使用紧凑编码（默认是ziplist，打开packlist格式后是packlist）
+robj *createZsetPacklistObject(void) { 
 
-    unsigned char *zl = ziplistNew(); ///创建一个压缩表对象
-    robj *o = createObject(OBJ_ZSET,zl); ///创建一个新的对象，它的type为OBJ_ZSET，ptr指向对象为zl
-    o->encoding = OBJ_ENCODING_ZIPLIST;  ///设置对象的编码格式，为OBJ_ENCODING_ZIPLIST
+    unsigned char *pl = packlistNew(); ///创建一个紧凑列表对象
+    robj *o = createObject(OBJ_ZSET,pl); ///创建一个新的对象，它的type为OBJ_ZSET，ptr指向对象为pl
+    o->encoding = OBJ_ENCODING_ZSET_PACKED;  ///设置对象的编码格式，packlist格式关闭时为OBJ_ENCODING_ZIPLIST
     return o;
 }
 
@@ -324,7 +327,8 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl); ///释放zs指向的zsl
         zfree(zs); ///释放o的ptr指向的内容
         break;
-    case OBJ_ENCODING_ZIPLIST: ///如果是ziplist类型的编码
+    case OBJ_ENCODING_ZIPLIST: ///如果是ziplist或者packlist类型的编码
+    case OBJ_ENCODING_PACKLIST:
         zfree(o->ptr); ///直接释放o的ptr指向的内容
         break;
     default: ///如果是其他类型的编码，则打印异常
@@ -389,7 +393,10 @@ void decrRefCount(robj *o) {
         case OBJ_STREAM: freeStreamObject(o); break;
         default: serverPanic("Unknown object type"); break;
         }
-        zfree(o); ///最后释放o的内存空间
+        ///最后释放o的内存空间。robj必须由createObject()和createEmbeddedStringObject()从slab分配器分配，
+        ///不能用zmalloc(sizeof(robj))之类的方式创建。zslab_free()只检查对象所在块头的标记，
+        ///块头所在的地址不可读时进程会直接崩溃，这个检查只是尽量报错，不能代替这个要求
+        zslab_free(o);
     } else {
         if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
         ///如果o->refcount >1 ,就直接-1即可
@@ -745,6 +752,7 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable"; ///字典类型编码
     case OBJ_ENCODING_QUICKLIST: return "quicklist"; ///快表类型编码
     case OBJ_ENCODING_ZIPLIST: return "ziplist"; ///压缩表类型编码
+    case OBJ_ENCODING_PACKLIST: return "packlist"; ///紧凑列表类型编码
     case OBJ_ENCODING_INTSET: return "intset"; ///整数集合类型编码
     case OBJ_ENCODING_SKIPLIST: return "skiplist"; ///跳跃表类型编码
     case OBJ_ENCODING_EMBSTR: return "embstr"; ///动态字符串类型编码
@@ -809,10 +817,11 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             quicklistNode *node = ql->head;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
+                elesize += sizeof(quicklistNode)+packlistBlobLen(node->zl);
                 samples++;
             } while ((node = node->next) && samples < sample_size);
-            asize += (double)elesize/samples*ql->len;
+            asize += (double)elesize/samples*ql->len + quicklistTreeSize(ql) +
+                     quicklistExtSize(ql);
         } else if (o->encoding == OBJ_ENCODING_ZIPLIST) {
             asize = sizeof(*o)+ziplistBlobLen(o->ptr);
         } else {
@@ -837,18 +846,18 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_ZSET_PACKED) {
+            asize = sizeof(*o)+(packlistBlobLen(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
             zskiplistNode *znode = zsl->header->level[0].forward;
             asize = sizeof(*o)+sizeof(zset)+sizeof(zskiplist)+sizeof(dict)+
                     (sizeof(struct dictEntry*)*dictSlots(d))+
-                    zmalloc_size(zsl->header);
+                    zslab_size(zsl->header);
             while(znode != NULL && samples < sample_size) {
                 elesize += sdsAllocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
+                elesize += sizeof(struct dictEntry) + zslab_size(znode);
                 samples++;
                 znode = znode->level[0].forward;
             }
@@ -950,6 +959,34 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     return asize;
 }
 
+/* Apply the hash-table-hugepages, hash-table-prefault and
+ * hash-table-numa-local settings to the allocator. initServer() must call
+ * it before the databases are created, and CONFIG SET must call it when one
+ * of them changes; server.c and config.c are not part of this tree, so both
+ * calls still have to be added there. Only tables allocated afterwards are
+ * affected. */
+void updateHashTableMemoryConfig(void) {
+    zmalloc_huge_config(server.hash_table_hugepages,
+                        server.hash_table_prefault,
+                        server.hash_table_numa_local);
+}
+
+/* Hand the expansion of the keyspace dicts to the background rehash
+ * thread when dict-background-rehash is set. This is a startup-only
+ * setting: initServer() must call it right after creating the
+ * server.db[j].dict tables, before any iterator exists. server.c and
+ * config.c are not part of this tree, so the call and the config entry
+ * still have to be added there. emptyDbAsync() replaces those dicts and
+ * must call it again; dicts already enabled are left alone. Shrinking and
+ * the expires dicts keep the incremental rehash. */
+void dbEnableBackgroundRehash(void) {
+    int j;
+
+    if (!server.dict_background_rehash) return;
+    for (j = 0; j < server.dbnum; j++)
+        dictEnableBackgroundRehash(server.db[j].dict);
+}
+
 /* Release data obtained with getMemoryOverheadData(). */
 void freeMemoryOverheadData(struct redisMemOverhead *mh) {
     zfree(mh->db);
@@ -1024,6 +1061,9 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mh->lua_caches = mem;
     mem_total+=mem;
 
+    quicklistGetDecompressCacheStats(&mh->list_cache);
+    mem_total+=mh->list_cache.bytes;
+
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         long long keyscount = dictSize(db->dict);
@@ -1059,6 +1099,7 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mh->dataset_perc = (float)mh->dataset*100/net_usage;
     mh->bytes_per_key = mh->total_keys ? (net_usage / mh->total_keys) : 0;
 
+    zmalloc_profile_get(&mh->alloc_profile);
     return mh;
 }
 
@@ -1235,6 +1276,28 @@ robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply) {
     return o;
 }
 
+/* 多个key的命令在逐个调用lookupKey*()之前调用，预取keys[0]、keys[step]、keys[2*step]...这count个key。
+ * 用dictPrefetch()只预取key所在的hash桶、节点和值对象，不比较key，再预取值对象中字符串的内容，过期字典不为空时同样预取。
+ * key的比较只在lookupKey*()中做一次，它的行为（过期、LRU/LFU、命中统计）不变，只是需要的数据大多已经在缓存中了。 */
+void dbPrefetchKeys(redisDb *db, robj **keys, int count, int step) {
+    const void *batch[DICT_FIND_BATCH];
+    void *vals[DICT_FIND_BATCH];
+    int i, j, n;
+
+    for (i = 0; i < count; i += n) {
+        n = (count-i < DICT_FIND_BATCH) ? count-i : DICT_FIND_BATCH;
+        for (j = 0; j < n; j++) batch[j] = keys[(i+j)*step]->ptr;
+        if (dictSize(db->expires)) dictPrefetch(db->expires,batch,n,NULL);
+        dictPrefetch(db->dict,batch,n,vals);
+        for (j = 0; j < n; j++) {
+            robj *o = vals[j]; ///候选节点的值，不一定属于这个key，但一定是一个有效的值对象
+
+            if (o && o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_RAW)
+                __builtin_prefetch(o->ptr);
+        }
+    }
+}
+
 /* Object command allows to inspect the internals of an Redis Object.
  * Usage: OBJECT <refcount|encoding|idletime|freq> <key> */
 void objectCommand(client *c) {
@@ -1292,6 +1355,7 @@ void memoryCommand(client *c) {
 "DOCTOR - Return memory problems reports.",
 "MALLOC-STATS -- Return internal statistics report from the memory allocator.",
 "PURGE -- Attempt to purge dirty pages for reclamation by the allocator.",
+"PROFILE <rate> -- Sample one in <rate> allocations by call site and size, reported by STATS. 0 disables sampling.",
 "STATS -- Return information about the memory usage of the server.",
 "USAGE <key> [SAMPLES <count>] -- Return memory in bytes used by <key> and its value. Nested values are sampled up to <count> times (default: 5).",
 NULL
@@ -1327,8 +1391,9 @@ NULL
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
+        zmallocProfile *prof = &mh->alloc_profile;
 
-        addReplyMapLen(c,25+mh->num_dbs);
+        addReplyMapLen(c,26+mh->num_dbs+(prof->rate != 0));
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1354,6 +1419,17 @@ NULL
         addReplyBulkCString(c,"lua.caches");
         addReplyLongLong(c,mh->lua_caches);
 
+        addReplyBulkCString(c,"list.decompress-cache");
+        addReplyMapLen(c,4);
+        addReplyBulkCString(c,"bytes");
+        addReplyLongLong(c,mh->list_cache.bytes);
+        addReplyBulkCString(c,"hits");
+        addReplyLongLong(c,mh->list_cache.hits);
+        addReplyBulkCString(c,"misses");
+        addReplyLongLong(c,mh->list_cache.misses);
+        addReplyBulkCString(c,"evictions");
+        addReplyLongLong(c,mh->list_cache.evictions);
+
         for (size_t j = 0; j < mh->num_dbs; j++) {
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
@@ -1418,7 +1494,60 @@ NULL
         addReplyBulkCString(c,"fragmentation.bytes");
         addReplyLongLong(c,mh->total_frag_bytes);
 
+        /* Estimated allocations per call site since MEMORY PROFILE was
+         * enabled, only reported while sampling is on. */
+        if (prof->rate) {
+            int tags = 0;
+
+            for (int t = 0; t < ZMALLOC_TAGS; t++) if (prof->bytes[t]) tags++;
+            addReplyBulkCString(c,"allocations.sampled");
+            addReplyMapLen(c,1+tags);
+            addReplyBulkCString(c,"sample-rate");
+            addReplyLongLong(c,prof->rate);
+            for (int t = 0; t < ZMALLOC_TAGS; t++) {
+                size_t count = 0;
+                int buckets = 0;
+
+                if (!prof->bytes[t]) continue;
+                for (int b = 0; b < ZMALLOC_PROFILE_BUCKETS; b++) {
+                    count += prof->count[t][b];
+                    if (prof->count[t][b]) buckets++;
+                }
+                addReplyBulkCString(c,zmalloc_tag_name(t));
+                addReplyMapLen(c,3);
+                addReplyBulkCString(c,"count");
+                addReplyLongLong(c,count);
+                addReplyBulkCString(c,"bytes");
+                addReplyLongLong(c,prof->bytes[t]);
+                /* Size histogram: "<N" counts sizes in [N/2, N). */
+                addReplyBulkCString(c,"sizes");
+                addReplyMapLen(c,buckets);
+                for (int b = 0; b < ZMALLOC_PROFILE_BUCKETS; b++) {
+                    char label[32];
+
+                    if (!prof->count[t][b]) continue;
+                    if (b == ZMALLOC_PROFILE_BUCKETS-1)
+                        snprintf(label,sizeof(label),">=%llu",1ULL<<(b-1));
+                    else
+                        snprintf(label,sizeof(label),"<%llu",1ULL<<b);
+                    addReplyBulkCString(c,label);
+                    addReplyLongLong(c,prof->count[t][b]);
+                }
+            }
+        }
+
         freeMemoryOverheadData(mh);
+    } else if (!strcasecmp(c->argv[1]->ptr,"profile") && c->argc == 3) {
+        long long rate;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[2],&rate,NULL) != C_OK)
+            return;
+        if (rate < 0 || rate > UINT_MAX) {
+            addReplyError(c,"sample rate out of range");
+            return;
+        }
+        zmalloc_profile_set_rate(rate);
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"malloc-stats") && c->argc == 2) {
 #if defined(USE_JEMALLOC)
         sds info = sdsempty();
@@ -0,0 +1,1379 @@
+/* packlist是和ziplist用途相同的紧凑列表，用来保存快表的节点和小的有序集合。它的接口和ziplist.h的形式相同，函数名以packlist开头，
+ * 调用方只需要把ziplistXXX替换成packlistXXX。
+ *
+ * ziplist的每个节点记录前驱节点的长度（prevlen），前驱节点的长度从小于254变成不小于254时，prevlen需要从1个字节扩展成5个字节，
+ * 这又可能让后面的节点继续扩展，也就是连锁更新。packlist的节点改为在末尾记录自己的长度（backlen），
+ * 一个节点的内容只和它自己有关，插入和删除只需要移动后面的内存，不会修改其它节点。
+ * 节点的编码方式参考了stream使用的listpack，但接口和ziplist相同，两者是独立的实现。
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * PACKLIST总体布局
+ * ======================
+ *
+ *       头部          |            真实节点数据        | 结尾标志
+ * <plbytes> <pllen>  | <entry> <entry> ... <entry>  | <plend>
+ *
+ * <uint32_t plbytes>是整个packlist占用的字节数，包括头部和结尾标志。
+ * <uint16_t pllen>是节点的数量，节点数量不小于UINT16_MAX时设置为UINT16_MAX，这时需要遍历整个packlist才能得到节点数量。
+ * <uint8_t plend>是结尾标志，值为255，节点编码的第一个字节不会是255。
+ * 注意：所有的多字节字段都以little endian存储。
+ *
+ * PACKLIST节点
+ * ======================
+ *
+ * 每个节点由编码（整数节点的编码包括了整数的值）、字符串内容和backlen组成：
+ *
+ * <encoding> <entry-data> <backlen>
+ *
+ * 编码的第一个字节决定了节点的类型：
+ *
+ * |0xxxxxxx| 0到127之间的整数，值就保存在这7位中。
+ * |10xxxxxx| 长度小于64的字符串，后面是字符串的内容。
+ * |110xxxxx|yyyyyyyy| 13位有符号整数，高5位在第一个字节中。
+ * |1110xxxx|yyyyyyyy| 长度小于4096的字符串，长度的高4位在第一个字节中，后面是字符串的内容。
+ * |11110000|aaaaaaaa|bbbbbbbb|cccccccc|dddddddd| 更长的字符串，4个字节的长度，后面是字符串的内容。
+ * |11110001| 16位有符号整数，后面是2个字节的值。
+ * |11110010| 24位有符号整数，后面是3个字节的值。
+ * |11110011| 32位有符号整数，后面是4个字节的值。
+ * |11110100| 64位有符号整数，后面是8个字节的值。
+ *
+ * backlen是<encoding>和<entry-data>的总字节数，每个字节保存7位。从节点末尾向左读取，先读到的是低位，
+ * 字节的最高位为1表示左边还有更多的字节。所以从一个节点的末尾（也就是后继节点的开头）可以找到这个节点的开头，
+ * 这样就可以从后向前遍历packlist。
+ *
+ * 和ziplist一样，可以转换成整数的字符串总是保存成整数，所以字符串节点的内容不会是一个整数。
+ *
+ * 打开和关闭
+ * ======================
+ *
+ * packlist格式默认是关闭的。关闭时所有的packlist*函数都转调ziplist.c中对应的函数，操作的是ziplist，
+ * 快表的节点和小的有序集合仍然以ziplist保存（有序集合的编码也仍然是OBJ_ENCODING_ZIPLIST），
+ * 所以RDB/AOF、ZSCAN、GEO、SORT、module和defrag这些按ziplist解析数据的代码不受影响。
+ *
+ * 默认的编译中packlist_enabled是常量0（见packlist.h），格式不能打开，这些函数只是对ziplist函数的一次跳转，
+ * 调用处的判断和OBJ_ENCODING_ZSET_PACKED在编译时就确定了。打开USE_PACKLIST编译选项（单元测试总是打开）后，
+ * packlist_enabled才是变量，可以用packlistSetEnabled(1)打开。
+ * 在RDB有了对应的类型、配置项和上面那些代码都支持packlist之前，不应该在正式的编译中打开这个选项。
+ * 格式只能在创建任何快表或者有序集合之前（启动读取配置的时候）设置，否则已有的数据会被当作另一种格式解析。
+ */
+
+#define ZMALLOC_TAG ZMALLOC_TAG_ZIPLIST ///分配分析中和ziplist记在一起，见zmalloc.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "zmalloc.h"
+#include "util.h"
+#include "packlist.h"
+#include "ziplist.h"
+#include "redisassert.h"
+
+#define PL_HDR_SIZE 6 ///头部的大小，4个字节的plbytes加2个字节的pllen
+#define PL_HDR_NUMELE_UNKNOWN UINT16_MAX ///pllen为这个值时需要遍历才能得到节点数量
+#define PL_EOF 0xFF ///packlist的结尾标志
+
+///节点编码，见文件开头的说明
+#define PL_ENCODING_7BIT_UINT 0
+#define PL_ENCODING_7BIT_UINT_MASK 0x80
+#define PL_ENCODING_IS_7BIT_UINT(byte) (((byte)&PL_ENCODING_7BIT_UINT_MASK)==PL_ENCODING_7BIT_UINT)
+#define PL_ENCODING_6BIT_STR 0x80
+#define PL_ENCODING_6BIT_STR_MASK 0xC0
+#define PL_ENCODING_IS_6BIT_STR(byte) (((byte)&PL_ENCODING_6BIT_STR_MASK)==PL_ENCODING_6BIT_STR)
+#define PL_ENCODING_13BIT_INT 0xC0
+#define PL_ENCODING_13BIT_INT_MASK 0xE0
+#define PL_ENCODING_IS_13BIT_INT(byte) (((byte)&PL_ENCODING_13BIT_INT_MASK)==PL_ENCODING_13BIT_INT)
+#define PL_ENCODING_12BIT_STR 0xE0
+#define PL_ENCODING_12BIT_STR_MASK 0xF0
+#define PL_ENCODING_IS_12BIT_STR(byte) (((byte)&PL_ENCODING_12BIT_STR_MASK)==PL_ENCODING_12BIT_STR)
+#define PL_ENCODING_32BIT_STR 0xF0
+#define PL_ENCODING_16BIT_INT 0xF1
+#define PL_ENCODING_24BIT_INT 0xF2
+#define PL_ENCODING_32BIT_INT 0xF3
+#define PL_ENCODING_64BIT_INT 0xF4
+
+#ifdef HAVE_PACKLIST_FORMAT
+int packlist_enabled = 0; ///为0时packlist*函数操作的是ziplist，见文件开头的说明
+
+///设置是否使用packlist格式，只能在创建任何快表或者有序集合之前调用
+void packlistSetEnabled(int enabled) {
+    packlist_enabled = enabled != 0;
+}
+#endif
+
+#define PL_FIRST(pl) ((pl)+PL_HDR_SIZE) ///第一个节点（或者结尾标志）的地址
+#define PL_END(pl) ((pl)+plGetTotalBytes(pl)-1) ///结尾标志的地址
+
+static inline uint32_t plGetTotalBytes(unsigned char *pl) {
+    return (uint32_t)pl[0] | ((uint32_t)pl[1] << 8) | ((uint32_t)pl[2] << 16) | ((uint32_t)pl[3] << 24);
+}
+
+static inline void plSetTotalBytes(unsigned char *pl, uint32_t bytes) {
+    pl[0] = bytes & 0xff;
+    pl[1] = (bytes >> 8) & 0xff;
+    pl[2] = (bytes >> 16) & 0xff;
+    pl[3] = bytes >> 24;
+}
+
+static inline unsigned int plGetNumElements(unsigned char *pl) {
+    return pl[4] | ((unsigned int)pl[5] << 8);
+}
+
+static inline void plSetNumElements(unsigned char *pl, unsigned int num) {
+    pl[4] = num & 0xff;
+    pl[5] = (num >> 8) & 0xff;
+}
+
+///节点数量增加incr，节点数量未知时保持未知，和ZIPLIST_INCR_LENGTH一样；增加后达到UINT16_MAX时也变成未知
+static inline void plIncrNumElements(unsigned char *pl, long incr) {
+    unsigned int num = plGetNumElements(pl);
+    long newnum;
+
+    if (num == PL_HDR_NUMELE_UNKNOWN) return;
+    newnum = (long)num + incr;
+    plSetNumElements(pl,newnum < PL_HDR_NUMELE_UNKNOWN ? newnum : PL_HDR_NUMELE_UNKNOWN);
+}
+
+/* 要写入packlist的一个值的编码。整数的编码连同值都在buf中；字符串的编码在buf中，内容是str。
+ * enclen是编码和内容的总长度，也就是backlen记录的值，backlen是backlen本身占用的字节数。 */
+typedef struct plValue {
+    unsigned char buf[9];
+    unsigned int buflen;
+    unsigned char *str;
+    unsigned int slen;
+    unsigned int enclen;
+    unsigned int backlen;
+} plValue;
+
+/* 把节点长度l编码成backlen保存到buf中，返回占用的字节数；buf为NULL时只计算字节数。
+ * 最左边的字节保存最高的7位并且最高位为0，其余字节的最高位为1。 */
+static unsigned int plEncodeBacklen(unsigned char *buf, uint64_t l) {
+    unsigned int n = 1;
+
+    while (n < 5 && (l >> (7*n)) != 0) n++;
+    if (buf) {
+        for (unsigned int i = 0; i < n; i++)
+            buf[i] = ((l >> (7*(n-1-i))) & 127) | (i ? 128 : 0);
+    }
+    return n;
+}
+
+///p指向backlen的最后一个字节，从右向左解码出节点的长度
+static uint64_t plDecodeBacklen(unsigned char *p) {
+    uint64_t val = 0;
+    unsigned int shift = 0;
+
+    while (1) {
+        val |= (uint64_t)(p[0] & 127) << shift;
+        if (!(p[0] & 128) || shift >= 28) break;
+        shift += 7;
+        p--;
+    }
+    return val;
+}
+
+///字符串能否转换成整数，规则和ziplist的zipTryEncoding()相同
+static int plStringToInt64(unsigned char *s, unsigned int slen, long long *v) {
+    if (slen == 0 || slen >= 32) return 0;
+    return string2ll((char*)s,slen,v);
+}
+
+///整数ll的编码，使用能够表示它的最短编码
+static void plEncodeInteger(plValue *v, long long ll) {
+    uint64_t uv = (uint64_t)ll;
+    unsigned int bytes;
+
+    v->str = NULL;
+    v->slen = 0;
+    if (ll >= 0 && ll <= 127) {
+        v->buf[0] = ll;
+        v->buflen = 1;
+    } else if (ll >= -4096 && ll <= 4095) {
+        uv &= 0x1fff;
+        v->buf[0] = (uv >> 8) | PL_ENCODING_13BIT_INT;
+        v->buf[1] = uv & 0xff;
+        v->buflen = 2;
+    } else {
+        if (ll >= INT16_MIN && ll <= INT16_MAX) {
+            v->buf[0] = PL_ENCODING_16BIT_INT;
+            bytes = 2;
+        } else if (ll >= -8388608 && ll <= 8388607) {
+            v->buf[0] = PL_ENCODING_24BIT_INT;
+            bytes = 3;
+        } else if (ll >= INT32_MIN && ll <= INT32_MAX) {
+            v->buf[0] = PL_ENCODING_32BIT_INT;
+            bytes = 4;
+        } else {
+            v->buf[0] = PL_ENCODING_64BIT_INT;
+            bytes = 8;
+        }
+        for (unsigned int i = 0; i < bytes; i++) v->buf[1+i] = (uv >> (8*i)) & 0xff;
+        v->buflen = 1 + bytes;
+    }
+    v->enclen = v->buflen;
+    v->backlen = plEncodeBacklen(NULL,v->enclen);
+}
+
+///长度为len的字符串s的编码
+static void plEncodeString(plValue *v, unsigned char *s, unsigned int len) {
+    if (len < 64) {
+        v->buf[0] = PL_ENCODING_6BIT_STR | len;
+        v->buflen = 1;
+    } else if (len < 4096) {
+        v->buf[0] = PL_ENCODING_12BIT_STR | (len >> 8);
+        v->buf[1] = len & 0xff;
+        v->buflen = 2;
+    } else {
+        v->buf[0] = PL_ENCODING_32BIT_STR;
+        v->buf[1] = len & 0xff;
+        v->buf[2] = (len >> 8) & 0xff;
+        v->buf[3] = (len >> 16) & 0xff;
+        v->buf[4] = len >> 24;
+        v->buflen = 5;
+    }
+    v->str = s;
+    v->slen = len;
+    v->enclen = v->buflen + len;
+    v->backlen = plEncodeBacklen(NULL,v->enclen);
+}
+
+///字符串s的编码，可以转换成整数的保存为整数
+static void plEncodeValue(plValue *v, unsigned char *s, unsigned int slen) {
+    long long ll;
+
+    if (plStringToInt64(s,slen,&ll))
+        plEncodeInteger(v,ll);
+    else
+        plEncodeString(v,s,slen);
+}
+
+///把v写入到dst，返回写入的节点之后的地址
+static unsigned char *plWriteValue(unsigned char *dst, plValue *v) {
+    memcpy(dst,v->buf,v->buflen);
+    dst += v->buflen;
+    if (v->slen) {
+        memcpy(dst,v->str,v->slen);
+        dst += v->slen;
+    }
+    return dst + plEncodeBacklen(dst,v->enclen);
+}
+
+///p所指节点的编码和内容的总长度，不包括backlen
+static uint32_t plCurrentEncodedSize(unsigned char *p) {
+    if (PL_ENCODING_IS_7BIT_UINT(p[0])) return 1;
+    if (PL_ENCODING_IS_6BIT_STR(p[0])) return 1 + (p[0] & 0x3f);
+    if (PL_ENCODING_IS_13BIT_INT(p[0])) return 2;
+    if (PL_ENCODING_IS_12BIT_STR(p[0])) return 2 + (((p[0] & 0xf) << 8) | p[1]);
+    switch (p[0]) {
+    case PL_ENCODING_16BIT_INT: return 3;
+    case PL_ENCODING_24BIT_INT: return 4;
+    case PL_ENCODING_32BIT_INT: return 5;
+    case PL_ENCODING_64BIT_INT: return 9;
+    case PL_ENCODING_32BIT_STR:
+        return 5 + ((uint32_t)p[1] | ((uint32_t)p[2] << 8) |
+                    ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 24));
+    case PL_EOF: return 1;
+    }
+    assert(NULL);
+    return 0;
+}
+
+///p所指节点的总长度，包括backlen
+static inline uint32_t plEntrySize(unsigned char *p) {
+    uint32_t l = plCurrentEncodedSize(p);
+    return l + plEncodeBacklen(NULL,l);
+}
+
+///p所指节点的下一个节点（或者结尾标志）
+static inline unsigned char *plSkip(unsigned char *p) {
+    return p + plEntrySize(p);
+}
+
+///p所指节点的编码占用的字节数，字符串节点的内容从p加上这个长度开始；整数节点返回整个节点的编码长度
+static inline unsigned int plHeaderSize(unsigned char *p) {
+    if (PL_ENCODING_IS_6BIT_STR(p[0])) return 1;
+    if (PL_ENCODING_IS_12BIT_STR(p[0])) return 2;
+    if (p[0] == PL_ENCODING_32BIT_STR) return 5;
+    return plCurrentEncodedSize(p);
+}
+
+///p所指的节点是字符串时返回内容的地址，并把长度保存到len中；整数节点返回NULL
+static unsigned char *plGetString(unsigned char *p, unsigned int *len) {
+    if (PL_ENCODING_IS_6BIT_STR(p[0])) {
+        *len = p[0] & 0x3f;
+        return p+1;
+    } else if (PL_ENCODING_IS_12BIT_STR(p[0])) {
+        *len = ((p[0] & 0xf) << 8) | p[1];
+        return p+2;
+    } else if (p[0] == PL_ENCODING_32BIT_STR) {
+        *len = (uint32_t)p[1] | ((uint32_t)p[2] << 8) | ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 24);
+        return p+5;
+    }
+    return NULL;
+}
+
+///p所指的整数节点的值
+static int64_t plGetInteger(unsigned char *p) {
+    uint64_t uv = 0;
+    unsigned int bits, bytes;
+
+    if (PL_ENCODING_IS_7BIT_UINT(p[0])) return p[0] & 0x7f;
+    if (PL_ENCODING_IS_13BIT_INT(p[0])) {
+        uv = ((p[0] & 0x1f) << 8) | p[1];
+        bits = 13;
+    } else {
+        switch (p[0]) {
+        case PL_ENCODING_16BIT_INT: bytes = 2; break;
+        case PL_ENCODING_24BIT_INT: bytes = 3; break;
+        case PL_ENCODING_32BIT_INT: bytes = 4; break;
+        case PL_ENCODING_64BIT_INT: bytes = 8; break;
+        default: assert(NULL); return 0;
+        }
+        for (unsigned int i = 0; i < bytes; i++) uv |= (uint64_t)p[1+i] << (8*i);
+        if (bytes == 8) return (int64_t)uv;
+        bits = bytes*8;
+    }
+    ///符号扩展
+    if (uv >= (1ULL << (bits-1))) return (int64_t)uv - (int64_t)(1ULL << bits);
+    return (int64_t)uv;
+}
+
+///创建一个空的packlist
+unsigned char *packlistNew(void) {
+    if (!packlist_enabled) return ziplistNew();
+
+    unsigned char *pl = zmalloc(PL_HDR_SIZE+1);
+    plSetTotalBytes(pl,PL_HDR_SIZE+1);
+    plSetNumElements(pl,0);
+    pl[PL_HDR_SIZE] = PL_EOF;
+    return pl;
+}
+
+///在p所指的位置插入v，p可以指向结尾标志。只需要一次realloc和一次memmove，其它节点的内容不变
+static unsigned char *plInsertValue(unsigned char *pl, unsigned char *p, plValue *v) {
+    uint32_t bytes = plGetTotalBytes(pl);
+    uint32_t entrylen = v->enclen + v->backlen;
+    size_t offset = p-pl;
+
+    pl = zrealloc(pl,bytes+entrylen);
+    p = pl+offset;
+    memmove(p+entrylen,p,bytes-offset);
+    plWriteValue(p,v);
+    plSetTotalBytes(pl,bytes+entrylen);
+    plIncrNumElements(pl,1);
+    return pl;
+}
+
+///从p开始删除最多num个节点
+static unsigned char *plDeleteRaw(unsigned char *pl, unsigned char *p, unsigned int num) {
+    uint32_t bytes = plGetTotalBytes(pl);
+    unsigned char *q = p;
+    unsigned int deleted = 0;
+
+    while (q[0] != PL_EOF && deleted < num) {
+        q = plSkip(q);
+        deleted++;
+    }
+    if (deleted == 0) return pl;
+
+    memmove(p,q,bytes-(q-pl));
+    pl = zrealloc(pl,bytes-(q-p));
+    plSetTotalBytes(pl,bytes-(q-p));
+    plIncrNumElements(pl,-(int)deleted);
+    return pl;
+}
+
+///在p所指的位置插入节点，如果p是packlist中的节点，则将这个新节点插入到p的前面
+unsigned char *packlistInsert(unsigned char *pl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    plValue v;
+
+    if (!packlist_enabled) return ziplistInsert(pl,p,s,slen);
+    plEncodeValue(&v,s,slen);
+    return plInsertValue(pl,p,&v);
+}
+
+///将长度为slen的字符串push到pl中，where表示push的地方，可以是头部，也可以是尾部
+unsigned char *packlistPush(unsigned char *pl, unsigned char *s, unsigned int slen, int where) {
+    if (!packlist_enabled) return ziplistPush(pl,s,slen,where);
+    unsigned char *p = (where == PACKLIST_HEAD) ? PL_FIRST(pl) : PL_END(pl);
+    return packlistInsert(pl,p,s,slen);
+}
+
+/* 把count个字符串一次写入packlist的头部或者尾部，结果和依次对s[0]到s[count-1]调用packlistPush(pl,s[i],slen[i],where)相同，
+ * 所以写入头部时s[count-1]在最前面。先计算出所有节点的总长度，整个操作只需要一次realloc和一次memmove。 */
+unsigned char *packlistPushMany(unsigned char *pl, unsigned char **s, unsigned int *slen, unsigned int count, int where) {
+    uint32_t bytes = plGetTotalBytes(pl);
+    size_t offset, added = 0;
+    unsigned char *dst;
+    plValue v;
+
+    if (count == 0) return pl;
+    if (!packlist_enabled) return ziplistPushMany(pl,s,slen,count,where);
+    for (unsigned int i = 0; i < count; i++) {
+        plEncodeValue(&v,s[i],slen[i]);
+        added += v.enclen + v.backlen;
+    }
+
+    offset = (where == PACKLIST_HEAD) ? PL_HDR_SIZE : bytes-1;
+    pl = zrealloc(pl,bytes+added);
+    dst = pl+offset;
+    memmove(dst+added,dst,bytes-offset);
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int j = (where == PACKLIST_HEAD) ? count-1-i : i;
+        plEncodeValue(&v,s[j],slen[j]);
+        dst = plWriteValue(dst,&v);
+    }
+    plSetTotalBytes(pl,bytes+added);
+    plIncrNumElements(pl,count);
+    return pl;
+}
+
+///从packlist中删除*p指向的节点，并把*p更新为删除后这个位置上的节点（可能是结尾标志），以便继续遍历
+unsigned char *packlistDelete(unsigned char *pl, unsigned char **p) {
+    size_t offset = *p-pl;
+
+    if (!packlist_enabled) return ziplistDelete(pl,p);
+    pl = plDeleteRaw(pl,*p,1);
+    *p = pl+offset;
+    return pl;
+}
+
+///删除从index开始的num个节点
+unsigned char *packlistDeleteRange(unsigned char *pl, int index, unsigned int num) {
+    if (!packlist_enabled) return ziplistDeleteRange(pl,index,num);
+    unsigned char *p = packlistIndex(pl,index);
+    return (p == NULL) ? pl : plDeleteRaw(pl,p,num);
+}
+
+/* 删除ps中的count个节点，ps必须按地址从小到大排列并且没有重复。
+ * 只把保留下来的节点依次向前移动一次，最后realloc一次，不需要像逐个调用packlistDelete()那样每次都移动后面所有的内存。 */
+unsigned char *packlistDeleteMany(unsigned char *pl, unsigned char **ps, unsigned int count) {
+    uint32_t bytes = plGetTotalBytes(pl);
+    unsigned char *dst, *src, *next;
+    size_t removed;
+
+    if (count == 0) return pl;
+    if (!packlist_enabled) return ziplistDeleteMany(pl,ps,count);
+    dst = ps[0];
+    for (unsigned int i = 0; i < count; i++) {
+        assert(ps[i][0] != PL_EOF && (i == 0 || ps[i] > ps[i-1]));
+        src = plSkip(ps[i]);
+        next = (i+1 < count) ? ps[i+1] : pl+bytes;
+        memmove(dst,src,next-src);
+        dst += next-src;
+    }
+    removed = (pl+bytes) - dst;
+    pl = zrealloc(pl,bytes-removed);
+    plSetTotalBytes(pl,bytes-removed);
+    plIncrNumElements(pl,-(long)count);
+    return pl;
+}
+
+///返回p的下一个节点，p是最后一个节点或者结尾标志时返回NULL
+unsigned char *packlistNext(unsigned char *pl, unsigned char *p) {
+    if (!packlist_enabled) return ziplistNext(pl,p);
+    if (p[0] == PL_EOF) return NULL;
+    p = plSkip(p);
+    return (p[0] == PL_EOF) ? NULL : p;
+}
+
+///返回p的前驱节点，p是结尾标志时返回最后一个节点，p是第一个节点时返回NULL
+unsigned char *packlistPrev(unsigned char *pl, unsigned char *p) {
+    uint64_t prevlen;
+
+    if (!packlist_enabled) return ziplistPrev(pl,p);
+    if (p == PL_FIRST(pl)) return NULL;
+    p--; ///前驱节点backlen的最后一个字节
+    prevlen = plDecodeBacklen(p);
+    prevlen += plEncodeBacklen(NULL,prevlen);
+    return p-prevlen+1;
+}
+
+/* 查询下标为index的节点地址，index为负数时从尾部开始计数，不存在时返回NULL。
+ * 知道节点数量时从离index较近的一端开始遍历。 */
+unsigned char *packlistIndex(unsigned char *pl, int index) {
+    unsigned int numele;
+    unsigned char *p;
+
+    if (!packlist_enabled) return ziplistIndex(pl,index);
+    numele = plGetNumElements(pl);
+    if (numele != PL_HDR_NUMELE_UNKNOWN) {
+        if (index < 0) {
+            if ((unsigned int)-(long)index > numele) return NULL;
+            if ((unsigned int)-(long)index > numele/2) index += numele;
+        } else {
+            if ((unsigned int)index >= numele) return NULL;
+            if ((unsigned int)index > numele/2) index -= numele;
+        }
+    }
+
+    if (index < 0) {
+        index = (-index)-1;
+        p = packlistPrev(pl,PL_END(pl));
+        while (p && index--) p = packlistPrev(pl,p);
+    } else {
+        p = PL_FIRST(pl);
+        while (p[0] != PL_EOF && index--) p = plSkip(p);
+        if (p[0] == PL_EOF) p = NULL;
+    }
+    return p;
+}
+
+/* 稀疏偏移索引，记录第0、step、2*step……个节点相对packlist起始地址的偏移量。
+ * packlistIndex()需要从较近的一端逐个节点地走过去，对一个很长的packlist反复按下标访问时（比如LINDEX、LSET），
+ * 可以建立这个索引，从最近的记录点出发，最多只需要走step/2步。
+ * 索引由调用方保存，packlist被修改之后索引就失效了，调用方必须丢弃它，需要时再重新建立。 */
+struct packlistOffsets {
+    unsigned int step; ///每隔step个节点记录一次偏移量
+    unsigned int numele; ///建立索引时packlist的节点数量
+    unsigned int count; ///offset数组的长度
+    uint32_t offset[];
+};
+
+///为pl建立每隔step个节点记录一次偏移量的稀疏索引，用packlistFreeOffsets()释放
+packlistOffsets *packlistBuildOffsets(unsigned char *pl, unsigned int step) {
+    unsigned int numele = packlistLen(pl), count, i;
+    packlistOffsets *po;
+    unsigned char *p;
+
+    if (step == 0) step = 1;
+    count = (numele + step - 1) / step;
+    po = zmalloc(sizeof(*po) + sizeof(uint32_t) * count);
+    po->step = step;
+    po->numele = numele;
+    po->count = count;
+    p = packlistIndex(pl,0);
+    for (i = 0; i < numele; i++) {
+        if (i % step == 0) po->offset[i/step] = p - pl;
+        p = packlistNext(pl,p);
+    }
+    return po;
+}
+
+///释放稀疏索引
+void packlistFreeOffsets(packlistOffsets *po) {
+    zfree(po);
+}
+
+///稀疏索引占用的内存
+size_t packlistOffsetsSize(packlistOffsets *po) {
+    return sizeof(*po) + sizeof(uint32_t) * po->count;
+}
+
+/* 和packlistIndex()相同，但是通过稀疏索引po找到离index最近的记录点，再向前或者向后走到index处。
+ * po必须是在pl最后一次修改之后建立的。 */
+unsigned char *packlistIndexWithOffsets(unsigned char *pl, packlistOffsets *po, int index) {
+    unsigned int k;
+    unsigned char *p;
+    long d;
+
+    if (index < 0) index += po->numele;
+    if (index < 0 || (unsigned int)index >= po->numele) return NULL;
+
+    k = (index + po->step / 2) / po->step;
+    if (k >= po->count) k = po->count - 1;
+    d = (long)index - (long)k * po->step;
+    ///最后一个记录点之后的节点，从结尾标志向前走可能更近
+    if (d > 0 && po->numele - index <= (unsigned long)d) {
+        p = packlistIndex(pl,-1);
+        d = (long)index - (po->numele - 1);
+    } else {
+        p = pl + po->offset[k];
+    }
+    for (; d > 0; d--) p = packlistNext(pl,p);
+    for (; d < 0; d++) p = packlistPrev(pl,p);
+    return p;
+}
+
+/* 获取由p指向的节点，和ziplistGet()一样，字符串保存在*sstr和*slen中，整数保存在*sval中并把*sstr设置为NULL。
+ * p为NULL或者指向结尾标志时返回0，否则返回1。 */
+unsigned int packlistGet(unsigned char *p, unsigned char **sstr, unsigned int *slen, long long *sval) {
+    unsigned char *str;
+    unsigned int len;
+
+    if (!packlist_enabled) return ziplistGet(p,sstr,slen,sval);
+    if (p == NULL || p[0] == PL_EOF) return 0;
+    if (sstr) *sstr = NULL;
+
+    str = plGetString(p,&len);
+    if (str) {
+        if (sstr) {
+            *slen = len;
+            *sstr = str;
+        }
+    } else {
+        if (sval) *sval = plGetInteger(p);
+    }
+    return 1;
+}
+
+///比较p所指向的节点和sstr，如果相等返回1，不相等返回0
+unsigned int packlistCompare(unsigned char *p, unsigned char *sstr, unsigned int slen) {
+    unsigned char *str;
+    unsigned int len;
+    long long sval;
+
+    if (!packlist_enabled) return ziplistCompare(p,sstr,slen);
+    if (p[0] == PL_EOF) return 0;
+    str = plGetString(p,&len);
+    if (str) return len == slen && memcmp(str,sstr,slen) == 0;
+    if (plStringToInt64(sstr,slen,&sval)) return plGetInteger(p) == sval;
+    return 0;
+}
+
+/* 从p开始查找和vstr值相等的节点，每次比较之后跳过skip个节点，找不到时返回NULL。
+ * 和ziplistFindIn()的做法一样：不能转换成整数的vstr只可能和字符串节点相等，而相等的节点一定以“编码的最后一个字节 + vstr”开头，
+ * 所以先用ziplistScan()扫描这个字节序列，只有扫描到的时候才逐个跳过节点，确认它正好是一个没有被skip跳过的字符串节点。 */
+unsigned char *packlistFind(unsigned char *pl, unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip) {
+    unsigned char *end, *c;
+    unsigned int skipcnt = 0;
+    long long vll;
+    plValue v;
+
+    if (!packlist_enabled) return ziplistFindIn(pl,p,vstr,vlen,skip);
+    end = PL_END(pl);
+    if (vlen == 0 || plStringToInt64(vstr,vlen,&vll)) {
+        ///整数和空字符串逐个节点比较
+        int isint = vlen != 0;
+
+        while (p[0] != PL_EOF) {
+            if (skipcnt == 0) {
+                unsigned int len;
+                unsigned char *str = plGetString(p,&len);
+
+                if (str) {
+                    if (len == vlen && memcmp(str,vstr,vlen) == 0) return p;
+                } else if (isint && plGetInteger(p) == vll) {
+                    return p;
+                }
+                skipcnt = skip;
+            } else {
+                skipcnt--;
+            }
+            p = plSkip(p);
+        }
+        return NULL;
+    }
+
+    plEncodeString(&v,vstr,vlen);
+    c = ziplistScan(p,end,v.buf[v.buflen-1],vstr,vlen);
+    while (c) {
+        unsigned int hlen;
+
+        ///跳过c之前的节点，c在最后一个节点的内容或者backlen中时会走到结尾标志
+        while (1) {
+            if (p[0] == PL_EOF) return NULL;
+            hlen = plHeaderSize(p);
+            if (p + hlen - 1 >= c) break;
+            skipcnt = skipcnt ? skipcnt - 1 : skip;
+            p = plSkip(p);
+        }
+
+        if (p + hlen - 1 == c) {
+            unsigned int len;
+
+            ///c正好是节点编码的最后一个字节，内容已经在扫描时比较过了
+            if (skipcnt == 0 && plGetString(p,&len) && len == vlen) return p;
+            c = ziplistScan(c+1,end,v.buf[v.buflen-1],vstr,vlen);
+        } else {
+            c = ziplistScan(p+hlen-1,end,v.buf[v.buflen-1],vstr,vlen);
+        }
+    }
+    return NULL;
+}
+
+/* 在[s,end)中查找字节first后面紧跟len个字节str的位置，len为0时只查找first。 */
+static unsigned char *plScan(unsigned char *s, unsigned char *end, unsigned char first, unsigned char *str, unsigned int len) {
+    if (s >= end) return NULL;
+    if (len == 0) return memchr(s,first,end-s);
+    return ziplistScan(s,end,first,str,len);
+}
+
+/* 查找pl中所有和vstr值相等的节点，按从头到尾的顺序把它们的地址写入ps、下标写入indexes（两者都可以为NULL），
+ * 最多找max个，返回找到的个数。LPOS和LREM用它一次处理快表的一个节点。
+ * 和packlistFind()一样先用ziplistScan()扫描字节序列，只有扫描到的时候才逐个跳过节点，并且整数也不需要解码：
+ * 可以转换成整数的值总是使用最短的编码，所以和vll相等的节点的编码和backlen与vll自己的完全相同，直接扫描这些字节。
+ * 空字符串节点的编码和backlen也是固定的。其它字符串仍然扫描“编码的最后一个字节 + vstr”。 */
+unsigned int packlistFindAll(unsigned char *pl, unsigned char *vstr, unsigned int vlen,
+                             unsigned char **ps, unsigned int *indexes, unsigned int max) {
+    unsigned char *p, *end, *str, *c;
+    unsigned char pat[9+5]; ///整数节点的编码（最长9个字节）加上backlen（最长5个字节）
+    unsigned int len, anchor, idx = 0, found = 0;
+    unsigned char first;
+    plValue v;
+
+    if (max == 0) return 0;
+    if (!packlist_enabled) return ziplistFindAll(pl,vstr,vlen,ps,indexes,max);
+    p = PL_FIRST(pl);
+    end = PL_END(pl);
+    plEncodeValue(&v,vstr,vlen);
+    if (v.slen) {
+        anchor = v.buflen-1; ///扫描到的位置在节点开头之后anchor个字节处
+        first = v.buf[anchor];
+        str = vstr;
+        len = vlen;
+    } else {
+        anchor = 0;
+        memcpy(pat,v.buf,v.buflen);
+        len = v.buflen + plEncodeBacklen(pat+v.buflen,v.enclen) - 1;
+        first = pat[0];
+        str = pat+1;
+    }
+
+    c = plScan(p,end,first,str,len);
+    while (c) {
+        unsigned int a, l;
+
+        ///跳过c之前的节点，它们不可能和vstr相等
+        while (1) {
+            if (p[0] == PL_EOF) return found;
+            a = v.slen ? plHeaderSize(p)-1 : 0;
+            if (p + a >= c) break;
+            p = plSkip(p);
+            idx++;
+        }
+
+        if (p + a != c) {
+            ///c在节点p的编码中间，从p可能匹配的位置重新扫描
+            c = plScan(p+a,end,first,str,len);
+            continue;
+        }
+        ///整数和空字符串整个节点都已经比较过了，字符串还需要确认长度相同
+        if (!v.slen || (plGetString(p,&l) && l == vlen)) {
+            if (ps) ps[found] = p;
+            if (indexes) indexes[found] = idx;
+            if (++found == max) break;
+        }
+        c = plScan(c+1,end,first,str,len);
+    }
+    return found;
+}
+
+///返回packlist中的节点数量，头部没有记录时遍历统计，并在小于UINT16_MAX时记录下来
+unsigned int packlistLen(unsigned char *pl) {
+    unsigned int num;
+    unsigned char *p;
+
+    if (!packlist_enabled) return ziplistLen(pl);
+    num = plGetNumElements(pl);
+    if (num != PL_HDR_NUMELE_UNKNOWN) return num;
+    num = 0;
+    p = PL_FIRST(pl);
+    while (p[0] != PL_EOF) {
+        p = plSkip(p);
+        num++;
+    }
+    if (num < PL_HDR_NUMELE_UNKNOWN) plSetNumElements(pl,num);
+    return num;
+}
+
+///返回packlist总的字节数
+size_t packlistBlobLen(unsigned char *pl) {
+    if (!packlist_enabled) return ziplistBlobLen(pl);
+    return plGetTotalBytes(pl);
+}
+
+/* 合并两个packlist，把second追加到first后面，语义和ziplistMerge()相同：
+ * 节点数较多的一个被重新分配成合并后的packlist，另一个被释放，两个参数都设置为合并的结果。不能合并时返回NULL。
+ * 节点不依赖前驱节点，所以合并只是内存拷贝，不需要更新任何节点。 */
+unsigned char *packlistMerge(unsigned char **first, unsigned char **second) {
+    if (!packlist_enabled) return ziplistMerge(first,second);
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second)
+        return NULL;
+
+    size_t first_bytes = plGetTotalBytes(*first);
+    size_t first_len = plGetNumElements(*first);
+    size_t second_bytes = plGetTotalBytes(*second);
+    size_t second_len = plGetNumElements(*second);
+    unsigned char *source, *target;
+    size_t target_bytes, source_bytes;
+    int append;
+
+    if (first_len >= second_len) {
+        target = *first;
+        target_bytes = first_bytes;
+        source = *second;
+        source_bytes = second_bytes;
+        append = 1;
+    } else {
+        target = *second;
+        target_bytes = second_bytes;
+        source = *first;
+        source_bytes = first_bytes;
+        append = 0;
+    }
+
+    size_t plbytes = first_bytes + second_bytes - PL_HDR_SIZE - 1;
+    size_t pllength = first_len + second_len;
+    if (first_len == PL_HDR_NUMELE_UNKNOWN || second_len == PL_HDR_NUMELE_UNKNOWN ||
+        pllength > PL_HDR_NUMELE_UNKNOWN) pllength = PL_HDR_NUMELE_UNKNOWN;
+
+    target = zrealloc(target,plbytes);
+    if (append) {
+        ///[TARGET - END, SOURCE - HEADER]
+        memcpy(target + target_bytes - 1, source + PL_HDR_SIZE, source_bytes - PL_HDR_SIZE);
+    } else {
+        ///[SOURCE - END, TARGET - HEADER]
+        memmove(target + source_bytes - 1, target + PL_HDR_SIZE, target_bytes - PL_HDR_SIZE);
+        memcpy(target + PL_HDR_SIZE, source + PL_HDR_SIZE, source_bytes - PL_HDR_SIZE - 1);
+    }
+    plSetTotalBytes(target,plbytes);
+    plSetNumElements(target,pllength);
+
+    if (append) {
+        zfree(*second);
+        *second = NULL;
+        *first = target;
+    } else {
+        zfree(*first);
+        *first = NULL;
+        *second = target;
+    }
+    return target;
+}
+
+/* 把ziplist转换成内容相同的packlist，用于加载以ziplist保存的旧数据。
+ * 先遍历一次计算出总大小，只分配一次内存。zl不会被释放。packlist格式关闭时返回zl的一份拷贝。 */
+unsigned char *packlistFromZiplist(unsigned char *zl) {
+    unsigned char *p, *pl, *dst, *sstr;
+    unsigned int slen, count = 0;
+    size_t bytes = PL_HDR_SIZE+1;
+    long long sval;
+    plValue v;
+
+    if (!packlist_enabled) {
+        bytes = ziplistBlobLen(zl);
+        pl = zmalloc(bytes);
+        memcpy(pl,zl,bytes);
+        return pl;
+    }
+    p = ziplistIndex(zl,0);
+    while (ziplistGet(p,&sstr,&slen,&sval)) {
+        if (sstr) plEncodeValue(&v,sstr,slen);
+        else plEncodeInteger(&v,sval);
+        bytes += v.enclen + v.backlen;
+        count++;
+        p = ziplistNext(zl,p);
+    }
+
+    pl = zmalloc(bytes);
+    plSetTotalBytes(pl,bytes);
+    plSetNumElements(pl,count < PL_HDR_NUMELE_UNKNOWN ? count : PL_HDR_NUMELE_UNKNOWN);
+    dst = PL_FIRST(pl);
+    p = ziplistIndex(zl,0);
+    while (ziplistGet(p,&sstr,&slen,&sval)) {
+        if (sstr) plEncodeValue(&v,sstr,slen);
+        else plEncodeInteger(&v,sval);
+        dst = plWriteValue(dst,&v);
+        p = ziplistNext(zl,p);
+    }
+    *dst = PL_EOF;
+    return pl;
+}
+
+///格式化打印
+void packlistRepr(unsigned char *pl) {
+    unsigned char *p, *str;
+    unsigned int len;
+    int index = 0;
+
+    if (!packlist_enabled) {
+        ziplistRepr(pl);
+        return;
+    }
+    printf("{total bytes %u} {num entries %u}\n",
+        plGetTotalBytes(pl), plGetNumElements(pl));
+    p = PL_FIRST(pl);
+    while (p[0] != PL_EOF) {
+        uint32_t enclen = plCurrentEncodedSize(p);
+        uint32_t entrylen = plEntrySize(p);
+
+        printf(
+            "{\n"
+                "\taddr 0x%08lx,\n"
+                "\tindex %2d,\n"
+                "\toffset %5ld,\n"
+                "\tentry len: %5u,\n"
+                "\tbacklen: %2u\n",
+            (long unsigned)p,
+            index,
+            (unsigned long) (p-pl),
+            entrylen,
+            entrylen-enclen);
+        printf("\tbytes: ");
+        for (unsigned int i = 0; i < entrylen; i++) printf("%02x|",p[i]);
+        printf("\n");
+        str = plGetString(p,&len);
+        if (str) {
+            printf("\t[str]");
+            if (len > 40) {
+                if (fwrite(str,40,1,stdout) == 0) perror("fwrite");
+                printf("...");
+            } else {
+                if (len && fwrite(str,len,1,stdout) == 0) perror("fwrite");
+            }
+        } else {
+            printf("\t[int]%lld", (long long) plGetInteger(p));
+        }
+        printf("\n}\n");
+        p += entrylen;
+        index++;
+    }
+    printf("{end}\n\n");
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include "adlist.h"
+#include "sds.h"
+
+#define UNUSED(x) (void)(x)
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static int randstring(char *target, unsigned int min, unsigned int max) {
+    int p = 0;
+    int len = min+rand()%(max-min+1);
+    int minval, maxval;
+    switch(rand() % 3) {
+    case 0:
+        minval = 0;
+        maxval = 255;
+    break;
+    case 1:
+        minval = 48;
+        maxval = 122;
+    break;
+    case 2:
+        minval = 48;
+        maxval = 52;
+    break;
+    default:
+        assert(NULL);
+    }
+
+    while(p < len)
+        target[p++] = minval+rand()%(maxval-minval+1);
+    return len;
+}
+
+///生成一个随机的值，包括各种长度的字符串和各种宽度的整数
+static int randvalue(char *buf, unsigned int max) {
+    switch (rand() % 4) {
+    case 0: return randstring(buf,0,max);
+    case 1: return sprintf(buf,"%d",rand() % 200 - 100);
+    case 2: return sprintf(buf,"%lld",(long long)((unsigned long long)rand() << (rand() % 40)) * (rand() & 1 ? 1 : -1));
+    default: return randstring(buf,0,rand() % 8 == 0 ? max : 80);
+    }
+}
+
+///检查pl的内容和参考链表ref相同，并且正向、反向遍历和packlistIndex的结果一致
+static void plVerify(unsigned char *pl, list *ref) {
+    unsigned char *p, *sstr;
+    unsigned int slen, i = 0;
+    long long sval;
+    char buf[32];
+    listIter li;
+    listNode *ln;
+
+    assert(packlistLen(pl) == listLength(ref));
+    p = packlistIndex(pl,0);
+    listRewind(ref,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        sds ele = listNodeValue(ln);
+
+        assert(p != NULL && p == packlistIndex(pl,i) && p == packlistIndex(pl,(int)i-(int)listLength(ref)));
+        assert(packlistGet(p,&sstr,&slen,&sval));
+        if (sstr == NULL) {
+            slen = sprintf(buf,"%lld",sval);
+            sstr = (unsigned char*)buf;
+        }
+        assert(slen == sdslen(ele) && memcmp(sstr,ele,slen) == 0);
+        assert(packlistCompare(p,(unsigned char*)ele,sdslen(ele)));
+        p = packlistNext(pl,p);
+        i++;
+    }
+    assert(p == NULL);
+
+    p = packlistPrev(pl,PL_END(pl));
+    listRewindTail(ref,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        assert(p != NULL && packlistCompare(p,listNodeValue(ln),sdslen(listNodeValue(ln))));
+        p = packlistPrev(pl,p);
+    }
+    assert(p == NULL);
+}
+
+int packlistTest(int argc, char *argv[]) {
+    unsigned char *pl, *p;
+    char buf[8192];
+    int buflen, was_enabled = packlist_enabled;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    packlistSetEnabled(1);
+
+    printf("Encode and decode integers and backlen:\n");
+    {
+        long long values[] = {0, 1, 127, 128, -1, -4096, 4095, -4097, 4096, INT16_MIN, INT16_MAX,
+                              -8388608, 8388607, INT32_MIN, INT32_MAX, (long long)INT32_MAX+1,
+                              LLONG_MIN, LLONG_MAX};
+        unsigned char *sstr;
+        unsigned int slen;
+        long long sval;
+
+        pl = packlistNew();
+        for (unsigned int i = 0; i < sizeof(values)/sizeof(values[0]); i++) {
+            buflen = sprintf(buf,"%lld",values[i]);
+            pl = packlistPush(pl,(unsigned char*)buf,buflen,PACKLIST_TAIL);
+        }
+        p = packlistIndex(pl,0);
+        for (unsigned int i = 0; i < sizeof(values)/sizeof(values[0]); i++) {
+            assert(packlistGet(p,&sstr,&slen,&sval) && sstr == NULL && sval == values[i]);
+            p = packlistNext(pl,p);
+        }
+        zfree(pl);
+
+        for (uint64_t l = 1; l < (1ULL << 35); l = l*3+1) {
+            unsigned char b[5];
+            unsigned int n = plEncodeBacklen(b,l);
+            assert(plDecodeBacklen(b+n-1) == l);
+        }
+        printf("SUCCESS\n\n");
+    }
+
+    ///格式关闭时同样的操作转调ziplist，两种格式都要和参考链表一致
+    for (int enabled = 1; enabled >= 0; enabled--) {
+        printf("Compare with a reference list under random operations (%s):\n",
+            enabled ? "packlist" : "ziplist");
+        packlistSetEnabled(enabled);
+        for (int i = 0; i < 2000; i++) {
+            list *ref = listCreate();
+            listSetFreeMethod(ref,(void (*)(void*))sdsfree);
+            pl = packlistNew();
+
+            for (int j = 0; j < 200; j++) {
+                int len = listLength(ref), op = rand() % 6;
+
+                if (op <= 1 || len == 0) {
+                    ///在随机的位置插入
+                    int index = len ? rand() % (len+1) : 0;
+                    buflen = randvalue(buf,sizeof(buf)-1);
+                    p = index == len ? PL_END(pl) : packlistIndex(pl,index);
+                    pl = packlistInsert(pl,p,(unsigned char*)buf,buflen);
+                    sds ele = sdsnewlen(buf,buflen);
+                    if (index == len) listAddNodeTail(ref,ele);
+                    else listInsertNode(ref,listIndex(ref,index),ele,0);
+                } else if (op == 2) {
+                    ///删除随机位置的一个节点
+                    int index = rand() % len;
+                    p = packlistIndex(pl,index);
+                    pl = packlistDelete(pl,&p);
+                    listDelNode(ref,listIndex(ref,index));
+                    assert(index == len-1 ? p[0] == PL_EOF : p == packlistIndex(pl,index));
+                } else if (op == 3) {
+                    ///删除一个范围
+                    int index = rand() % len, num = rand() % 4;
+                    pl = packlistDeleteRange(pl,index,num);
+                    while (num-- && index < (int)listLength(ref))
+                        listDelNode(ref,listIndex(ref,index));
+                } else if (op == 4) {
+                    ///在头部或者尾部一次插入多个节点
+                    unsigned char *vals[8];
+                    unsigned int lens[8], num = rand() % 8;
+                    int where = rand() % 2 ? PACKLIST_HEAD : PACKLIST_TAIL;
+                    char *q = buf;
+                    for (unsigned int k = 0; k < num; k++) {
+                        vals[k] = (unsigned char*)q;
+                        lens[k] = randvalue(q,(sizeof(buf)-1)/8);
+                        sds ele = sdsnewlen(q,lens[k]);
+                        if (where == PACKLIST_HEAD) listAddNodeHead(ref,ele);
+                        else listAddNodeTail(ref,ele);
+                        q += lens[k];
+                    }
+                    pl = packlistPushMany(pl,vals,lens,num,where);
+                } else {
+                    ///一次删除随机选出的多个节点
+                    unsigned char *ps[8];
+                    unsigned int num = 0;
+                    int index = rand() % len;
+                    while (num < 8 && index < len) {
+                        ps[num] = packlistIndex(pl,index);
+                        listDelNode(ref,listIndex(ref,index-num));
+                        num++;
+                        index += 1 + rand() % 3;
+                    }
+                    pl = packlistDeleteMany(pl,ps,num);
+                }
+            }
+            plVerify(pl,ref);
+
+            ///稀疏索引的查找结果和packlistIndex()相同
+            {
+                packlistOffsets *po = packlistBuildOffsets(pl,1 + rand() % 20);
+                int len = listLength(ref);
+                for (int k = -len-1; k <= len; k++)
+                    assert(packlistIndexWithOffsets(pl,po,k) == packlistIndex(pl,k));
+                packlistFreeOffsets(po);
+            }
+
+            ///和ziplist相互转换、合并
+            unsigned char *zl = ziplistNew(), *pl2;
+            listIter li;
+            listNode *ln;
+            listRewind(ref,&li);
+            while ((ln = listNext(&li)) != NULL)
+                zl = ziplistPush(zl,listNodeValue(ln),sdslen(listNodeValue(ln)),ZIPLIST_TAIL);
+            pl2 = packlistFromZiplist(zl);
+            ///ziplist删除节点后prevlen不会缩短，所以只有packlist的字节完全相同
+            if (enabled)
+                assert(packlistBlobLen(pl2) == packlistBlobLen(pl) && memcmp(pl2,pl,packlistBlobLen(pl)) == 0);
+            zfree(zl);
+
+            for (int j = 0; j < 16; j++) {
+                int len = listLength(ref);
+                unsigned int skip = rand() % 3;
+                unsigned char *start = packlistIndex(pl,len ? rand() % len : 0);
+                if (start == NULL) break;
+                if (rand() % 2) {
+                    sds ele = listNodeValue(listIndex(ref,rand() % len));
+                    buflen = sdslen(ele);
+                    memcpy(buf,ele,buflen);
+                } else {
+                    buflen = randvalue(buf,16);
+                }
+                ///plFind的结果和逐个节点比较相同
+                unsigned char *expect = NULL, *q = start;
+                unsigned int cnt = 0;
+                while (q) {
+                    if (cnt == 0) {
+                        if (packlistCompare(q,(unsigned char*)buf,buflen)) {
+                            expect = q;
+                            break;
+                        }
+                        cnt = skip;
+                    } else {
+                        cnt--;
+                    }
+                    q = packlistNext(pl,q);
+                }
+                assert(packlistFind(pl,start,(unsigned char*)buf,buflen,skip) == expect);
+            }
+
+            ///packlistFindAll的结果和逐个节点比较相同，包括整数和空字符串
+            for (int j = 0; j < 16; j++) {
+                int len = listLength(ref);
+                unsigned char *ps[200], *q;
+                unsigned int idx[200], n, cnt = 0, max = rand() % 2 ? 200 : 1 + rand() % 4;
+                if (len && rand() % 2) {
+                    sds ele = listNodeValue(listIndex(ref,rand() % len));
+                    buflen = sdslen(ele);
+                    memcpy(buf,ele,buflen);
+                } else {
+                    buflen = rand() % 8 ? sprintf(buf,"%d",rand() % 300 - 150) : 0;
+                }
+                n = packlistFindAll(pl,(unsigned char*)buf,buflen,ps,idx,max);
+                q = packlistIndex(pl,0);
+                for (int k = 0; q && cnt < max; k++, q = packlistNext(pl,q)) {
+                    if (!packlistCompare(q,(unsigned char*)buf,buflen)) continue;
+                    assert(cnt < n && ps[cnt] == q && idx[cnt] == (unsigned int)k);
+                    cnt++;
+                }
+                assert(cnt == n);
+            }
+
+            list *ref2 = listCreate();
+            listSetFreeMethod(ref2,(void (*)(void*))sdsfree);
+            listRewind(ref,&li);
+            while ((ln = listNext(&li)) != NULL)
+                listAddNodeTail(ref2,sdsdup(listNodeValue(ln)));
+            listRewind(ref2,&li);
+            while ((ln = listNext(&li)) != NULL)
+                listAddNodeTail(ref,sdsdup(listNodeValue(ln)));
+            pl = packlistMerge(&pl,&pl2);
+            assert(pl != NULL);
+            plVerify(pl,ref);
+            zfree(pl);
+            listRelease(ref);
+            listRelease(ref2);
+        }
+        printf("SUCCESS\n\n");
+    }
+    packlistSetEnabled(1);
+
+    printf("Find a value whose pattern only appears inside the last entry:\n");
+    {
+        ///最后一个节点的内容是“abc”的编码字节加上“abcd”，扫描到的位置在它的内容中，查找不能越过结尾标志
+        pl = packlistNew();
+        pl = packlistPush(pl,(unsigned char*)"abc",3,PACKLIST_TAIL);
+        buf[0] = packlistIndex(pl,0)[0];
+        memcpy(buf+1,"abcd",4);
+        zfree(pl);
+        pl = packlistNew();
+        pl = packlistPush(pl,(unsigned char*)"xyz",3,PACKLIST_TAIL);
+        pl = packlistPush(pl,(unsigned char*)buf,5,PACKLIST_TAIL);
+        assert(packlistFind(pl,packlistIndex(pl,0),(unsigned char*)"abc",3,0) == NULL);
+        assert(packlistFindAll(pl,(unsigned char*)"abc",3,NULL,NULL,2) == 0);
+        zfree(pl);
+        printf("SUCCESS\n\n");
+    }
+
+    printf("Benchmark pushing 1000 values one by one vs packlistPushMany:\n");
+    {
+        unsigned char *vals[1000];
+        unsigned int lens[1000];
+        long long start, one, many;
+        int iter = 200;
+
+        memset(buf,'x',sizeof(buf));
+        for (int i = 0; i < 1000; i++) {
+            vals[i] = (unsigned char*)buf;
+            lens[i] = 8 + i % 24;
+        }
+        start = usec();
+        for (int k = 0; k < iter; k++) {
+            pl = packlistNew();
+            for (int i = 0; i < 1000; i++) pl = packlistPush(pl,vals[i],lens[i],PACKLIST_TAIL);
+            zfree(pl);
+        }
+        one = usec()-start;
+        start = usec();
+        for (int k = 0; k < iter; k++) {
+            pl = packlistNew();
+            pl = packlistPushMany(pl,vals,lens,1000,PACKLIST_TAIL);
+            zfree(pl);
+        }
+        many = usec()-start;
+        printf("packlistPush %lld usec, packlistPushMany %lld usec (%dx 1000 values)\n\n",one,many,iter);
+    }
+
+    printf("Benchmark random access on an 8KB node, packlistIndex vs sparse offsets:\n");
+    {
+        packlistOffsets *po;
+        long long start, plain, indexed;
+        unsigned int numele, sum = 0;
+        int iter = 1000000;
+
+        memset(buf,'x',sizeof(buf));
+        pl = packlistNew();
+        while (packlistBlobLen(pl) < 8192)
+            pl = packlistPush(pl,(unsigned char*)buf,16,PACKLIST_TAIL);
+        numele = packlistLen(pl);
+
+        start = usec();
+        for (int i = 0; i < iter; i++) sum += packlistIndex(pl,((unsigned long)i*7919) % numele)[0];
+        plain = usec()-start;
+        start = usec();
+        po = packlistBuildOffsets(pl,PACKLIST_OFFSETS_STEP);
+        for (int i = 0; i < iter; i++) sum += packlistIndexWithOffsets(pl,po,((unsigned long)i*7919) % numele)[0];
+        indexed = usec()-start;
+        printf("%u entries: packlistIndex %lld usec, with offsets %lld usec (%zu bytes of offsets, %dx lookups, %u)\n\n",
+            numele,plain,indexed,packlistOffsetsSize(po),iter,sum & 1);
+        packlistFreeOffsets(po);
+        zfree(pl);
+    }
+
+    printf("Benchmark finding all matches in an 8KB node, packlistCompare vs packlistFindAll:\n");
+    for (int enabled = 0; enabled <= 1; enabled++) {
+        /* 节点约8KB，每32个值中有一个和要找的值相等，分别测试两种格式下的短字符串和整数。 */
+        const char *names[] = {"short strings","integers"};
+        int iter = 20000;
+
+        packlistSetEnabled(enabled);
+        for (int k = 0; k < 2; k++) {
+            unsigned char *ps[1024];
+            unsigned int n = 0, m = 0;
+            char needle[32];
+            int needlelen;
+            long long start, linear, scan;
+
+            pl = packlistNew();
+            for (int i = 0; packlistBlobLen(pl) < 8192; i++) {
+                int v = i % 32 == 7 ? 7 : i % 32 + 1000 * (i / 32);
+                buflen = k ? sprintf(buf,"%d",v) : sprintf(buf,"item:%d",v);
+                pl = packlistPush(pl,(unsigned char*)buf,buflen,PACKLIST_TAIL);
+            }
+            needlelen = k ? sprintf(needle,"%d",7) : sprintf(needle,"item:%d",7);
+
+            start = usec();
+            for (int i = 0; i < iter; i++) {
+                p = packlistIndex(pl,0);
+                n = 0;
+                while (p) {
+                    if (packlistCompare(p,(unsigned char*)needle,needlelen)) ps[n++] = p;
+                    p = packlistNext(pl,p);
+                }
+            }
+            linear = usec()-start;
+            start = usec();
+            for (int i = 0; i < iter; i++)
+                m = packlistFindAll(pl,(unsigned char*)needle,needlelen,ps,NULL,1024);
+            scan = usec()-start;
+            assert(n == m);
+            printf("%-8s %-13s (%u entries, %u matches): packlistCompare %lld usec, packlistFindAll %lld usec (%dx)\n",
+                enabled ? "packlist" : "ziplist",names[k],packlistLen(pl),m,linear,scan,iter);
+            zfree(pl);
+        }
+    }
+    packlistSetEnabled(1);
+    printf("\n");
+
+    printf("Benchmark insert/delete on 8KB nodes, ziplist vs packlist:\n");
+    {
+        /* 节点约8KB，对应list-max-ziplist-size -2。每次从同一个节点的副本开始，在头部插入一个300字节的节点，再删除尾部的节点。
+         * 第二种数据的节点长度都在250到253之间，在ziplist头部插入超过253字节的节点会让后面所有节点的prevlen
+         * 从1字节扩展到5字节，也就是连锁更新，每扩展一个节点都要realloc和memmove一次。 */
+        const char *names[] = {"short strings","250-byte strings"};
+        int sizes[] = {16, 248};
+        int iter = 20000;
+
+        memset(buf,'x',sizeof(buf));
+        for (int k = 0; k < 2; k++) {
+            unsigned char *zl = ziplistNew(), *copy;
+            long long start, zt, lt;
+
+            pl = packlistNew();
+            while (packlistBlobLen(pl) < 8192) {
+                zl = ziplistPush(zl,(unsigned char*)buf,sizes[k],ZIPLIST_TAIL);
+                pl = packlistPush(pl,(unsigned char*)buf,sizes[k],PACKLIST_TAIL);
+            }
+
+            start = usec();
+            for (int i = 0; i < iter; i++) {
+                copy = zmalloc(ziplistBlobLen(zl));
+                memcpy(copy,zl,ziplistBlobLen(zl));
+                copy = ziplistPush(copy,(unsigned char*)buf,300,ZIPLIST_HEAD);
+                copy = ziplistDeleteRange(copy,-1,1);
+                zfree(copy);
+            }
+            zt = usec()-start;
+
+            start = usec();
+            for (int i = 0; i < iter; i++) {
+                copy = zmalloc(packlistBlobLen(pl));
+                memcpy(copy,pl,packlistBlobLen(pl));
+                copy = packlistPush(copy,(unsigned char*)buf,300,PACKLIST_HEAD);
+                copy = packlistDeleteRange(copy,-1,1);
+                zfree(copy);
+            }
+            lt = usec()-start;
+
+            printf("%-16s (%u entries): ziplist %lld usec, packlist %lld usec (%dx insert+delete)\n",
+                names[k],packlistLen(pl),zt,lt,iter);
+            zfree(zl);
+            zfree(pl);
+        }
+        printf("\n");
+    }
+    packlistSetEnabled(was_enabled);
+    return 0;
+}
+#endif
@@ -0,0 +1,54 @@
+#ifndef _PACKLIST_H
+#define _PACKLIST_H
+
+#include <stddef.h>
+
+///packlist是和ziplist用法相同的紧凑列表，节点的长度记录在节点末尾，插入和删除不会引起连锁更新，见packlist.c
+#define PACKLIST_HEAD 0
+#define PACKLIST_TAIL 1
+
+/* packlist格式默认不编译：RDB类型、配置项和defrag等按ziplist解析数据的代码还不支持它。
+ * 只有打开USE_PACKLIST编译选项（或者编译单元测试）时，才能在运行时用packlistSetEnabled(1)打开。
+ * 否则packlist_enabled是常量0，下面的函数都直接转调ziplist，快表和小的有序集合保存ziplist，
+ * 调用处对格式的判断在编译时就被去掉了，见packlist.c开头的说明 */
+#if defined(USE_PACKLIST) || defined(REDIS_TEST)
+#define HAVE_PACKLIST_FORMAT 1
+extern int packlist_enabled;
+void packlistSetEnabled(int enabled); ///只能在创建任何快表或者有序集合之前调用
+#else
+#define packlist_enabled 0
+#endif
+
+unsigned char *packlistNew(void); ///创建一个空的packlist
+unsigned char *packlistMerge(unsigned char **first, unsigned char **second); ///合并两个packlist
+unsigned char *packlistPush(unsigned char *pl, unsigned char *s, unsigned int slen, int where); ///在packlist的头或者尾部插入一个节点
+unsigned char *packlistPushMany(unsigned char *pl, unsigned char **s, unsigned int *slen, unsigned int count, int where); ///一次在头或者尾部插入count个节点
+unsigned char *packlistIndex(unsigned char *pl, int index); ///查找index下标处的节点
+unsigned char *packlistNext(unsigned char *pl, unsigned char *p); ///获取p指向节点的下一个节点
+unsigned char *packlistPrev(unsigned char *pl, unsigned char *p); ///获取p指向节点的前驱节点
+/* 稀疏偏移索引，用来加速对很长的packlist按下标的随机访问，packlist被修改后失效，见packlist.c */
+typedef struct packlistOffsets packlistOffsets;
+#define PACKLIST_OFFSETS_STEP 16 ///默认每隔16个节点记录一次偏移量
+packlistOffsets *packlistBuildOffsets(unsigned char *pl, unsigned int step); ///为pl建立稀疏偏移索引
+unsigned char *packlistIndexWithOffsets(unsigned char *pl, packlistOffsets *po, int index); ///通过稀疏索引查找index下标处的节点
+size_t packlistOffsetsSize(packlistOffsets *po); ///稀疏索引占用的内存
+void packlistFreeOffsets(packlistOffsets *po); ///释放稀疏索引
+unsigned int packlistGet(unsigned char *p, unsigned char **sval, unsigned int *slen, long long *lval); ///获取p所指向的节点信息
+unsigned char *packlistInsert(unsigned char *pl, unsigned char *p, unsigned char *s, unsigned int slen); ///在p所指的位置插入节点，p指向节点时插入到p前面
+unsigned char *packlistDelete(unsigned char *pl, unsigned char **p); ///删除p所指的位置的节点
+unsigned char *packlistDeleteMany(unsigned char *pl, unsigned char **ps, unsigned int count); ///一次删除ps中按地址排列的count个节点
+unsigned char *packlistDeleteRange(unsigned char *pl, int index, unsigned int num); ///删除从index处开始的num个节点
+unsigned int packlistCompare(unsigned char *p, unsigned char *s, unsigned int slen); ///比较p所指的节点和s
+unsigned char *packlistFind(unsigned char *pl, unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip); ///从p开始寻找和vstr值相等的节点
+unsigned int packlistFindAll(unsigned char *pl, unsigned char *vstr, unsigned int vlen,
+                             unsigned char **ps, unsigned int *indexes, unsigned int max); ///查找所有和vstr值相等的节点，最多max个
+unsigned int packlistLen(unsigned char *pl); ///获取packlist的节点数量
+size_t packlistBlobLen(unsigned char *pl); ///获取packlist的二进制长度
+unsigned char *packlistFromZiplist(unsigned char *zl); ///把ziplist转换成内容相同的packlist，zl不会被释放
+void packlistRepr(unsigned char *pl);
+
+#ifdef REDIS_TEST
+int packlistTest(int argc, char *argv[]);
+#endif
+
+#endif /* _PACKLIST_H */
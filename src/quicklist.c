@@ -1,9 +1,21 @@
+#define ZMALLOC_TAG ZMALLOC_TAG_QUICKLIST ///分配分析中记为quicklist，见zmalloc.h
 #include <string.h> 
+#include <strings.h>
+#include <pthread.h>
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "packlist.h"
 #include "util.h"
 #include "lzf.h"
+#include "redisassert.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -49,6 +61,11 @@ quicklistBookmark *_quicklistBookmarkFindByName(quicklist *ql, const char *name)
 quicklistBookmark *_quicklistBookmarkFindByNode(quicklist *ql, quicklistNode *node);
 void _quicklistBookmarkDelete(quicklist *ql, quicklistBookmark *bm);
 
+/* Async compression and decompression cache forward declarations */
+REDIS_STATIC void quicklistAsyncCompressCancel(quicklistNode *node);
+REDIS_STATIC void quicklistAsyncCompressForget(quicklist *quicklist);
+REDIS_STATIC void quicklistCacheForget(quicklist *quicklist);
+
 /* Simple way to give quicklistEntry structs default values with one call. */
 ///初始化快表节点中的压缩表信息
 #define initEntry(e)                                                           \
@@ -69,6 +86,198 @@ void _quicklistBookmarkDelete(quicklist *ql, quicklistBookmark *bm);
 #define unlikely(x) (x)
 #endif
 
+/* ============================== 压缩算法 ==============================
+ * 快表节点可以使用不同的压缩算法，每个快表有自己的codec设置，新建的快表使用quicklistSetDefaultCodec()设置的默认值。
+ * 节点的encoding字段记录了节点实际使用的算法，所以修改快表的codec之后，已经压缩的节点仍然可以正常解压，
+ * 同一个快表中可以同时存在不同算法压缩的节点。LZF总是可用，LZ4和zstd需要在编译时定义HAVE_LZ4、HAVE_ZSTD并链接对应的库。
+ * 压缩后的数据都使用quicklistLZF结构保存。 */
+
+///压缩算法的实现，compress和decompress返回写入out的字节数，失败（包括out的空间不够）时返回0
+typedef struct quicklistCodecType {
+    const char *name;
+    size_t (*compress)(const void *in, size_t in_len, void *out, size_t out_len);
+    size_t (*decompress)(const void *in, size_t in_len, void *out, size_t out_len);
+} quicklistCodecType;
+
+static size_t _quicklistLzfCompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    return lzf_compress(in, in_len, out, out_len);
+}
+
+static size_t _quicklistLzfDecompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    return lzf_decompress(in, in_len, out, out_len);
+}
+
+#ifdef HAVE_LZ4
+static size_t _quicklistLz4Compress(const void *in, size_t in_len, void *out, size_t out_len) {
+    int ret = LZ4_compress_default(in, out, in_len, out_len);
+    return ret > 0 ? (size_t)ret : 0;
+}
+
+static size_t _quicklistLz4Decompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    int ret = LZ4_decompress_safe(in, out, in_len, out_len);
+    return ret > 0 ? (size_t)ret : 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* 节点通常只有几KB，使用较低的压缩级别。压缩和解压的上下文每个线程一份，避免每次调用都重新分配，
+ * 线程退出时由zstd_key的析构函数释放（异步压缩的后台线程在关闭异步压缩时退出）。
+ * 共享字典用quicklistSetZstdDictionary()加载，新压缩的节点使用最后加载的字典，
+ * 之前加载的字典会一直保留，解压时根据帧中记录的字典ID选择，所以用旧字典压缩的节点仍然可以解压。 */
+#define QUICKLIST_ZSTD_LEVEL 1
+#define QUICKLIST_ZSTD_MAX_DICTS 8
+
+typedef struct quicklistZstdCtx {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} quicklistZstdCtx;
+
+static __thread quicklistZstdCtx zstd_ctx = {NULL, NULL};
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+static pthread_key_t zstd_key; ///线程退出时通过这个key的析构函数释放线程的上下文
+static ZSTD_CDict *zstd_cdict = NULL; ///压缩使用的字典
+static ZSTD_DDict *zstd_ddicts[QUICKLIST_ZSTD_MAX_DICTS]; ///加载过的所有字典
+static int zstd_ddict_count = 0;
+
+static void _quicklistZstdThreadExit(void *arg) {
+    quicklistZstdCtx *ctx = arg;
+
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+    ctx->cctx = NULL;
+    ctx->dctx = NULL;
+}
+
+static void _quicklistZstdKeyInit(void) {
+    pthread_key_create(&zstd_key, _quicklistZstdThreadExit);
+}
+
+///当前线程的上下文，第一次使用时登记到zstd_key，值不为NULL时线程退出才会调用析构函数
+static quicklistZstdCtx *_quicklistZstdCtx(void) {
+    if (!zstd_ctx.cctx && !zstd_ctx.dctx) {
+        pthread_once(&zstd_once, _quicklistZstdKeyInit);
+        pthread_setspecific(zstd_key, &zstd_ctx);
+    }
+    return &zstd_ctx;
+}
+
+static size_t _quicklistZstdCompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    quicklistZstdCtx *ctx = _quicklistZstdCtx();
+    size_t ret;
+
+    if (!ctx->cctx) ctx->cctx = ZSTD_createCCtx();
+    if (!ctx->cctx) return 0;
+    if (zstd_cdict)
+        ret = ZSTD_compress_usingCDict(ctx->cctx, out, out_len, in, in_len, zstd_cdict);
+    else
+        ret = ZSTD_compressCCtx(ctx->cctx, out, out_len, in, in_len, QUICKLIST_ZSTD_LEVEL);
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+static size_t _quicklistZstdDecompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    unsigned int dict_id = ZSTD_getDictID_fromFrame(in, in_len);
+    quicklistZstdCtx *ctx = _quicklistZstdCtx();
+    size_t ret;
+
+    if (!ctx->dctx) ctx->dctx = ZSTD_createDCtx();
+    if (!ctx->dctx) return 0;
+    if (dict_id) {
+        ZSTD_DDict *ddict = NULL;
+        for (int j = 0; j < zstd_ddict_count; j++) {
+            if (ZSTD_getDictID_fromDDict(zstd_ddicts[j]) == dict_id) {
+                ddict = zstd_ddicts[j];
+                break;
+            }
+        }
+        if (!ddict) return 0;
+        ret = ZSTD_decompress_usingDDict(ctx->dctx, out, out_len, in, in_len, ddict);
+    } else {
+        ret = ZSTD_decompressDCtx(ctx->dctx, out, out_len, in, in_len);
+    }
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+#endif
+
+///按QUICKLIST_CODEC_*排列，没有编译进来的算法两个函数都为NULL
+static const quicklistCodecType quicklist_codecs[QUICKLIST_CODECS] = {
+    {"lzf", _quicklistLzfCompress, _quicklistLzfDecompress},
+#ifdef HAVE_LZ4
+    {"lz4", _quicklistLz4Compress, _quicklistLz4Decompress},
+#else
+    {"lz4", NULL, NULL},
+#endif
+#ifdef HAVE_ZSTD
+    {"zstd", _quicklistZstdCompress, _quicklistZstdDecompress},
+#else
+    {"zstd", NULL, NULL},
+#endif
+};
+
+static int quicklist_default_codec = QUICKLIST_CODEC_LZF; ///新建快表使用的压缩算法
+
+///压缩算法是否可用
+int quicklistCodecAvailable(int codec) {
+    return codec >= 0 && codec < QUICKLIST_CODECS &&
+           quicklist_codecs[codec].compress != NULL;
+}
+
+///压缩算法的名字
+const char *quicklistCodecName(int codec) {
+    if (codec < 0 || codec >= QUICKLIST_CODECS) return "unknown";
+    return quicklist_codecs[codec].name;
+}
+
+///根据名字查找压缩算法，不存在时返回-1（没有编译进来的算法也能找到，用quicklistCodecAvailable()检查）
+int quicklistCodecFromName(const char *name) {
+    for (int j = 0; j < QUICKLIST_CODECS; j++) {
+        if (!strcasecmp(name, quicklist_codecs[j].name)) return j;
+    }
+    return -1;
+}
+
+///设置新建快表使用的压缩算法，算法不可用时返回0，成功返回1
+int quicklistSetDefaultCodec(int codec) {
+    if (!quicklistCodecAvailable(codec)) return 0;
+    quicklist_default_codec = codec;
+    return 1;
+}
+
+/* 设置快表之后压缩节点时使用的压缩算法，算法不可用时返回0，成功返回1。
+ * 已经压缩的节点不会重新压缩，它们下一次被解压再压缩时才改用新的算法。 */
+int quicklistSetCodec(quicklist *quicklist, int codec) {
+    if (!quicklistCodecAvailable(codec)) return 0;
+    quicklist->codec = codec;
+    return 1;
+}
+
+/* 加载一个zstd共享字典（比如quicklistTrainZstdDictionary()训练的结果），之后压缩的节点都使用这个字典。
+ * 不支持zstd、字典无效或者加载的字典太多时返回0，成功返回1。 */
+int quicklistSetZstdDictionary(const void *dict, size_t len) {
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+
+    if (zstd_ddict_count == QUICKLIST_ZSTD_MAX_DICTS) return 0;
+    if (ZDICT_getDictID(dict, len) == 0) return 0;
+    cdict = ZSTD_createCDict(dict, len, QUICKLIST_ZSTD_LEVEL);
+    ddict = ZSTD_createDDict(dict, len);
+    if (!cdict || !ddict) {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+        return 0;
+    }
+    quicklistAsyncCompressWait(); ///后台线程可能正在使用旧的字典
+    ZSTD_freeCDict(zstd_cdict);
+    zstd_cdict = cdict;
+    zstd_ddicts[zstd_ddict_count++] = ddict;
+    return 1;
+#else
+    (void)dict;
+    (void)len;
+    return 0;
+#endif
+}
+
 /// 新建一个快表，同时可以使用quicklistRelease()释放快表
 quicklist *quicklistCreate(void) {
     struct quicklist *quicklist; ///定义快表指针
@@ -80,6 +289,8 @@ quicklist *quicklistCreate(void) {
     quicklist->compress = 0; ///是否进行压缩操作，默认是不进行压缩
     quicklist->fill = -2; ///设置默认值，每个ziplist的字节数最大为8kb
     quicklist->bookmark_count = 0; ///快表中bookmark的数量
+    quicklist->codec = quicklist_default_codec; ///压缩节点使用的算法
+    quicklist->ext = NULL; ///节点需要扩展信息时才建立
     return quicklist;
 }
 
@@ -125,11 +336,488 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->sz = 0; ///设置节点中压缩表的节点数量
     node->next = node->prev = NULL; ///设置当前节点的前驱节点和后继节点
     node->encoding = QUICKLIST_NODE_ENCODING_RAW; ///设置是否进行压缩，默认为不压缩
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST; ///设置存书数据的数据结构，默认是压缩表
+    node->container = QUICKLIST_NODE_CONTAINER_PACKED; ///设置存书数据的数据结构，默认是压缩表
     node->recompress = 0; ///设置是否进行压缩，0表示不进行压缩
+    node->offsets_wanted = 0; ///稀疏偏移索引在按下标访问时才建立
+    node->ext = 0;
+    node->compress_pending = 0;
+    node->cached = 0;
     return node;
 }
 
+/* 节点中的packlist节点数不少于这个值时才考虑建立稀疏偏移索引，更短的packlist直接遍历就足够快了。 */
+#define QUICKLIST_OFFSETS_MIN_COUNT 64
+
+/* 节点的扩展信息。quicklistNode保持32个字节，只有部分节点才需要的信息（稀疏偏移索引，计数树中所在的叶子）
+ * 不放在节点中，而是放在快表自己的一张按节点指针查找的hash表中，节点的ext位表示表中有它的一项，没有设置时不用查表。
+ * 计数树的根和capped list的长度上限也放在这里，普通的短快表只需要quicklist中的一个ext指针。
+ * hash表使用开放寻址和线性探测，删除时把同一个探测序列中后面的项往前移，不需要墓碑。
+ * 表只属于一个快表，和快表的其它部分一样不需要加锁。 */
+typedef struct quicklistNodeExt {
+    quicklistNode *node; ///所属的节点，NULL表示空槽
+    packlistOffsets *offsets; ///packlist的稀疏偏移索引，没有建立时为NULL
+    struct quicklistTreeNode *leaf; ///节点在计数树中所在的叶子，快表没有计数树时为NULL
+} quicklistNodeExt;
+
+typedef struct quicklistExt {
+    quicklistNodeExt *table; ///hash表，没有任何项时为NULL
+    unsigned long size; ///槽数，总是2的幂
+    unsigned long used; ///使用的槽数
+    size_t offsets_bytes; ///所有稀疏偏移索引占用的内存
+    struct quicklistTreeNode *tree; ///节点数较多时建立的计数树，见quicklistSetTreeThreshold()
+    unsigned long cap; ///长度上限，0表示没有上限，见quicklistCapTrim()
+} quicklistExt;
+
+///快表的计数树，没有建立时为NULL
+#define quicklistTree(_ql) ((_ql)->ext ? (_ql)->ext->tree : NULL)
+
+#define QUICKLIST_EXT_INITIAL_SIZE 8
+
+static unsigned long _quicklistExtSlot(const quicklistExt *ext, const quicklistNode *node) {
+    uint64_t h = (uintptr_t)node >> 4;
+    return (unsigned long)((h * 0x9E3779B97F4A7C15ULL) >> 32) & (ext->size - 1);
+}
+
+///查找节点的扩展信息，调用方需要先确认node->ext
+static quicklistNodeExt *_quicklistExtFind(const quicklist *quicklist, const quicklistNode *node) {
+    const quicklistExt *ext = quicklist->ext;
+    unsigned long j = _quicklistExtSlot(ext, node);
+
+    while (ext->table[j].node != node) j = (j + 1) & (ext->size - 1);
+    return &ext->table[j];
+}
+
+static void _quicklistExtResize(quicklistExt *ext, unsigned long size) {
+    quicklistNodeExt *old = ext->table;
+    unsigned long j, k, old_size = ext->size;
+
+    ext->table = zcalloc(sizeof(*ext->table) * size);
+    ext->size = size;
+    for (j = 0; j < old_size; j++) {
+        if (!old[j].node) continue;
+        k = _quicklistExtSlot(ext, old[j].node);
+        while (ext->table[k].node) k = (k + 1) & (size - 1);
+        ext->table[k] = old[j];
+    }
+    zfree(old);
+}
+
+///返回快表的扩展信息，没有时新建
+static quicklistExt *_quicklistExtCreate(quicklist *quicklist) {
+    if (!quicklist->ext) quicklist->ext = zcalloc(sizeof(*quicklist->ext));
+    return quicklist->ext;
+}
+
+///返回节点的扩展信息，没有时新建一项
+static quicklistNodeExt *_quicklistExtGet(quicklist *quicklist, quicklistNode *node) {
+    quicklistExt *ext;
+    quicklistNodeExt *e;
+    unsigned long j;
+
+    if (node->ext) return _quicklistExtFind(quicklist, node);
+    ext = _quicklistExtCreate(quicklist);
+    if ((ext->used + 1) * 4 > ext->size * 3)
+        _quicklistExtResize(ext, ext->size ? ext->size * 2 : QUICKLIST_EXT_INITIAL_SIZE);
+    j = _quicklistExtSlot(ext, node);
+    while (ext->table[j].node) j = (j + 1) & (ext->size - 1);
+    e = &ext->table[j];
+    memset(e, 0, sizeof(*e));
+    e->node = node;
+    ext->used++;
+    node->ext = 1;
+    return e;
+}
+
+///扩展信息都为空时删除节点在表中的项，后面同一个探测序列中的项往前移，表变得稀疏时缩小
+static void _quicklistExtRelease(quicklist *quicklist, quicklistNodeExt *e) {
+    quicklistExt *ext = quicklist->ext;
+    unsigned long mask = ext->size - 1, i, j, k;
+
+    if (e->offsets || e->leaf) return;
+    e->node->ext = 0;
+    i = j = e - ext->table;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!ext->table[j].node) break;
+        k = _quicklistExtSlot(ext, ext->table[j].node);
+        ///k不在(i, j]之间时，j的项从k开始探测一定会经过i，可以移到i
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            ext->table[i] = ext->table[j];
+            i = j;
+        }
+    }
+    ext->table[i].node = NULL;
+    ext->used--;
+    if (ext->used == 0) {
+        zfree(ext->table);
+        ext->table = NULL;
+        ext->size = 0;
+    } else if (ext->size > QUICKLIST_EXT_INITIAL_SIZE && ext->used * 8 < ext->size) {
+        _quicklistExtResize(ext, ext->size / 2);
+    }
+}
+
+///释放快表的扩展信息，计数树需要先释放
+static void _quicklistExtFree(quicklist *quicklist) {
+    quicklistExt *ext = quicklist->ext;
+
+    if (!ext) return;
+    for (unsigned long j = 0; j < ext->size; j++) {
+        if (!ext->table[j].node) continue;
+        if (ext->table[j].offsets) packlistFreeOffsets(ext->table[j].offsets);
+    }
+    zfree(ext->table);
+    zfree(ext);
+    quicklist->ext = NULL;
+}
+
+///快表的扩展信息占用的内存（包括稀疏偏移索引，不包括计数树），没有时为0
+size_t quicklistExtSize(const quicklist *quicklist) {
+    const quicklistExt *ext = quicklist->ext;
+    if (!ext) return 0;
+    return sizeof(*ext) + sizeof(*ext->table) * ext->size + ext->offsets_bytes;
+}
+
+///设置快表的长度上限，插入之后调用quicklistCapTrim()删除超出的部分
+void quicklistSetCap(quicklist *quicklist, unsigned long cap) {
+    if (cap || quicklist->ext) _quicklistExtCreate(quicklist)->cap = cap;
+}
+
+unsigned long quicklistGetCap(const quicklist *quicklist) {
+    return quicklist->ext ? quicklist->ext->cap : 0;
+}
+
+///节点的稀疏偏移索引，没有建立时为NULL
+static packlistOffsets *_quicklistNodeOffsets(const quicklist *quicklist, const quicklistNode *node) {
+    return node->ext ? _quicklistExtFind(quicklist, node)->offsets : NULL;
+}
+
+///设置节点的稀疏偏移索引，节点原来没有索引
+static void _quicklistNodeSetOffsets(quicklist *quicklist, quicklistNode *node,
+                                     packlistOffsets *offsets) {
+    _quicklistExtGet(quicklist, node)->offsets = offsets;
+    quicklist->ext->offsets_bytes += packlistOffsetsSize(offsets);
+}
+
+///从节点上取下稀疏偏移索引交给调用方，没有建立时返回NULL
+static packlistOffsets *_quicklistNodeTakeOffsets(quicklist *quicklist, quicklistNode *node) {
+    quicklistNodeExt *e;
+    packlistOffsets *offsets;
+
+    if (!node->ext) return NULL;
+    e = _quicklistExtFind(quicklist, node);
+    offsets = e->offsets;
+    if (offsets) {
+        quicklist->ext->offsets_bytes -= packlistOffsetsSize(offsets);
+        e->offsets = NULL;
+        _quicklistExtRelease(quicklist, e);
+    }
+    return offsets;
+}
+
+///释放节点的稀疏偏移索引，节点中的packlist被修改之后必须调用
+#define quicklistNodeDropOffsets(_ql, _node)                                   \
+    do {                                                                       \
+        if ((_node)->ext) {                                                    \
+            packlistOffsets *_offsets =                                        \
+                _quicklistNodeTakeOffsets((_ql), (_node));                     \
+            if (_offsets) packlistFreeOffsets(_offsets);                       \
+        }                                                                      \
+        (_node)->offsets_wanted = 0;                                           \
+    } while (0)
+
+/* 在未压缩的node中查找下标为offset的packlist节点。
+ * 建立索引需要遍历整个packlist，所以修改之后第一次按下标访问只做标记，第二次访问时才建立，
+ * 之后直到下一次修改，每次访问最多只需要走PACKLIST_OFFSETS_STEP/2步。
+ * 频繁修改的节点（比如不断push的尾节点）不会反复建立索引。
+ * 和节点的offsets_wanted一样，索引是按下标读取时顺便建立的，所以即使调用方只有const的快表也会修改扩展信息。 */
+REDIS_STATIC unsigned char *quicklistNodeIndex(const quicklist *quicklist, quicklistNode *node,
+                                               int offset) {
+    packlistOffsets *offsets = _quicklistNodeOffsets(quicklist, node);
+
+    if (offsets)
+        return packlistIndexWithOffsets(node->zl, offsets, offset);
+    if (node->count >= QUICKLIST_OFFSETS_MIN_COUNT) {
+        if (node->offsets_wanted) {
+            offsets = packlistBuildOffsets(node->zl, PACKLIST_OFFSETS_STEP);
+            _quicklistNodeSetOffsets((struct quicklist *)quicklist, node, offsets);
+            return packlistIndexWithOffsets(node->zl, offsets, offset);
+        }
+        node->offsets_wanted = 1;
+    }
+    return packlistIndex(node->zl, offset);
+}
+
+/* 计数树。quicklistIndex()原本要从头（尾）开始沿着链表累加node->count，节点很多时LINDEX、LSET和LRANGE的起点
+ * 都要走很多步。节点数达到quicklist_tree_min_nodes时，快表在节点之上建立一棵计数B树：
+ * 叶子按顺序保存快表节点，内部节点保存子树，每个孩子旁边记录子树中的元素个数，按下标查找时从根向下走，
+ * 每层最多比较QUICKLIST_TREE_FANOUT次。节点的扩展信息记录它所在的叶子，节点的元素个数变化时，
+ * quicklistTreeUpdateCount()从叶子向上修改计数；插入和删除节点时在叶子中插入、删除，满了就分裂，空了就删除。
+ * 节点数降到阈值的一半以下时释放整棵树，回到遍历链表。
+ *
+ * 计数树不是免费的：树节点528字节，叶子满了从中间分裂，在尾部不断加入节点时叶子大约半满，平均每个快表节点大约35字节；
+ * 每个快表节点还要在扩展信息的hash表中占一项（24字节，负载因子在3/8到3/4之间，也就是32到64字节）。
+ * 合计每个快表节点大约70到100字节，100k个节点大约10MB。每个节点只有几个元素的快表这部分开销和元素本身的大小相当，
+ * 所以默认不建立计数树，由quicklistSetTreeThreshold()（list-tree-min-nodes）开启，QUICKLIST_TREE_MIN_NODES是开启时建议的阈值。树和扩展信息占用的内存由quicklistTreeSize()和quicklistExtSize()报告，
+ * 计入MEMORY USAGE。 */
+#define QUICKLIST_TREE_FANOUT 32
+#define QUICKLIST_TREE_MIN_NODES 256
+
+typedef struct quicklistTreeNode {
+    struct quicklistTreeNode *parent; ///父节点，根节点为NULL
+    unsigned int n; ///孩子的个数
+    unsigned int leaf; ///孩子是快表节点（1）还是计数树的节点（0）
+    unsigned long counts[QUICKLIST_TREE_FANOUT]; ///每个孩子（子树）中的元素个数
+    void *child[QUICKLIST_TREE_FANOUT];
+} quicklistTreeNode;
+
+static unsigned long quicklist_tree_min_nodes = 0; ///默认不建立计数树，内存开销见上面的说明
+
+/* 设置建立计数树的节点数，0表示不再建立计数树（默认）。已经建立的树在节点数降到新阈值的一半以下时释放。 */
+void quicklistSetTreeThreshold(unsigned long nodes) {
+    quicklist_tree_min_nodes = nodes;
+}
+
+static quicklistTreeNode *_quicklistTreeNodeCreate(int leaf) {
+    quicklistTreeNode *tn = zmalloc(sizeof(*tn));
+    tn->parent = NULL;
+    tn->n = 0;
+    tn->leaf = leaf;
+    return tn;
+}
+
+///孩子在tn中的位置
+static unsigned int _quicklistTreePos(const quicklistTreeNode *tn, const void *child) {
+    unsigned int j = 0;
+    while (tn->child[j] != child) j++;
+    return j;
+}
+
+///设置tn中第pos个孩子指向tn的指针，快表节点的叶子记录在它的扩展信息中
+#define quicklistTreeSetParent(_ql, _tn, _pos)                                 \
+    do {                                                                       \
+        if ((_tn)->leaf)                                                       \
+            _quicklistExtGet((_ql), (_tn)->child[(_pos)])->leaf = (_tn);       \
+        else                                                                   \
+            ((quicklistTreeNode *)(_tn)->child[(_pos)])->parent = (_tn);       \
+    } while (0)
+
+///从tn开始向上，把tn所有祖先中这棵子树的计数加上delta
+static void _quicklistTreePropagate(quicklistTreeNode *tn, long delta) {
+    while (tn->parent) {
+        quicklistTreeNode *parent = tn->parent;
+        parent->counts[_quicklistTreePos(parent, tn)] += delta;
+        tn = parent;
+    }
+}
+
+/* 在tn的pos位置插入一个孩子，只修改tn中的计数，不修改祖先。tn满了时先分裂成两半，右半边插入父节点，
+ * 根节点分裂时树长高一层。分裂前后tn和它的新兄弟的计数之和不变，所以祖先的计数也不用修改。 */
+static void _quicklistTreeInsertChild(quicklist *quicklist, quicklistTreeNode *tn,
+                                      unsigned int pos, void *child, unsigned long count) {
+    if (tn->n == QUICKLIST_TREE_FANOUT) {
+        quicklistTreeNode *right = _quicklistTreeNodeCreate(tn->leaf);
+        unsigned int half = QUICKLIST_TREE_FANOUT / 2, j;
+        unsigned long moved = 0;
+
+        for (j = half; j < tn->n; j++) {
+            right->child[j - half] = tn->child[j];
+            right->counts[j - half] = tn->counts[j];
+            moved += tn->counts[j];
+            quicklistTreeSetParent(quicklist, right, j - half);
+        }
+        right->n = tn->n - half;
+        tn->n = half;
+        if (!tn->parent) {
+            quicklistTreeNode *root = _quicklistTreeNodeCreate(0);
+            root->child[0] = tn;
+            root->counts[0] = moved; ///下面减去moved之后就是tn的计数
+            root->n = 1;
+            tn->parent = root;
+            quicklist->ext->tree = root;
+            for (j = 0; j < half; j++) root->counts[0] += tn->counts[j];
+        }
+        unsigned int tpos = _quicklistTreePos(tn->parent, tn);
+        tn->parent->counts[tpos] -= moved;
+        _quicklistTreeInsertChild(quicklist, tn->parent, tpos + 1, right, moved);
+        if (pos > half) {
+            tn = right;
+            pos -= half;
+        }
+    }
+    memmove(tn->child + pos + 1, tn->child + pos, sizeof(void *) * (tn->n - pos));
+    memmove(tn->counts + pos + 1, tn->counts + pos, sizeof(unsigned long) * (tn->n - pos));
+    tn->child[pos] = child;
+    tn->counts[pos] = count;
+    tn->n++;
+    quicklistTreeSetParent(quicklist, tn, pos);
+}
+
+///删除tn中的第pos个孩子，修改祖先的计数，tn空了时从父节点中删除它，根节点只剩一个孩子时树变矮一层
+static void _quicklistTreeRemoveChild(quicklist *quicklist, quicklistTreeNode *tn, unsigned int pos) {
+    long delta = -(long)tn->counts[pos];
+
+    memmove(tn->child + pos, tn->child + pos + 1, sizeof(void *) * (tn->n - pos - 1));
+    memmove(tn->counts + pos, tn->counts + pos + 1, sizeof(unsigned long) * (tn->n - pos - 1));
+    tn->n--;
+    if (delta) _quicklistTreePropagate(tn, delta);
+    if (tn->n == 0 && tn->parent) {
+        quicklistTreeNode *parent = tn->parent;
+        _quicklistTreeRemoveChild(quicklist, parent, _quicklistTreePos(parent, tn));
+        zfree(tn);
+        return;
+    }
+    while (quicklist->ext->tree == tn && !tn->leaf && tn->n == 1) {
+        quicklist->ext->tree = tn->child[0];
+        quicklist->ext->tree->parent = NULL;
+        zfree(tn);
+        tn = quicklist->ext->tree;
+    }
+}
+
+///释放计数树
+static void _quicklistTreeFree(quicklistTreeNode *tn) {
+    if (!tn->leaf) {
+        for (unsigned int j = 0; j < tn->n; j++) _quicklistTreeFree(tn->child[j]);
+    }
+    zfree(tn);
+}
+
+///按链表的顺序自底向上建立计数树，每个叶子和内部节点都装满
+static void _quicklistTreeBuild(quicklist *quicklist) {
+    quicklistTreeNode *level = NULL, *last = NULL, *tn = NULL;
+    quicklistNode *node;
+
+    ///先建立叶子，同一层的节点暂时用parent串起来
+    for (node = quicklist->head; node; node = node->next) {
+        if (!tn || tn->n == QUICKLIST_TREE_FANOUT) {
+            tn = _quicklistTreeNodeCreate(1);
+            if (last) last->parent = tn; else level = tn;
+            last = tn;
+        }
+        tn->child[tn->n] = node;
+        tn->counts[tn->n] = node->count;
+        _quicklistExtGet(quicklist, node)->leaf = tn;
+        tn->n++;
+    }
+    ///逐层建立上一层，直到只剩一个节点
+    while (level->parent) {
+        quicklistTreeNode *cur = level, *up = NULL, *next;
+        level = last = NULL;
+        for (; cur; cur = next) {
+            unsigned long sum = 0;
+            next = cur->parent;
+            if (!up || up->n == QUICKLIST_TREE_FANOUT) {
+                up = _quicklistTreeNodeCreate(0);
+                if (last) last->parent = up; else level = up;
+                last = up;
+            }
+            for (unsigned int j = 0; j < cur->n; j++) sum += cur->counts[j];
+            up->child[up->n] = cur;
+            up->counts[up->n] = sum;
+            up->n++;
+        }
+        ///up一层的parent现在串着同一层的节点，下一轮处理它们；这一层的parent改为真正的父节点
+        for (up = level; up; up = up->parent)
+            for (unsigned int j = 0; j < up->n; j++)
+                ((quicklistTreeNode *)up->child[j])->parent = up;
+    }
+    level->parent = NULL;
+    quicklist->ext->tree = level;
+}
+
+/* 快表中增加了节点new_node（已经链接在old_node旁边）之后调用，把它插入计数树。
+ * 快表还没有计数树并且节点数达到阈值时建立计数树。 */
+REDIS_STATIC void quicklistTreeInsertNode(quicklist *quicklist, quicklistNode *old_node,
+                                          quicklistNode *new_node, int after) {
+    if (quicklistTree(quicklist) && old_node) {
+        quicklistTreeNode *leaf = _quicklistExtFind(quicklist, old_node)->leaf;
+        unsigned int pos = _quicklistTreePos(leaf, old_node) + (after ? 1 : 0);
+        _quicklistTreeInsertChild(quicklist, leaf, pos, new_node, new_node->count);
+        if (new_node->count)
+            _quicklistTreePropagate(_quicklistExtFind(quicklist, new_node)->leaf, new_node->count);
+    } else if (!quicklistTree(quicklist) && quicklist_tree_min_nodes &&
+               quicklist->len >= quicklist_tree_min_nodes) {
+        _quicklistTreeBuild(quicklist);
+    }
+}
+
+/* 快表中删除节点node（已经从链表中摘下）之后调用，把它从计数树中删除。
+ * 节点数降到阈值的一半以下时释放计数树。 */
+REDIS_STATIC void quicklistTreeRemoveNode(quicklist *quicklist, quicklistNode *node) {
+    quicklistNodeExt *e;
+    quicklistTreeNode *leaf;
+
+    if (!quicklistTree(quicklist)) return;
+    e = _quicklistExtFind(quicklist, node);
+    leaf = e->leaf;
+    e->leaf = NULL;
+    _quicklistExtRelease(quicklist, e);
+    if (quicklist->len < quicklist_tree_min_nodes / 2 || quicklist_tree_min_nodes == 0 ||
+        quicklist->len == 0) {
+        _quicklistTreeFree(quicklist->ext->tree);
+        quicklist->ext->tree = NULL;
+        ///其余节点的扩展信息中也不再记录叶子
+        for (node = quicklist->head; node; node = node->next) {
+            e = _quicklistExtFind(quicklist, node);
+            e->leaf = NULL;
+            _quicklistExtRelease(quicklist, e);
+        }
+        return;
+    }
+    _quicklistTreeRemoveChild(quicklist, leaf, _quicklistTreePos(leaf, node));
+}
+
+///节点的元素个数变化之后，修改计数树中它和它祖先的计数
+REDIS_STATIC void _quicklistTreeUpdateCount(quicklist *quicklist, quicklistNode *node) {
+    quicklistTreeNode *leaf = _quicklistExtFind(quicklist, node)->leaf;
+    unsigned int pos = _quicklistTreePos(leaf, node);
+    long delta = (long)node->count - (long)leaf->counts[pos];
+
+    if (delta == 0) return;
+    leaf->counts[pos] = node->count;
+    _quicklistTreePropagate(leaf, delta);
+}
+
+///修改了快表中节点的count之后调用，快表没有计数树时什么也不做
+#define quicklistTreeUpdateCount(_ql, _node)                                   \
+    do {                                                                       \
+        if (quicklistTree(_ql)) _quicklistTreeUpdateCount((_ql), (_node));    \
+    } while (0)
+
+/* 用计数树查找正向下标为index的元素所在的节点，*offset设置为元素在节点中的下标。 */
+REDIS_STATIC quicklistNode *quicklistTreeLookup(const quicklist *quicklist,
+                                                unsigned long long index,
+                                                unsigned long long *offset) {
+    const quicklistTreeNode *tn = quicklist->ext->tree;
+
+    while (1) {
+        unsigned int j = 0;
+        while (j < tn->n - 1 && index >= tn->counts[j]) {
+            index -= tn->counts[j];
+            j++;
+        }
+        if (tn->leaf) {
+            *offset = index;
+            return tn->child[j];
+        }
+        tn = tn->child[j];
+    }
+}
+
+///计数树占用的内存，没有建立时为0
+static size_t _quicklistTreeSize(const quicklistTreeNode *tn) {
+    size_t size = sizeof(*tn);
+    if (!tn->leaf) {
+        for (unsigned int j = 0; j < tn->n; j++) size += _quicklistTreeSize(tn->child[j]);
+    }
+    return size;
+}
+
+size_t quicklistTreeSize(const quicklist *quicklist) {
+    return quicklistTree(quicklist) ? _quicklistTreeSize(quicklist->ext->tree) : 0;
+}
+
 /* Return cached quicklist count */
 ///返回快表中压缩表中的节点个数
 unsigned long quicklistCount(const quicklist *ql) { return ql->count; }
@@ -139,6 +827,8 @@ void quicklistRelease(quicklist *quicklist) {
     unsigned long len;
     quicklistNode *current, *next;
 
+    quicklistAsyncCompressForget(quicklist); ///取消所有节点的后台压缩任务，lazyfree时在后台线程中执行
+    quicklistCacheForget(quicklist); ///删除所有节点的解压缓存项
     current = quicklist->head; ///从头节点开始进行释放
     len = quicklist->len; ///获取快表的节点数量
     while (len--) { ///进行循环释放操作
@@ -152,93 +842,665 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--; ///修改快表的节点数量
         current = next; ///修改指针，指向下一个节点
     }
+    if (quicklistTree(quicklist)) _quicklistTreeFree(quicklist->ext->tree); ///释放计数树
+    _quicklistExtFree(quicklist); ///释放扩展信息和稀疏偏移索引
     quicklistBookmarksClear(quicklist); ///释放Bookmark
     zfree(quicklist); ///释放快表
 }
 
-/// 对节点进行压缩操作，返回1表示压缩成功， 0表示压缩失败或者压缩表太小，不能进行压缩操作
-REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
-#ifdef REDIS_TEST
-    node->attempted_compress = 1; ///将节点的压缩标志设置为可压缩
-#endif
+/* 用codec算法压缩一个packlist，返回压缩的结果，packlist太小或者压缩后没有明显变小时返回NULL。
+ * 不访问节点，后台线程也使用它。 */
+static quicklistLZF *_quicklistCompressBlob(const unsigned char *zl, size_t sz, int codec) {
     /* Don't bother compressing small values */
-    if (node->sz < MIN_COMPRESS_BYTES) ///如果压缩表的大小小于最小值（48字节），直接返回0
-        return 0;
+    if (sz < MIN_COMPRESS_BYTES) ///如果压缩表的大小小于最小值（48字节），直接返回NULL
+        return NULL;
 
-    quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz); ///分配压缩后需要的空间
+    quicklistLZF *lzf = zmalloc(sizeof(*lzf) + sz); ///分配压缩后需要的空间
 
-    ///如果压缩失败或者压缩空间太小了，直接返回0
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
-        lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+    ///如果压缩失败或者压缩空间太小了，直接返回NULL
+    if (((lzf->sz = quicklist_codecs[codec].compress(zl, sz, lzf->compressed, sz)) == 0) ||
+        lzf->sz + MIN_COMPRESS_IMPROVE >= sz) {
+        /* The codecs abort/reject compression if value not compressable. */
         zfree(lzf); ///不能进行压缩操作，释放前面申请的空间
-        return 0;
+        return NULL;
     }
-    lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz); ///压缩成功并分配压缩成功大小的空间
+    return zrealloc(lzf, sizeof(*lzf) + lzf->sz); ///压缩成功并分配压缩成功大小的空间
+}
+
+/// 用codec算法对节点进行压缩操作，返回1表示压缩成功， 0表示压缩失败或者压缩表太小，不能进行压缩操作
+REDIS_STATIC int __quicklistCompressNode(quicklistNode *node, int codec) {
+#ifdef REDIS_TEST
+    node->attempted_compress = 1; ///将节点的压缩标志设置为可压缩
+#endif
+    quicklistLZF *lzf = _quicklistCompressBlob(node->zl, node->sz, codec);
+
+    if (!lzf) return 0;
     zfree(node->zl); ///释放原来的压缩表的空间
     node->zl = (unsigned char *)lzf; ///将新的空间赋值给当前的快表节点
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF; ///把节点的编码格式设置为LZF类型
+    node->encoding = QUICKLIST_CODEC_ENCODING(codec); ///记录节点使用的压缩算法
     node->recompress = 0;///设置压缩标志。0表示不用进行压缩操作
     return 1; ///返回操作成功
 }
 
+/* 异步压缩。开启之后，内部节点不再在主线程上压缩：节点的packlist复制一份交给后台线程，节点标记为compress_pending，
+ * 原来的packlist仍然是未压缩的，照常读写，写入路径上只多了一次memcpy。
+ * 后台线程压缩完成后，由主线程调用quicklistAsyncCompressApply()把结果装回节点。装回时会释放节点原来的packlist，
+ * 所以只能在没有迭代器或者quicklistEntry指向节点内部的时候调用，比如两个命令之间：listBeforeSleep()就是为此准备的，
+ * 需要由server.c中的beforeSleep()调用（server.c不在这个源码树中，需要在那里接上）。在那之前，完成的结果只在下一次
+ * LPUSH/RPUSH之前装回，一直没有写入的列表中的节点会停留在compress_pending状态，保持未压缩。
+ * quicklistRelease()可能在lazyfree的后台线程中执行，所以任务队列、async_pending和节点的compress_pending都在async_mutex中修改，
+ * 装回结果也在锁中进行：释放快表时在锁中取消它的任务之后，主线程就不会再访问这些节点。
+ * 节点在结果装回之前被修改、删除或者回到两端不压缩的范围时取消它的任务，已经完成的结果直接丢弃。
+ * 等待中的任务达到QUICKLIST_ASYNC_MAX_PENDING个时退回到同步压缩，避免副本占用太多内存。 */
+#define QUICKLIST_ASYNC_MAX_PENDING 1024
+
+typedef struct quicklistCompressJob {
+    quicklistNode *node; ///等待压缩的节点，任务被取消后为NULL
+    unsigned char *zl; ///节点中packlist的副本，压缩完成后释放
+    size_t sz; ///副本的长度
+    int codec; ///使用的压缩算法
+    quicklistLZF *lzf; ///压缩的结果，不能压缩时为NULL
+    struct quicklistCompressJob *next;
+} quicklistCompressJob;
+
+static int async_compress = 0; ///是否开启了异步压缩
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER; ///保护下面的任务队列
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER; ///有新的任务，或者后台线程完成了一个任务
+static quicklistCompressJob *async_todo = NULL, *async_todo_tail = NULL; ///等待压缩的任务，先进先出
+static quicklistCompressJob *async_running = NULL; ///后台线程正在压缩的任务
+static quicklistCompressJob *async_done = NULL; ///已经压缩完成，等待装回节点的任务
+static unsigned long async_done_count = 0; ///async_done中的任务数，主线程不加锁读取，为0时不用加锁
+static unsigned long async_pending = 0; ///还没有装回节点的任务总数，在async_mutex中修改，不加锁时原子读取
+static int async_thread_started = 0; ///后台线程是否在运行，在async_mutex中设置，不加锁时原子读取
+
+/* 后台线程：依次压缩队列中的副本，把完成的任务放到async_done中。
+ * 关闭异步压缩并且队列为空时退出，线程的zstd上下文由zstd_key的析构函数释放，再次开启时重新创建线程。 */
+static void *quicklistAsyncCompressMain(void *arg) {
+    ((void) arg);
+
+    pthread_mutex_lock(&async_mutex);
+    while(1) {
+        quicklistCompressJob *job = async_todo;
+
+        if (!job) {
+            if (!async_compress) break;
+            pthread_cond_wait(&async_cond, &async_mutex);
+            continue;
+        }
+        async_todo = job->next;
+        if (!async_todo) async_todo_tail = NULL;
+        async_running = job;
+        pthread_mutex_unlock(&async_mutex);
+
+        job->lzf = _quicklistCompressBlob(job->zl, job->sz, job->codec);
+        zfree(job->zl);
+        job->zl = NULL;
+
+        pthread_mutex_lock(&async_mutex);
+        async_running = NULL;
+        job->next = async_done;
+        async_done = job;
+        __atomic_add_fetch(&async_done_count, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&async_cond);
+    }
+    __atomic_store_n(&async_thread_started, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&async_mutex);
+    return NULL;
+}
+
+/* 把节点交给后台线程压缩，返回1表示已经放入队列。
+ * 没有开启异步压缩、节点太小、队列已满或者无法创建线程时返回0，由调用方同步压缩。 */
+REDIS_STATIC int quicklistAsyncCompressNode(quicklistNode *node, int codec) {
+    quicklistCompressJob *job;
+
+    if (!async_compress || node->sz < MIN_COMPRESS_BYTES ||
+        __atomic_load_n(&async_pending, __ATOMIC_RELAXED) >= QUICKLIST_ASYNC_MAX_PENDING)
+        return 0;
+
+    job = zmalloc(sizeof(*job));
+    job->node = node;
+    job->zl = zmalloc(node->sz);
+    memcpy(job->zl, node->zl, node->sz); ///节点原来的packlist留在节点中，仍然可以读写
+    job->sz = node->sz;
+    job->codec = codec;
+    job->lzf = NULL;
+    job->next = NULL;
+
+    pthread_mutex_lock(&async_mutex);
+    if (!async_thread_started) {
+        pthread_t tid;
+
+        if (pthread_create(&tid, NULL, quicklistAsyncCompressMain, NULL) != 0) {
+            pthread_mutex_unlock(&async_mutex);
+            zfree(job->zl);
+            zfree(job);
+            return 0;
+        }
+        pthread_detach(tid);
+        __atomic_store_n(&async_thread_started, 1, __ATOMIC_RELAXED);
+    }
+    if (async_todo_tail)
+        async_todo_tail->next = job;
+    else
+        async_todo = job;
+    async_todo_tail = job;
+    __atomic_add_fetch(&async_pending, 1, __ATOMIC_RELAXED);
+#ifdef REDIS_TEST
+    node->attempted_compress = 1;
+#endif
+    node->compress_pending = 1;
+    node->recompress = 0;
+    pthread_cond_broadcast(&async_cond);
+    pthread_mutex_unlock(&async_mutex);
+    return 1;
+}
+
+/* 取消节点的压缩任务，调用方需要持有async_mutex。
+ * 还在排队的任务直接释放，正在压缩或者已经完成的任务只断开和节点的联系，由quicklistAsyncCompressApply()释放。 */
+static void _quicklistAsyncCompressCancel(quicklistNode *node) {
+    quicklistCompressJob *job, *prev = NULL;
+
+    for (job = async_todo; job; prev = job, job = job->next) {
+        if (job->node != node) continue;
+        if (prev)
+            prev->next = job->next;
+        else
+            async_todo = job->next;
+        if (async_todo_tail == job) async_todo_tail = prev;
+        zfree(job->zl);
+        zfree(job);
+        __atomic_sub_fetch(&async_pending, 1, __ATOMIC_RELAXED);
+        goto done;
+    }
+    if (async_running && async_running->node == node) {
+        async_running->node = NULL;
+        goto done;
+    }
+    for (job = async_done; job; job = job->next) {
+        if (job->node == node) {
+            job->node = NULL;
+            break;
+        }
+    }
+done:
+    node->compress_pending = 0;
+}
+
+///取消节点的压缩任务，节点被修改、删除或者需要保持不压缩之前调用
+REDIS_STATIC void quicklistAsyncCompressCancel(quicklistNode *node) {
+    pthread_mutex_lock(&async_mutex);
+    _quicklistAsyncCompressCancel(node);
+    pthread_mutex_unlock(&async_mutex);
+}
+
+/* 释放快表之前取消它所有节点的压缩任务。lazyfree在后台线程中释放快表时，主线程可能同时在装回结果，
+ * 所以在锁中检查compress_pending。后台线程没有在运行时不会有任务（它只在所有任务都装回之后退出），不用加锁。 */
+REDIS_STATIC void quicklistAsyncCompressForget(quicklist *quicklist) {
+    quicklistNode *node;
+
+    if (!__atomic_load_n(&async_thread_started, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&async_mutex);
+    for (node = quicklist->head; node; node = node->next)
+        if (node->compress_pending) _quicklistAsyncCompressCancel(node);
+    pthread_mutex_unlock(&async_mutex);
+}
+
+/* 把后台线程完成的压缩结果装回节点，并释放这些任务。没有完成的任务时不加锁，直接返回。
+ * 装回在锁中进行，这样在其它线程中释放的快表（见quicklistAsyncCompressForget()）不会被同时修改。
+ * 节点原来的packlist换下来之后挂在任务上，解锁之后再释放。 */
+void quicklistAsyncCompressApply(void) {
+    quicklistCompressJob *job, *next;
+
+    if (__atomic_load_n(&async_done_count, __ATOMIC_ACQUIRE) == 0) return;
+
+    pthread_mutex_lock(&async_mutex);
+    job = async_done;
+    async_done = NULL;
+    __atomic_store_n(&async_done_count, 0, __ATOMIC_RELEASE);
+    for (next = job; next; next = next->next) {
+        quicklistNode *node = next->node;
+
+        if (node) {
+            node->compress_pending = 0;
+            if (next->lzf) {
+                unsigned char *raw = node->zl;
+
+                node->zl = (unsigned char *)next->lzf;
+                node->encoding = QUICKLIST_CODEC_ENCODING(next->codec);
+                next->lzf = (quicklistLZF *)raw; ///下面和没有用上的结果一起释放
+            }
+        }
+        __atomic_sub_fetch(&async_pending, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&async_mutex);
+
+    for (; job; job = next) {
+        next = job->next;
+        zfree(job->lzf);
+        zfree(job);
+    }
+}
+
+///等待后台线程压缩完所有排队的任务，完成的结果仍然需要调用quicklistAsyncCompressApply()装回节点
+void quicklistAsyncCompressWait(void) {
+    pthread_mutex_lock(&async_mutex);
+    while (async_todo || async_running)
+        pthread_cond_wait(&async_cond, &async_mutex);
+    pthread_mutex_unlock(&async_mutex);
+}
+
+///还没有装回节点的压缩任务数，包括已经被取消、等待释放的任务
+unsigned long quicklistAsyncCompressPending(void) {
+    return __atomic_load_n(&async_pending, __ATOMIC_RELAXED);
+}
+
+/* 开启或者关闭异步压缩，返回之前的设置。后台线程在第一次需要时创建。
+ * 关闭时等待所有的任务完成并装回节点，之后不会再有节点处于compress_pending状态，然后唤醒后台线程让它退出。 */
+int quicklistSetAsyncCompression(int enable) {
+    int old = async_compress;
+
+    if (!enable && old) {
+        quicklistAsyncCompressWait();
+        quicklistAsyncCompressApply();
+    }
+    pthread_mutex_lock(&async_mutex);
+    async_compress = enable ? 1 : 0;
+    pthread_cond_broadcast(&async_cond);
+    pthread_mutex_unlock(&async_mutex);
+    return old;
+}
+
 /* Compress only uncompressed nodes. */
-///只压缩没有压缩过的节点
-#define quicklistCompressNode(_node)                                           \
+///只压缩没有压缩过、也没有等待后台压缩的节点，使用快表_ql设置的压缩算法，开启了异步压缩时交给后台线程
+#define quicklistCompressNode(_ql, _node)                                      \
     do {                                                                       \
         ///如果节点的编码类型为QUICKLIST_NODE_ENCODING_RAW，表示没有压缩过           \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW) {     \
-            __quicklistCompressNode((_node));                                  \
+        if ((_node) && (_node)->cached &&                                      \
+            (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW) {                \
+            quicklistCacheRecompress((_node)); ///换回缓存中的压缩数据                \
+        } else if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW && \
+            !(_node)->compress_pending) {                                      \
+            if (!quicklistAsyncCompressNode((_node), (_ql)->codec))            \
+                __quicklistCompressNode((_node), (_ql)->codec);                \
         }                                                                      \
     } while (0)
 
+///解压节点中压缩的数据，返回解压后的packlist，节点不变。解压失败时返回NULL
+static unsigned char *_quicklistDecompressBlob(const quicklistNode *node) {
+    unsigned char *decompressed = zmalloc(node->sz);  ///申请解压所需要的空间
+    quicklistLZF *lzf = (quicklistLZF *)node->zl; ///获取压缩的节点
+    const quicklistCodecType *codec =
+        &quicklist_codecs[node->encoding - QUICKLIST_NODE_ENCODING_LZF]; ///节点压缩时使用的算法
+    ///进行解压操作，如果返回0，表示解压失败
+    if (codec->decompress == NULL ||
+        codec->decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+        /* Someone requested decompress, but we can't decompress.  Not good. */
+        zfree(decompressed); ///释放申请的解压缩空间
+        return NULL;
+    }
+    return decompressed;
+}
+
 ///解压压缩过的节点，并设置它的压缩编码，操作成功返回1，操作失败返回0
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 0;
 #endif
 
-    void *decompressed = zmalloc(node->sz);  ///申请解压所需要的空间
-    quicklistLZF *lzf = (quicklistLZF *)node->zl; ///获取压缩的节点
-    ///进行解压操作，如果返回0，表示解压失败
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
-        /* Someone requested decompress, but we can't decompress.  Not good. */
-        zfree(decompressed); ///释放申请的解压缩空间
-        return 0; ///返回操作失败
+    unsigned char *decompressed = _quicklistDecompressBlob(node);
+
+    if (!decompressed) return 0; ///返回操作失败
+    zfree(node->zl); ///操作成功，释放原来的压缩的空间
+    node->zl = decompressed;  ///将解压缩空间赋值给当前快表节点
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW; ///修改快表节点的压缩类型为QUICKLIST_NODE_ENCODING_RAW
+    return 1; ///返回操作成功
+}
+
+/* 解压缓存。对深度范围之外的节点按下标访问或者遍历（LINDEX、LRANGE）时，节点先被临时解压，
+ * 离开时再重新压缩，反复访问同一段内部节点时每次都要解压和压缩一遍。
+ * 开启缓存后，临时解压的节点不释放压缩的数据，而是放在缓存中，重新压缩时如果节点没有被修改，直接换回压缩的数据，
+ * 换下来的未压缩的packlist留在缓存中，下一次临时解压时直接换上，不需要解压。缓存的一项总是保存着节点当前没有使用的那种形式：
+ *   - 节点是压缩的：缓存保存解压后的packlist；
+ *   - 节点被临时解压：缓存保存压缩的数据和压缩时的编码。
+ * 缓存在所有快表之间共享，按节点指针查找，缓存占用的内存超过容量时淘汰最久没有使用的项，
+ * 淘汰只释放缓存中的数据，不影响节点本身。节点被修改或者释放时删除它的缓存项。
+ * 缓存由主线程使用，但是quicklistRelease()可能在lazyfree的后台线程中执行，而主线程淘汰缓存项时会修改节点的cached，
+ * 所以缓存的所有状态和节点的cached都在cache_mutex中访问。只有主线程会修改自己的快表，不需要加锁就可以读取它们的cached。 */
+typedef struct quicklistCacheEntry {
+    quicklistNode *node; ///缓存的节点
+    unsigned char *held; ///节点当前没有使用的那种形式的数据
+    size_t size; ///held的长度
+    unsigned int encoding; ///节点被临时解压时，held压缩时使用的编码
+    struct quicklistCacheEntry *prev, *next; ///LRU链表，表头是最近使用的
+    struct quicklistCacheEntry *hnext; ///hash表中同一个桶的下一项
+} quicklistCacheEntry;
+
+#define QUICKLIST_CACHE_INITIAL_BUCKETS 64
+
+static quicklistCacheEntry **cache_table = NULL; ///按节点指针查找的hash表
+static unsigned long cache_buckets = 0; ///hash表的桶数，总是2的幂
+static quicklistCacheEntry *cache_head = NULL, *cache_tail = NULL; ///LRU链表
+static quicklistCacheStats cache_stats; ///统计，以及容量和占用的内存
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER; ///保护上面的状态，以下以下划线开头的函数需要调用方持有
+static int cache_used = 0; ///是否开启过缓存，没有开启过时不会有节点在缓存中，原子访问
+
+static unsigned long _quicklistCacheBucket(const quicklistNode *node) {
+    uint64_t h = (uintptr_t)node >> 4;
+    return (unsigned long)((h * 0x9E3779B97F4A7C15ULL) >> 32) & (cache_buckets - 1);
+}
+
+///缓存项计入缓存的内存
+#define quicklistCacheEntrySize(_e) (sizeof(quicklistCacheEntry) + (_e)->size)
+
+static quicklistCacheEntry *_quicklistCacheFind(const quicklistNode *node) {
+    quicklistCacheEntry *e = cache_table[_quicklistCacheBucket(node)];
+    while (e && e->node != node) e = e->hnext;
+    return e;
+}
+
+static void _quicklistCacheUnlinkLRU(quicklistCacheEntry *e) {
+    if (e->prev) e->prev->next = e->next; else cache_head = e->next;
+    if (e->next) e->next->prev = e->prev; else cache_tail = e->prev;
+}
+
+static void _quicklistCacheLinkHead(quicklistCacheEntry *e) {
+    e->prev = NULL;
+    e->next = cache_head;
+    if (cache_head) cache_head->prev = e; else cache_tail = e;
+    cache_head = e;
+}
+
+///桶数不够时扩大一倍
+static void _quicklistCacheGrow(void) {
+    quicklistCacheEntry **old = cache_table;
+    unsigned long j, old_buckets = cache_buckets;
+
+    cache_buckets = old_buckets ? old_buckets * 2 : QUICKLIST_CACHE_INITIAL_BUCKETS;
+    cache_table = zcalloc(sizeof(*cache_table) * cache_buckets);
+    for (j = 0; j < old_buckets; j++) {
+        quicklistCacheEntry *e = old[j], *next;
+        for (; e; e = next) {
+            unsigned long b = _quicklistCacheBucket(e->node);
+            next = e->hnext;
+            e->hnext = cache_table[b];
+            cache_table[b] = e;
+        }
+    }
+    zfree(old);
+}
+
+///从缓存中删除一项，释放它保存的数据
+static void _quicklistCacheRemove(quicklistCacheEntry *e) {
+    quicklistCacheEntry **pe = &cache_table[_quicklistCacheBucket(e->node)];
+
+    while (*pe != e) pe = &(*pe)->hnext;
+    *pe = e->hnext;
+    _quicklistCacheUnlinkLRU(e);
+    cache_stats.bytes -= quicklistCacheEntrySize(e);
+    cache_stats.entries--;
+    e->node->cached = 0;
+    zfree(e->held);
+    zfree(e);
+}
+
+///淘汰最久没有使用的项，直到占用的内存不超过容量
+static void _quicklistCacheEvict(void) {
+    while (cache_tail && cache_stats.bytes > cache_stats.limit) {
+        _quicklistCacheRemove(cache_tail);
+        cache_stats.evictions++;
+    }
+}
+
+///保存节点的另一种形式，节点不能已经在缓存中
+static void _quicklistCacheAdd(quicklistNode *node, unsigned char *held,
+                               size_t size, unsigned int encoding) {
+    quicklistCacheEntry *e = zmalloc(sizeof(*e));
+    unsigned long b;
+
+    if (cache_stats.entries >= cache_buckets) _quicklistCacheGrow();
+    e->node = node;
+    e->held = held;
+    e->size = size;
+    e->encoding = encoding;
+    b = _quicklistCacheBucket(node);
+    e->hnext = cache_table[b];
+    cache_table[b] = e;
+    _quicklistCacheLinkHead(e);
+    cache_stats.bytes += quicklistCacheEntrySize(e);
+    cache_stats.entries++;
+    node->cached = 1;
+    _quicklistCacheEvict();
+}
+
+/* 临时解压一个压缩的节点，压缩的数据留在缓存中。缓存中有解压后的packlist时直接换上。
+ * 没有开启缓存时返回0，由调用方按原来的方式解压。 */
+REDIS_STATIC int quicklistCacheDecompressForUse(quicklistNode *node) {
+    quicklistCacheEntry *e;
+    unsigned char *lzf = node->zl;
+    size_t lzf_size = sizeof(quicklistLZF) + ((quicklistLZF *)lzf)->sz;
+
+    if (cache_stats.limit == 0) return 0; ///只有主线程修改limit
+#ifdef REDIS_TEST
+    node->attempted_compress = 0;
+#endif
+    pthread_mutex_lock(&cache_mutex);
+    if (node->cached && (e = _quicklistCacheFind(node)) != NULL) {
+        cache_stats.hits++;
+        cache_stats.bytes -= e->size;
+        node->zl = e->held;
+        e->held = lzf;
+        e->size = lzf_size;
+        e->encoding = node->encoding;
+        cache_stats.bytes += e->size;
+        node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+        _quicklistCacheUnlinkLRU(e);
+        _quicklistCacheLinkHead(e);
+        _quicklistCacheEvict();
+        pthread_mutex_unlock(&cache_mutex);
+        return 1;
+    }
+    cache_stats.misses++;
+    pthread_mutex_unlock(&cache_mutex);
+
+    ///节点属于主线程的快表，解压时不需要持有锁
+    unsigned char *decompressed = _quicklistDecompressBlob(node);
+    if (!decompressed) return 1;
+    pthread_mutex_lock(&cache_mutex);
+    _quicklistCacheAdd(node, lzf, lzf_size, node->encoding);
+    pthread_mutex_unlock(&cache_mutex);
+    node->zl = decompressed;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    return 1;
+}
+
+/* 重新压缩临时解压过的节点：换回缓存中的压缩数据，解压后的packlist留在缓存中。
+ * 节点只有在没有被修改过时才在缓存中（修改时quicklistNodeUpdateSz删除了它的缓存项）。 */
+REDIS_STATIC void quicklistCacheRecompress(quicklistNode *node) {
+    quicklistCacheEntry *e;
+    unsigned char *raw = node->zl;
+
+#ifdef REDIS_TEST
+    node->attempted_compress = 1;
+#endif
+    pthread_mutex_lock(&cache_mutex);
+    e = _quicklistCacheFind(node);
+    cache_stats.bytes -= e->size;
+    node->zl = e->held;
+    node->encoding = e->encoding;
+    node->recompress = 0;
+    e->held = raw;
+    e->size = node->sz;
+    cache_stats.bytes += e->size;
+    _quicklistCacheEvict();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* 永久解压一个在缓存中的压缩节点（比如节点进入了两端不压缩的范围），直接使用缓存中解压后的packlist，
+ * 然后删除缓存项。 */
+REDIS_STATIC void quicklistCacheDecompress(quicklistNode *node) {
+    quicklistCacheEntry *e;
+
+#ifdef REDIS_TEST
+    node->attempted_compress = 0;
+#endif
+    pthread_mutex_lock(&cache_mutex);
+    e = _quicklistCacheFind(node);
+    cache_stats.hits++;
+    zfree(node->zl);
+    node->zl = e->held;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    e->held = NULL;
+    cache_stats.bytes -= e->size;
+    e->size = 0;
+    _quicklistCacheRemove(e);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+///删除节点的缓存项，调用方需要持有cache_mutex
+static void _quicklistCacheDrop(quicklistNode *node) {
+    quicklistCacheEntry *e = _quicklistCacheFind(node);
+    if (e) _quicklistCacheRemove(e);
+    node->cached = 0;
+}
+
+///删除节点的缓存项，节点被修改之前调用
+REDIS_STATIC void quicklistCacheDrop(quicklistNode *node) {
+    pthread_mutex_lock(&cache_mutex);
+    _quicklistCacheDrop(node);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* 释放快表之前删除它所有节点的缓存项。可能在lazyfree的后台线程中执行，这时主线程可能正在淘汰这些节点的缓存项，
+ * 所以在锁中检查cached。从来没有开启过缓存时不用加锁。 */
+REDIS_STATIC void quicklistCacheForget(quicklist *quicklist) {
+    quicklistNode *node;
+
+    if (!__atomic_load_n(&cache_used, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&cache_mutex);
+    for (node = quicklist->head; node; node = node->next)
+        if (node->cached) _quicklistCacheDrop(node);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* 设置解压缓存的容量（字节），0表示关闭缓存并释放所有缓存项。缩小容量时立即淘汰多出的项。只能在主线程调用 */
+void quicklistSetDecompressCacheSize(size_t bytes) {
+    pthread_mutex_lock(&cache_mutex);
+    cache_stats.limit = bytes;
+    if (bytes) __atomic_store_n(&cache_used, 1, __ATOMIC_RELAXED);
+    _quicklistCacheEvict();
+    if (bytes == 0) {
+        zfree(cache_table);
+        cache_table = NULL;
+        cache_buckets = 0;
     }
-    zfree(lzf); ///操作成功，释放原来的压缩的空间
-    node->zl = decompressed;  ///将解压缩空间赋值给当前快表节点
-    node->encoding = QUICKLIST_NODE_ENCODING_RAW; ///修改快表节点的压缩类型为QUICKLIST_NODE_ENCODING_RAW
-    return 1; ///返回操作成功
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+///读取解压缓存的统计
+void quicklistGetDecompressCacheStats(quicklistCacheStats *stats) {
+    pthread_mutex_lock(&cache_mutex);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_mutex);
 }
 
 /* Decompress only compressed nodes. */
-///对没有解压的节点进行解压缩操作
+///对没有解压的节点进行解压缩操作，等待后台压缩的节点取消它的任务，保持不压缩
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && (_node)->compress_pending) {                            \
+            quicklistAsyncCompressCancel((_node));                             \
+        } else if ((_node) && (_node)->cached &&                               \
+                   quicklistNodeIsCompressed(_node)) {                         \
+            quicklistCacheDecompress((_node));                                 \
+        } else if ((_node) && quicklistNodeIsCompressed(_node)) {              \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
 
 /* Force node to not be immediately re-compresable */
-///标记已经被压缩的节点，等待被再一次压缩
+///标记已经被压缩的节点，等待被再一次压缩。等待后台压缩的节点本身就是未压缩的，可以直接读取，不取消任务
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
-            __quicklistDecompressNode((_node));                                \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
+            if (!quicklistCacheDecompressForUse((_node)))                      \
+                __quicklistDecompressNode((_node));                            \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
-///从快表中获取压缩过的压缩表的大小，并且将这个压缩过的数据保存到data中
+/* 从快表中获取压缩过的压缩表的大小，并且将这个压缩过的数据保存到data中，节点必须是用LZF压缩过的。
+ * 用其它算法压缩的节点没有LZF数据，调用者要先检查node->encoding，改用quicklistGetLzfCopy()。 */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
-    quicklistLZF *lzf = (quicklistLZF *)node->zl; ///获取压缩后的压缩表
+    quicklistLZF *lzf;
+
+    assert(node->encoding == QUICKLIST_NODE_ENCODING_LZF);
+    lzf = (quicklistLZF *)node->zl; ///获取压缩后的压缩表
     *data = lzf->compressed; ///将数据地址保存到data中
     return lzf->sz; ///返回压缩后压缩表的大小
 }
 
+/* 把用LZ4或者zstd压缩的节点导出为LZF数据，保存在一块新分配的内存中，data指向它，调用者用完之后要zfree(*data)。
+ * RDB和DEBUG只认识LZF，它们在node->encoding不是LZF时用这个函数代替quicklistGetLzf()。
+ * 节点本身不会被修改：SAVE在fork出的子进程中调用这个函数，修改节点会复制页面，并且节点会丢掉快表设置的算法。
+ * 输出空间按LZF最坏的情况分配，压缩不会因为数据不可压缩而失败。只有节点的数据损坏、无法解压时才返回0，*data为NULL。 */
+size_t quicklistGetLzfCopy(const quicklistNode *node, void **data) {
+    unsigned char *decompressed, *out;
+    size_t max = node->sz + node->sz/16 + 64, sz; ///LZF的输出最多比输入多出约3%
+
+    assert(quicklistNodeIsCompressed(node) && node->encoding != QUICKLIST_NODE_ENCODING_LZF);
+    *data = NULL;
+    decompressed = _quicklistDecompressBlob(node);
+    if (!decompressed) return 0;
+    out = zmalloc(max);
+    sz = lzf_compress(decompressed, node->sz, out, max);
+    zfree(decompressed);
+    if (sz == 0) {
+        zfree(out);
+        return 0;
+    }
+    *data = out;
+    return sz;
+}
+
+/* 用快表中节点的内容训练一个zstd字典，写入dict，最多capacity字节，返回字典的长度，失败或者不支持zstd时返回0。
+ * 样本总量最多为capacity的100倍，训练好的字典用quicklistSetZstdDictionary()加载。 */
+size_t quicklistTrainZstdDictionary(quicklist *quicklist, void *dict, size_t capacity) {
+#ifdef HAVE_ZSTD
+    size_t max_bytes = capacity * 100, used = 0, ret;
+    unsigned int nsamples = 0;
+    quicklistNode *node;
+    unsigned char *samples;
+    size_t *sizes;
+
+    for (node = quicklist->head; node && used + node->sz <= max_bytes; node = node->next) {
+        used += node->sz;
+        nsamples++;
+    }
+    if (nsamples == 0) return 0;
+
+    samples = zmalloc(used);
+    sizes = zmalloc(sizeof(size_t) * nsamples);
+    used = 0;
+    node = quicklist->head;
+    for (unsigned int j = 0; j < nsamples; j++, node = node->next) {
+        quicklistDecompressNodeForUse(node);
+        memcpy(samples + used, node->zl, node->sz);
+        sizes[j] = node->sz;
+        used += node->sz;
+        if (node->recompress) quicklistCompressNode(quicklist, node);
+    }
+    ret = ZDICT_trainFromBuffer(dict, capacity, samples, sizes, nsamples);
+    zfree(samples);
+    zfree(sizes);
+    return ZDICT_isError(ret) ? 0 : ret;
+#else
+    (void)quicklist;
+    (void)dict;
+    (void)capacity;
+    return 0;
+#endif
+}
+
 ///返回快表节点是否可压缩，1表示可压缩，0表示不可压缩
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
@@ -263,7 +1525,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         quicklistDecompressNode(h);///如果需要解压，就进行解压缩操作
         quicklistDecompressNode(t);
         if (h != node && t != node) ///如果头节点和尾节点都不是我们要找的节点
-            quicklistCompressNode(node); ///就对该node进行压缩操作
+            quicklistCompressNode(quicklist, node); ///就对该node进行压缩操作
         return;
     } else if (quicklist->compress == 2) {///如果压缩标志为2，两端的两个节点
         quicklistNode *h = quicklist->head, *hn = h->next, *hnn = hn->next;
@@ -273,13 +1535,13 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         quicklistDecompressNode(t);
         quicklistDecompressNode(tp);
         if (h != node && hn != node && t != node && tp != node) {
-            quicklistCompressNode(node); ///如果上面4个节点都不是我们要查找的节点，就对node进行压缩操作
+            quicklistCompressNode(quicklist, node); ///如果上面4个节点都不是我们要查找的节点，就对node进行压缩操作
         }
         if (hnn != t) {
-            quicklistCompressNode(hnn); ///如果第三个节点不是尾节点，将其进行压缩操作
+            quicklistCompressNode(quicklist, hnn); ///如果第三个节点不是尾节点，将其进行压缩操作
         }
         if (tpp != h) {
-            quicklistCompressNode(tpp); ///如果倒数第三个节点不是头节点，将其进行压缩操作
+            quicklistCompressNode(quicklist, tpp); ///如果倒数第三个节点不是头节点，将其进行压缩操作
         }
         return;
     }
@@ -300,7 +1562,9 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         if (forward == node || reverse == node) ///如果找node节点,就设置标志
             in_depth = 1;
 
-        if (forward == reverse) ///如果头尾指针相遇，直接返回
+        ///如果头尾指针相遇或者相邻，所有节点都在深度范围内，直接返回。
+        ///节点数正好是compress的两倍时两个指针最后是相邻的，不返回会把深度范围内的节点压缩掉
+        if (forward == reverse || forward->next == reverse)
             return;
 
         forward = forward->next; ///指向后继节点
@@ -308,12 +1572,12 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     }
 
     if (!in_depth)  ///如果node不在两端不需要压缩的的范围，就表示需要就这个节点进行压缩
-        quicklistCompressNode(node);
+        quicklistCompressNode(quicklist, node);
 
     if (depth > 2) { ///如果深度大于2，需要压缩首尾两个指针指向的节点
         /* At this point, forward and reverse are one node beyond depth */
-        quicklistCompressNode(forward);
-        quicklistCompressNode(reverse);
+        quicklistCompressNode(quicklist, forward);
+        quicklistCompressNode(quicklist, reverse);
     }
 }
 
@@ -321,7 +1585,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistCompress(_ql, _node)                                          \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCompressNode((_ql), (_node));                             \
         else                                                                   \
             __quicklistCompress((_ql), (_node));                               \
     } while (0)
@@ -331,7 +1595,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistRecompressOnly(_ql, _node)                                    \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCompressNode((_ql), (_node));                             \
     } while (0)
 
 ///如果after = 1， 表示在old_node节点后面插入新的节点
@@ -370,6 +1634,7 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
         quicklistCompress(quicklist, old_node); ///对old_node进行压缩操作
 
     quicklist->len++;
+    quicklistTreeInsertNode(quicklist, old_node, new_node, after); ///插入计数树
 }
 
 /* Wrappers for node inserting around existing node. */
@@ -410,40 +1675,72 @@ _quicklistNodeSizeMeetsOptimizationRequirement(const size_t sz,
 ///判断sz大小是否超过了SIZE_SAFETY_LIMIT = 8192，
 #define sizeMeetsSafetyLimit(sz) ((sz) <= SIZE_SAFETY_LIMIT)
 
-///判断node节点是否能插入到快表中，主要通过fill和size两个指标进行判断
-REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
-                                           const int fill, const size_t sz) {
-    if (unlikely(!node)) ///unlikely()表示为假可能性的函数，如果!node为假的可能性大，就直接返回
-        return 0;
+///长度为sz的值在packlist中除了内容之外占用的字节数
+REDIS_STATIC int _quicklistEntryOverhead(const size_t sz) {
+    int pl_overhead;
+
+    if (!packlist_enabled) {
+        int ziplist_overhead;
+        ///packlist格式关闭时节点是ziplist：prevlen小于254用1个字节，否则用5个字节
+        if (sz < 254)
+            ziplist_overhead = 1;
+        else
+            ziplist_overhead = 5;
+
+        ///编码长度：长度小于64用1个字节，小于16384用2个字节，否则用5个字节
+        if (sz < 64)
+            ziplist_overhead += 1;
+        else if (likely(sz < 16384))
+            ziplist_overhead += 2;
+        else
+            ziplist_overhead += 5;
+        return ziplist_overhead;
+    }
 
-    int ziplist_overhead; ///
-    /* size of previous offset */
-    if (sz < 254) ///上一个节点的信息
-        ziplist_overhead = 1; ///如果压缩表的大小小于254，需要一个字节编码
+    ///packlist节点的编码长度：长度小于64用1个字节，小于4096用2个字节，否则用5个字节
+    if (sz < 64)
+        pl_overhead = 1;
+    else if (likely(sz < 4096))
+        pl_overhead = 2;
     else
-        ziplist_overhead = 5; ///否则需要5个字节来编码
+        pl_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64) ///当前节点的信息
-        ziplist_overhead += 1; ///如果长度小于64，用一个字节的编码
-    else if (likely(sz < 16384)) ///如果小于16384，就用两个字节编码
-        ziplist_overhead += 2;
-    else                         ///否则，用5个字节编码
-        ziplist_overhead += 5; 
+    ///节点末尾的backlen，每个字节保存7位
+    if (sz + pl_overhead <= 127)
+        pl_overhead += 1;
+    else if (likely(sz + pl_overhead < 16384))
+        pl_overhead += 2;
+    else
+        pl_overhead += 5;
+    return pl_overhead;
+}
 
-    /* new_sz overestimates if 'sz' encodes to an integer type */
-    ///新节点的长度为当前节点长度 + 压缩表节点大小+压缩表当前节点编码长度 + 压缩表前一个节点编码长度
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+///插入后packlist的长度为new_sz，插入前节点数为count时，是否满足fill的要求
+REDIS_STATIC int _quicklistNodeAllowSize(const size_t new_sz,
+                                         const unsigned int count,
+                                         const int fill) {
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill))) ///如果new_符合fill要求
         return 1; ///返回成功
     else if (!sizeMeetsSafetyLimit(new_sz)) ///如果new_sz的大小超过了安全线，返回0
         return 0;
-    else if ((int)node->count < fill) ///如果节点中压缩表节点数小于fill的要求，返回1 
+    else if ((int)count < fill) ///如果节点中压缩表节点数小于fill的要求，返回1 
         return 1;
     else
         return 0;
 }
 
+///判断node节点是否能插入到快表中，主要通过fill和size两个指标进行判断
+REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
+                                           const int fill, const size_t sz) {
+    if (unlikely(!node)) ///unlikely()表示为假可能性的函数，如果!node为假的可能性大，就直接返回
+        return 0;
+
+    /* new_sz overestimates if 'sz' encodes to an integer type */
+    ///新节点的长度为当前节点长度 + 值的长度 + 编码长度 + backlen的长度
+    size_t new_sz = node->sz + sz + _quicklistEntryOverhead(sz);
+    return _quicklistNodeAllowSize(new_sz, node->count, fill);
+}
+
 ///根据fill来判断两个快表节点中的压缩表是否可以进行合并操作，如果可以则返回1，否则返回0
 REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
                                           const quicklistNode *b,
@@ -453,8 +1750,9 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 
     /* approximate merged ziplist size (- 11 to remove one ziplist
      * header/trailer) */
-    ///计算连个压缩表的大小，但是要减去一个表头和结尾标志符的大小（4(albytes) + 4(zltail_offset) + 2(zllength) + 1(zlend) = 11）
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    ///计算合并后的大小，要减去一个头部和结尾标志的大小：packlist格式关闭时节点是ziplist
+    ///（4(albytes) + 4(zltail_offset) + 2(zllength) + 1(zlend) = 11），否则是packlist（4(plbytes) + 2(pllen) + 1(plend) = 7）
+    unsigned int merge_sz = a->sz + b->sz - (packlist_enabled ? 7 : 11);
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill))) ///如果merge_sz符合要求，返回1
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz)) ///如果merge_sz大小超过了安全限定，返回0
@@ -465,10 +1763,17 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
         return 0;
 }
 
-///更新快表节点中的压缩表大小
-#define quicklistNodeUpdateSz(node)                                            \
+/* 更新快表节点中的压缩表大小，节点被修改过，稀疏偏移索引和解压缓存项也随之失效。
+ * 等待后台压缩的节点取消任务，它仍然是内部节点，标记recompress，之后的quicklistRecompressOnly()重新压缩它。 */
+#define quicklistNodeUpdateSz(ql, node)                                        \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = packlistBlobLen((node)->zl);                               \
+        quicklistNodeDropOffsets((ql), (node));                                \
+        if ((node)->cached) quicklistCacheDrop(node);                          \
+        if ((node)->compress_pending) {                                        \
+            quicklistAsyncCompressCancel(node);                                \
+            (node)->recompress = 1;                                            \
+        }                                                                      \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -482,17 +1787,18 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) { ///检测是否能够插入这个节点
         quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD); ///将这个ziplist以头插入的方式插入快表头节点的ziplist中
-        quicklistNodeUpdateSz(quicklist->head); ///更新快表head节点中的ziplist数据记录
+            packlistPush(quicklist->head->zl, value, sz, PACKLIST_HEAD); ///将这个ziplist以头插入的方式插入快表头节点的ziplist中
+        quicklistNodeUpdateSz(quicklist, quicklist->head); ///更新快表head节点中的ziplist数据记录
     } else { ///如果插入新的entry后不满足file，size的约定
         quicklistNode *node = quicklistCreateNode(); ///就需要创建一个新的快表节点 
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);///将这个ziplist写入到这个新的节点中
+        node->zl = packlistPush(packlistNew(), value, sz, PACKLIST_HEAD);///将这个ziplist写入到这个新的节点中
 
-        quicklistNodeUpdateSz(node); ///更新这个新建节点中关于ziplist的信息
+        quicklistNodeUpdateSz(quicklist, node); ///更新这个新建节点中关于ziplist的信息
         _quicklistInsertNodeBefore(quicklist, quicklist->head, node); ///将这个节点插入到快表头节点之前，称为新的头节点
     }
     quicklist->count++; ///修改快表中压缩表节点的数目
     quicklist->head->count++; ///修改头节点中的压缩表的节点数目
+    quicklistTreeUpdateCount(quicklist, quicklist->head);
     return (orig_head != quicklist->head);  ///如果头节点发生改变，就返回1，否则返回0
 }
 
@@ -506,33 +1812,93 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
         quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
-        quicklistNodeUpdateSz(quicklist->tail);
+            packlistPush(quicklist->tail->zl, value, sz, PACKLIST_TAIL);
+        quicklistNodeUpdateSz(quicklist, quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->zl = packlistPush(packlistNew(), value, sz, PACKLIST_TAIL);
 
-        quicklistNodeUpdateSz(node);
+        quicklistNodeUpdateSz(quicklist, node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     }
     quicklist->count++;
     quicklist->tail->count++;
+    quicklistTreeUpdateCount(quicklist, quicklist->tail);
     return (orig_tail != quicklist->tail);
 }
 
+/* 一次在快表的头部或者尾部插入count个值，结果和依次调用quicklistPush()相同。
+ * 先算出头（尾）节点还能容纳多少个值，用packlistPushMany()一次写入，剩下的值写入新建的节点。
+ * 两种格式下每个快表节点都只需要一次realloc；ziplist格式写入头部时，原来的第一个节点的prevlen变长后
+ * 还可能在接缝处做一次连锁更新，见ziplistPushMany()。 */
+void quicklistPushMany(quicklist *quicklist, unsigned char **values,
+                       unsigned int *sizes, unsigned long count, int where) {
+    int pl_where = (where == QUICKLIST_HEAD) ? PACKLIST_HEAD : PACKLIST_TAIL;
+    unsigned long i = 0;
+
+    while (i < count) {
+        quicklistNode *node = (where == QUICKLIST_HEAD) ? quicklist->head : quicklist->tail;
+        unsigned int n = 0;
+        size_t new_sz;
+
+        ///当前的头（尾）节点一个值也放不下时创建新的节点，和quicklistPushHead()一样，新节点至少放入一个值
+        if (!_quicklistNodeAllowInsert(node, quicklist->fill, sizes[i])) {
+            node = quicklistCreateNode();
+            node->zl = packlistNew();
+            quicklistNodeUpdateSz(quicklist, node);
+            if (where == QUICKLIST_HEAD)
+                _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
+            else
+                _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
+            n = 1;
+        }
+
+        ///计算这个节点还能容纳多少个值
+        new_sz = node->sz;
+        if (n) new_sz += sizes[i] + _quicklistEntryOverhead(sizes[i]);
+        while (i + n < count) {
+            new_sz += sizes[i+n] + _quicklistEntryOverhead(sizes[i+n]);
+            if (!_quicklistNodeAllowSize(new_sz, node->count + n, quicklist->fill))
+                break;
+            n++;
+        }
+
+        node->zl = packlistPushMany(node->zl, values + i, sizes + i, n, pl_where);
+        quicklistNodeUpdateSz(quicklist, node);
+        node->count += n;
+        quicklist->count += n;
+        quicklistTreeUpdateCount(quicklist, node);
+        i += n;
+    }
+}
+
+///创建一个新的节点，该节点由预先形成的packlist组成，pl由快表接管
+void quicklistAppendPacklist(quicklist *quicklist, unsigned char *pl) {
+    quicklistNode *node = quicklistCreateNode(); ///创建一个新的快表节点
+
+    node->zl = pl; ///将node的packlist指针指向这个给定的pl
+    node->count = packlistLen(node->zl); ///初始化节点中packlist的节点数目
+    node->sz = packlistBlobLen(pl); ///初始化节点中packlist的大小
+
+    _quicklistInsertNodeAfter(quicklist, quicklist->tail, node); ///将这个节点插入到快表的尾部
+    quicklist->count += node->count; ///更新快表中记录压缩表的大小的数据
+}
+
 /* Create new node consisting of a pre-formed ziplist.
  * Used for loading RDBs where entire ziplists have been stored
  * to be retrieved later. */
 /// 创建一个新的节点，该节点由预先形成的ziplist组成。 用于加载已存储整个ziplist以便以后检索的RDB。 
+/// 打开了packlist格式时快表节点保存packlist，加载时把ziplist转换成packlist，并释放zl
 void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
-    quicklistNode *node = quicklistCreateNode(); ///创建一个新的快表节点
-
-    node->zl = zl; ///将node的ziplist指针指向这个给定的zl
-    node->count = ziplistLen(node->zl); ///初始化节点中压缩表的节点数目
-    node->sz = ziplistBlobLen(zl); ///初始化节点中压缩表的大小
+    unsigned char *pl;
 
-    _quicklistInsertNodeAfter(quicklist, quicklist->tail, node); ///将这个节点插入到快表的尾部
-    quicklist->count += node->count; ///更新快表中记录压缩表的大小的数据
+    if (!packlist_enabled) { ///节点本来就是ziplist，直接接管zl
+        quicklistAppendPacklist(quicklist, zl);
+        return;
+    }
+    pl = packlistFromZiplist(zl);
+    zfree(zl);
+    quicklistAppendPacklist(quicklist, pl);
 }
 
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
@@ -609,9 +1975,13 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
 
     quicklist->count -= node->count; //更新快表中压缩表节点数量
 
+    if (node->compress_pending) quicklistAsyncCompressCancel(node); ///取消后台压缩任务
+    if (node->cached) quicklistCacheDrop(node); ///删除解压缓存项
     zfree(node->zl); ///释放压缩表
-    zfree(node); ///释放节点
+    quicklistNodeDropOffsets(quicklist, node); ///释放稀疏偏移索引
     quicklist->len--; ///快表中的节点数量-1
+    quicklistTreeRemoveNode(quicklist, node); ///从计数树中删除
+    zfree(node); ///释放节点
 }
 
 ///从快表中的node节点中删除压缩表节点p，如果删除后该快表节点的压缩表节点数为0，就需要删除这个快表节点。
@@ -620,13 +1990,14 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
 
-    node->zl = ziplistDelete(node->zl, p); ///删除node节点的ziplist中的p
+    node->zl = packlistDelete(node->zl, p); ///删除node节点的ziplist中的p
     node->count--; ///快表节点中记录压缩表节点数的计算器-1
     if (node->count == 0) { ///如果删除压缩表节点后node的count变成了0
         gone = 1;
         __quicklistDelNode(quicklist, node); ///就需要从快表中删除节点
     } else {
-        quicklistNodeUpdateSz(node); ///否则就更新快表中的node节点
+        quicklistNodeUpdateSz(quicklist, node); ///否则就更新快表中的node节点
+        quicklistTreeUpdateCount(quicklist, node);
     }
     quicklist->count--; ///快表中的压缩表节点计数器-1
     /* If we deleted the node, the original node is no longer valid */
@@ -681,9 +2052,17 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data, int sz
     quicklistEntry entry;
     if (likely(quicklistIndex(quicklist, index, &entry))) { ///首先通过quicklistIndex()找到下标为index处的压缩表节点
         /* quicklistIndex provides an uncompressed node */
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi); ///删除需要被替换的压缩表节点
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz); ///在删除的位置插入替换的压缩表节点
-        quicklistNodeUpdateSz(entry.node); ///更新快表的头部信息
+        packlistOffsets *offsets = _quicklistNodeTakeOffsets(quicklist, entry.node);
+        size_t old_sz = entry.node->sz;
+
+        entry.node->zl = packlistDelete(entry.node->zl, &entry.zi); ///删除需要被替换的压缩表节点
+        entry.node->zl = packlistInsert(entry.node->zl, entry.zi, data, sz); ///在删除的位置插入替换的压缩表节点
+        quicklistNodeUpdateSz(quicklist, entry.node); ///更新快表的头部信息
+        ///只替换了一个节点，总长度不变说明这个节点的长度也没有变，其它节点的偏移量都不变，稀疏索引仍然有效
+        if (offsets && entry.node->sz == old_sz)
+            _quicklistNodeSetOffsets(quicklist, entry.node, offsets);
+        else if (offsets)
+            packlistFreeOffsets(offsets);
         quicklistCompress(quicklist, entry.node); ///对该节点按需进行压缩操作
         return 1; ///返回操作成功
     } else { ///否则返回失败
@@ -709,7 +2088,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
 
     quicklistDecompressNode(a); ///对快表节点a执行解压缩操作
     quicklistDecompressNode(b); ///对快表节点b执行解压缩操作
-    if ((ziplistMerge(&a->zl, &b->zl))) { ///合并两个压缩表
+    if ((packlistMerge(&a->zl, &b->zl))) { ///合并两个压缩表
         /* We merged ziplists! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
         if (!a->zl) { ///如果a指向的zl为空，说明a已经发生了变化
@@ -719,8 +2098,9 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
             nokeep = b;
             keep = a;
         }
-        keep->count = ziplistLen(keep->zl); ///更新快表节点中的压缩表的数量
-        quicklistNodeUpdateSz(keep); ///更新快表中记录压缩表节点数目的值
+        keep->count = packlistLen(keep->zl); ///更新快表节点中的压缩表的数量
+        quicklistNodeUpdateSz(quicklist, keep); ///更新快表中记录压缩表节点数目的值
+        quicklistTreeUpdateCount(quicklist, keep);
  
         nokeep->count = 0; ///将a合并到b中，所以将a的数量置为0
         __quicklistDelNode(quicklist, nokeep); ///删除合并后没有不在使用的节点
@@ -804,8 +2184,8 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
  *
  * Returns newly created node or NULL if split not possible. 
  */
-REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
-                                                int after) {
+REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklist *quicklist, quicklistNode *node,
+                                                int offset, int after) {
     size_t zl_sz = node->sz; ///获取快表节点的压缩表大小
 
     quicklistNode *new_node = quicklistCreateNode(); ///创建一个新出的压缩表节点
@@ -825,13 +2205,13 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent); //将原来节点中的org部分删除
-    node->count = ziplistLen(node->zl); ///更新节点的压缩表节点计数器
-    quicklistNodeUpdateSz(node); ///更新快表节点关于压缩表的信息
+    node->zl = packlistDeleteRange(node->zl, orig_start, orig_extent); //将原来节点中的org部分删除
+    node->count = packlistLen(node->zl); ///更新节点的压缩表节点计数器
+    quicklistNodeUpdateSz(quicklist, node); ///更新快表节点关于压缩表的信息
 
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent); ///删除新节点中new部分
-    new_node->count = ziplistLen(new_node->zl);///更新新节点的压缩表计数器
-    quicklistNodeUpdateSz(new_node);///更新快表节点表关于压缩表的信息
+    new_node->zl = packlistDeleteRange(new_node->zl, new_start, new_extent); ///删除新节点中new部分
+    new_node->count = packlistLen(new_node->zl);///更新新节点的压缩表计数器
+    quicklistNodeUpdateSz(quicklist, new_node);///更新快表节点表关于压缩表的信息
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
     return new_node;
@@ -852,9 +2232,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
         new_node = quicklistCreateNode(); ///创建一个新的快表节点
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD); ///将新的压缩表信息加入到新节点的ziplist中
+        new_node->zl = packlistPush(packlistNew(), value, sz, PACKLIST_HEAD); ///将新的压缩表信息加入到新节点的ziplist中
         __quicklistInsertNode(quicklist, NULL, new_node, after); ////在快表中插入新节点
         new_node->count++; ///修改节点的计数器
+        quicklistTreeUpdateCount(quicklist, new_node);
         quicklist->count++; ///修改快表的计数器
         return;
     }
@@ -889,21 +2270,23 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     if (!full && after) {
         D("Not full, inserting after current position.");
         quicklistDecompressNodeForUse(node); ///将node进行解压操作
-        unsigned char *next = ziplistNext(node->zl, entry->zi); ///返回node->zl锁指向的下一个压缩表节点的位置
+        unsigned char *next = packlistNext(node->zl, entry->zi); ///返回node->zl锁指向的下一个压缩表节点的位置
         if (next == NULL) { ///如果下一个节点为空，表示该节点已经为尾节点 
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);///直接在尾部插入即可
+            node->zl = packlistPush(node->zl, value, sz, PACKLIST_TAIL);///直接在尾部插入即可
         } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz); ///否则就在entry的后面插入一个压缩表节点
+            node->zl = packlistInsert(node->zl, next, value, sz); ///否则就在entry的后面插入一个压缩表节点
         }
         node->count++; ///将快表节点的压缩表节点计数器+1
-        quicklistNodeUpdateSz(node); ///更新快表节点的压缩表大小信息
+        quicklistTreeUpdateCount(quicklist, node);
+        quicklistNodeUpdateSz(quicklist, node); ///更新快表节点的压缩表大小信息
         quicklistRecompressOnly(quicklist, node); ///对node进行重压缩
     } else if (!full && !after) { ///如果fill满足要求，在entry的前面插入一个压缩表节点
         D("Not full, inserting before current position.");
         quicklistDecompressNodeForUse(node); ///将node解压
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz); ///在entry的前面插入压缩表节点
+        node->zl = packlistInsert(node->zl, entry->zi, value, sz); ///在entry的前面插入压缩表节点
         node->count++;///将快表节点的压缩表节点计数器+1
-        quicklistNodeUpdateSz(node);///更新快表节点的压缩表大小信息
+        quicklistTreeUpdateCount(quicklist, node);
+        quicklistNodeUpdateSz(quicklist, node);///更新快表节点的压缩表大小信息
         quicklistRecompressOnly(quicklist, node);//对node进行重压缩
     } 
     ///如果当前的node已经满了（full ==1），并且当前的entry是尾节点，node的next不为空，但是它的next能够没有满
@@ -913,9 +2296,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next; ///让new_node指向node的下一个节点
         quicklistDecompressNodeForUse(new_node); ///将new_node进行解压缩操作
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD); ///采用头插入的方式在new_node的压缩表中新增一个压缩表节点
+        new_node->zl = packlistPush(new_node->zl, value, sz, PACKLIST_HEAD); ///采用头插入的方式在new_node的压缩表中新增一个压缩表节点
         new_node->count++; ///new_node的压缩表计数器+1
-        quicklistNodeUpdateSz(new_node); ///更新new_node的压缩表大小
+        quicklistTreeUpdateCount(quicklist, new_node);
+        quicklistNodeUpdateSz(quicklist, new_node); ///更新new_node的压缩表大小
         quicklistRecompressOnly(quicklist, new_node); ///对new_node进行重压缩
     } 
     ///如果当前节点为full，并且entry已经是头部节点，前驱节点没有满，而且采用的是头插入的方式
@@ -924,9 +2308,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev; ///让new_node指向node的前驱节点
         quicklistDecompressNodeForUse(new_node); ///将new_node进行解压缩操作
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL); ///采用尾插入的形式在new_node的尾部插入一个压缩表节点
+        new_node->zl = packlistPush(new_node->zl, value, sz, PACKLIST_TAIL); ///采用尾插入的形式在new_node的尾部插入一个压缩表节点
         new_node->count++; ///new_node的压缩表计数器+1
-        quicklistNodeUpdateSz(new_node);///更新new_node的压缩表大小
+        quicklistTreeUpdateCount(quicklist, new_node);
+        quicklistNodeUpdateSz(quicklist, new_node);///更新new_node的压缩表大小
         quicklistRecompressOnly(quicklist, new_node);///对new_node进行重压缩
     } 
     ///上面集中情况是比较好的，下面这种情况就比较糟糕，我们必须要创建新的节点才行。
@@ -936,9 +2321,9 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
       
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode(); ///创建一个新的节点
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);  ///将entry插入到new_node的头部
+        new_node->zl = packlistPush(packlistNew(), value, sz, PACKLIST_HEAD);  ///将entry插入到new_node的头部
         new_node->count++; ///更新new_node的压缩表节点计数器
-        quicklistNodeUpdateSz(new_node); ///更新new_node的压缩表大小
+        quicklistNodeUpdateSz(quicklist, new_node); ///更新new_node的压缩表大小
         __quicklistInsertNode(quicklist, node, new_node, after); ///将new_node插入当前node的后面
     } 
     ///如果当前node满来，且将entry插入在中间的位置，需要将node分割
@@ -946,11 +2331,12 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
       
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node); ///对node进行解压操作
-        new_node = _quicklistSplitNode(node, entry->offset, after); ///将node进行切割操作=
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL); ///将entry加入到new_node中去
+        new_node = _quicklistSplitNode(quicklist, node, entry->offset, after); ///将node进行切割操作=
+        quicklistTreeUpdateCount(quicklist, node);
+        new_node->zl = packlistPush(new_node->zl, value, sz,
+                                   after ? PACKLIST_HEAD : PACKLIST_TAIL); ///将entry加入到new_node中去
         new_node->count++; ///更新new_node的压缩表节点计数
-        quicklistNodeUpdateSz(new_node); ///更新new_node压缩表大小
+        quicklistNodeUpdateSz(quicklist, new_node); ///更新new_node压缩表大小
         __quicklistInsertNode(quicklist, node, new_node, after); ///在node后面插入new_node
         _quicklistMergeNodes(quicklist, node); ///node进行左右合并
     }
@@ -1009,7 +2395,7 @@ int quicklistDelRange(quicklist *quicklist, const long start, const long count)
            
             delete_entire_node = 1; ///删除节点数量置为1
             del = node->count; ///更新已删除压缩表节点的数量
-        } else if (entry.offset >= 0 && extent >= node->count) { ///如果entry的offset大于0并且当前要删除的压缩表节点数大约node的压缩表的节点数量的
+        } else if (entry.offset >= 0 && extent + entry.offset >= node->count) { ///如果entry的offset不小于0，并且要删除的范围超出了当前节点的末尾，这个节点只删除offset之后的所有值
             
             del = node->count - entry.offset;   /// 更新已删除压缩表节点的数量
         } else if (entry.offset < 0) { ///如果entry的offset小于0.则从尾节点向前删除offset个节点
@@ -1037,9 +2423,10 @@ int quicklistDelRange(quicklist *quicklist, const long start, const long count)
             __quicklistDelNode(quicklist, node);  ///进行快表节点删除
         } else {///如果不用删除快表节点
             quicklistDecompressNodeForUse(node); ///解压节点
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del); ///删除节点中一定范围的压缩表节点
-            quicklistNodeUpdateSz(node); ///更新node的压缩表大小
+            node->zl = packlistDeleteRange(node->zl, entry.offset, del); ///删除节点中一定范围的压缩表节点
+            quicklistNodeUpdateSz(quicklist, node); ///更新node的压缩表大小
             node->count -= del; ///更新快表节点node的压缩表节点计数
+            quicklistTreeUpdateCount(quicklist, node);
             quicklist->count -= del; ///更新快表的压缩表节点计数
             quicklistDeleteIfEmpty(quicklist, node); ///如果压缩表为空，就需要删除这个节点
             if (node) ///如果node不会空
@@ -1052,10 +2439,147 @@ int quicklistDelRange(quicklist *quicklist, const long start, const long count)
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
-///比较两个压缩表，将ziplist中的ziplistCompare()函数封装成quicklistCompare函数
+/* 设置了长度上限的快表（capped list）在插入之后调用，where是插入的一端。从另一端删除多余的值，返回删除的值的数量。
+ * 上限是近似的：通常只删除整个节点，节点中有多少个值已经记录在node->count中，被删除的节点不需要解压，
+ * 也不需要修改packlist，边界上的节点不会被解压再重新压缩。所以和XADD的MAXLEN ~一样，删除之后快表中的值不少于cap个，
+ * 最多比cap多出另一端的节点中的值的数量减一。cap比一个节点还小时这样会超出很多，所以另一端的节点中的值比cap还多时，
+ * 在这个节点中精确地删除到cap个值。快表中的值因此总是少于2*cap个。
+ * 删除的总是最旧的值，剩下的正好是最新的quicklist->count个值，调用方按这个数量传播一个精确的LTRIM，
+ * 副本和AOF不需要知道节点是怎么划分的，见t_list.c中的listTypeCapTrim()。 */
+unsigned long quicklistCapTrim(quicklist *quicklist, int where) {
+    unsigned long cap = quicklistGetCap(quicklist), removed = 0, excess;
+    quicklistNode *node;
+
+    if (!cap || quicklist->count <= cap) return 0;
+    while (1) {
+        node = where == QUICKLIST_HEAD ? quicklist->tail : quicklist->head;
+        if (quicklist->count - node->count < cap) break;
+        removed += node->count;
+        __quicklistDelNode(quicklist, node);
+    }
+    excess = quicklist->count - cap;
+    if (excess && node->count > cap) {
+        if (where == QUICKLIST_HEAD)
+            quicklistDelRange(quicklist, -(long)excess, excess);
+        else
+            quicklistDelRange(quicklist, 0, excess);
+        removed += excess;
+    }
+    return removed;
+}
+
+/* Passthrough to packlistCompare() */
+///比较两个压缩表节点，将packlist中的packlistCompare()函数封装成quicklistCompare函数
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return packlistCompare(p1, p2, p2_len);
+}
+
+/* 在快表中查找和value相等的值，供LPOS使用。direction为AL_START_HEAD时从头部开始，AL_START_TAIL时从尾部开始，
+ * 最多扫描maxlen个值（0表示不限制），跳过前rank-1个相等的值之后最多再找count个（0表示全部）。
+ * 找到的值的下标（从头部开始计算，和LINDEX相同）按查找的顺序保存在*indexes中，由调用方zfree()，返回找到的个数。
+ * 每个节点只解压一次，用packlistFindAll()一次找出节点中所有相等的值，不需要逐个解码比较。 */
+unsigned long quicklistFindIndexes(quicklist *quicklist, unsigned char *value,
+                                   size_t sz, int direction, unsigned long rank,
+                                   unsigned long count, unsigned long maxlen,
+                                   long **indexes) {
+    int forward = direction == AL_START_HEAD;
+    quicklistNode *node = forward ? quicklist->head : quicklist->tail;
+    unsigned long scanned = 0, matches = 0, found = 0, cap = 0;
+    unsigned int *offsets = NULL, offcap = 0;
+    long *res = NULL;
+
+    if (rank == 0) rank = 1;
+    while (node && (maxlen == 0 || scanned < maxlen)) {
+        unsigned int limit = node->count, max = node->count, n, i;
+        long base; ///节点第一个值的下标
+
+        ///这个节点中最多只能扫描limit个值
+        if (maxlen && maxlen - scanned < limit) limit = maxlen - scanned;
+        ///从头部查找时不需要找出节点中所有相等的值
+        if (forward && count && rank - 1 + count - matches < max)
+            max = rank - 1 + count - matches;
+        if (offcap < node->count) {
+            offcap = node->count;
+            offsets = zrealloc(offsets, sizeof(*offsets) * offcap);
+        }
+
+        quicklistDecompressNodeForUse(node);
+        n = packlistFindAll(node->zl, value, sz, NULL, offsets, max);
+        quicklistRecompressOnly(quicklist, node);
+
+        base = forward ? (long)scanned
+                       : (long)(quicklist->count - scanned - node->count);
+        for (i = 0; i < n; i++) {
+            ///从尾部查找时倒序使用节点中找到的值
+            unsigned int offset = forward ? offsets[i] : offsets[n - 1 - i];
+            if ((forward ? offset : node->count - 1 - offset) >= limit) break;
+            if (++matches < rank) continue;
+            if (found == cap) {
+                cap = cap ? cap * 2 : 1;
+                res = zrealloc(res, sizeof(*res) * cap);
+            }
+            res[found++] = base + offset;
+            if (count && found == count) break;
+        }
+        if (count && found == count) break;
+
+        scanned += limit;
+        node = forward ? node->next : node->prev;
+    }
+    zfree(offsets);
+    *indexes = res;
+    return found;
+}
+
+/* 删除快表中和value相等的值，供LREM使用。count大于0时从头部开始删除count个，小于0时从尾部开始删除-count个，
+ * 等于0时全部删除。返回删除的个数。每个节点用packlistFindAll()找出要删除的值，再用packlistDeleteMany()一次删除，
+ * 节点中的值全部被删除时删除整个节点。 */
+unsigned long quicklistDelValue(quicklist *quicklist, unsigned char *value,
+                                size_t sz, long count) {
+    int forward = count >= 0;
+    unsigned long toremove = count < 0 ? -(unsigned long)count : (unsigned long)count;
+    unsigned long removed = 0;
+    quicklistNode *node = forward ? quicklist->head : quicklist->tail;
+    unsigned char **ps = NULL;
+    unsigned int pscap = 0;
+
+    while (node) {
+        quicklistNode *next = forward ? node->next : node->prev;
+        unsigned int max = node->count, first = 0, n;
+
+        if (forward && toremove && toremove - removed < max)
+            max = toremove - removed;
+        if (pscap < node->count) {
+            pscap = node->count;
+            ps = zrealloc(ps, sizeof(*ps) * pscap);
+        }
+
+        quicklistDecompressNodeForUse(node);
+        n = packlistFindAll(node->zl, value, sz, ps, NULL, max);
+        ///从尾部删除时只删除节点中最后的几个
+        if (!forward && toremove && n > toremove - removed) {
+            first = n - (toremove - removed);
+            n = toremove - removed;
+        }
+
+        if (n && n == node->count) {
+            __quicklistDelNode(quicklist, node);
+        } else {
+            if (n) {
+                node->zl = packlistDeleteMany(node->zl, ps + first, n);
+                quicklistNodeUpdateSz(quicklist, node);
+                node->count -= n;
+                quicklistTreeUpdateCount(quicklist, node);
+                quicklist->count -= n;
+            }
+            quicklistRecompressOnly(quicklist, node);
+        }
+        removed += n;
+        if (toremove && removed == toremove) break;
+        node = next;
+    }
+    zfree(ps);
+    return removed;
 }
 ///返回快表迭代器“iter”。 初始化后，每次对quicklistNext()的调用都将返回快表的下一个元素。
 quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction) {
@@ -1142,14 +2666,14 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (!iter->zi) { ///如果迭代器的ziplist为空
         
         quicklistDecompressNodeForUse(iter->current); ///临时解压缩current节点
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset); ///j解压缩后就可以得到zl，以及偏移量
+        iter->zi = packlistIndex(iter->current->zl, iter->offset); ///j解压缩后就可以得到zl，以及偏移量
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         if (iter->direction == AL_START_HEAD) { ///如果遍历的方向是从头到尾的方式
-            nextFn = ziplistNext; ///nextFn就设置为ziplistNext
+            nextFn = packlistNext; ///nextFn就设置为packlistNext
             offset_update = 1; ///向后移动一个，记录偏移量
         } else if (iter->direction == AL_START_TAIL) { ///如果是从尾向头的方式遍历
-            nextFn = ziplistPrev; ///next就设置为ziplistPrev
+            nextFn = packlistPrev; ///next就设置为packlistPrev
             offset_update = -1; ///向前移动一步，并记录下来
         }
         iter->zi = nextFn(iter->current->zl, iter->zi); ///更新zi指向的ziplist中的节点
@@ -1163,7 +2687,7 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (iter->zi) { ///如果迭代器指向的ziplist不为空
         
         /// 将entry的节点信息读入到快表节点中
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        packlistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
         return 1;
     } else { ///如果迭代器指向的节点为空
         quicklistCompress(iter->quicklist, iter->current); ///按照需要对节点进行压缩 
@@ -1192,12 +2716,14 @@ quicklist *quicklistDup(quicklist *orig) {
     
     quicklist *copy; ///声明拷贝副本的指针
     copy = quicklistNew(orig->fill, orig->compress); ///创建一个新的快表
+    copy->codec = orig->codec;
+    quicklistSetCap(copy, quicklistGetCap(orig));
 
     ///遍历整个全表进行拷贝操作
     for (quicklistNode *current = orig->head; current; current = current->next) {
        
         quicklistNode *node = quicklistCreateNode(); ///创建一个新的快表节点
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) { ///如果是采用了LZF算法进行压缩
+        if (quicklistNodeIsCompressed(current)) { ///如果节点被压缩过，压缩后的数据都保存在quicklistLZF中
             quicklistLZF *lzf = (quicklistLZF *)current->zl; ///拷贝quicklistLZF
             size_t lzf_sz = sizeof(*lzf) + lzf->sz; ///获取它的大小
             node->zl = zmalloc(lzf_sz); ///申请内存空间
@@ -1244,6 +2770,13 @@ int quicklistIndex(const quicklist *quicklist, const long long idx, quicklistEnt
     if (index >= quicklist->count) ///如果index已经超过了快表汇总的压缩表节点数量，直接返回0
         return 0;
 
+    if (quicklistTree(quicklist)) {
+        ///有计数树时直接按正向下标查找，再换算成和遍历链表相同的accum，下面的offset计算保持不变
+        unsigned long long off;
+        n = quicklistTreeLookup(quicklist, forward ? index : quicklist->count - 1 - index, &off);
+        accum = forward ? index - off : index - (n->count - 1 - off);
+    }
+
     while (likely(n)) { ///遍历节点
         if ((accum + n->count) > index) { ///找到index在当前的节点中，跳出循环
             break;
@@ -1268,8 +2801,8 @@ int quicklistIndex(const quicklist *quicklist, const long long idx, quicklistEnt
     }
 
     quicklistDecompressNodeForUse(entry->node);///对节点进行临时解压缩
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset); ///设置entry的offset
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval); ///将entry的信息都读取出来，放入快表节点中
+    entry->zi = quicklistNodeIndex(entry->quicklist, entry->node, entry->offset); ///设置entry的offset
+    packlistGet(entry->zi, &entry->value, &entry->sz, &entry->longval); ///将entry的信息都读取出来，放入快表节点中
     return 1;
 }
 
@@ -1278,25 +2811,32 @@ void quicklistRotate(quicklist *quicklist) {
     if (quicklist->count <= 1) ///如果快表中只有一个entry，就直接返回
         return;
     
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1); ///获取entry的尾节点
+    unsigned char *p = packlistIndex(quicklist->tail->zl, -1); ///获取entry的尾节点
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval); ///获取p所指位置的ziplist的值
+    unsigned char *copy = NULL;
+    packlistGet(p, &value, &sz, &longval); ///获取p所指位置的ziplist的值
 
     if (!value) {///如果value的字符串为空，表示这个压缩表节点数据为long long类型
         sz = ll2string(longstr, sizeof(longstr), longval); ///将long long类型的整数转化为z字符串
         value = (unsigned char *)longstr; ///并这个字符串赋值给value
+    } else if (quicklist->len == 1) {
+        ///只有一个节点时value指向的就是要插入的packlist，插入时重新分配内存会让它失效，先复制一份
+        copy = zmalloc(sz);
+        memcpy(copy, value, sz);
+        value = copy;
     }
     ///将entry节点的信息保存到快表的头部
     quicklistPushHead(quicklist, value, sz);
+    zfree(copy);
 
     /* If quicklist has only one node, the head ziplist is also the
      * tail ziplist and PushHead() could have reallocated our single ziplist,
      * which would make our pre-existing 'p' unusable. */
     if (quicklist->len == 1) { ///如果快表只有一个节点
-        p = ziplistIndex(quicklist->tail->zl, -1); ///返回entry节点的指针
+        p = packlistIndex(quicklist->tail->zl, -1); ///返回entry节点的指针
     }
     /* Remove tail entry. */
     quicklistDelIndex(quicklist, quicklist->tail, &p); ///移除p指向的entry
@@ -1341,8 +2881,8 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    p = ziplistIndex(node->zl, pos); ///获取压缩表中的pos位置出的元素地址
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) { ///获取p所指的位置的值
+    p = packlistIndex(node->zl, pos); ///获取压缩表中的pos位置出的元素地址
+    if (packlistGet(p, &vstr, &vlen, &vlong)) { ///获取p所指的位置的值
         if (vstr) { ///如果字符串不为空，数据类型为long long类型整数
             if (data) ///如果data为空
                 *data = saver(vstr, vlen);///调用特定的函数将字符串值保存到*data
@@ -1490,8 +3030,11 @@ void quicklistBookmarksClear(quicklist *ql) {
 /* The rest of this file is test cases and test helpers. */
 #ifdef REDIS_TEST
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
+#include <unistd.h>
 
+#undef assert
 #define assert(_e)                                                             \
     do {                                                                       \
         if (!(_e)) {                                                           \
@@ -1529,9 +3072,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", packlistLen(ql->head->zl));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", packlistLen(ql->tail->zl));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1552,6 +3095,12 @@ static long long ustime(void) {
 /* Return the UNIX time in milliseconds */
 static long long mstime(void) { return ustime() / 1000; }
 
+/* Release a quicklist from another thread, like lazyfree does. */
+static void *releaseThread(void *ql) {
+    quicklistRelease(ql);
+    return NULL;
+}
+
 /* Iterate over an entire quicklist.
  * Print the list if 'print' == 1.
  *
@@ -1592,10 +3141,59 @@ static int itrprintr_rev(quicklist *ql, int print) {
     } while (0)
 
 /* Verify list metadata matches physical list contents. */
+/* 检查计数树的子树tn：叶子中的节点按顺序和链表一致，父指针正确，每个计数等于子树中的元素个数。
+ * *next是链表中下一个应该出现的节点，返回子树中的元素个数，出错时增加*errors。 */
+static unsigned long _ql_verify_tree(const quicklist *ql, quicklistTreeNode *tn,
+                                     quicklistNode **next, int *errors) {
+    unsigned long total = 0;
+
+    if (tn->n == 0 || tn->n > QUICKLIST_TREE_FANOUT) {
+        yell("tree node %p has %u children", (void *)tn, tn->n);
+        (*errors)++;
+        return 0;
+    }
+    for (unsigned int j = 0; j < tn->n; j++) {
+        unsigned long count;
+        if (tn->leaf) {
+            quicklistNode *node = tn->child[j];
+            if (node != *next || !node->ext || _quicklistExtFind(ql, node)->leaf != tn) {
+                yell("tree leaf %p slot %u holds %p, expected %p", (void *)tn, j,
+                     (void *)node, (void *)*next);
+                (*errors)++;
+                return total;
+            }
+            count = node->count;
+            *next = node->next;
+        } else {
+            quicklistTreeNode *child = tn->child[j];
+            if (child->parent != tn) {
+                yell("tree node %p has wrong parent", (void *)child);
+                (*errors)++;
+            }
+            count = _ql_verify_tree(ql, child, next, errors);
+        }
+        if (count != tn->counts[j]) {
+            yell("tree node %p slot %u counts %lu, expected %lu", (void *)tn, j,
+                 tn->counts[j], count);
+            (*errors)++;
+        }
+        total += count;
+    }
+    return total;
+}
+
 static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                       uint32_t head_count, uint32_t tail_count) {
     int errors = 0;
 
+    if (quicklistTree(ql)) {
+        quicklistNode *next = ql->head;
+        if (_ql_verify_tree(ql, ql->ext->tree, &next, &errors) != ql->count || next) {
+            yell("%s", "tree does not cover the whole list");
+            errors++;
+        }
+    }
+
     ql_info(ql);
     if (len != ql->len) {
         yell("quicklist length wrong: expected %d, got %u", len, ql->len);
@@ -1629,18 +3227,18 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != packlistLen(ql->head->zl)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, packlistLen(ql->head->zl));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != packlistLen(ql->tail->zl)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, packlistLen(ql->tail->zl));
         errors++;
     }
 
@@ -1660,7 +3258,7 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
+                if (!quicklistNodeIsCompressed(node) &&
                     !node->attempted_compress) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
@@ -1700,6 +3298,37 @@ int quicklistTest(int argc, char *argv[]) {
     size_t option_count = sizeof(options) / sizeof(*options);
     long long runtime[option_count];
 
+#if UINTPTR_MAX == 0xffffffffffffffff
+    TEST("node is 32 bytes, quicklist 48") {
+        if (sizeof(quicklistNode) != 32)
+            ERR("quicklistNode is %zu bytes", sizeof(quicklistNode));
+        if (sizeof(quicklist) != 48)
+            ERR("quicklist is %zu bytes", sizeof(quicklist));
+    }
+#endif
+
+    TEST("merge boundary subtracts the header of the node format") {
+        /* Two nodes merge at fill -1 while the merged size stays within
+         * 4096 bytes. One header/trailer is dropped: 11 bytes for ziplist
+         * nodes (the default format), 7 for packlist nodes. */
+        int was_enabled = packlist_enabled;
+        for (int enabled = 0; enabled <= 1; enabled++) {
+            unsigned int header = enabled ? 7 : 11;
+            quicklistNode a = {0}, b = {0};
+
+            packlistSetEnabled(enabled);
+            a.count = b.count = 100;
+            a.sz = 2048;
+            b.sz = 4096 - a.sz + header;
+            if (!_quicklistNodeAllowMerge(&a, &b, -1))
+                ERR("%u + %u bytes should merge with packlist %d", a.sz, b.sz, enabled);
+            b.sz++;
+            if (_quicklistNodeAllowMerge(&a, &b, -1))
+                ERR("%u + %u bytes should not merge with packlist %d", a.sz, b.sz, enabled);
+        }
+        packlistSetEnabled(was_enabled);
+    }
+
     for (int _i = 0; _i < (int)option_count; _i++) {
         printf("Testing Option %d\n", options[_i]);
         long long start = mstime();
@@ -1782,6 +3411,58 @@ int quicklistTest(int argc, char *argv[]) {
             }
         }
 
+        for (int f = optimize_start; f < 64; f++) {
+            TEST_DESC("push many matches push one by one at fill %d at compress %d",
+                      f, options[_i]) {
+                static char bufs[500][300];
+                unsigned char *values[500];
+                unsigned int sizes[500];
+                int wheres[2] = {QUICKLIST_HEAD, QUICKLIST_TAIL};
+
+                for (int i = 0; i < 500; i++) {
+                    if (i % 3 == 0) {
+                        sizes[i] = snprintf(bufs[i], sizeof(bufs[i]), "%d", i * 7919);
+                    } else {
+                        sizes[i] = (i * 37) % 290 + 1;
+                        memset(bufs[i], 'a' + i % 26, sizes[i]);
+                    }
+                    values[i] = (unsigned char *)bufs[i];
+                }
+                for (int w = 0; w < 2; w++) {
+                    quicklist *a = quicklistNew(f, options[_i]);
+                    quicklist *b = quicklistNew(f, options[_i]);
+                    /* Push in uneven batches so batches start both on a
+                     * partially filled node and on a fresh one. */
+                    for (int i = 0, n; i < 500; i += n) {
+                        n = 1 + (i * 13) % 97;
+                        if (i + n > 500)
+                            n = 500 - i;
+                        for (int j = i; j < i + n; j++)
+                            quicklistPush(a, values[j], sizes[j], wheres[w]);
+                        quicklistPushMany(b, values + i, sizes + i, n, wheres[w]);
+                    }
+                    if (a->count != b->count || a->len != b->len)
+                        ERR("count/len mismatch: %lu/%lu vs %lu/%lu", a->count,
+                            a->len, b->count, b->len);
+                    quicklistNode *na = a->head, *nb = b->head;
+                    while (na && nb) {
+                        quicklistDecompressNodeForUse(na);
+                        quicklistDecompressNodeForUse(nb);
+                        if (na->count != nb->count || na->sz != nb->sz ||
+                            memcmp(na->zl, nb->zl, na->sz) != 0)
+                            ERR("node mismatch at fill %d", f);
+                        quicklistRecompressOnly(a, na);
+                        quicklistRecompressOnly(b, nb);
+                        na = na->next;
+                        nb = nb->next;
+                    }
+                    ql_verify(b, a->len, 500, a->head->count, a->tail->count);
+                    quicklistRelease(a);
+                    quicklistRelease(b);
+                }
+            }
+        }
+
         TEST("rotate empty") {
             quicklist *ql = quicklistNew(-2, options[_i]);
             quicklistRotate(ql);
@@ -2194,6 +3875,50 @@ int quicklistTest(int argc, char *argv[]) {
             }
         }
 
+        TEST_DESC("index through sparse offsets at compress %d", options[_i]) {
+            quicklist *ql = quicklistNew(-2, options[_i]);
+            char buf[32];
+            for (int i = 0; i < 5000; i++)
+                quicklistPushTail(ql, genstr("hello", i), 32);
+            quicklistEntry entry;
+            for (int round = 0; round < 3; round++) {
+                for (int i = 0; i < 5000; i += 7) {
+                    long long idx = (i % 2) ? i : i - 5000;
+                    snprintf(buf, sizeof(buf), "hello%d", i);
+                    quicklistIndex(ql, idx, &entry);
+                    if (entry.sz != 32 || strcmp((char *)entry.value, buf))
+                        ERR("Index %lld got %.*s instead of %s", idx, entry.sz,
+                            entry.value, buf);
+                }
+                /* Same-size replacements keep the offsets, others drop
+                 * them; both must still index correctly. */
+                quicklistReplaceAtIndex(ql, 100 + round, genstr("hello", 100 + round), 32);
+                quicklistReplaceAtIndex(ql, 3000 + round, genstr("hello", 3000 + round), 32);
+            }
+            quicklistIndex(ql, 4999, &entry);
+            if (!_quicklistNodeOffsets(ql, entry.node) &&
+                entry.node->count >= QUICKLIST_OFFSETS_MIN_COUNT)
+                ERR("Offsets not built on node with %u entries", entry.node->count);
+            if (!ql->ext || quicklistExtSize(ql) <= ql->ext->offsets_bytes)
+                ERROR;
+            quicklistReplaceAtIndex(ql, 4999, "x", 1);
+            if (_quicklistNodeOffsets(ql, ql->tail) || ql->tail->ext)
+                ERROR;
+            quicklistIndex(ql, 4999, &entry);
+            if (entry.sz != 1 || entry.value[0] != 'x')
+                ERROR;
+            /* Deleted nodes leave the side table, every entry belongs to
+             * a live node. */
+            quicklistDelRange(ql, 0, 4000);
+            unsigned long with_ext = 0;
+            for (quicklistNode *n = ql->head; n; n = n->next)
+                if (n->ext) with_ext++;
+            if (ql->ext->used != with_ext)
+                ERR("Side table has %lu entries, %lu nodes point to it",
+                    ql->ext->used, with_ext);
+            quicklistRelease(ql);
+        }
+
         TEST("delete range empty list") {
             quicklist *ql = quicklistNew(-2, options[_i]);
             quicklistDelRange(ql, 5, 20);
@@ -2695,7 +4420,7 @@ int quicklistTest(int argc, char *argv[]) {
                                     node->sz);
                             }
                         } else {
-                            if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                            if (!quicklistNodeIsCompressed(node)) {
                                 ERR("Incorrect non-compression: node %d is NOT "
                                     "compressed at depth %d ((%u, %u); total "
                                     "nodes: %u; size: %u; attempted: %d)",
@@ -2766,6 +4491,716 @@ int quicklistTest(int argc, char *argv[]) {
         quicklistRelease(ql);
     }
 
+    TEST("mixed codecs in one list") {
+        quicklist *ql = quicklistNew(-2, 1);
+        char buf[128];
+        int n = 0;
+        for (int codec = 0; codec < QUICKLIST_CODECS; codec++) {
+            if (!quicklistSetCodec(ql, codec))
+                continue;
+            for (int i = 0; i < 2000; i++, n++) {
+                int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", n, n % 97);
+                quicklistPushTail(ql, buf, len);
+            }
+        }
+        /* Interior nodes keep the codec they were compressed with. */
+        int used[QUICKLIST_CODECS] = {0};
+        for (quicklistNode *node = ql->head; node; node = node->next) {
+            if (quicklistNodeIsCompressed(node))
+                used[node->encoding - QUICKLIST_NODE_ENCODING_LZF]++;
+        }
+        for (int codec = 0; codec < QUICKLIST_CODECS; codec++) {
+            if (quicklistCodecAvailable(codec) && !used[codec])
+                ERR("No node compressed with %s", quicklistCodecName(codec));
+        }
+        quicklistIter *iter = quicklistGetIterator(ql, AL_START_HEAD);
+        quicklistEntry entry;
+        int i = 0;
+        while (quicklistNext(iter, &entry)) {
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+            if (entry.sz != (unsigned int)len || memcmp(entry.value, buf, len))
+                ERR("Entry %d: %.*s instead of %s", i, entry.sz, entry.value, buf);
+            i++;
+        }
+        quicklistReleaseIterator(iter);
+        if (i != n)
+            ERR("Iterated %d entries instead of %d", i, n);
+        if (quicklistCodecFromName("LZF") != QUICKLIST_CODEC_LZF ||
+            quicklistCodecFromName("none") != -1)
+            ERROR;
+        /* RDB and DEBUG read every compressed node as an LZF blob. */
+        for (quicklistNode *node = ql->head; node; node = node->next) {
+            if (!quicklistNodeIsCompressed(node))
+                continue;
+            void *data, *alloc = NULL;
+            int encoding = node->encoding;
+            unsigned char *zl = node->zl;
+            size_t sz;
+            if (encoding == QUICKLIST_NODE_ENCODING_LZF)
+                sz = quicklistGetLzf(node, &data);
+            else {
+                sz = quicklistGetLzfCopy(node, &data);
+                alloc = data;
+            }
+            unsigned char *out = zmalloc(node->sz);
+            if (sz == 0 || lzf_decompress(data, sz, out, node->sz) != node->sz)
+                ERR("Node of %u bytes is not a valid LZF blob", node->sz);
+            /* The node keeps its own codec and buffer. */
+            if (node->encoding != encoding || node->zl != zl ||
+                (alloc != NULL) != (encoding != QUICKLIST_NODE_ENCODING_LZF))
+                ERR("Node of %u bytes was changed by the LZF export", node->sz);
+            zfree(out);
+            zfree(alloc);
+        }
+        iter = quicklistGetIterator(ql, AL_START_HEAD);
+        i = 0;
+        while (quicklistNext(iter, &entry)) {
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+            if (entry.sz != (unsigned int)len || memcmp(entry.value, buf, len))
+                ERR("Entry %d after LZF export: %.*s instead of %s", i, entry.sz, entry.value, buf);
+            i++;
+        }
+        quicklistReleaseIterator(iter);
+        quicklistRelease(ql);
+    }
+
+    TEST("async compression of interior nodes") {
+        char buf[128];
+        quicklistSetAsyncCompression(1);
+        quicklist *ql = quicklistNew(-2, 1);
+        for (int i = 0; i < 20000; i++) {
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+            quicklistPushTail(ql, buf, len);
+        }
+        /* Pending nodes are still plain packlists and readable. */
+        quicklistIter *iter = quicklistGetIterator(ql, AL_START_HEAD);
+        quicklistEntry entry;
+        int i = 0;
+        while (quicklistNext(iter, &entry)) {
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+            if (entry.sz != (unsigned int)len || memcmp(entry.value, buf, len))
+                ERR("Pending entry %d: %.*s instead of %s", i, entry.sz, entry.value, buf);
+            i++;
+        }
+        quicklistReleaseIterator(iter);
+
+        /* Modify some pending nodes before their results are applied. */
+        quicklistReplaceAtIndex(ql, 5000, "replaced", 8);
+        quicklistDelRange(ql, 10000, 500);
+        quicklistAsyncCompressWait();
+        quicklistAsyncCompressApply();
+        for (quicklistNode *node = ql->head; node; node = node->next) {
+            quicklistRecompressOnly(ql, node);
+        }
+        quicklistAsyncCompressWait();
+        quicklistAsyncCompressApply();
+        if (quicklistAsyncCompressPending())
+            ERR("%lu jobs still pending", quicklistAsyncCompressPending());
+
+        unsigned long compressed = 0;
+        for (quicklistNode *node = ql->head; node; node = node->next) {
+            if (node->compress_pending)
+                ERR("Node %p still pending", (void *)node);
+            if (quicklistNodeIsCompressed(node))
+                compressed++;
+        }
+        if (compressed != ql->len - 2)
+            ERR("%lu of %lu nodes compressed", compressed, ql->len);
+        if (ql->count != 19500)
+            ERR("Count is %lu instead of 19500", ql->count);
+        iter = quicklistGetIterator(ql, AL_START_HEAD);
+        i = 0;
+        while (quicklistNext(iter, &entry)) {
+            int n = i < 10000 ? i : i + 500;
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", n, n % 97);
+            if (n == 5000) {
+                len = 8;
+                memcpy(buf, "replaced", 8);
+            }
+            if (entry.sz != (unsigned int)len || memcmp(entry.value, buf, len))
+                ERR("Entry %d: %.*s instead of %.*s", i, entry.sz, entry.value, len, buf);
+            i++;
+        }
+        quicklistReleaseIterator(iter);
+        if (i != 19500)
+            ERR("Iterated %d entries instead of 19500", i);
+        quicklistRelease(ql);
+
+        /* Releasing a list cancels its pending jobs. */
+        ql = quicklistNew(-2, 1);
+        for (i = 0; i < 20000; i++) {
+            int len = snprintf(buf, sizeof(buf), "entry %d", i);
+            quicklistPushHead(ql, buf, len);
+        }
+        quicklistRelease(ql);
+        quicklistAsyncCompressWait();
+        quicklistAsyncCompressApply();
+        if (quicklistAsyncCompressPending())
+            ERR("%lu jobs left after release", quicklistAsyncCompressPending());
+
+        /* Lists released in another thread while the main thread keeps
+         * applying finished results. */
+        for (int round = 0; round < 20; round++) {
+            pthread_t tid;
+
+            ql = quicklistNew(-2, 1);
+            for (i = 0; i < 5000; i++) {
+                int len = snprintf(buf, sizeof(buf), "entry %d", i);
+                quicklistPushHead(ql, buf, len);
+            }
+            pthread_create(&tid, NULL, releaseThread, ql);
+            for (int k = 0; k < 100; k++) quicklistAsyncCompressApply();
+            pthread_join(tid, NULL);
+        }
+        quicklistAsyncCompressWait();
+        quicklistAsyncCompressApply();
+        if (quicklistAsyncCompressPending())
+            ERR("%lu jobs left after threaded release", quicklistAsyncCompressPending());
+        quicklistSetAsyncCompression(0);
+        /* With async compression off and no jobs left the worker exits. */
+        for (i = 0; i < 1000 && __atomic_load_n(&async_thread_started, __ATOMIC_RELAXED); i++)
+            usleep(1000);
+        if (__atomic_load_n(&async_thread_started, __ATOMIC_RELAXED))
+            ERR("%s", "compression thread still running after disabling async compression");
+    }
+
+    printf("Benchmark LPUSH with sync vs async node compression:\n");
+    {
+        char buf[256];
+        int iter = 200000;
+        for (int async = 0; async <= 1; async++) {
+            quicklistSetAsyncCompression(async);
+            quicklist *ql = quicklistNew(-2, 1);
+            long long start = ustime();
+            for (int i = 0; i < iter; i++) {
+                int len = snprintf(buf, sizeof(buf),
+                    "2026-10-16T12:%02d:%02d.%03dZ INFO worker-%d request id=%d "
+                    "path=/api/v1/items/%d status=%d latency_ms=%d",
+                    i / 60000 % 60, i / 1000 % 60, i % 1000, i % 8, i,
+                    i % 5000, i % 50 ? 200 : 404, i % 300);
+                quicklistPushHead(ql, buf, len);
+                /* The server applies finished jobs once per event loop iteration. */
+                if (i % 100 == 0) quicklistAsyncCompressApply();
+            }
+            long long push_us = ustime() - start;
+            quicklistAsyncCompressWait();
+            quicklistAsyncCompressApply();
+            size_t stored = 0;
+            for (quicklistNode *node = ql->head; node; node = node->next) {
+                stored += quicklistNodeIsCompressed(node) ?
+                    sizeof(quicklistLZF) + ((quicklistLZF *)node->zl)->sz : node->sz;
+            }
+            printf("%-5s LPUSH %lld usec, %zu bytes stored\n",
+                   async ? "async" : "sync", push_us, stored);
+            quicklistRelease(ql);
+        }
+        quicklistSetAsyncCompression(0);
+        printf("\n");
+    }
+
+    TEST("decompression cache") {
+        char buf[128];
+        quicklistCacheStats stats, before;
+        quicklistGetDecompressCacheStats(&before);
+        quicklistSetDecompressCacheSize(1024 * 1024);
+        quicklist *ql = quicklistNew(-2, 1);
+        for (int i = 0; i < 50000; i++) {
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+            quicklistPushTail(ql, buf, len);
+        }
+        /* Page through the same range three times: the first pass misses,
+         * the others hit and leave the nodes compressed again. */
+        for (int round = 0; round < 3; round++) {
+            quicklistIter *iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, 20000);
+            quicklistEntry entry;
+            for (int i = 20000; i < 22000 && quicklistNext(iter, &entry); i++) {
+                int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+                if (entry.sz != (unsigned int)len || memcmp(entry.value, buf, len))
+                    ERR("Entry %d: %.*s instead of %s", i, entry.sz, entry.value, buf);
+            }
+            quicklistReleaseIterator(iter);
+        }
+        quicklistGetDecompressCacheStats(&stats);
+        stats.hits -= before.hits;
+        stats.misses -= before.misses;
+        if (stats.misses == 0 || stats.hits < 2 * stats.misses)
+            ERR("Expected hits on later passes: %llu hits, %llu misses",
+                stats.hits, stats.misses);
+        if (stats.entries != before.entries + stats.misses || stats.bytes > stats.limit)
+            ERR("%lu entries using %zu bytes", stats.entries, stats.bytes);
+        unsigned long compressed = 0;
+        for (quicklistNode *node = ql->head; node; node = node->next)
+            if (quicklistNodeIsCompressed(node)) compressed++;
+        if (compressed != ql->len - 2)
+            ERR("%lu of %lu nodes compressed", compressed, ql->len);
+
+        /* Modifying a cached node drops its entry. */
+        unsigned long entries = stats.entries;
+        quicklistReplaceAtIndex(ql, 21000, "replaced", 8);
+        quicklistGetDecompressCacheStats(&stats);
+        if (stats.entries != entries - 1)
+            ERR("%lu entries after modifying a cached node", stats.entries);
+        quicklistEntry entry;
+        quicklistIndex(ql, 21000, &entry);
+        if (entry.sz != 8 || memcmp(entry.value, "replaced", 8))
+            ERR("Replaced value is %.*s", entry.sz, entry.value);
+
+        /* Shrinking the cache evicts the least recently used entries. */
+        quicklistSetDecompressCacheSize(16 * 1024);
+        quicklistGetDecompressCacheStats(&stats);
+        if (stats.evictions == 0 || stats.bytes > 16 * 1024)
+            ERR("%llu evictions, %zu bytes", stats.evictions, stats.bytes);
+        quicklistRelease(ql);
+        quicklistGetDecompressCacheStats(&stats);
+        if (stats.entries || stats.bytes)
+            ERR("%lu entries using %zu bytes after release", stats.entries, stats.bytes);
+        quicklistSetDecompressCacheSize(0);
+    }
+
+    printf("Benchmark paging through the middle of a compressed list with and without the decompression cache:\n");
+    {
+        char buf[128];
+        quicklist *ql = quicklistNew(-2, 1);
+        for (int i = 0; i < 1000000; i++) {
+            int len = snprintf(buf, sizeof(buf), "GET /api/v1/items/%d 200 %dms", i, i % 97);
+            quicklistPushTail(ql, buf, len);
+        }
+        for (int cached = 0; cached <= 1; cached++) {
+            quicklistCacheStats stats;
+            quicklistSetDecompressCacheSize(cached ? 4 * 1024 * 1024 : 0);
+            long long start = ustime();
+            for (int round = 0; round < 2000; round++) {
+                /* LRANGE key 500000+100*(round%50) +100 */
+                quicklistIter *iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD,
+                                                                500000 + 100 * (round % 50));
+                quicklistEntry entry;
+                for (int i = 0; i < 100 && quicklistNext(iter, &entry); i++);
+                quicklistReleaseIterator(iter);
+            }
+            quicklistGetDecompressCacheStats(&stats);
+            printf("%-8s 2000 LRANGE of 100: %lld usec (%llu hits, %llu misses, %zu bytes)\n",
+                   cached ? "cache" : "no cache", ustime() - start,
+                   stats.hits, stats.misses, stats.bytes);
+        }
+        quicklistSetDecompressCacheSize(0);
+        quicklistRelease(ql);
+        printf("\n");
+    }
+
+    for (int compress = 0; compress <= 1; compress++) {
+        TEST_DESC("counted tree matches the list under random operations at compress %d",
+                  compress) {
+            long long *ref = zmalloc(sizeof(long long) * 20000);
+            long len = 0;
+            long long next = 0;
+            char buf[32];
+            quicklistSetTreeThreshold(8);
+            quicklist *ql = quicklistNew(4, compress);
+            srand(1234 + compress);
+            for (int op = 0; op < 40000 && !err; op++) {
+                /* Grow for a while, then shrink, so the tree is built and freed. */
+                int growing = (op / 5000) % 2 == 0;
+                int r = rand() % 8;
+                if (!growing && r < 4 && len) r = 4 + rand() % 2;
+                if (len >= 15000) r = 4;
+                if (r == 0 || r == 1 || len == 0) {
+                    int where = r == 0 ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+                    int sz = snprintf(buf, sizeof(buf), "%lld", next);
+                    quicklistPush(ql, buf, sz, where);
+                    if (where == QUICKLIST_HEAD) {
+                        memmove(ref + 1, ref, sizeof(*ref) * len);
+                        ref[0] = next;
+                    } else {
+                        ref[len] = next;
+                    }
+                    len++;
+                    next++;
+                } else if (r == 2) {
+                    long idx = rand() % len;
+                    int after = rand() % 2;
+                    quicklistEntry entry;
+                    int sz = snprintf(buf, sizeof(buf), "%lld", next);
+                    quicklistIndex(ql, idx, &entry);
+                    if (after)
+                        quicklistInsertAfter(ql, &entry, buf, sz);
+                    else
+                        quicklistInsertBefore(ql, &entry, buf, sz);
+                    idx += after;
+                    memmove(ref + idx + 1, ref + idx, sizeof(*ref) * (len - idx));
+                    ref[idx] = next;
+                    len++;
+                    next++;
+                } else if (r == 3) {
+                    unsigned char *vals[30];
+                    unsigned int sizes[30];
+                    char strs[30][32];
+                    int n = 1 + rand() % 30, where = rand() % 2;
+                    if (len + n > 20000) continue;
+                    for (int j = 0; j < n; j++) {
+                        sizes[j] = snprintf(strs[j], sizeof(strs[j]), "%lld", next + j);
+                        vals[j] = (unsigned char *)strs[j];
+                    }
+                    quicklistPushMany(ql, vals, sizes, n,
+                                      where ? QUICKLIST_HEAD : QUICKLIST_TAIL);
+                    if (where) {
+                        memmove(ref + n, ref, sizeof(*ref) * len);
+                        for (int j = 0; j < n; j++) ref[n - 1 - j] = next + j;
+                    } else {
+                        for (int j = 0; j < n; j++) ref[len + j] = next + j;
+                    }
+                    len += n;
+                    next += n;
+                } else if (r == 4) {
+                    long start = rand() % len, count = 1 + rand() % 40;
+                    if (count > len - start) count = len - start;
+                    quicklistDelRange(ql, rand() % 2 ? start : start - len, count);
+                    memmove(ref + start, ref + start + count,
+                            sizeof(*ref) * (len - start - count));
+                    len -= count;
+                } else if (r == 5) {
+                    int where = rand() % 2 ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+                    quicklistPop(ql, where, NULL, NULL, NULL);
+                    if (where == QUICKLIST_HEAD)
+                        memmove(ref, ref + 1, sizeof(*ref) * (len - 1));
+                    len--;
+                } else {
+                    long idx = rand() % len;
+                    int sz = snprintf(buf, sizeof(buf), "%lld", next);
+                    quicklistReplaceAtIndex(ql, rand() % 2 ? idx : idx - len, buf, sz);
+                    ref[idx] = next++;
+                }
+
+                if (op % 500 == 0 || (unsigned long)len != ql->count) {
+                    if (quicklistTree(ql)) {
+                        quicklistNode *nextnode = ql->head;
+                        int tree_errors = 0;
+                        if (_ql_verify_tree(ql, ql->ext->tree, &nextnode, &tree_errors) != ql->count ||
+                            nextnode || tree_errors)
+                            ERR("Tree mismatch after op %d", op);
+                    }
+                    unsigned long with_ext = 0;
+                    for (quicklistNode *n = ql->head; n; n = n->next)
+                        if (n->ext) with_ext++;
+                    if (with_ext != (ql->ext ? ql->ext->used : 0))
+                        ERR("%lu nodes have extras, side table holds %lu after op %d",
+                            with_ext, ql->ext ? ql->ext->used : 0, op);
+                    if ((unsigned long)len != ql->count)
+                        ERR("Count %lu instead of %ld after op %d", ql->count, len, op);
+                    for (int j = 0; j < 50 && len; j++) {
+                        long idx = rand() % len;
+                        quicklistEntry entry;
+                        long lookup = rand() % 2 ? idx : idx - len;
+                        if (!quicklistIndex(ql, lookup, &entry) || entry.longval != ref[idx])
+                            ERR("Index %ld is %lld instead of %lld", lookup, entry.longval,
+                                ref[idx]);
+                    }
+                }
+            }
+            quicklistRelease(ql);
+            zfree(ref);
+            quicklistSetTreeThreshold(0);
+        }
+    }
+
+    for (int compress = 0; compress <= 1; compress++) {
+        TEST_DESC("find and delete by value match a linear scan at compress %d", compress) {
+            srand(4321 + compress);
+            for (int round = 0; round < 200 && !err; round++) {
+                quicklist *ql = quicklistNew(1 + rand() % 16, compress);
+                int len = rand() % 400, vals[400];
+                char buf[32];
+                for (int i = 0; i < len; i++) {
+                    int sz;
+                    vals[i] = rand() % 6;
+                    /* Integers on odd rounds, strings on even ones, plus empty strings. */
+                    if (vals[i] == 5)
+                        sz = 0;
+                    else if (round % 2)
+                        sz = snprintf(buf, sizeof(buf), "%d", vals[i]);
+                    else
+                        sz = snprintf(buf, sizeof(buf), "v%d", vals[i]);
+                    quicklistPushTail(ql, buf, sz);
+                }
+                int target = rand() % 6, forward = rand() % 2;
+                int sz = target == 5 ? 0
+                                     : round % 2 ? snprintf(buf, sizeof(buf), "%d", target)
+                                                 : snprintf(buf, sizeof(buf), "v%d", target);
+                unsigned long rank = 1 + rand() % 3, count = rand() % 4,
+                              maxlen = rand() % 2 ? 0 : rand() % (len + 1);
+                long *indexes;
+                unsigned long found = quicklistFindIndexes(
+                    ql, (unsigned char *)buf, sz, forward ? AL_START_HEAD : AL_START_TAIL,
+                    rank, count, maxlen, &indexes);
+                unsigned long matches = 0, expect = 0;
+                for (int k = 0; k < len && (maxlen == 0 || k < (long)maxlen); k++) {
+                    int i = forward ? k : len - 1 - k;
+                    if (vals[i] != target || ++matches < rank) continue;
+                    if (expect >= found || indexes[expect] != i)
+                        ERR("Match %lu should be index %d", expect, i);
+                    expect++;
+                    if (count && expect == count) break;
+                }
+                if (expect != found) ERR("Found %lu matches instead of %lu", found, expect);
+                zfree(indexes);
+
+                long lrem = (long)(rand() % 4) * (rand() % 2 ? 1 : -1);
+                unsigned long removed = quicklistDelValue(ql, (unsigned char *)buf, sz, lrem);
+                int newlen = 0;
+                unsigned long want = 0;
+                for (int k = 0; k < len; k++) {
+                    int i = lrem >= 0 ? k : len - 1 - k;
+                    if (vals[i] == target && (lrem == 0 || want < (unsigned long)labs(lrem))) {
+                        vals[i] = -1;
+                        want++;
+                    }
+                }
+                for (int i = 0; i < len; i++)
+                    if (vals[i] != -1) vals[newlen++] = vals[i];
+                if (removed != want) ERR("Removed %lu instead of %lu", removed, want);
+                ql_verify(ql, ql->len, newlen, ql->head ? ql->head->count : 0,
+                          ql->tail ? ql->tail->count : 0);
+                quicklistIter *iter = quicklistGetIterator(ql, AL_START_HEAD);
+                quicklistEntry entry;
+                int i = 0;
+                while (quicklistNext(iter, &entry)) {
+                    int v;
+                    if (entry.value && entry.sz == 0) v = 5;
+                    else if (entry.value) v = atoi((char *)entry.value + 1);
+                    else v = entry.longval;
+                    if (v != vals[i]) ERR("Value at %d is %d instead of %d", i, v, vals[i]);
+                    i++;
+                }
+                quicklistReleaseIterator(iter);
+                quicklistRelease(ql);
+            }
+        }
+    }
+
+    printf("Benchmark LPOS and LREM on a list of short strings and integers, iterator vs node search:\n");
+    {
+        for (int integers = 0; integers <= 1; integers++) {
+            quicklist *ql = quicklistNew(-2, 0);
+            char buf[32], needle[32];
+            int needlelen = integers ? snprintf(needle, sizeof(needle), "%d", 7)
+                                     : snprintf(needle, sizeof(needle), "item:%d", 7);
+            for (int i = 0; i < 1000000; i++) {
+                int v = i % 1000 == 500 ? 7 : i + 1000;
+                int sz = integers ? snprintf(buf, sizeof(buf), "%d", v)
+                                  : snprintf(buf, sizeof(buf), "item:%d", v);
+                quicklistPushTail(ql, buf, sz);
+            }
+
+            long long start = ustime();
+            unsigned long it_found = 0;
+            for (int k = 0; k < 10; k++) {
+                quicklistIter *iter = quicklistGetIterator(ql, AL_START_HEAD);
+                quicklistEntry entry;
+                it_found = 0;
+                while (quicklistNext(iter, &entry))
+                    if (quicklistCompare(entry.zi, (unsigned char *)needle, needlelen))
+                        it_found++;
+                quicklistReleaseIterator(iter);
+            }
+            long long iter_us = ustime() - start;
+
+            start = ustime();
+            unsigned long found = 0;
+            for (int k = 0; k < 10; k++) {
+                long *indexes;
+                found = quicklistFindIndexes(ql, (unsigned char *)needle, needlelen,
+                                             AL_START_HEAD, 1, 0, 0, &indexes);
+                zfree(indexes);
+            }
+            long long find_us = ustime() - start;
+
+            /* LREM: delete through the iterator one by one vs per node. */
+            quicklist *copy = quicklistDup(ql);
+            start = ustime();
+            quicklistIter *iter = quicklistGetIterator(copy, AL_START_HEAD);
+            quicklistEntry entry;
+            while (quicklistNext(iter, &entry))
+                if (quicklistCompare(entry.zi, (unsigned char *)needle, needlelen))
+                    quicklistDelEntry(iter, &entry);
+            quicklistReleaseIterator(iter);
+            long long delit_us = ustime() - start;
+            start = ustime();
+            unsigned long removed = quicklistDelValue(ql, (unsigned char *)needle, needlelen, 0);
+            long long del_us = ustime() - start;
+
+            if (found != it_found || removed != found || copy->count != ql->count)
+                ERR("Mismatch: %lu %lu %lu", found, it_found, removed);
+            printf("%-13s LPOS COUNT 0 x10: iterator %lld usec, node search %lld usec; "
+                   "LREM 0: iterator %lld usec, node search %lld usec (%lu matches)\n",
+                   integers ? "integers" : "short strings", iter_us, find_us, delit_us,
+                   del_us, found);
+            quicklistRelease(copy);
+            quicklistRelease(ql);
+        }
+        printf("\n");
+    }
+
+    for (int compress = 0; compress <= 1; compress++) {
+        TEST_DESC("capped list overshoots by less than a node and less than cap at compress %d",
+                  compress) {
+            quicklist *ql = quicklistNew(8, compress);
+            unsigned long removed = 0;
+            quicklistSetCap(ql, 100);
+            for (int i = 0; i < 1000; i++) {
+                char buf[32];
+                int where = i < 500 ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+                int sz = snprintf(buf, sizeof(buf), "%d", i);
+                quicklistPush(ql, buf, sz, where);
+                removed += quicklistCapTrim(ql, where);
+                /* The oldest elements are dropped, the newest is kept. */
+                quicklistEntry entry;
+                quicklistIndex(ql, where == QUICKLIST_HEAD ? 0 : -1, &entry);
+                if (entry.longval != i) ERR("Newest element is %lld, not %d", entry.longval, i);
+                /* Never below the cap, and less than the far end node
+                 * over it. */
+                quicklistNode *far = where == QUICKLIST_HEAD ? ql->tail : ql->head;
+                if (ql->count < (unsigned long)(i < 100 ? i + 1 : 100) ||
+                    (ql->count > 100 && ql->count - far->count >= 100))
+                    ERR("Count %lu out of range after %d pushes", ql->count, i + 1);
+                /* The elements kept are the newest ones, so an exact LTRIM
+                 * to ql->count elements gives the same list. */
+                long long oldest = (long long)i - (long long)ql->count + 1;
+                quicklistIndex(ql, where == QUICKLIST_HEAD ? -1 : 0, &entry);
+                if ((i < 500 || entry.longval >= 500) && entry.longval != oldest)
+                    ERR("Oldest element is %lld, not %lld", entry.longval, oldest);
+            }
+            if (removed + ql->count != 1000)
+                ERR("Removed %lu with %lu left", removed, ql->count);
+            quicklist *copy = quicklistDup(ql);
+            if (quicklistGetCap(copy) != 100) ERR("Dup lost the cap: %lu", quicklistGetCap(copy));
+            quicklistSetCap(copy, 0);
+            if (quicklistCapTrim(copy, QUICKLIST_HEAD) != 0) ERR("%s", "Trimmed without a cap");
+            quicklistRelease(copy);
+            ql_verify(ql, ql->len, ql->count, ql->head->count, ql->tail->count);
+            quicklistRelease(ql);
+
+            /* A cap smaller than a node is trimmed exactly, instead of
+             * keeping a whole node of up to 128 elements. */
+            ql = quicklistNew(128, compress);
+            quicklistSetCap(ql, 5);
+            for (int i = 0; i < 1000; i++) {
+                char buf[32];
+                int where = i % 2 ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+                int sz = snprintf(buf, sizeof(buf), "%d", i);
+                quicklistPush(ql, buf, sz, where);
+                quicklistCapTrim(ql, where);
+                if (ql->count > (unsigned long)(i < 5 ? i + 1 : 5))
+                    ERR("Count %lu over a cap of 5 after %d pushes", ql->count, i + 1);
+            }
+            quicklistRelease(ql);
+        }
+    }
+
+    printf("Benchmark a capped log: LPUSH+LTRIM vs LPUSH on a capped list:\n");
+    {
+        for (int compress = 0; compress <= 1; compress++) {
+            long long elapsed[2];
+            unsigned long len[2];
+            for (int capped = 0; capped <= 1; capped++) {
+                quicklist *ql = quicklistNew(-2, compress);
+                char buf[64];
+                if (capped) quicklistSetCap(ql, 10000);
+                long long start = ustime();
+                for (int i = 0; i < 2000000; i++) {
+                    int sz = snprintf(buf, sizeof(buf), "log line %d with some payload", i);
+                    quicklistPushHead(ql, buf, sz);
+                    if (capped) {
+                        quicklistCapTrim(ql, QUICKLIST_HEAD);
+                    } else if (ql->count > 10000) {
+                        /* LTRIM key 0 9999 */
+                        quicklistDelRange(ql, -(long)(ql->count - 10000), ql->count - 10000);
+                    }
+                }
+                elapsed[capped] = ustime() - start;
+                len[capped] = ql->count;
+                quicklistRelease(ql);
+            }
+            printf("compress %d, 2M pushes capped at 10000: LPUSH+LTRIM %lld usec (len %lu), "
+                   "capped LPUSH %lld usec (len %lu)\n",
+                   compress, elapsed[0], len[0], elapsed[1], len[1]);
+        }
+        printf("\n");
+    }
+
+    printf("Benchmark LINDEX in the middle of a 100k node list with and without the counted tree:\n");
+    {
+        for (int tree = 0; tree <= 1; tree++) {
+            quicklistSetTreeThreshold(tree ? QUICKLIST_TREE_MIN_NODES : 0);
+            quicklist *ql = quicklistNew(8, 0);
+            for (int i = 0; i < 800000; i++) {
+                char buf[32];
+                int sz = snprintf(buf, sizeof(buf), "%d", i);
+                quicklistPushTail(ql, buf, sz);
+            }
+            long long start = ustime();
+            long long sum = 0;
+            for (int i = 0; i < 2000; i++) {
+                quicklistEntry entry;
+                quicklistIndex(ql, 200000 + (i * 37) % 400000, &entry);
+                sum += entry.longval;
+            }
+            printf("%-7s %lu nodes, 2000 LINDEX: %lld usec, 2000 LSET: ",
+                   tree ? "tree" : "no tree", ql->len, ustime() - start);
+            start = ustime();
+            for (int i = 0; i < 2000; i++)
+                quicklistReplaceAtIndex(ql, 200000 + (i * 37) % 400000, "x", 1);
+            printf("%lld usec, tree %zu bytes (checksum %lld)\n", ustime() - start,
+                   quicklistTreeSize(ql), sum);
+            quicklistRelease(ql);
+        }
+        quicklistSetTreeThreshold(0);
+        printf("\n");
+    }
+
+    printf("Benchmark codecs on log-style entries (LPUSH, LRANGE, memory):\n");
+    {
+        char buf[256];
+        int iter = 200000;
+        for (int codec = 0; codec < QUICKLIST_CODECS; codec++) {
+            if (!quicklistCodecAvailable(codec)) {
+                printf("%-5s not compiled in\n", quicklistCodecName(codec));
+                continue;
+            }
+            quicklist *ql = quicklistNew(-2, 1);
+            quicklistSetCodec(ql, codec);
+            long long start = ustime();
+            for (int i = 0; i < iter; i++) {
+                int len = snprintf(buf, sizeof(buf),
+                    "2026-10-16T12:%02d:%02d.%03dZ INFO worker-%d request id=%d "
+                    "path=/api/v1/items/%d status=%d latency_ms=%d",
+                    i / 60000 % 60, i / 1000 % 60, i % 1000, i % 8, i,
+                    i % 5000, i % 50 ? 200 : 404, i % 300);
+                quicklistPushHead(ql, buf, len);
+            }
+            long long push_us = ustime() - start;
+
+            start = ustime();
+            quicklistIter *it = quicklistGetIterator(ql, AL_START_HEAD);
+            quicklistEntry entry;
+            size_t total = 0;
+            while (quicklistNext(it, &entry))
+                total += entry.sz;
+            quicklistReleaseIterator(it);
+            long long range_us = ustime() - start;
+
+            size_t raw = 0, stored = 0;
+            for (quicklistNode *node = ql->head; node; node = node->next) {
+                raw += node->sz;
+                stored += quicklistNodeIsCompressed(node) ?
+                    sizeof(quicklistLZF) + ((quicklistLZF *)node->zl)->sz : node->sz;
+            }
+            printf("%-5s LPUSH %lld usec, LRANGE %lld usec, %zu -> %zu bytes (%.2fx, %zu payload)\n",
+                   quicklistCodecName(codec), push_us, range_us, raw, stored,
+                   (double)raw / stored, total);
+            quicklistRelease(ql);
+        }
+        printf("\n");
+    }
+
     if (!err)
         printf("ALL TESTS PASSED!\n");
     else
@@ -8,27 +8,36 @@
 
 /* quicklistNode是一个32字节的结构，快表的ziplist的节点。 我们使用位字段将quicklistNode保持为32个字节。
  * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
- * encoding: 2 bits, RAW=1, LZF=2.
- * container: 2 bits, NONE=1, ZIPLIST=2.
+ * encoding: 3 bits, RAW=1, LZF=2, LZ4=3, ZSTD=4.
+ * container: 2 bits, NONE=1, PACKED=2.
  * recompress: 1 bit, bool, true 如果节点被临时压缩以供使用。
  * attempted_compress: 1 bit, boolean, 用于测试期间的验证.
- * extra: 12 bits, free for future use; pads out the remainder of 32 bits
+ * offsets_wanted: 1 bit, boolean, 上次修改之后是否已经按下标访问过.
+ * compress_pending: 1 bit, boolean, 已经交给后台线程压缩，结果还没有装回节点，zl仍然是未压缩的packlist.
+ * cached: 1 bit, boolean, 节点在解压缓存中有一项，见quicklistSetDecompressCacheSize().
+ * ext: 1 bit, boolean, 快表的扩展信息表中有这个节点的一项（稀疏偏移索引或者计数树中的叶子），见quicklist.c.
+ * extra: 5 bits, free for future use; pads out the remainder of 32 bits
  */
 ///快表中节点的数据结构定义
 typedef struct quicklistNode {
     struct quicklistNode *prev; ///指向前驱节点的指针
     struct quicklistNode *next; ///指向后继节点的指针
-    unsigned char *zl;          ///如果说没有设置压缩的参数，zl指向一个压缩表，如果设置了压缩参数，就指向quicklistLZF结构
+    unsigned char *zl;          ///如果说没有设置压缩的参数，zl指向一个压缩表（打开packlist格式时是packlist），如果设置了压缩参数，就指向quicklistLZF结构
     unsigned int sz;            ///压缩表的大小
     unsigned int count : 16;    ///压缩表中的节点数，用16位来表示；注意 ： 在这里表示占位符的意思
-    unsigned int encoding : 2;  ///编码格式，表示是否采用LZF压缩算法进行快表节点压缩，1表示不用，2表示采用，用2位来表示
+    unsigned int encoding : 3;  ///编码格式，表示节点是否被压缩以及使用的压缩算法，1表示没有压缩，用3位来表示
     unsigned int container : 2; ///表示一个快表节点是否采用压缩表来保存数据，1表示不采用，2表示采用。用2位来表示
     unsigned int recompress : 1;///用来标识该节点是否被压缩过，占用1位。如果recompress = 1,表示该节点等待被再次压缩
     unsigned int attempted_compress : 1; ///测试使用，如果节点太小，，就不能被压缩
-    unsigned int extra : 10;    ///额外的空间，以供以后使用
+    unsigned int offsets_wanted : 1; ///上次修改之后已经按下标访问过一次，再次访问时建立稀疏偏移索引
+    unsigned int compress_pending : 1; ///等待后台线程压缩，见quicklistSetAsyncCompression()
+    unsigned int cached : 1;    ///节点在解压缓存中，缓存保存着另一种形式（压缩或者未压缩）的packlist
+    unsigned int ext : 1;       ///快表的扩展信息表中有这个节点的一项
+    unsigned int extra : 5;     ///额外的空间，以供以后使用
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
+ * 不论节点使用哪种压缩算法，压缩后的数据都用这个结构保存，算法记录在quicklistNode->encoding中。
  * 'sz' is byte length of 'compressed' field.
  * 'compressed' is LZF data with total (compressed) length 'sz'
  * 注意：未压缩的长度存储在quicklistNode-> sz中。
@@ -39,6 +48,16 @@ typedef struct quicklistLZF {
     char compressed[]; ///保存被压缩后的压缩表，它是柔性数组，大小不确定
 } quicklistLZF;
 
+/* 解压缓存的统计，见quicklistSetDecompressCacheSize() */
+typedef struct quicklistCacheStats {
+    size_t limit; ///缓存的容量（字节），0表示没有开启
+    size_t bytes; ///缓存占用的内存
+    unsigned long entries; ///缓存中的节点数
+    unsigned long long hits; ///需要解压的节点在缓存中的次数
+    unsigned long long misses; ///需要解压的节点不在缓存中的次数
+    unsigned long long evictions; ///因为超过容量被淘汰的节点数
+} quicklistCacheStats;
+
 /* Bookmarks are padded with realloc at the end of of the quicklist struct.
  * They should only be used for very big lists if thousands of nodes were the
  * excess memory usage is negligible, and there's a real need to iterate on them
@@ -58,19 +77,24 @@ typedef struct quicklistBookmark {
 #   define QL_FILL_BITS 14
 #   define QL_COMP_BITS 14
 #   define QL_BM_BITS 4
+#   define QL_CODEC_BITS 2
 #elif UINTPTR_MAX == 0xffffffffffffffff
 /* 64-bit */
 #   define QL_FILL_BITS 16
 #   define QL_COMP_BITS 16
 #   define QL_BM_BITS 4 /* we can encode more, but we rather limit the user
                            since they cause performance degradation. */
+#   define QL_CODEC_BITS 2
 #else
 #   error unknown arch bits count
 #endif
 
-/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
+/* quicklist is a 48 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
+ * 'ext' holds the per-node extras (sparse offsets, counted tree leaves), the
+ *       counted tree used for lookups by index and the length cap of a capped
+ *       list, NULL until one of them is needed.
  * 'compress' is: -1 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
  * 'fill' is the user-requested (or default) fill factor.
@@ -85,6 +109,8 @@ typedef struct quicklist {
     int fill : QL_FILL_BITS; ///保存压缩表的大小           
     unsigned int compress : QL_COMP_BITS;///保存压缩的程度，0表示不保存 
     unsigned int bookmark_count: QL_BM_BITS; ///保存bookmark的数量 
+    unsigned int codec : QL_CODEC_BITS; ///压缩节点使用的算法，QUICKLIST_CODEC_*
+    struct quicklistExt *ext; ///按节点指针查找的节点扩展信息和计数树，没有节点需要时为NULL
     quicklistBookmark bookmarks[]; ///保存所有bookmark的数组
 } quicklist;
 
@@ -114,29 +140,61 @@ typedef struct quicklistEntry {
 /* quicklist node encodings */
 #define QUICKLIST_NODE_ENCODING_RAW 1 ///没有进行压缩操作
 #define QUICKLIST_NODE_ENCODING_LZF 2 ///采用LZF算法进行压缩操作
+#define QUICKLIST_NODE_ENCODING_LZ4 3 ///采用LZ4算法进行压缩操作
+#define QUICKLIST_NODE_ENCODING_ZSTD 4 ///采用zstd算法进行压缩操作
+
+/* quicklist compression codecs */
+#define QUICKLIST_CODEC_LZF 0 ///LZF，总是可用
+#define QUICKLIST_CODEC_LZ4 1 ///LZ4，压缩和解压都很快，需要定义HAVE_LZ4
+#define QUICKLIST_CODEC_ZSTD 2 ///zstd，压缩率高，可以使用共享字典，需要定义HAVE_ZSTD
+#define QUICKLIST_CODECS 3
+#define QUICKLIST_CODEC_ENCODING(codec) ((codec) + QUICKLIST_NODE_ENCODING_LZF) ///压缩算法对应的节点编码
 
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0 ///不能就快表进行压缩
 
 /* quicklist container formats */
 #define QUICKLIST_NODE_CONTAINER_NONE 1 ///快表节点中直接保存对象
-#define QUICKLIST_NODE_CONTAINER_ZIPLIST 2 ///快表节点中直接保存ziplist对象
+#define QUICKLIST_NODE_CONTAINER_PACKED 2 ///快表节点中保存packlist*函数操作的紧凑列表，默认是ziplist，打开packlist格式后是packlist（见packlist.h）
+#define QUICKLIST_NODE_CONTAINER_ZIPLIST QUICKLIST_NODE_CONTAINER_PACKED ///原来的名字，rdb.c等这个目录之外的代码仍然使用
 
 ///检测压缩表是否被压缩，1表是被压缩，0表示不被压缩
 #define quicklistNodeIsCompressed(node)                                        \
-    ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
+    ((node)->encoding != QUICKLIST_NODE_ENCODING_RAW)
 
 quicklist *quicklistCreate(void); ///创建一个空的压缩表
 quicklist *quicklistNew(int fill, int compress); ///创建一个新的快表
 void quicklistSetCompressDepth(quicklist *quicklist, int depth) ; ///设置快表的a压缩深度
 void quicklistSetFill(quicklist *quicklist, int fill); ///设置快表的fill参数
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth); ///设置快表的参数
+int quicklistCodecAvailable(int codec); ///压缩算法是否编译进来了
+const char *quicklistCodecName(int codec); ///压缩算法的名字
+int quicklistCodecFromName(const char *name); ///根据名字查找压缩算法，不存在时返回-1
+int quicklistSetDefaultCodec(int codec); ///设置新建快表使用的压缩算法
+int quicklistSetCodec(quicklist *quicklist, int codec); ///设置快表压缩节点时使用的算法
+void quicklistSetCap(quicklist *quicklist, unsigned long cap); ///设置快表的长度上限，0表示没有上限
+unsigned long quicklistGetCap(const quicklist *quicklist); ///快表的长度上限，0表示没有上限
+unsigned long quicklistCapTrim(quicklist *quicklist, int where); ///从where的另一端整个删除超出长度上限的节点
+int quicklistSetZstdDictionary(const void *dict, size_t len); ///加载zstd共享字典
+size_t quicklistTrainZstdDictionary(quicklist *quicklist, void *dict, size_t capacity); ///用快表的内容训练zstd字典
+int quicklistSetAsyncCompression(int enable); ///是否由后台线程压缩内部节点
+void quicklistAsyncCompressApply(void); ///把后台线程压缩好的结果装回节点，只能在没有迭代器的时候调用
+void quicklistAsyncCompressWait(void); ///等待后台线程处理完所有的任务
+unsigned long quicklistAsyncCompressPending(void); ///还没有装回节点的压缩任务数
+void quicklistSetDecompressCacheSize(size_t bytes); ///设置解压缓存的容量，0表示关闭
+void quicklistGetDecompressCacheStats(quicklistCacheStats *stats); ///读取解压缓存的统计
 void quicklistRelease(quicklist *quicklist); ///示范整个快表
 int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz); ///在快表的头部节点中加入entry
 int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz); ///在快表尾部节点中加入entry
 void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
                    int where); ///在快表节点中加入entry，通过where确定是是头节点还是尾节点插入
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl); ///在快表的节点中追加ziplist
+void quicklistPushMany(quicklist *quicklist, unsigned char **values,
+                       unsigned int *sizes, unsigned long count, int where); ///一次在头部或者尾部加入count个entry，每个快表节点只写入一次
+size_t quicklistExtSize(const quicklist *quicklist); ///节点扩展信息（包括稀疏偏移索引）占用的内存
+void quicklistSetTreeThreshold(unsigned long nodes); ///节点数达到nodes时建立计数树，0表示不建立
+size_t quicklistTreeSize(const quicklist *quicklist); ///计数树占用的内存
+void quicklistAppendPacklist(quicklist *quicklist, unsigned char *pl); ///在快表的尾部追加一个保存pl的节点
+void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl); ///在快表的节点中追加ziplist，打开packlist格式时转换成packlist保存
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
                                             unsigned char *zl); ///
 quicklist *quicklistCreateFromZiplist(int fill, int compress,
@@ -149,6 +207,12 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry); ///通过迭
 int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
                             int sz); ///替换快表节点中zl index出的数据
 int quicklistDelRange(quicklist *quicklist, const long start, const long stop); ///删除快表节点中固定范围的压缩表节点
+unsigned long quicklistFindIndexes(quicklist *quicklist, unsigned char *value,
+                                   size_t sz, int direction, unsigned long rank,
+                                   unsigned long count, unsigned long maxlen,
+                                   long **indexes); ///查找和value相等的值的下标，用于LPOS
+unsigned long quicklistDelValue(quicklist *quicklist, unsigned char *value,
+                                size_t sz, long count); ///删除和value相等的值，用于LREM
 quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction);///创建一个快表迭代器
 quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist,
                                          int direction, const long long idx); ///获取idx处的迭代器
@@ -167,7 +231,8 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
                  unsigned int *sz, long long *slong); ///在头节点或者尾节点中弹出entry
 unsigned long quicklistCount(const quicklist *ql);
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len); //比较快表节点中两个压缩表节点
-size_t quicklistGetLzf(const quicklistNode *node, void **data);
+size_t quicklistGetLzf(const quicklistNode *node, void **data); ///取出LZF压缩的节点的数据
+size_t quicklistGetLzfCopy(const quicklistNode *node, void **data); ///把LZ4/zstd压缩的节点导出为LZF副本，调用者zfree(*data)
 
 /* bookmarks */
 int quicklistBookmarkCreate(quicklist **ql_ref, const char *name, quicklistNode *node);
@@ -1,3 +1,4 @@
+#define ZMALLOC_TAG ZMALLOC_TAG_SDS ///分配分析中记为sds，见zmalloc.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
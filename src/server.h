@@ -64,6 +64,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "packlist.h" /* Compact list without cascade updates */
 #include "intset.h"  /* Compact integer set structure */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
@@ -595,6 +596,15 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_PACKLIST 11 /* Encoded as packlist */
+/* Compact encoding of small sorted sets: ziplist unless the server is
+ * built with USE_PACKLIST and the packlist format is enabled at startup,
+ * see packlist.c. Without USE_PACKLIST this is a compile time constant. */
+#ifdef HAVE_PACKLIST_FORMAT
+#define OBJ_ENCODING_ZSET_PACKED (packlist_enabled ? OBJ_ENCODING_PACKLIST : OBJ_ENCODING_ZIPLIST)
+#else
+#define OBJ_ENCODING_ZSET_PACKED OBJ_ENCODING_ZIPLIST
+#endif
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -902,6 +912,13 @@ typedef struct zskiplist {
     int level; ///跳跃表的最大层数
 } zskiplist;
 
+/* 有序集合的一个(score, ele)对，批量建立有序集合时按(score, ele)排序的数组使用，
+ * 见zslCreateFromSorted()和zsetCreateFromSorted()。zbtree.h中B+树的元素也是这个类型。 */
+typedef struct zsetPair {
+    double score;
+    sds ele;
+} zsetPair;
+
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
@@ -950,6 +967,7 @@ struct redisMemOverhead {
     size_t clients_normal;
     size_t aof_buffer;
     size_t lua_caches;
+    quicklistCacheStats list_cache; /* Decompressed quicklist node cache. */
     size_t overhead_total;
     size_t dataset;
     size_t total_keys;
@@ -970,6 +988,8 @@ struct redisMemOverhead {
         size_t overhead_ht_main;
         size_t overhead_ht_expires;
     } *db;
+    zmallocProfile alloc_profile; /* Sampled allocations by call site and size
+                                     (see MEMORY PROFILE). */
 };
 
 /* This structure can be optionally passed to RDB save/load functions in
@@ -1167,6 +1187,11 @@ struct redisServer {
     int active_expire_effort;       /* From 1 (default) to 10, active effort. */
     int active_defrag_enabled;
     int jemalloc_bg_thread;         /* Enable jemalloc background thread */
+    int hash_table_hugepages;       /* ZMALLOC_HUGEPAGE_* advice for hash tables of 2MB or more,
+                                       default leaves transparent huge pages to the kernel. */
+    int hash_table_prefault;        /* Prefault those tables in a background thread. */
+    int hash_table_numa_local;      /* Bind those tables to the NUMA node of the allocating thread. */
+    int dict_background_rehash;     /* Expand the keyspace dicts in a background thread, default off. */
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
     int active_defrag_threshold_lower; /* minimum percentage of fragmentation to start active defrag */
     int active_defrag_threshold_upper; /* maximum percentage of fragmentation at which we use maximum effort */
@@ -1354,12 +1379,19 @@ struct redisServer {
     size_t set_max_intset_entries;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    int zset_union_threads;     /* Threads aggregating large ZUNIONSTORE/ZINTERSTORE, 0 or 1 = off. */
+    size_t zset_union_parallel_min; /* Use those threads from this many input elements. */
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_codec;    /* QUICKLIST_CODEC_* used to compress list nodes. */
+    int list_compress_async;    /* Compress interior list nodes in a background thread. */
+    size_t list_decompress_cache_size; /* Bytes of decompressed list nodes to cache, 0 = off. */
+    unsigned long list_tree_min_nodes; /* Index lists with at least this many nodes, 0 = never (default).
+                                          The index costs about 70-100 bytes per node. */
     /* time cache */
     _Atomic time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;            /* Cached timezone. As set by tzset(). */
@@ -1708,6 +1740,8 @@ void trackingBroadcastInvalidationMessages(void);
 /* List data type */
 void listTypeTryConversion(robj *subject, robj *value);
 void listTypePush(robj *subject, robj *value, int where);
+void listTypePushMany(robj *subject, robj **values, int count, int where);
+unsigned long listTypeCapTrim(redisDb *db, robj *key, robj *subject, int where, int now);
 robj *listTypePop(robj *subject, int where);
 unsigned long listTypeLength(const robj *subject);
 listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char direction);
@@ -1718,6 +1752,8 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where);
 int listTypeEqual(listTypeEntry *entry, robj *o);
 void listTypeDelete(listTypeIterator *iter, listTypeEntry *entry);
 void listTypeConvert(robj *subject, int enc);
+void listBeforeSleep(void);
+sds genListInfoString(sds info);
 void unblockClientWaitingData(client *c);
 void popGenericCommand(client *c, int where);
 
@@ -1763,7 +1799,10 @@ robj *createSetObject(void);
 robj *createIntsetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetPacklistObject(void);
+/* Name used before the packlist format existed, kept for callers outside this
+ * tree such as moduleCreateEmptyKey(). */
+#define createZsetZiplistObject createZsetPacklistObject
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1923,10 +1962,17 @@ typedef struct {
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+zskiplist *zslCreateFromSorted(zsetPair *entries, unsigned long count, dict *dict);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
+unsigned char *zzlAppendMany(unsigned char *zl, sds *eles, double *scores, unsigned long count);
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
 zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range);
+zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore);
+zskiplistNode *zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict);
+unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *dict);
+unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
@@ -1935,13 +1981,16 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertFromZiplist(robj *zobj);
+robj *zsetCreateFromSorted(zsetPair *entries, unsigned long count, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds packlistGetObject(unsigned char *sptr);
+#define ziplistGetObject packlistGetObject /* Old name, see above. */
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1950,8 +1999,12 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
 zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
 zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+#ifdef REDIS_TEST
+int zslTest(int argc, char **argv);
+#endif
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
+int sdscmplex(sds a, sds b);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
@@ -1998,6 +2051,8 @@ unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
 struct redisMemOverhead *getMemoryOverheadData(void);
 void freeMemoryOverheadData(struct redisMemOverhead *mh);
+void updateHashTableMemoryConfig(void);
+void dbEnableBackgroundRehash(void);
 void checkChildrenDone(void);
 
 #define RESTART_SERVER_NONE 0
@@ -2080,6 +2135,7 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags);
 robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
+void dbPrefetchKeys(redisDb *db, robj **keys, int count, int step);
 int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
                        long long lru_clock, int lru_multiplier);
 #define LOOKUP_NONE 0
@@ -2276,6 +2332,9 @@ void flushallCommand(client *c);
 void sortCommand(client *c);
 void lremCommand(client *c);
 void lposCommand(client *c);
+#ifdef USE_CAPPED_LISTS
+void lcapCommand(client *c);
+#endif
 void rpoplpushCommand(client *c);
 void infoCommand(client *c);
 void mgetCommand(client *c);
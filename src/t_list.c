@@ -50,6 +50,91 @@ void listTypePush(robj *subject, robj *value, int where) {
     }
 }
 
+/* Push 'count' elements at once, with the same result as calling
+ * listTypePush() for each of them in order. The values are handed to
+ * quicklistPushMany() in chunks of LIST_PUSH_CHUNK, using arrays on the
+ * stack, so every quicklist node is resized once per chunk instead of once
+ * per element. A single element goes straight to listTypePush(). */
+#define LIST_PUSH_CHUNK 64
+void listTypePushMany(robj *subject, robj **values, int count, int where) {
+    if (count == 1) {
+        listTypePush(subject,values[0],where);
+    } else if (subject->encoding == OBJ_ENCODING_QUICKLIST) {
+        int pos = (where == LIST_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        robj *decoded[LIST_PUSH_CHUNK];
+        unsigned char *vals[LIST_PUSH_CHUNK];
+        unsigned int lens[LIST_PUSH_CHUNK];
+        int j, n;
+
+        while (count > 0) {
+            n = (count < LIST_PUSH_CHUNK) ? count : LIST_PUSH_CHUNK;
+            for (j = 0; j < n; j++) {
+                decoded[j] = getDecodedObject(values[j]);
+                vals[j] = (unsigned char*)decoded[j]->ptr;
+                lens[j] = sdslen(decoded[j]->ptr);
+            }
+            quicklistPushMany(subject->ptr, vals, lens, n, pos);
+            for (j = 0; j < n; j++) decrRefCount(decoded[j]);
+            values += n;
+            count -= n;
+        }
+    } else {
+        serverPanic("Unknown list encoding");
+    }
+}
+
+/* Drop the elements over the cap of a capped list (see LCAP) after a push
+ * at 'where'. The cap is approximate: whole quicklist nodes are dropped from
+ * the other end, so the list may keep up to one node more than 'cap'
+ * elements, like the ~ form of XADD MAXLEN, but never 'cap' or more over
+ * it (see quicklistCapTrim()). Since the number of elements left depends on the
+ * node layout, the trim is propagated as an explicit LTRIM to the exact
+ * length that is left, and replicas or the AOF being loaded never trim on
+ * their own: they only apply that LTRIM, so their lists end up identical
+ * whatever their own node layout. When 'now' is false the LTRIM is queued
+ * with alsoPropagate() to follow the command being executed, when it is
+ * true (BRPOPLPUSH served outside of call()) it is propagated at once, so
+ * the caller must have propagated the push already.
+ *
+ * Returns the number of elements removed. */
+unsigned long listTypeCapTrim(redisDb *db, robj *key, robj *subject, int where, int now) {
+    quicklist *ql;
+    unsigned long removed;
+    robj *argv[4];
+
+    if (subject->encoding != OBJ_ENCODING_QUICKLIST)
+        serverPanic("Unknown list encoding");
+    ql = subject->ptr;
+    if (!quicklistGetCap(ql) || server.loading || server.masterhost) return 0;
+    removed = quicklistCapTrim(ql,(where == LIST_HEAD) ? QUICKLIST_HEAD :
+                                                         QUICKLIST_TAIL);
+    if (!removed) return 0;
+
+    /* LTRIM key 0 len-1 after LPUSH, LTRIM key -len -1 after RPUSH, where
+     * len is the number of elements left. */
+    argv[0] = createStringObject("LTRIM",5);
+    argv[1] = key;
+    if (where == LIST_HEAD) {
+        argv[2] = createStringObjectFromLongLong(0);
+        argv[3] = createStringObjectFromLongLong((long long)ql->count-1);
+    } else {
+        argv[2] = createStringObjectFromLongLong(-(long long)ql->count);
+        argv[3] = createStringObjectFromLongLong(-1);
+    }
+    if (now)
+        propagate(lookupCommandByCString("ltrim"),db->id,argv,4,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+    else
+        alsoPropagate(lookupCommandByCString("ltrim"),db->id,argv,4,
+                      PROPAGATE_AOF|PROPAGATE_REPL);
+    decrRefCount(argv[0]);
+    decrRefCount(argv[2]);
+    decrRefCount(argv[3]);
+    notifyKeyspaceEvent(NOTIFY_LIST,"ltrim",key,db->id);
+    server.dirty += removed;
+    return removed;
+}
+
 void *listPopSaver(unsigned char *data, unsigned int sz) {
     return createStringObject((char*)data,sz);
 }
@@ -184,18 +269,55 @@ void listTypeConvert(robj *subject, int enc) {
         size_t zlen = server.list_max_ziplist_size;
         int depth = server.list_compress_depth;
         subject->ptr = quicklistCreateFromZiplist(zlen, depth, subject->ptr);
+        quicklistSetCodec(subject->ptr, server.list_compress_codec);
         subject->encoding = OBJ_ENCODING_QUICKLIST;
     } else {
         serverPanic("Unsupported list conversion");
     }
 }
 
+/* Install the list nodes compressed by the background thread. This must
+ * be called from beforeSleep() in server.c, which is not part of this
+ * tree, so the call still has to be added there. No command is running at
+ * that point, so no iterator or entry points inside a node and the node
+ * buffers can be replaced. Until it is hooked up, finished results are
+ * only installed before the next LPUSH/RPUSH, and nodes of lists that are
+ * never pushed to again stay uncompressed. */
+void listBeforeSleep(void) {
+    quicklistAsyncCompressApply();
+}
+
+/* Append the list node cache and background compression fields to the
+ * INFO output. genRedisInfoString() calls it at the end of the "memory"
+ * section. */
+sds genListInfoString(sds info) {
+    quicklistCacheStats stats;
+
+    quicklistGetDecompressCacheStats(&stats);
+    info = sdscatprintf(info,
+        "list_decompress_cache_size:%zu\r\n"
+        "list_decompress_cache_bytes:%zu\r\n"
+        "list_decompress_cache_entries:%lu\r\n"
+        "list_decompress_cache_hits:%llu\r\n"
+        "list_decompress_cache_misses:%llu\r\n"
+        "list_decompress_cache_evictions:%llu\r\n"
+        "list_async_compress_pending:%lu\r\n",
+        stats.limit,
+        stats.bytes,
+        stats.entries,
+        stats.hits,
+        stats.misses,
+        stats.evictions,
+        quicklistAsyncCompressPending());
+    return info;
+}
+
 /*-----------------------------------------------------------------------------
  * List Commands
  *----------------------------------------------------------------------------*/
 
 void pushGenericCommand(client *c, int where) {
-    int j, pushed = 0;
+    int pushed;
     robj *lobj = lookupKeyWrite(c->db,c->argv[1]);
 
     if (lobj && lobj->type != OBJ_LIST) {
@@ -203,23 +325,27 @@ void pushGenericCommand(client *c, int where) {
         return;
     }
 
-    for (j = 2; j < c->argc; j++) {
-        if (!lobj) {
-            lobj = createQuicklistObject();
-            quicklistSetOptions(lobj->ptr, server.list_max_ziplist_size,
-                                server.list_compress_depth);
-            dbAdd(c->db,c->argv[1],lobj);
-        }
-        listTypePush(lobj,c->argv[j],where);
-        pushed++;
+    if (!lobj) {
+        lobj = createQuicklistObject();
+        quicklistSetOptions(lobj->ptr, server.list_max_ziplist_size,
+                            server.list_compress_depth);
+        quicklistSetCodec(lobj->ptr, server.list_compress_codec);
+        dbAdd(c->db,c->argv[1],lobj);
     }
-    addReplyLongLong(c, (lobj ? listTypeLength(lobj) : 0));
+    /* Install nodes compressed in the background before pushing more, so
+     * the number of pending copies stays small. No list entry is referenced
+     * at this point, so replacing node buffers is safe. */
+    quicklistAsyncCompressApply();
+    pushed = c->argc-2;
+    listTypePushMany(lobj,c->argv+2,pushed,where);
     if (pushed) {
         char *event = (where == LIST_HEAD) ? "lpush" : "rpush";
 
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_LIST,event,c->argv[1],c->db->id);
+        listTypeCapTrim(c->db,c->argv[1],lobj,where,0);
     }
+    addReplyLongLong(c, (lobj ? listTypeLength(lobj) : 0));
     server.dirty += pushed;
 }
 
@@ -232,24 +358,23 @@ void rpushCommand(client *c) {
 }
 
 void pushxGenericCommand(client *c, int where) {
-    int j, pushed = 0;
+    int pushed;
     robj *subject;
 
     if ((subject = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,subject,OBJ_LIST)) return;
 
-    for (j = 2; j < c->argc; j++) {
-        listTypePush(subject,c->argv[j],where);
-        pushed++;
-    }
-
-    addReplyLongLong(c,listTypeLength(subject));
+    pushed = c->argc-2;
+    listTypePushMany(subject,c->argv+2,pushed,where);
 
     if (pushed) {
         char *event = (where == LIST_HEAD) ? "lpush" : "rpush";
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_LIST,event,c->argv[1],c->db->id);
+        listTypeCapTrim(c->db,c->argv[1],subject,where,0);
     }
+
+    addReplyLongLong(c,listTypeLength(subject));
     server.dirty += pushed;
 }
 
@@ -395,6 +520,56 @@ void rpopCommand(client *c) {
     popGenericCommand(c,LIST_TAIL);
 }
 
+/* Emit 'rangelen' elements starting at 'start' as bulk strings. Instead of
+ * appending every element with addReplyBulkCBuffer(), which costs three
+ * separate appends to the output buffer per element, the whole
+ * "$<len>\r\n<value>\r\n" sequence of consecutive elements is serialized
+ * into a PROTO_REPLY_CHUNK_BYTES stack buffer while walking the quicklist
+ * nodes, and every full chunk is appended with a single addReplyProto().
+ * Elements too big to fit in a chunk are emitted on their own. */
+static void addListRangeReply(client *c, robj *o, long start, long rangelen) {
+    char buf[PROTO_REPLY_CHUNK_BYTES];
+    size_t used = 0;
+    quicklistIter *iter = quicklistGetIteratorAtIdx(o->ptr,AL_START_HEAD,start);
+    quicklistEntry qe;
+
+    while (rangelen-- && quicklistNext(iter,&qe)) {
+        char num[LONG_STR_SIZE];
+        const char *val;
+        size_t len;
+
+        if (qe.value) {
+            val = (char*)qe.value;
+            len = qe.sz;
+        } else {
+            len = ll2string(num,sizeof(num),qe.longval);
+            val = num;
+        }
+
+        /* Room for "$", the length digits and the two CRLFs. */
+        if (len + LONG_STR_SIZE + 5 > sizeof(buf)) {
+            if (used) addReplyProto(c,buf,used);
+            used = 0;
+            addReplyBulkCBuffer(c,val,len);
+            continue;
+        }
+        if (used + len + LONG_STR_SIZE + 5 > sizeof(buf)) {
+            addReplyProto(c,buf,used);
+            used = 0;
+        }
+        buf[used++] = '$';
+        used += ll2string(buf+used,sizeof(buf)-used,len);
+        buf[used++] = '\r';
+        buf[used++] = '\n';
+        memcpy(buf+used,val,len);
+        used += len;
+        buf[used++] = '\r';
+        buf[used++] = '\n';
+    }
+    if (used) addReplyProto(c,buf,used);
+    quicklistReleaseIterator(iter);
+}
+
 void lrangeCommand(client *c) {
     robj *o;
     long start, end, llen, rangelen;
@@ -423,19 +598,7 @@ void lrangeCommand(client *c) {
     /* Return the result in form of a multi-bulk reply */
     addReplyArrayLen(c,rangelen);
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
-        listTypeIterator *iter = listTypeInitIterator(o, start, LIST_TAIL);
-
-        while(rangelen--) {
-            listTypeEntry entry;
-            listTypeNext(iter, &entry);
-            quicklistEntry *qe = &entry.entry;
-            if (qe->value) {
-                addReplyBulkCBuffer(c,qe->value,qe->sz);
-            } else {
-                addReplyBulkLongLong(c,qe->longval);
-            }
-        }
-        listTypeReleaseIterator(iter);
+        addListRangeReply(c,o,start,rangelen);
     } else {
         serverPanic("List encoding is not QUICKLIST!");
     }
@@ -487,6 +650,58 @@ void ltrimCommand(client *c) {
     addReply(c,shared.ok);
 }
 
+#ifdef USE_CAPPED_LISTS
+/* LCAP key maxlen
+ *
+ * Only built with USE_CAPPED_LISTS, and not in the command table: the cap
+ * is not persisted yet (see below), so a restart, or a full resync of a
+ * replica that is later promoted, silently turns a capped list back into a
+ * plain one.
+ *
+ * Turn the list into a capped list of about 'maxlen' elements, as used for
+ * logs written with LPUSH+LTRIM. After every push whole quicklist nodes are
+ * dropped from the other end, without being decompressed or rewritten, as
+ * long as at least 'maxlen' elements are left: the list keeps less than one
+ * node, and less than 'maxlen' elements, over the cap. Every such trim is propagated as an explicit LTRIM to the
+ * exact length left (see listTypeCapTrim()). A 'maxlen' of zero removes the
+ * cap.
+ *
+ * The nodes already over the cap are dropped from the tail, and the number
+ * of elements removed is returned. LCAP itself is propagated, followed by
+ * the LTRIM of that first trim, so replicas and the AOF get the cap for
+ * after a failover, but never trim on their own.
+ *
+ * The cap is a property of the in-memory list only: the RDB format has no
+ * field for it and an AOF rewrite emits the list without it, so after a
+ * restart or a full resync the list is a plain list until LCAP is sent
+ * again. The contents never diverge because of this, since every trim
+ * reaches the replicas and the AOF as an LTRIM. */
+void lcapCommand(client *c) {
+    robj *o;
+    long maxlen;
+    quicklist *ql;
+    unsigned long removed;
+
+    if (getLongFromObjectOrReply(c,c->argv[2],&maxlen,NULL) != C_OK) return;
+    if (maxlen < 0) {
+        addReplyError(c,"maxlen can't be negative");
+        return;
+    }
+    if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        checkType(c,o,OBJ_LIST)) return;
+
+    if (o->encoding != OBJ_ENCODING_QUICKLIST) serverPanic("Unknown list encoding");
+    ql = o->ptr;
+    if (quicklistGetCap(ql) != (unsigned long)maxlen) {
+        quicklistSetCap(ql,maxlen);
+        server.dirty++;
+    }
+    removed = listTypeCapTrim(c->db,c->argv[1],o,LIST_HEAD,0);
+    if (removed) signalModifiedKey(c,c->db,c->argv[1]);
+    addReplyLongLong(c,removed);
+}
+#endif
+
 /* LPOS key element [FIRST rank] [COUNT num-matches] [MAXLEN len]
  *
  * FIRST "rank" is the position of the match, so if it is 1, the first match
@@ -563,44 +778,26 @@ void lposCommand(client *c) {
     }
     if (checkType(c,o,OBJ_LIST)) return;
 
-    /* If we got the COUNT option, prepare to emit an array. */
-    void *arraylenptr = NULL;
-    if (count != -1) arraylenptr = addReplyDeferredLen(c);
-
-    /* Seek the element. */
-    listTypeIterator *li;
-    li = listTypeInitIterator(o,direction == LIST_HEAD ? -1 : 0,direction);
-    listTypeEntry entry;
-    long llen = listTypeLength(o);
-    long index = 0, matches = 0, matchindex = -1;
-    while (listTypeNext(li,&entry) && (maxlen == 0 || index < maxlen)) {
-        if (listTypeEqual(&entry,ele)) {
-            matches++;
-            matchindex = (direction == LIST_TAIL) ? index : llen - index - 1;
-            if (matches >= rank) {
-                if (arraylenptr) {
-                    addReplyLongLong(c,matchindex);
-                    if (count && matches-rank+1 >= count) break;
-                } else {
-                    break;
-                }
-            }
-        }
-        index++;
-        matchindex = -1; /* Remember if we exit the loop without a match. */
-    }
-    listTypeReleaseIterator(li);
-
-    /* Reply to the client. Note that arraylenptr is not NULL only if
-     * the COUNT option was selected. */
-    if (arraylenptr != NULL) {
-        setDeferredArrayLen(c,arraylenptr,matches-rank+1);
+    /* Seek the matching elements one quicklist node at a time. Without
+     * COUNT we only need the rank-th match. */
+    if (o->encoding != OBJ_ENCODING_QUICKLIST) serverPanic("Unknown list encoding");
+    serverAssertWithInfo(c,ele,sdsEncodedObject(ele));
+    long *indexes;
+    unsigned long found = quicklistFindIndexes(o->ptr,ele->ptr,sdslen(ele->ptr),
+        direction == LIST_HEAD ? AL_START_TAIL : AL_START_HEAD,
+        rank,count == -1 ? 1 : count,maxlen,&indexes);
+
+    if (count != -1) {
+        addReplyArrayLen(c,found);
+        for (unsigned long j = 0; j < found; j++)
+            addReplyLongLong(c,indexes[j]);
     } else {
-        if (matchindex != -1)
-            addReplyLongLong(c,matchindex);
+        if (found)
+            addReplyLongLong(c,indexes[0]);
         else
             addReply(c,shared.null[c->resp]);
     }
+    zfree(indexes);
 }
 
 void lremCommand(client *c) {
@@ -615,24 +812,12 @@ void lremCommand(client *c) {
     subject = lookupKeyWriteOrReply(c,c->argv[1],shared.czero);
     if (subject == NULL || checkType(c,subject,OBJ_LIST)) return;
 
-    listTypeIterator *li;
-    if (toremove < 0) {
-        toremove = -toremove;
-        li = listTypeInitIterator(subject,-1,LIST_HEAD);
-    } else {
-        li = listTypeInitIterator(subject,0,LIST_TAIL);
-    }
-
-    listTypeEntry entry;
-    while (listTypeNext(li,&entry)) {
-        if (listTypeEqual(&entry,obj)) {
-            listTypeDelete(li, &entry);
-            server.dirty++;
-            removed++;
-            if (toremove && removed == toremove) break;
-        }
-    }
-    listTypeReleaseIterator(li);
+    /* A negative count removes from the tail. Every quicklist node is
+     * searched once and its matches are deleted together. */
+    if (subject->encoding != OBJ_ENCODING_QUICKLIST) serverPanic("Unknown list encoding");
+    serverAssertWithInfo(c,obj,sdsEncodedObject(obj));
+    removed = quicklistDelValue(subject->ptr,obj->ptr,sdslen(obj->ptr),toremove);
+    server.dirty += removed;
 
     if (removed) {
         signalModifiedKey(c,c->db,c->argv[1]);
@@ -669,6 +854,7 @@ void rpoplpushHandlePush(client *c, robj *dstkey, robj *dstobj, robj *value) {
         dstobj = createQuicklistObject();
         quicklistSetOptions(dstobj->ptr, server.list_max_ziplist_size,
                             server.list_compress_depth);
+        quicklistSetCodec(dstobj->ptr, server.list_compress_codec);
         dbAdd(c->db,dstkey,dstobj);
     }
     signalModifiedKey(c,c->db,dstkey);
@@ -698,6 +884,8 @@ void rpoplpushCommand(client *c) {
          * currently). */
         incrRefCount(touchedkey);
         rpoplpushHandlePush(c,c->argv[2],dobj,value);
+        listTypeCapTrim(c->db,c->argv[2],lookupKeyWrite(c->db,c->argv[2]),
+                        LIST_HEAD,0);
 
         /* listTypePop returns an object with its refcount incremented */
         decrRefCount(value);
@@ -779,6 +967,8 @@ int serveClientBlockedOnList(client *receiver, robj *key, robj *dstkey, redisDb
                 db->id,argv,3,
                 PROPAGATE_AOF|
                 PROPAGATE_REPL);
+            listTypeCapTrim(db,dstkey,lookupKeyWrite(receiver->db,dstkey),
+                            LIST_HEAD,1);
 
             /* Notify event ("lpush" was notified by rpoplpushHandlePush). */
             notifyKeyspaceEvent(NOTIFY_LIST,"rpop",key,receiver->db->id);
@@ -303,6 +303,7 @@ void mgetCommand(client *c) {
     int j;
 
     addReplyArrayLen(c,c->argc-1); ///发送key的个数给客户端
+    dbPrefetchKeys(c->db,c->argv+1,c->argc-1,1); ///批量预取所有的key，减少下面逐个查找时的缓存缺失
     for (j = 1; j < c->argc; j++) { ///从下标为1的key进行遍历
         robj *o = lookupKeyRead(c->db,c->argv[j]); ///查询每一个key对应的对象
         if (o == NULL) { ///如果对象为空，则直接返回空信息给客户端
@@ -325,6 +326,7 @@ void msetGenericCommand(client *c, int nx) {
         addReplyError(c,"wrong number of arguments for MSET");
         return;
     }
+    dbPrefetchKeys(c->db,c->argv+1,(c->argc-1)/2,2); ///批量预取所有的key，参数中key和value交替出现
 
     /* Handle the NX flag. The MSETNX semantic is to return zero and don't
      * set anything if at least one key alerady exists. */
@@ -41,8 +41,10 @@
  * pointers being only at "level 1". This allows to traverse the list
  * from tail to head, useful for ZREVRANGE. */
 
+#define ZMALLOC_TAG ZMALLOC_TAG_SKIPLIST ///分配分析中记为skiplist，见zmalloc.h
 #include "server.h"
 #include <math.h>
+#include <pthread.h>
 
 /*-----------------------------------------------------------------------------
  * 跳跃表底层API的实现
@@ -55,7 +57,8 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec);
 ///创建一个跳跃表节点
 zskiplistNode *zslCreateNode(int level, double score, sds ele) {
     
-    zskiplistNode *zn = zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));///申请内存空间
+    ///申请内存空间。节点的大小只取决于level，最大的头节点也不超过ZSLAB_MAX_SIZE，所以从slab分配器按大小类分配
+    zskiplistNode *zn = zslab_alloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
     zn->score = score; ///设置该节点的score
     zn->ele = ele; ///设置节点元素
     return zn;
@@ -85,14 +88,14 @@ zskiplist *zslCreate(void) {
 ///释放跳跃表节点，释放节点之前，需要线释放node中的元素
 void zslFreeNode(zskiplistNode *node) {
     sdsfree(node->ele); ///释放node中保存的元素
-    zfree(node); ///释放node的地址空间
+    zslab_free(node); ///释放node的地址空间
 }
 
 ///释放整个跳跃表
 void zslFree(zskiplist *zsl) {
     
     zskiplistNode *node = zsl->header->level[0].forward, *next; ///获取跳跃表的头节点后继
-    zfree(zsl->header); ///释放跳跃表的头节点
+    zslab_free(zsl->header); ///释放跳跃表的头节点
     while(node) { ///如果node不为nkong
         next = node->level[0].forward; ///将next指向node的后继
         zslFreeNode(node); ///释放node节点
@@ -101,24 +104,41 @@ void zslFree(zskiplist *zsl) {
     zfree(zsl); ///释放整个压缩表头
 }
 
+/* 跳跃表层数使用的随机数。每个线程一个xorshift64*的状态，第一次使用时用random()初始化，所以srandom()仍然可以让结果重现。
+ * 以前直接调用random()，它在glibc中每次都要加锁，并且只产生31位，每插入一个节点平均要调用1.33次。 */
+static __thread uint64_t zsl_random_state = 0;
+
+static inline uint64_t zslRandom(void) {
+    uint64_t x = zsl_random_state;
+
+    if (x == 0) x = (((uint64_t)random() << 31) ^ (uint64_t)random()) | 1;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    zsl_random_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
 /* 为我们将要创建的跳过列表节点返回一个随机level。
  * 该函数的返回值在1到ZSKIPLIST_MAXLEVEL之间（包括两者），具有类似于幂律的分布，其中较高级别的返回可能性较小。
  *
  * 解释：什么是幂律分布：
  * 就是：某个属性事件发生的概率和某个属性有特定的关系，少数几个事件发生的概率占了大部分，而其余的事件发生的概率比较小
- */
-int zslRandomLevel(void) {
-    int level = 1;
-    ///ZSKIPLIST_P大小为0.25
-    ///random在（0，1）这个区间内任意产生一个随机数
-    ///所以第一次发生level + 1事件发生的概率为0.25
-    ///第二次发生level + 1事件的概率为0.25 * 0.25
-    ///.........
-    ///因此越高的level发生的概率越小
-    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-        level += 1;
-    ///如果level的值超过了ZSKIPLIST_MAXLEVEL（32），就让它等于最大值
-    return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
+ *
+ * 新节点的层数最多比跳跃表当前的最大层数高1层。偶尔出现的很高的层数对查找没有帮助，
+ * 只会让之后每次查找都从这些几乎为空的层开始。 */
+int zslRandomLevel(zskiplist *zsl) {
+    int level = 1, max = zsl->level + 1;
+
+    if (ZSKIPLIST_P == 0.25) {
+        ///每两位随机数都为0的概率正好是0.25，所以末尾连续为0的位数除以2就是要增加的层数，一个随机数就够了
+        level += __builtin_ctzll(zslRandom() | (1ULL << 63)) / 2;
+    } else {
+        while ((zslRandom() >> 40) < (uint64_t)(ZSKIPLIST_P * (1 << 24)))
+            level += 1;
+    }
+    if (max > ZSKIPLIST_MAXLEVEL) max = ZSKIPLIST_MAXLEVEL;
+    return (level<max) ? level : max;
 }
 
 /* Insert a new node in the skiplist. Assumes the element does not already
@@ -149,7 +169,7 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     }
     
     ///我们假定该元素尚未在内部，因为我们允许重复的分数，因此永远不会发生重新插入同一元素的情况，因为zslInsert（）的调用者应在哈希表中测试该元素是否已在内部。
-    level = zslRandomLevel(); ///获取该节点的随机level
+    level = zslRandomLevel(zsl); ///获取该节点的随机level
     if (level > zsl->level) { ///如果level比跳跃表现在的level要大
         for (i = zsl->level; i < level; i++) { ///需要将
             rank[i] = 0; ///将大于 zsl->level的rank[i]都设置为0
@@ -517,6 +537,61 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
     return NULL;
 }
 
+/* 从排好序的元素一次性建立跳跃表时第i个节点（从1开始）的层数：每1/ZSKIPLIST_P个节点中有一个升高一层，
+ * 各层节点的比例和随机层数的期望相同，但是间隔均匀，查找的路径长度没有随机性，建立的结果也总是一样的。 */
+static int zslSortedLevel(unsigned long i) {
+    unsigned long step = (unsigned long)(1/ZSKIPLIST_P);
+    int level = 1;
+
+    while (i % step == 0 && level < ZSKIPLIST_MAXLEVEL) {
+        i /= step;
+        level++;
+    }
+    return level;
+}
+
+///按(score, ele)比较元素e和给定的分数和元素
+static inline int zsetPairCompare(const zsetPair *e, double score, sds ele) {
+    if (e->score < score) return -1;
+    if (e->score > score) return 1;
+    return sdscmp(e->ele,ele);
+}
+
+/* 用按(score, ele)排好序、互不相同的count个元素建立跳跃表，跳跃表获得这些SDS字符串的所有权。
+ * 节点按顺序追加在末尾，每一层只需要记住最后一个节点和它的排名，所以是O(N)，
+ * 不用像zslInsert()那样每个元素都从头节点开始查找。dict不为NULL时同时把元素加入字典，值指向节点中的score。 */
+zskiplist *zslCreateFromSorted(zsetPair *entries, unsigned long count, dict *dict) {
+    zskiplist *zsl = zslCreate();
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], j;
+    int i, level;
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        last[i] = zsl->header;
+        rank[i] = 0;
+    }
+    for (j = 0; j < count; j++) {
+        level = zslSortedLevel(j+1);
+        if (level > zsl->level) zsl->level = level;
+        x = zslCreateNode(level,entries[j].score,entries[j].ele);
+        x->backward = (j == 0) ? NULL : last[0];
+        for (i = 0; i < level; i++) {
+            x->level[i].forward = NULL;
+            x->level[i].span = 0;
+            last[i]->level[i].forward = x;
+            last[i]->level[i].span = j+1-rank[i];
+            last[i] = x;
+            rank[i] = j+1;
+        }
+        if (dict) serverAssert(dictAdd(dict,entries[j].ele,&x->score) == DICT_OK);
+    }
+    /* 每一层最后一个节点的跨度是它后面的元素个数，和zslInsert()的结果一致。 */
+    for (i = 0; i < zsl->level; i++) last[i]->level[i].span = count-rank[i];
+    zsl->length = count;
+    zsl->tail = (count == 0) ? NULL : last[0];
+    return zsl;
+}
+
 /* Populate the rangespec according to the objects min and max. */
 /// 根据对象的最小值和最大值填充rangespec。
 static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
@@ -719,8 +794,9 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
     return x;
 }
 
+
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Packlist-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -731,7 +807,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(packlistGet(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -744,14 +820,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a packlist element as an SDS string. */
+sds packlistGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(packlistGet(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -768,7 +844,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    serverAssert(packlistGet(eptr,&vstr,&vlen,&vlong));
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -782,7 +858,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return packlistLen(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -791,9 +867,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = packlistNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = packlistNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -810,9 +886,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = packlistPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = packlistPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -834,13 +910,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = packlistIndex(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = packlistIndex(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -852,14 +928,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = packlistIndex(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -871,7 +947,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = packlistNext(zl,sptr);
     }
 
     return NULL;
@@ -880,14 +956,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = packlistIndex(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -900,9 +976,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = packlistPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = packlistPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -911,14 +987,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = packlistGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = packlistGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -934,12 +1010,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = packlistIndex(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = packlistIndex(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -950,7 +1026,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = packlistIndex(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -964,9 +1040,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = packlistNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = packlistNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -975,7 +1051,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = packlistIndex(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -990,9 +1066,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = packlistPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = packlistPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -1001,32 +1077,29 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = packlistIndex(zl,0), *sptr;
 
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+    ///成员和分值交替存放，查找时跳过分值节点
+    if (eptr != NULL) eptr = packlistFind(zl,eptr,(unsigned char*)ele,sdslen(ele),1);
+    if (eptr != NULL) {
+        sptr = packlistNext(zl,eptr);
         serverAssert(sptr != NULL);
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
-            /* Matching element, pull out score. */
-            if (score != NULL) *score = zzlGetScore(sptr);
-            return eptr;
-        }
-
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        /* Matching element, pull out score. */
+        if (score != NULL) *score = zzlGetScore(sptr);
+        return eptr;
     }
     return NULL;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from packlist. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    /* TODO: add function to packlist API to delete N elements from offset. */
+    zl = packlistDelete(zl,&p);
+    zl = packlistDelete(zl,&p);
     return zl;
 }
 
@@ -1038,29 +1111,61 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = packlistPush(zl,(unsigned char*)ele,sdslen(ele),PACKLIST_TAIL);
+        zl = packlistPush(zl,(unsigned char*)scorebuf,scorelen,PACKLIST_TAIL);
     } else {
         /* Keep offset relative to zl, as it might be re-allocated. */
         offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
+        zl = packlistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
         eptr = zl+offset;
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        serverAssert((sptr = packlistNext(zl,eptr)) != NULL);
+        zl = packlistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+    }
+    return zl;
+}
+
+#define ZZL_SCORE_BUFLEN 32 /* d2string() needs at most 24 bytes. */
+
+/* Append 'count' (element,score) pairs at the tail of the packlist, in the
+ * given order. The caller must pass the pairs already sorted by score and
+ * greater than or equal to the last pair in 'zl', as when rebuilding a
+ * packlist from a skiplist. All the pairs are written with a single
+ * packlistPushMany() call, so the packlist is reallocated only once. */
+unsigned char *zzlAppendMany(unsigned char *zl, sds *eles, double *scores, unsigned long count) {
+    unsigned char **vals;
+    unsigned int *lens;
+    char *scorebuf;
+    unsigned long j;
+
+    if (count == 0) return zl;
+    vals = zmalloc(sizeof(unsigned char*)*count*2);
+    lens = zmalloc(sizeof(unsigned int)*count*2);
+    scorebuf = zmalloc(ZZL_SCORE_BUFLEN*count);
+    for (j = 0; j < count; j++) {
+        char *buf = scorebuf+j*ZZL_SCORE_BUFLEN;
+
+        vals[j*2] = (unsigned char*)eles[j];
+        lens[j*2] = sdslen(eles[j]);
+        vals[j*2+1] = (unsigned char*)buf;
+        lens[j*2+1] = d2string(buf,ZZL_SCORE_BUFLEN,scores[j]);
     }
+    zl = packlistPushMany(zl,vals,lens,count*2,PACKLIST_TAIL);
+    zfree(vals);
+    zfree(lens);
+    zfree(scorebuf);
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in packlist. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = packlistIndex(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1079,7 +1184,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = packlistNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1098,14 +1203,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the packlist is deleted, eptr will point to the sentinel
+     * byte and packlistNext will return NULL. */
+    while ((sptr = packlistNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = packlistDelete(zl,&eptr);
+            zl = packlistDelete(zl,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1126,13 +1231,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the packlist is deleted, eptr will point to the sentinel
+     * byte and packlistNext will return NULL. */
+    while ((sptr = packlistNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = packlistDelete(zl,&eptr);
+            zl = packlistDelete(zl,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1149,7 +1254,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = packlistDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1159,7 +1264,7 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
@@ -1172,11 +1277,11 @@ unsigned long zsetLength(const robj *zobj) {
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
     zskiplistNode *node, *next;
-    sds ele;
-    double score;
+    zsetPair *entries;
+    unsigned long len, j = 0;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1188,45 +1293,64 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
 
-        eptr = ziplistIndex(zl,0);
+        eptr = packlistIndex(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
+        /* packlist中的元素已经按(score, ele)排好序，先全部取出来，再一次性建立跳跃表。 */
+        len = zzlLength(zl);
+        entries = zmalloc(sizeof(zsetPair)*len);
         while (eptr != NULL) {
-            score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(NULL,zobj,packlistGet(eptr,&vstr,&vlen,&vlong));
+            entries[j].score = zzlGetScore(sptr);
             if (vstr == NULL)
-                ele = sdsfromlonglong(vlong);
+                entries[j].ele = sdsfromlonglong(vlong);
             else
-                ele = sdsnewlen((char*)vstr,vlen);
-
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+                entries[j].ele = sdsnewlen((char*)vstr,vlen);
+            j++;
             zzlNext(zl,&eptr,&sptr);
         }
+        dictExpand(zs->dict,len);
+        zs->zsl = zslCreateFromSorted(entries,len,zs->dict);
+        zfree(entries);
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
+        zobj->encoding = encoding;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl = packlistNew();
+        sds *eles;
+        double *scores;
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_ZSET_PACKED)
             serverPanic("Unknown target encoding");
 
-        /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
+        /* The skiplist is already sorted, so collect all the pairs and
+         * write them with a single zzlAppendMany() call instead of
+         * growing the packlist once per element. */
         zs = zobj->ptr;
+        len = zsetLength(zobj);
+        eles = zmalloc(sizeof(sds)*len);
+        scores = zmalloc(sizeof(double)*len);
+        for (node = zs->zsl->header->level[0].forward; node; node = node->level[0].forward) {
+            eles[j] = node->ele;
+            scores[j] = node->score;
+            j++;
+        }
+        zl = zzlAppendMany(zl,eles,scores,len);
+        zfree(eles);
+        zfree(scores);
+
+        /* Approach similar to zslFree(), since the dict does not own the
+         * elements. */
         dictRelease(zs->dict);
         node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
+        zslab_free(zs->zsl->header);
         zfree(zs->zsl);
 
         while (node) {
-            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
             next = node->level[0].forward;
             zslFreeNode(node);
             node = next;
@@ -1234,22 +1358,68 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_ZSET_PACKED;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a packlist if it is not already a packlist
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
-    zset *zset = zobj->ptr;
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) return;
+
+    if (zsetLength(zobj) <= server.zset_max_ziplist_entries &&
+        maxelelen <= server.zset_max_ziplist_value)
+            zsetConvert(zobj,OBJ_ENCODING_ZSET_PACKED);
+}
+
+/* 打开了packlist格式时，加载以ziplist编码的小的有序集合（比如RDB文件）之后调用，
+ * 把它转换成packlist编码并释放原来的ziplist。packlist格式关闭时ziplist就是紧凑编码，不做任何处理，其它编码的对象也不做处理。 */
+void zsetConvertFromZiplist(robj *zobj) {
+    unsigned char *zl;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (!packlist_enabled || zobj->encoding != OBJ_ENCODING_ZIPLIST) return;
+    zl = zobj->ptr;
+    zobj->ptr = packlistFromZiplist(zl);
+    zobj->encoding = OBJ_ENCODING_PACKLIST;
+    zfree(zl);
+}
+
+/* 用按(score, ele)排好序、互不相同的count个元素创建有序集合对象，直接选择最终的编码，
+ * 和逐个插入这些元素最后得到的编码相同。数组中的SDS字符串交给新的对象，maxelelen是最长的元素的长度。 */
+robj *zsetCreateFromSorted(zsetPair *entries, unsigned long count, size_t maxelelen) {
+    robj *zobj;
+    zset *zs;
+    unsigned long j;
+
+    if (count <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+    {
+        sds *eles = zmalloc(sizeof(sds)*count);
+        double *scores = zmalloc(sizeof(double)*count);
+
+        for (j = 0; j < count; j++) {
+            eles[j] = entries[j].ele;
+            scores[j] = entries[j].score;
+        }
+        zobj = createZsetPacklistObject();
+        zobj->ptr = zzlAppendMany(zobj->ptr,eles,scores,count);
+        for (j = 0; j < count; j++) sdsfree(eles[j]);
+        zfree(eles);
+        zfree(scores);
+        return zobj;
+    }
+
+    zs = zmalloc(sizeof(*zs));
+    zs->dict = dictCreate(&zsetDictType,NULL);
+    zs->zsl = NULL;
+    dictExpand(zs->dict,count);
+    zobj = createObject(OBJ_ZSET,zs);
+    zs->zsl = zslCreateFromSorted(entries,count,zs->dict);
+    zobj->encoding = OBJ_ENCODING_SKIPLIST;
+    return zobj;
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1259,7 +1429,7 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
@@ -1309,7 +1479,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The command as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from packlist to hashtable+skiplist.
  *
  * Memory management of 'ele':
  *
@@ -1330,7 +1500,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1425,7 +1595,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
@@ -1479,18 +1649,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = packlistIndex(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (packlistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1532,6 +1702,43 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
  * Sorted set commands
  *----------------------------------------------------------------------------*/
 
+/* ZADD创建新的key时，如果score-element对已经严格按(score, ele)递增（这同时保证了元素互不相同），
+ * 就一次性创建有序集合，不用逐个插入。argv指向第一个score，元素没有排好序时返回NULL。
+ * 紧凑编码只复制元素的内容，直接从argv中的SDS字符串写入packlist；跳跃表的节点要持有自己的SDS字符串，
+ * 这时才复制元素，交给zsetCreateFromSorted()。 */
+static robj *zaddCreateFromSortedArgs(robj **argv, double *scores, int elements) {
+    zsetPair *entries;
+    size_t maxelelen = 0;
+    robj *zobj;
+    int j;
+
+    for (j = 0; j < elements; j++) {
+        if (sdslen(argv[j*2+1]->ptr) > maxelelen) maxelelen = sdslen(argv[j*2+1]->ptr);
+        if (j > 0 && (scores[j] < scores[j-1] ||
+            (scores[j] == scores[j-1] && sdscmp(argv[j*2+1]->ptr,argv[j*2-1]->ptr) <= 0)))
+            return NULL;
+    }
+    if ((size_t)elements <= server.zset_max_ziplist_entries &&
+        maxelelen <= server.zset_max_ziplist_value)
+    {
+        sds *eles = zmalloc(sizeof(sds)*elements);
+
+        for (j = 0; j < elements; j++) eles[j] = argv[j*2+1]->ptr;
+        zobj = createZsetPacklistObject();
+        zobj->ptr = zzlAppendMany(zobj->ptr,eles,scores,elements);
+        zfree(eles);
+        return zobj;
+    }
+    entries = zmalloc(sizeof(zsetPair)*elements);
+    for (j = 0; j < elements; j++) {
+        entries[j].score = scores[j];
+        entries[j].ele = sdsdup(argv[j*2+1]->ptr);
+    }
+    zobj = zsetCreateFromSorted(entries,elements,maxelelen);
+    zfree(entries);
+    return zobj;
+}
+
 /* This generic command implements both ZADD and ZINCRBY. */
 void zaddGenericCommand(client *c, int flags) {
     static char *nanerr = "resulting score is not a number (NaN)";
@@ -1603,12 +1810,20 @@ void zaddGenericCommand(client *c, int flags) {
     zobj = lookupKeyWrite(c->db,key);
     if (zobj == NULL) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
+        if (!incr && elements > 1 &&
+            (zobj = zaddCreateFromSortedArgs(c->argv+scoreidx,scores,elements)) != NULL)
+        {
+            dbAdd(c->db,key,zobj);
+            added = elements;
+            server.dirty += added;
+            goto reply_to_client;
+        }
         if (server.zset_max_ziplist_entries == 0 ||
             server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr))
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetPacklistObject();
         }
         dbAdd(c->db,key,zobj);
     } else {
@@ -1741,7 +1956,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1883,11 +2098,11 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_ZSET_PACKED) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = packlistIndex(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = packlistNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -1916,7 +2131,7 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_ZSET_PACKED) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             UNUSED(it); /* skip */
@@ -1942,7 +2157,7 @@ unsigned long zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_ZSET_PACKED) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
@@ -1992,11 +2207,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_ZSET_PACKED) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            serverAssert(packlistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -2110,7 +2325,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_ZSET_PACKED) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2176,6 +2391,298 @@ dictType setAccumulatorDictType = {
     NULL                       /* val destructor */
 };
 
+/* ZUNIONSTORE/ZINTERSTORE的结果不再逐个用zslInsert()插入跳跃表，而是先收集到一个(score, ele)数组中，
+ * 排好序之后一次性生成目标有序集合。
+ *
+ * 结果是按输入的遍历顺序产生的，输入本身按score有序，所以数组通常由少数几段有序的区间组成：
+ * 只有一个输入、输入之间没有重复的元素、或者各个输入中重复元素的分数一致时都是这样。
+ * zsetSortEntries()先找出这些区间，再两两归并，区间很少时接近O(N)，最坏情况也是O(N*log(N))。 */
+
+///把a[lo, mid)和a[mid, hi)两段有序的元素归并到dst[lo, hi)中
+static void zsetMergeEntries(zsetPair *a, zsetPair *dst, size_t lo, size_t mid, size_t hi) {
+    size_t i = lo, j = mid, k = lo;
+
+    while (i < mid && j < hi) {
+        if (zsetPairCompare(&a[j],a[i].score,a[i].ele) < 0)
+            dst[k++] = a[j++];
+        else
+            dst[k++] = a[i++];
+    }
+    if (i < mid) memcpy(dst+k,a+i,sizeof(zsetPair)*(mid-i));
+    if (j < hi) memcpy(dst+k,a+j,sizeof(zsetPair)*(hi-j));
+}
+
+/* 把n个元素按(score, ele)排序，元素必须互不相同。递减的区间先原地反转，
+ * 所以权重为负数的输入产生的结果也是整段有序的。 */
+static void zsetSortEntries(zsetPair *a, size_t n) {
+    size_t *runs, nruns = 0, i, j, k;
+    zsetPair *src, *dst, *tmp, *t, swap;
+
+    if (n < 2) return;
+
+    /* 除了最后一段，每一段至少有两个元素，所以最多n/2+1段，另外还要一个位置放结尾n。 */
+    runs = zmalloc(sizeof(size_t)*(n/2+2));
+    for (i = 0; i < n; i = j) {
+        runs[nruns++] = i;
+        j = i+1;
+        if (j < n && zsetPairCompare(&a[j],a[j-1].score,a[j-1].ele) < 0) {
+            while (j < n && zsetPairCompare(&a[j],a[j-1].score,a[j-1].ele) < 0) j++;
+            for (k = 0; k < (j-i)/2; k++) {
+                swap = a[i+k];
+                a[i+k] = a[j-1-k];
+                a[j-1-k] = swap;
+            }
+        } else {
+            while (j < n && zsetPairCompare(&a[j],a[j-1].score,a[j-1].ele) > 0) j++;
+        }
+    }
+    runs[nruns] = n;
+    if (nruns == 1) {
+        zfree(runs);
+        return;
+    }
+
+    tmp = zmalloc(sizeof(zsetPair)*n);
+    src = a;
+    dst = tmp;
+    while (nruns > 1) {
+        for (i = 0, k = 0; i < nruns; i += 2, k++) {
+            size_t lo = runs[i], mid = runs[i+1];
+            size_t hi = (i+2 <= nruns) ? runs[i+2] : n;
+
+            zsetMergeEntries(src,dst,lo,mid,hi);
+            runs[k] = lo;
+        }
+        nruns = k;
+        runs[nruns] = n;
+        t = src; src = dst; dst = t;
+    }
+    if (src != a) memcpy(a,src,sizeof(zsetPair)*n);
+    zfree(tmp);
+    zfree(runs);
+}
+
+/* 输入很大时，ZUNIONSTORE/ZINTERSTORE可以按元素的hash值分成多个分区，用server.zset_union_threads个线程并行聚合。
+ *
+ * 第一阶段每个线程负责每个输入中连续的一段元素（按排名切分），计算hash值并把(加权后的score, ele)
+ * 分散到各个分区的缓冲区中，同时记录每个输入在缓冲区中结束的位置。第二阶段每个线程负责一个分区，
+ * 按输入的顺序读取所有线程为这个分区收集的元素，在自己的字典中聚合，然后排好序。
+ * 同一个元素在每个输入中最多出现一次，所以聚合的顺序和单线程时完全一样，SUM的结果不会因为浮点数的舍入而不同。
+ * 最后主线程把各个分区的结果归并起来。
+ *
+ * 工作线程只读取输入的跳跃表以及其中的SDS字符串，不访问输入的字典，执行期间主线程在等待，
+ * 所以输入不会被修改。只有所有输入都是跳跃表编码时才使用这条路径。 */
+#define ZUNIONINTER_MAX_THREADS 16
+#define ZUNIONINTER_INTER_SKEW 4 /* ZINTERSTORE最大的输入最多是最小的输入的几倍 */
+
+typedef struct zunionInterBuf {
+    zsetPair *e;
+    size_t len, cap;
+} zunionInterBuf;
+
+typedef struct zunionInterJob {
+    int id, nthreads, op, aggregate;
+    long setnum;
+    zsetopsrc *src;
+    zunionInterBuf *bufs; ///第一阶段：本线程为每个分区收集的元素
+    size_t *ends; ///第一阶段：ends[p*setnum+i]是输入i在bufs[p]中结束的位置
+    struct zunionInterJob *jobs; ///所有线程的任务，第二阶段读取其它线程收集的元素
+    zsetPair *res; ///第二阶段：本分区的结果，已经排好序
+    size_t count, maxelelen;
+} zunionInterJob;
+
+static void zunionInterBufPush(zunionInterBuf *buf, double score, sds ele) {
+    if (buf->len == buf->cap) {
+        buf->cap = buf->cap ? buf->cap*2 : 1024;
+        buf->e = zrealloc(buf->e,sizeof(zsetPair)*buf->cap);
+    }
+    buf->e[buf->len].score = score;
+    buf->e[buf->len].ele = ele;
+    buf->len++;
+}
+
+///第一阶段：把每个输入中属于本线程的一段元素分散到各个分区
+static void *zunionInterScatter(void *arg) {
+    zunionInterJob *job = arg;
+    int p, n = job->nthreads;
+    long i;
+
+    for (i = 0; i < job->setnum; i++) {
+        zsetopsrc *op = &job->src[i];
+        unsigned long len = zuiLength(op);
+        unsigned long start = len*job->id/n, end = len*(job->id+1)/n, j;
+        zskiplistNode *node = NULL;
+
+        if (start < end) {
+            zset *zs = op->subject->ptr;
+            node = zslGetElementByRank(zs->zsl,start+1);
+        }
+        for (j = start; j < end; j++) {
+            double score = node->score;
+            sds ele = node->ele;
+
+            node = node->level[0].forward;
+            /* 和单线程的实现一样，ZINTERSTORE只对第一个输入的分数处理NaN，其余的交给zunionInterAggregate()。 */
+            score *= op->weight;
+            if (isnan(score) && (job->op == SET_OP_UNION || i == 0)) score = 0;
+            /* 用hash值的高位选择分区，低位留给分区中的字典选择hash桶。 */
+            p = (dictSdsHash(ele) >> 40) % n;
+            zunionInterBufPush(&job->bufs[p],score,ele);
+        }
+        for (p = 0; p < n; p++) job->ends[p*job->setnum+i] = job->bufs[p].len;
+    }
+    return NULL;
+}
+
+///第二阶段：聚合本线程负责的分区
+static void *zunionInterAggregatePartition(void *arg) {
+    zunionInterJob *job = arg;
+    dict *acc = dictCreate(&setAccumulatorDictType,NULL);
+    unsigned int *seen = NULL;
+    size_t total = 0, cap, j, k;
+    int w, p = job->id;
+    long i;
+
+    for (w = 0; w < job->nthreads; w++) total += job->jobs[w].bufs[p].len;
+    cap = total;
+    if (job->op == SET_OP_INTER) {
+        /* 只有第一个输入中的元素才可能出现在结果中 */
+        for (cap = 0, w = 0; w < job->nthreads; w++)
+            cap += job->jobs[w].ends[p*job->setnum];
+        seen = zmalloc(sizeof(unsigned int)*(cap ? cap : 1));
+    }
+    job->res = zmalloc(sizeof(zsetPair)*(cap ? cap : 1));
+    job->count = 0;
+    dictExpand(acc,cap);
+
+    for (i = 0; i < job->setnum; i++) {
+        for (w = 0; w < job->nthreads; w++) {
+            zunionInterJob *from = &job->jobs[w];
+            size_t *ends = from->ends+p*job->setnum;
+            zsetPair *e = from->bufs[p].e;
+
+            for (j = (i == 0) ? 0 : ends[i-1]; j < ends[i]; j++) {
+                dictEntry *de, *existing;
+
+                if (job->op == SET_OP_INTER && i > 0) {
+                    if ((de = dictFind(acc,e[j].ele)) == NULL) continue;
+                    k = dictGetUnsignedIntegerVal(de);
+                    zunionInterAggregate(&job->res[k].score,e[j].score,job->aggregate);
+                    seen[k]++;
+                    continue;
+                }
+                de = dictAddRaw(acc,e[j].ele,&existing);
+                if (existing) {
+                    k = dictGetUnsignedIntegerVal(existing);
+                    zunionInterAggregate(&job->res[k].score,e[j].score,job->aggregate);
+                } else {
+                    k = job->count++;
+                    dictSetUnsignedIntegerVal(de,k);
+                    job->res[k] = e[j];
+                    if (seen) seen[k] = 1;
+                }
+            }
+        }
+    }
+    dictRelease(acc);
+
+    /* 结果中的元素复制一份，之后交给目标有序集合；ZINTERSTORE同时去掉没有出现在所有输入中的元素。 */
+    job->maxelelen = 0;
+    for (j = 0, k = 0; j < job->count; j++) {
+        if (seen && seen[j] != (unsigned int)job->setnum) continue;
+        job->res[k].score = job->res[j].score;
+        job->res[k].ele = sdsdup(job->res[j].ele);
+        if (sdslen(job->res[k].ele) > job->maxelelen)
+            job->maxelelen = sdslen(job->res[k].ele);
+        k++;
+    }
+    job->count = k;
+    zfree(seen);
+    zsetSortEntries(job->res,job->count);
+    return NULL;
+}
+
+///在n个线程中执行fn，jobs[0]由当前线程执行。创建线程失败时就在当前线程中执行
+static void zunionInterRunJobs(void *(*fn)(void*), zunionInterJob *jobs, int n) {
+    pthread_t tids[ZUNIONINTER_MAX_THREADS];
+    int started[ZUNIONINTER_MAX_THREADS], j;
+
+    for (j = 1; j < n; j++)
+        started[j] = pthread_create(&tids[j],NULL,fn,&jobs[j]) == 0;
+    fn(&jobs[0]);
+    for (j = 1; j < n; j++) {
+        if (started[j])
+            pthread_join(tids[j],NULL);
+        else
+            fn(&jobs[j]);
+    }
+}
+
+/* 判断是否用多个线程聚合，返回线程的个数，返回1表示在当前线程中完成。 */
+static int zunionInterThreads(zsetopsrc *src, long setnum, int op) {
+    unsigned long total = 0;
+    int nthreads = server.zset_union_threads;
+    long i;
+
+    if (nthreads <= 1) return 1;
+    if (nthreads > ZUNIONINTER_MAX_THREADS) nthreads = ZUNIONINTER_MAX_THREADS;
+    for (i = 0; i < setnum; i++) {
+        if (src[i].subject == NULL) continue;
+        if (src[i].type != OBJ_ZSET || src[i].encoding != OBJ_ENCODING_SKIPLIST) return 1;
+        total += zuiLength(&src[i]);
+    }
+    if (total < server.zset_union_parallel_min) return 1;
+
+    /* 单线程的ZINTERSTORE只遍历最小的输入，在其它输入中查找；并行的实现要遍历所有的输入，
+     * 输入的大小相差很多时反而更慢。 */
+    if (op == SET_OP_INTER &&
+        zuiLength(&src[setnum-1]) > ZUNIONINTER_INTER_SKEW*zuiLength(&src[0])) return 1;
+    return nthreads;
+}
+
+/* 用nthreads个线程聚合，返回排好序的结果，元素的个数和最长的元素的长度保存在*count和*maxelelen中 */
+static zsetPair *zunionInterParallel(zsetopsrc *src, long setnum, int op, int aggregate,
+                                     int nthreads, size_t *count, size_t *maxelelen) {
+    zunionInterJob jobs[ZUNIONINTER_MAX_THREADS];
+    zsetPair *res;
+    size_t total = 0;
+    int j, p;
+
+    for (j = 0; j < nthreads; j++) {
+        jobs[j].id = j;
+        jobs[j].nthreads = nthreads;
+        jobs[j].op = op;
+        jobs[j].aggregate = aggregate;
+        jobs[j].setnum = setnum;
+        jobs[j].src = src;
+        jobs[j].bufs = zcalloc(sizeof(zunionInterBuf)*nthreads);
+        jobs[j].ends = zmalloc(sizeof(size_t)*nthreads*setnum);
+        jobs[j].jobs = jobs;
+        jobs[j].res = NULL;
+    }
+    zunionInterRunJobs(zunionInterScatter,jobs,nthreads);
+    zunionInterRunJobs(zunionInterAggregatePartition,jobs,nthreads);
+
+    /* 每个分区的结果各自有序，拼接起来再归并 */
+    *maxelelen = 0;
+    for (j = 0; j < nthreads; j++) {
+        total += jobs[j].count;
+        if (jobs[j].maxelelen > *maxelelen) *maxelelen = jobs[j].maxelelen;
+    }
+    res = zmalloc(sizeof(zsetPair)*(total ? total : 1));
+    for (total = 0, j = 0; j < nthreads; j++) {
+        memcpy(res+total,jobs[j].res,sizeof(zsetPair)*jobs[j].count);
+        total += jobs[j].count;
+        for (p = 0; p < nthreads; p++) zfree(jobs[j].bufs[p].e);
+        zfree(jobs[j].bufs);
+        zfree(jobs[j].ends);
+        zfree(jobs[j].res);
+    }
+    zsetSortEntries(res,total);
+    *count = total;
+    return res;
+}
+
 void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     int i, j;
     long setnum;
@@ -2185,8 +2692,8 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     sds tmp;
     size_t maxelelen = 0;
     robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
+    zunionInterBuf result = {NULL, 0, 0};
+    int nthreads;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2207,6 +2714,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 
     /* read keys to be used for input */
     src = zcalloc(sizeof(zsetopsrc) * setnum);
+    dbPrefetchKeys(c->db,c->argv+3,setnum,1); ///批量预取所有输入的key
     for (i = 0, j = 3; i < setnum; i++, j++) {
         robj *obj = lookupKeyWrite(c->db,c->argv[j]);
         if (obj != NULL) {
@@ -2272,49 +2780,50 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
     memset(&zval, 0, sizeof(zval));
+    nthreads = zunionInterThreads(src,setnum,op);
 
-    if (op == SET_OP_INTER) {
+    if (op != SET_OP_INTER && op != SET_OP_UNION) {
+        serverPanic("Unknown operator");
+    } else if (op == SET_OP_INTER && zuiLength(&src[0]) == 0) {
         /* Skip everything if the smallest input is empty. */
-        if (zuiLength(&src[0]) > 0) {
-            /* Precondition: as src[0] is non-empty and the inputs are ordered
-             * by size, all src[i > 0] are non-empty too. */
-            zuiInitIterator(&src[0]);
-            while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                for (j = 1; j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else {
-                        break;
-                    }
+    } else if (nthreads > 1) {
+        result.e = zunionInterParallel(src,setnum,op,aggregate,nthreads,
+                                       &result.len,&maxelelen);
+    } else if (op == SET_OP_INTER) {
+        /* Precondition: as src[0] is non-empty and the inputs are ordered
+         * by size, all src[i > 0] are non-empty too. */
+        zuiInitIterator(&src[0]);
+        while (zuiNext(&src[0],&zval)) {
+            double score, value;
+
+            score = src[0].weight * zval.score;
+            if (isnan(score)) score = 0;
+
+            for (j = 1; j < setnum; j++) {
+                /* It is not safe to access the zset we are
+                 * iterating, so explicitly check for equal object. */
+                if (src[j].subject == src[0].subject) {
+                    value = zval.score*src[j].weight;
+                    zunionInterAggregate(&score,value,aggregate);
+                } else if (zuiFind(&src[j],&zval,&value)) {
+                    value *= src[j].weight;
+                    zunionInterAggregate(&score,value,aggregate);
+                } else {
+                    break;
                 }
+            }
 
-                /* Only continue when present in every input. */
-                if (j == setnum) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
-                    if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                }
+            /* Only continue when present in every input. */
+            if (j == setnum) {
+                tmp = zuiNewSdsFromValue(&zval);
+                zunionInterBufPush(&result,score,tmp);
+                if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
             }
-            zuiClearIterator(&src[0]);
         }
-    } else if (op == SET_OP_UNION) {
+        zuiClearIterator(&src[0]);
+    } else {
         dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
-        dictIterator *di;
         dictEntry *de, *existing;
         double score;
 
@@ -2324,8 +2833,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             dictExpand(accumulator,zuiLength(&src[setnum-1]));
         }
 
-        /* Step 1: Create a dictionary of elements -> aggregated-scores
-         * by iterating one sorted set after the other. */
+        /* Create a dictionary of elements -> position of the element in
+         * the result array, by iterating one sorted set after the other.
+         * The aggregated scores are kept in the result array itself. */
         for (i = 0; i < setnum; i++) {
             if (zuiLength(&src[i]) == 0) continue;
 
@@ -2341,49 +2851,35 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to use a packlist
                      * at the end. */
-                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
+                    if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
                     dictSetKey(accumulator, de, tmp);
-                    dictSetDoubleVal(de,score);
+                    dictSetUnsignedIntegerVal(de,result.len);
+                    zunionInterBufPush(&result,score,tmp);
                 } else {
                     /* Update the score with the score of the new instance
-                     * of the element found in the current sorted set.
-                     *
-                     * Here we access directly the dictEntry double
-                     * value inside the union as it is a big speedup
-                     * compared to using the getDouble/setDouble API. */
-                    zunionInterAggregate(&existing->v.d,score,aggregate);
+                     * of the element found in the current sorted set. */
+                    zunionInterAggregate(&result.e[dictGetUnsignedIntegerVal(existing)].score,
+                                         score,aggregate);
                 }
             }
             zuiClearIterator(&src[i]);
         }
-
-        /* Step 2: convert the dictionary into the final sorted set. */
-        di = dictGetIterator(accumulator);
-
-        /* We now are aware of the final size of the resulting sorted set,
-         * let's resize the dictionary embedded inside the sorted set to the
-         * right size, in order to save rehashing time. */
-        dictExpand(dstzset->dict,dictSize(accumulator));
-
-        while((de = dictNext(di)) != NULL) {
-            sds ele = dictGetKey(de);
-            score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
-        }
-        dictReleaseIterator(di);
         dictRelease(accumulator);
-    } else {
-        serverPanic("Unknown operator");
     }
 
+    /* The results were produced following the inputs, which are sorted by
+     * score, so the array is usually made of a few sorted runs that just
+     * need to be merged. Then the destination is built in bulk, directly
+     * with its final encoding. */
+    if (nthreads == 1) zsetSortEntries(result.e,result.len);
+
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (result.len) {
+        dstobj = zsetCreateFromSorted(result.e,result.len,maxelelen);
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c,c->db,dstkey);
@@ -2392,7 +2888,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             dstkey,c->db->id);
         server.dirty++;
     } else {
-        decrRefCount(dstobj);
         addReply(c,shared.czero);
         if (touched) {
             signalModifiedKey(c,c->db,dstkey);
@@ -2400,6 +2895,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             server.dirty++;
         }
     }
+    zfree(result.e);
     zfree(src);
 }
 
@@ -2411,6 +2907,124 @@ void zinterstoreCommand(client *c) {
     zunionInterGenericCommand(c,c->argv[1], SET_OP_INTER);
 }
 
+/* ZRANGE和ZRANGEBYSCORE回复跳跃表编码的有序集合时，不再对每个元素和分数分别调用addReplyBulkCBuffer()
+ * 和addReplyDouble()（每次都要追加好几次输出缓冲区，回复很长时还会产生很多回复节点），而是沿着level[0]
+ * 把连续的元素的RESP直接拼接在一个PROTO_REPLY_CHUNK_BYTES的缓冲区中，满了才用一次addReplyProto()追加，
+ * 和LRANGE的addListRangeReply()一样。放不进缓冲区的大元素单独回复。 */
+typedef struct zsetReplyBuf {
+    client *c;
+    int withscores;
+    size_t used;
+    char buf[PROTO_REPLY_CHUNK_BYTES];
+} zsetReplyBuf;
+
+/* 格式化过的分数的缓存，按分数的二进制表示直接映射。排行榜这类被反复读取的有序集合每次都要把同样的分数
+ * 用snprintf("%.17g")格式化一遍，查缓存只需要复制字符串。缓存不放在节点中，否则每个节点都要多占用内存。
+ * 整数分数用ll2string()格式化已经足够快，不放进缓存。只在执行命令的主线程中使用。 */
+#define ZSET_SCORE_CACHE_BITS 12
+typedef struct zsetScoreCacheEntry {
+    uint64_t bits; ///分数的二进制表示
+    unsigned char len; ///字符串的长度，0表示这个位置是空的
+    char str[24]; ///"%.17g"最多产生24个字符，不包括结尾的'\0'
+} zsetScoreCacheEntry;
+
+static zsetScoreCacheEntry zset_score_cache[1<<ZSET_SCORE_CACHE_BITS];
+
+/* 把分数按addReplyDouble()的格式写到buf中，返回长度。buf至少要有ZZL_SCORE_BUFLEN个字节。 */
+static int zsetFormatScore(char *buf, double score) {
+    zsetScoreCacheEntry *ce;
+    uint64_t bits;
+    int len;
+
+    if (score > -4503599627370496.0 && score < 4503599627370496.0 &&
+        score == (double)(long long)score)
+        return d2string(buf,ZZL_SCORE_BUFLEN,score);
+
+    memcpy(&bits,&score,sizeof(bits));
+    ce = &zset_score_cache[(bits*0x9E3779B97F4A7C15ULL) >> (64-ZSET_SCORE_CACHE_BITS)];
+    if (ce->len && ce->bits == bits) {
+        memcpy(buf,ce->str,ce->len);
+        return ce->len;
+    }
+    len = d2string(buf,ZZL_SCORE_BUFLEN,score);
+    if (len > 0 && len <= (int)sizeof(ce->str)) {
+        ce->bits = bits;
+        ce->len = len;
+        memcpy(ce->str,buf,len);
+    }
+    return len;
+}
+
+static void zsetReplyInit(zsetReplyBuf *rb, client *c, int withscores) {
+    rb->c = c;
+    rb->withscores = withscores;
+    rb->used = 0;
+}
+
+static void zsetReplyFlush(zsetReplyBuf *rb) {
+    if (rb->used) addReplyProto(rb->c,rb->buf,rb->used);
+    rb->used = 0;
+}
+
+/* 回复一个元素，withscores时后面跟着它的分数，RESP3中两者放在一个长度为2的数组中 */
+static void zsetReplyAdd(zsetReplyBuf *rb, sds ele, double score) {
+    /* 除了元素本身，最多还有"*2\r\n"、两个"$"和长度、三个CRLF以及分数 */
+    const size_t extra = 2*LONG_STR_SIZE+ZZL_SCORE_BUFLEN+16;
+    client *c = rb->c;
+    size_t len = sdslen(ele);
+    char *p;
+
+    if (len+extra > sizeof(rb->buf)) {
+        zsetReplyFlush(rb);
+        if (rb->withscores && c->resp > 2) addReplyArrayLen(c,2);
+        addReplyBulkCBuffer(c,ele,len);
+        if (rb->withscores) addReplyDouble(c,score);
+        return;
+    }
+    if (rb->used+len+extra > sizeof(rb->buf)) zsetReplyFlush(rb);
+
+    p = rb->buf+rb->used;
+    if (rb->withscores && c->resp > 2) {
+        memcpy(p,"*2\r\n",4);
+        p += 4;
+    }
+    *p++ = '$';
+    p += ll2string(p,LONG_STR_SIZE,len);
+    *p++ = '\r';
+    *p++ = '\n';
+    memcpy(p,ele,len);
+    p += len;
+    *p++ = '\r';
+    *p++ = '\n';
+    if (rb->withscores) {
+        char num[ZZL_SCORE_BUFLEN];
+        int slen = zsetFormatScore(num,score);
+
+        if (c->resp > 2) {
+            *p++ = ',';
+        } else {
+            *p++ = '$';
+            p += ll2string(p,LONG_STR_SIZE,slen);
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+        memcpy(p,num,slen);
+        p += slen;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    rb->used = p-rb->buf;
+}
+
+/* 范围中有count个元素时，跳过offset个、再最多取limit个（负数表示不限制）之后的元素个数。
+ * 负的偏移量返回0，和以前逐个跳过元素时的结果一样。 */
+static unsigned long zsetLimitRange(unsigned long count, long offset, long limit) {
+    if (offset < 0 || (unsigned long)offset >= count) return 0;
+    count -= offset;
+    if (limit >= 0 && (unsigned long)limit < count) count = limit;
+    return count;
+}
+
 void zrangeGenericCommand(client *c, int reverse) {
     robj *key = c->argv[1];
     robj *zobj;
@@ -2456,7 +3070,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     else
         addReplyArrayLen(c, rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2464,16 +3078,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = packlistIndex(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = packlistIndex(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,packlistGet(eptr,&vstr,&vlen,&vlong));
 
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             if (vstr == NULL)
@@ -2492,7 +3106,7 @@ void zrangeGenericCommand(client *c, int reverse) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
         zskiplistNode *ln;
-        sds ele;
+        zsetReplyBuf rb;
 
         /* Check if starting point is trivial, before doing log(N) lookup. */
         if (reverse) {
@@ -2505,14 +3119,13 @@ void zrangeGenericCommand(client *c, int reverse) {
                 ln = zslGetElementByRank(zsl,start+1);
         }
 
+        zsetReplyInit(&rb,c,withscores);
         while(rangelen--) {
             serverAssertWithInfo(c,zobj,ln != NULL);
-            ele = ln->ele;
-            if (withscores && c->resp > 2) addReplyArrayLen(c,2);
-            addReplyBulkCBuffer(c,ele,sdslen(ele));
-            if (withscores) addReplyDouble(c,ln->score);
+            zsetReplyAdd(&rb,ln->ele,ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+        zsetReplyFlush(&rb);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2581,7 +3194,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptyarray)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2604,7 +3217,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2631,9 +3244,9 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so packlistGet should always
              * succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,packlistGet(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
@@ -2654,62 +3267,48 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistNode *first, *last, *ln;
+        unsigned long rfirst, rlast;
+        zsetReplyBuf rb;
 
-        /* If reversed, get the last node in range as starting point. */
-        if (reverse) {
-            ln = zslLastInRange(zsl,&range);
-        } else {
-            ln = zslFirstInRange(zsl,&range);
-        }
+        first = zslFirstInRange(zsl,&range);
 
         /* No "first" element in the specified interval. */
-        if (ln == NULL) {
+        if (first == NULL) {
             addReply(c,shared.emptyarray);
             return;
         }
 
-        /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addReplyDeferredLen(c);
-
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
-
-        while (ln && limit--) {
-            /* Abort when the node is no longer in range. */
-            if (reverse) {
-                if (!zslValueGteMin(ln->score,&range)) break;
-            } else {
-                if (!zslValueLteMax(ln->score,&range)) break;
-            }
-
-            rangelen++;
-            if (withscores && c->resp > 2) addReplyArrayLen(c,2);
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
-            if (withscores) addReplyDouble(c,ln->score);
+        /* 先按两端的排名算出范围中元素的个数，再去掉偏移量、限制个数，这样可以直接回复准确的数组长度，
+         * 不需要addReplyDeferredLen()，偏移量也按排名定位，不用一个一个地跳过。 */
+        last = zslLastInRange(zsl,&range);
+        rfirst = zslGetRank(zsl,first->score,first->ele);
+        rlast = zslGetRank(zsl,last->score,last->ele);
+        rangelen = zsetLimitRange(rlast-rfirst+1,offset,limit);
+        addReplyArrayLen(c,(withscores && c->resp == 2) ? rangelen*2 : rangelen);
+        if (rangelen == 0) return;
+
+        if (offset == 0)
+            ln = reverse ? last : first;
+        else
+            ln = zslGetElementByRank(zsl,reverse ? rlast-offset : rfirst+offset);
 
-            /* Move to next node */
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
+        zsetReplyInit(&rb,c,withscores);
+        while (rangelen--) {
+            serverAssertWithInfo(c,zobj,ln != NULL);
+            zsetReplyAdd(&rb,ln->ele,ln->score);
+            ln = reverse ? ln->backward : ln->level[0].forward;
         }
+        zsetReplyFlush(&rb);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 
-    if (withscores && c->resp == 2) rangelen *= 2;
-    setDeferredArrayLen(c, replylen, rangelen);
+    /* 只有packlist编码事先不知道元素的个数 */
+    if (replylen) {
+        if (withscores && c->resp == 2) rangelen *= 2;
+        setDeferredArrayLen(c, replylen, rangelen);
+    }
 }
 
 void zrangebyscoreCommand(client *c) {
@@ -2736,7 +3335,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2751,7 +3350,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2817,7 +3416,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2832,7 +3431,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2930,7 +3529,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2953,7 +3552,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = packlistNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2978,9 +3577,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so packlistGet should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,packlistGet(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -3176,7 +3775,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_ZSET_PACKED) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3184,16 +3783,16 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = packlistIndex(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,packlistGet(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = packlistNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
         } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -3267,6 +3866,7 @@ void blockingGenericZpopCommand(client *c, int where) {
     if (getTimeoutFromObjectOrReply(c,c->argv[c->argc-1],&timeout,UNIT_SECONDS)
         != C_OK) return;
 
+    dbPrefetchKeys(c->db,c->argv+1,c->argc-2,1); ///批量预取所有的key
     for (j = 1; j < c->argc-1; j++) {
         o = lookupKeyWrite(c->db,c->argv[j]);
         if (o != NULL) {
@@ -3307,3 +3907,316 @@ void bzpopminCommand(client *c) {
 void bzpopmaxCommand(client *c) {
     blockingGenericZpopCommand(c,ZSET_MAX);
 }
+
+#ifdef REDIS_TEST
+/* 检查跳跃表的结构：第0层按(score, ele)排序并且backward和tail正确，每一层的span都和第0层的排名一致，
+ * zslGetRank()和zslGetElementByRank()的结果正确。返回发现的错误个数。 */
+static int zslTestVerify(zskiplist *zsl) {
+    zskiplistNode **nodes = zmalloc(sizeof(*nodes)*(zsl->length+1));
+    zskiplistNode *x = zsl->header->level[0].forward, *prev = NULL;
+    unsigned long rank = 0;
+    int errors = 0, i;
+
+    while (x) {
+        if (x->backward != prev) errors++;
+        if (prev && (prev->score > x->score ||
+                     (prev->score == x->score && sdscmp(prev->ele,x->ele) >= 0))) errors++;
+        nodes[++rank] = x;
+        prev = x;
+        x = x->level[0].forward;
+    }
+    if (rank != zsl->length || zsl->tail != prev) errors++;
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        if (i >= zsl->level) {
+            if (zsl->header->level[i].forward) errors++;
+            continue;
+        }
+        x = zsl->header;
+        rank = 0;
+        while (x->level[i].forward) {
+            rank += x->level[i].span;
+            if (rank > zsl->length || nodes[rank] != x->level[i].forward) {
+                errors++;
+                break;
+            }
+            x = x->level[i].forward;
+        }
+    }
+
+    for (rank = 1; rank <= zsl->length; rank += 1 + rank/64) {
+        if (zslGetRank(zsl,nodes[rank]->score,nodes[rank]->ele) != rank) errors++;
+        if (zslGetElementByRank(zsl,rank) != nodes[rank]) errors++;
+    }
+    zfree(nodes);
+    return errors;
+}
+
+
+///以前的层数生成方式，只在下面的基准测试中用来比较
+static int zslTestCompareEntries(const void *a, const void *b) {
+    const zsetPair *x = a, *y = b;
+    return zsetPairCompare(x,y->score,y->ele);
+}
+
+static int zslTestLibcLevel(void) {
+    int level = 1;
+    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
+        level += 1;
+    return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
+}
+
+int zslTest(int argc, char **argv) {
+    int errors = 0;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srandom(1234);
+
+    printf("Skiplist stays consistent under inserts, updates and deletes: ");
+    {
+        zskiplist *zsl = zslCreate();
+        int n = 100000;
+        double *scores = zmalloc(sizeof(double)*n);
+        sds *eles = zmalloc(sizeof(sds)*n);
+        unsigned long levels[ZSKIPLIST_MAXLEVEL] = {0};
+
+        for (int i = 0; i < n; i++) {
+            scores[i] = random() % 1000; ///有很多相同的score，需要按ele排序
+            eles[i] = sdscatprintf(sdsempty(),"ele:%d",i);
+            zslInsert(zsl,scores[i],eles[i]);
+        }
+        errors += zslTestVerify(zsl);
+
+        ///统计每一层的节点数，第k层（从0开始）的节点应该约占1/4^k，最高的层数也只比log4(n)多几层
+        for (int i = 0; i < zsl->level; i++) {
+            unsigned long cnt = 0;
+            for (zskiplistNode *x = zsl->header->level[i].forward; x; x = x->level[i].forward) cnt++;
+            levels[i] = cnt;
+        }
+        if (levels[1] < (unsigned long)(n/4 - n/40) || levels[1] > (unsigned long)(n/4 + n/40)) errors++;
+        if (levels[2] < (unsigned long)(n/16 - n/80) || levels[2] > (unsigned long)(n/16 + n/80)) errors++;
+        if (zsl->level > 14) errors++;
+
+        for (int i = 0; i < n; i += 3) {
+            double newscore = random() % 1000;
+            zslUpdateScore(zsl,scores[i],eles[i],newscore);
+            scores[i] = newscore;
+        }
+        errors += zslTestVerify(zsl);
+        for (int i = 0; i < n; i += 2) {
+            zskiplistNode *node;
+            if (!zslDelete(zsl,scores[i],eles[i],&node)) errors++;
+            else zslFreeNode(node);
+        }
+        errors += zslTestVerify(zsl);
+        zslFree(zsl);
+        zfree(scores);
+        zfree(eles);
+        printf("%s\n\n", errors ? "FAILED" : "SUCCESS");
+    }
+
+
+    printf("Benchmark skiplist level generation, random() vs thread-local xorshift:\n");
+    {
+        zskiplist *zsl = zslCreate();
+        long long start, libc, fast, sum = 0;
+        int iter = 10000000;
+
+        zsl->level = ZSKIPLIST_MAXLEVEL;
+        start = ustime();
+        for (int i = 0; i < iter; i++) sum += zslTestLibcLevel();
+        libc = ustime()-start;
+        start = ustime();
+        for (int i = 0; i < iter; i++) sum += zslRandomLevel(zsl);
+        fast = ustime()-start;
+        printf("%d levels: random() %lld usec, xorshift %lld usec (%lld)\n\n",iter,libc,fast,sum & 1);
+        zslFree(zsl);
+    }
+
+    printf("Benchmark ZADD, ZRANGEBYSCORE and ZRANK on a 1M element skiplist:\n");
+    {
+        zskiplist *zsl = zslCreate();
+        int n = 1000000;
+        double *scores = zmalloc(sizeof(double)*n);
+        sds *eles = zmalloc(sizeof(sds)*n);
+        long long start, zadd, range, rank;
+        unsigned long sum = 0;
+
+        for (int i = 0; i < n; i++) {
+            scores[i] = (double)random() / RAND_MAX * 1e9;
+            eles[i] = sdscatprintf(sdsempty(),"member:%d",i);
+        }
+        start = ustime();
+        for (int i = 0; i < n; i++) zslInsert(zsl,scores[i],eles[i]);
+        zadd = ustime()-start;
+
+        start = ustime();
+        for (int i = 0; i < n; i++) {
+            zrangespec spec = {scores[i], scores[i] + 1e4, 0, 0};
+            zskiplistNode *x = zslFirstInRange(zsl,&spec);
+            for (int j = 0; x && j < 10 && zslValueLteMax(x->score,&spec); j++) {
+                sum += sdslen(x->ele);
+                x = x->level[0].forward;
+            }
+        }
+        range = ustime()-start;
+
+        start = ustime();
+        for (int i = 0; i < n; i++) {
+            int k = ((unsigned long)i * 7919) % n;
+            sum += zslGetRank(zsl,scores[k],eles[k]);
+        }
+        rank = ustime()-start;
+
+        printf("%d elements (%d levels): ZADD %lld usec, ZRANGEBYSCORE LIMIT 10 %lld usec, ZRANK %lld usec (%lu)\n\n",
+            n,zsl->level,zadd,range,rank,sum & 1);
+        zslFree(zsl);
+        zfree(scores);
+        zfree(eles);
+    }
+
+    printf("Union results are sorted by runs and built into a skiplist in bulk: ");
+    {
+        int n = 60000, err = 0;
+        zsetPair *a = zmalloc(sizeof(zsetPair)*n), *b = zmalloc(sizeof(zsetPair)*n);
+        zskiplist *zsl;
+        dict *d = dictCreate(&zsetDictType,NULL);
+        zskiplistNode *x;
+        unsigned long cnt;
+
+        /* 模拟ZUNIONSTORE的结果：递增的一段、递减的一段（权重为负数），最后一段是聚合之后打乱的分数 */
+        for (int i = 0; i < n; i++) {
+            if (i < n/3) a[i].score = i/2;
+            else if (i < n*2/3) a[i].score = -(double)i;
+            else a[i].score = random() % 1000;
+            a[i].ele = sdscatprintf(sdsempty(),"e%d",i);
+        }
+        memcpy(b,a,sizeof(zsetPair)*n);
+        zsetSortEntries(a,n);
+        qsort(b,n,sizeof(zsetPair),zslTestCompareEntries);
+        for (int i = 0; i < n; i++) if (a[i].ele != b[i].ele) err++;
+
+        zsl = zslCreateFromSorted(a,n,d);
+        if (zslTestVerify(zsl)) err++;
+        x = zsl->header->level[0].forward;
+        for (int i = 0; i < n; i++, x = x->level[0].forward) {
+            if (x->ele != a[i].ele) { err++; break; }
+        }
+        if (dictSize(d) != (unsigned long)n ||
+            *(double*)dictFetchValue(d,a[n/2].ele) != a[n/2].score) err++;
+
+        ///层数是确定的：第k层（从0开始）正好有n/4^k个节点
+        for (int i = 1; i < 4; i++) {
+            cnt = 0;
+            for (x = zsl->header->level[i].forward; x; x = x->level[i].forward) cnt++;
+            if (cnt != (unsigned long)n >> (2*i)) err++;
+        }
+
+        ///之后仍然可以正常地插入和删除
+        dictRelease(d);
+        for (int i = 0; i < n; i += 7) {
+            zskiplistNode *node;
+            if (!zslDelete(zsl,a[i].score,a[i].ele,&node)) err++;
+            else zslFreeNode(node);
+        }
+        for (int i = 0; i < 5000; i++)
+            zslInsert(zsl,random() % 1000,sdscatprintf(sdsempty(),"new%d",i));
+        if (zslTestVerify(zsl)) err++;
+        zslFree(zsl);
+        zfree(a);
+        zfree(b);
+        errors += err;
+        printf("%s\n\n", err ? "FAILED" : "SUCCESS");
+    }
+
+    printf("Benchmark building a 1M element skiplist from sorted input:\n");
+    {
+        int n = 1000000;
+        zsetPair *a = zmalloc(sizeof(zsetPair)*n);
+        zskiplist *zsl[2];
+        long long build[2], rank[2];
+        unsigned long sum = 0;
+
+        for (int i = 0; i < n; i++) {
+            a[i].score = i/3;
+            a[i].ele = sdscatprintf(sdsempty(),"ele:%08d",i);
+        }
+        for (int type = 0; type < 2; type++) {
+            long long start = ustime();
+            if (type == 0) {
+                zsl[0] = zslCreate();
+                for (int i = 0; i < n; i++) zslInsert(zsl[0],a[i].score,a[i].ele);
+            } else {
+                zsl[1] = zslCreateFromSorted(a,n,NULL);
+            }
+            build[type] = ustime()-start;
+
+            start = ustime();
+            for (int i = 0; i < n; i++) {
+                int k = ((unsigned long)i * 7919) % n;
+                sum += zslGetRank(zsl[type],a[k].score,a[k].ele);
+            }
+            rank[type] = ustime()-start;
+        }
+        printf("zslInsert %lld usec, zslCreateFromSorted %lld usec; ZRANK random levels %lld usec, deterministic levels %lld usec (%lu)\n\n",
+            build[0],build[1],rank[0],rank[1],sum & 1);
+
+        /* 两个跳跃表共享同样的元素，只让第二个释放它们 */
+        for (zskiplistNode *x = zsl[0]->header->level[0].forward; x; x = x->level[0].forward) x->ele = NULL;
+        zslFree(zsl[0]);
+        zslFree(zsl[1]);
+        zfree(a);
+    }
+
+    printf("Score strings for replies match the %%.17g format of addReplyDouble(): ");
+    {
+        double special[] = {0.0, -0.0, 1.0, -1.0, 0.5, -2.75, 1e17, -1e17, 4503599627370495.0,
+                            4503599627370496.0, -4503599627370496.0, 1e300, 5e-324,
+                            INFINITY, -INFINITY, 3.141592653589793};
+        int nspecial = sizeof(special)/sizeof(special[0]), n = 100000, err = 0;
+        double *scores = zmalloc(sizeof(double)*n);
+
+        for (int i = 0; i < n; i++) {
+            if (i < nspecial) scores[i] = special[i];
+            else if (i % 3 == 0) scores[i] = (double)(random() % 2000000) - 1000000;
+            else scores[i] = ((double)random() - RAND_MAX/2) / ((random() % 1000) + 1);
+        }
+        ///第二轮大部分从缓存中取
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < n; i++) {
+                char buf[ZZL_SCORE_BUFLEN], expected[64];
+                int len = zsetFormatScore(buf,scores[i]), elen;
+
+                if (isinf(scores[i]))
+                    elen = snprintf(expected,sizeof(expected),"%s",scores[i] > 0 ? "inf" : "-inf");
+                else
+                    elen = snprintf(expected,sizeof(expected),"%.17g",scores[i]);
+                if (len != elen || memcmp(buf,expected,len) != 0) err++;
+            }
+        }
+        errors += err;
+        printf("%s\n\n", err ? "FAILED" : "SUCCESS");
+
+        printf("Benchmark formatting the scores of the top 1000 of a leaderboard 10k times: ");
+        {
+            long long start, plain, cached;
+            unsigned long sum = 0;
+            char buf[ZZL_SCORE_BUFLEN];
+
+            start = ustime();
+            for (int i = 0; i < 10000000; i++)
+                sum += snprintf(buf,sizeof(buf),"%.17g",scores[nspecial+1+(i%1000)*3]);
+            plain = ustime()-start;
+            start = ustime();
+            for (int i = 0; i < 10000000; i++)
+                sum += zsetFormatScore(buf,scores[nspecial+1+(i%1000)*3]);
+            cached = ustime()-start;
+            printf("snprintf %lld usec, zsetFormatScore %lld usec (%lu)\n\n",plain,cached,sum & 1);
+        }
+        zfree(scores);
+    }
+
+    return errors;
+}
+#endif
@@ -0,0 +1,1028 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ */
+
+#include "zbtree.h"
+
+#ifdef USE_ZSET_BTREE
+
+/*-----------------------------------------------------------------------------
+ * B+树底层API的实现
+ *----------------------------------------------------------------------------*/
+
+/* 有序集合可以用一棵按(score, ele)排序的B+树代替跳跃表，字典仍然把ele映射到score，
+ * 不过score要直接保存在字典节点中（dictSetDoubleVal），因为B+树中的元素会在节点之间移动。
+ *
+ * 叶子节点连续地保存最多ZBT_LEAF_SIZE个元素，每个元素只有16个字节，范围查询和遍历基本上是顺序地读数组；
+ * 跳跃表每个元素要一个单独分配的节点，平均四十多个字节，遍历时每一步都可能是一次缓存未命中。
+ * 内部节点记录每个孩子下面的元素个数，所以按排名查找和计算排名都是O(log(N))。
+ *
+ * 内部节点的key[i]是child[i]下面最小的元素，它的ele和叶子节点共享同一个SDS。叶子节点的第一个元素改变时
+ * 必须用zbtFixMin()更新上层的key，否则key会引用已经被释放的字符串。
+ *
+ * 节点不保存父节点指针，修改操作从根节点向下查找时把经过的内部节点和孩子下标记录在zbtPath中。
+ *
+ * 这个文件只在定义了USE_ZSET_BTREE时编译，见zbtree.h。 */
+
+#define ZBT_MAX_DEPTH 32
+
+///按(score, ele)比较元素e和给定的分数和元素
+static inline int zbtCompare(const zbtEntry *e, double score, sds ele) {
+    if (e->score < score) return -1;
+    if (e->score > score) return 1;
+    return sdscmp(e->ele,ele);
+}
+
+typedef struct zbtPath {
+    zbtInner *node[ZBT_MAX_DEPTH]; ///从根节点开始经过的内部节点
+    unsigned int idx[ZBT_MAX_DEPTH]; ///在node[i]中走向的孩子的下标
+    int depth; ///内部节点的个数，也就是叶子节点的深度
+} zbtPath;
+
+///判断元素e是否排在要找的位置之前，对排好序的元素必须先返回真再返回假
+typedef int zbtBeforeFn(zbtEntry *e, void *ctx);
+
+static int zbtBeforeKey(zbtEntry *e, void *ctx) {
+    zbtEntry *key = ctx;
+    return zbtCompare(e,key->score,key->ele) <= 0;
+}
+
+static int zbtBeforeMin(zbtEntry *e, void *ctx) {
+    return !zslValueGteMin(e->score,ctx);
+}
+
+static int zbtBeforeMax(zbtEntry *e, void *ctx) {
+    return zslValueLteMax(e->score,ctx);
+}
+
+static int zbtBeforeLexMin(zbtEntry *e, void *ctx) {
+    return !zslLexValueGteMin(e->ele,ctx);
+}
+
+static int zbtBeforeLexMax(zbtEntry *e, void *ctx) {
+    return zslLexValueLteMax(e->ele,ctx);
+}
+
+///创建一棵空的B+树
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+
+    zbt->root = NULL;
+    zbt->head = zbt->tail = NULL;
+    zbt->length = 0;
+    zbt->leaves = zbt->inners = 0;
+    return zbt;
+}
+
+static zbtLeaf *zbtCreateLeaf(zbtree *zbt) {
+    zbtLeaf *leaf = zmalloc(sizeof(*leaf));
+
+    leaf->node.leaf = 1;
+    leaf->node.n = 0;
+    leaf->prev = leaf->next = NULL;
+    zbt->leaves++;
+    return leaf;
+}
+
+static zbtInner *zbtCreateInner(zbtree *zbt) {
+    zbtInner *inner = zmalloc(sizeof(*inner));
+
+    inner->node.leaf = 0;
+    inner->node.n = 0;
+    zbt->inners++;
+    return inner;
+}
+
+///释放一个节点，叶子节点先从链表中摘除。节点中的元素由调用者处理
+static void zbtFreeNode(zbtree *zbt, zbtNode *x) {
+    if (x->leaf) {
+        zbtLeaf *leaf = (zbtLeaf*)x;
+        if (leaf->prev) leaf->prev->next = leaf->next;
+        else zbt->head = leaf->next;
+        if (leaf->next) leaf->next->prev = leaf->prev;
+        else zbt->tail = leaf->prev;
+        zbt->leaves--;
+    } else {
+        zbt->inners--;
+    }
+    zfree(x);
+}
+
+///释放x和它下面的所有节点以及元素
+static void zbtFreeSubtree(zbtNode *x) {
+    unsigned int j;
+
+    if (x->leaf) {
+        zbtLeaf *leaf = (zbtLeaf*)x;
+        for (j = 0; j < x->n; j++) sdsfree(leaf->e[j].ele);
+    } else {
+        zbtInner *inner = (zbtInner*)x;
+        for (j = 0; j < x->n; j++) zbtFreeSubtree(inner->child[j]);
+    }
+    zfree(x);
+}
+
+/* 释放整棵B+树，元素的SDS也一起释放，除非之前把它们设置成了NULL */
+void zbtFree(zbtree *zbt) {
+    if (zbt->root) zbtFreeSubtree(zbt->root);
+    zfree(zbt);
+}
+
+///节点中最小的元素
+static inline zbtEntry *zbtNodeMin(zbtNode *x) {
+    return x->leaf ? &((zbtLeaf*)x)->e[0] : &((zbtInner*)x)->key[0];
+}
+
+/* 深度为depth的节点（在path中）的最小元素变成了*min，更新上层引用它的key。
+ * 只要节点是父节点的第一个孩子，父节点的最小元素也跟着改变，所以继续向上。 */
+static void zbtFixMin(zbtPath *path, int depth, zbtEntry *min) {
+    zbtEntry e = *min;
+
+    while (depth > 0) {
+        depth--;
+        path->node[depth]->key[path->idx[depth]] = e;
+        if (path->idx[depth] != 0) break;
+    }
+}
+
+/* 从根节点向下找到第一个before()为假的元素应该在的叶子节点，返回叶子节点，*pos是元素在叶子中的下标，
+ * 它可能等于叶子的元素个数，这时要找的元素是下一个叶子的第一个元素。*rank是它前面的元素个数。 */
+static zbtLeaf *zbtDescend(zbtree *zbt, zbtBeforeFn *before, void *ctx,
+                           zbtPath *path, unsigned int *pos, unsigned long *rank)
+{
+    zbtNode *x = zbt->root;
+    unsigned long traversed = 0;
+    unsigned int lo, hi, mid, j;
+
+    path->depth = 0;
+    while (!x->leaf) {
+        zbtInner *inner = (zbtInner*)x;
+
+        ///最后一个key满足before()的孩子，如果都不满足就是第一个孩子
+        lo = 1;
+        hi = x->n;
+        while (lo < hi) {
+            mid = (lo+hi)/2;
+            if (before(&inner->key[mid],ctx)) lo = mid+1;
+            else hi = mid;
+        }
+        lo--;
+        for (j = 0; j < lo; j++) traversed += inner->count[j];
+
+        serverAssert(path->depth < ZBT_MAX_DEPTH);
+        path->node[path->depth] = inner;
+        path->idx[path->depth] = lo;
+        path->depth++;
+        x = inner->child[lo];
+    }
+
+    zbtLeaf *leaf = (zbtLeaf*)x;
+    lo = 0;
+    hi = x->n;
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (before(&leaf->e[mid],ctx)) lo = mid+1;
+        else hi = mid;
+    }
+    *pos = lo;
+    *rank = traversed+lo;
+    return leaf;
+}
+
+/* 从根节点向下找到排名为rank的元素所在的叶子节点，rank从1开始并且不能超过元素个数 */
+static zbtLeaf *zbtDescendRank(zbtree *zbt, unsigned long rank, zbtPath *path, unsigned int *pos) {
+    zbtNode *x = zbt->root;
+    unsigned int j;
+
+    path->depth = 0;
+    while (!x->leaf) {
+        zbtInner *inner = (zbtInner*)x;
+
+        for (j = 0; j < x->n-1 && rank > inner->count[j]; j++)
+            rank -= inner->count[j];
+        serverAssert(path->depth < ZBT_MAX_DEPTH);
+        path->node[path->depth] = inner;
+        path->idx[path->depth] = j;
+        path->depth++;
+        x = inner->child[j];
+    }
+    *pos = rank-1;
+    return (zbtLeaf*)x;
+}
+
+///在叶子节点的pos位置插入一个元素，调用者保证叶子节点还有空间
+static void zbtLeafInsertAt(zbtLeaf *leaf, unsigned int pos, zbtEntry *e) {
+    memmove(leaf->e+pos+1,leaf->e+pos,sizeof(zbtEntry)*(leaf->node.n-pos));
+    leaf->e[pos] = *e;
+    leaf->node.n++;
+}
+
+///在内部节点的pos位置插入一个孩子，调用者保证内部节点还有空间
+static void zbtInnerInsertAt(zbtInner *inner, unsigned int pos, zbtEntry *key,
+                             zbtNode *child, unsigned long count)
+{
+    unsigned int move = inner->node.n-pos;
+
+    memmove(inner->key+pos+1,inner->key+pos,sizeof(zbtEntry)*move);
+    memmove(inner->count+pos+1,inner->count+pos,sizeof(unsigned long)*move);
+    memmove(inner->child+pos+1,inner->child+pos,sizeof(zbtNode*)*move);
+    inner->key[pos] = *key;
+    inner->count[pos] = count;
+    inner->child[pos] = child;
+    inner->node.n++;
+}
+
+///删除内部节点中下标为pos的孩子，孩子节点本身由调用者释放
+static void zbtInnerRemoveAt(zbtInner *inner, unsigned int pos) {
+    unsigned int move = inner->node.n-pos-1;
+
+    memmove(inner->key+pos,inner->key+pos+1,sizeof(zbtEntry)*move);
+    memmove(inner->count+pos,inner->count+pos+1,sizeof(unsigned long)*move);
+    memmove(inner->child+pos,inner->child+pos+1,sizeof(zbtNode*)*move);
+    inner->node.n--;
+}
+
+///路径上深度为depth的节点是不是它这一层最右边的节点
+static int zbtPathIsRightmost(zbtPath *path, int depth) {
+    int j;
+
+    for (j = 0; j < depth; j++)
+        if (path->idx[j] != path->node[j]->node.n-1) return 0;
+    return 1;
+}
+
+/* 深度为depth的节点left分裂出了它右边的节点right，把right插入到父节点中left的后面，
+ * 父节点满了就继续分裂父节点，根节点分裂时树增加一层。lcount和rcount是两个节点下面的元素个数。 */
+static void zbtInsertChild(zbtree *zbt, zbtPath *path, int depth, zbtNode *left, unsigned long lcount,
+                           zbtNode *right, unsigned long rcount)
+{
+    while (depth > 0) {
+        zbtInner *parent = path->node[depth-1], *sibling;
+        unsigned int pos = path->idx[depth-1]+1, split, j;
+        zbtEntry key = *zbtNodeMin(right);
+
+        parent->count[pos-1] = lcount;
+        if (parent->node.n < ZBT_INNER_SIZE) {
+            zbtInnerInsertAt(parent,pos,&key,right,rcount);
+            return;
+        }
+
+        /* 父节点已经满了，把它的后一半孩子移到新的节点中。如果是在整棵树最右边追加，
+         * 说明元素很可能是按顺序插入的，新节点只放新的孩子，这样按顺序插入时节点都是满的。 */
+        sibling = zbtCreateInner(zbt);
+        if (pos == ZBT_INNER_SIZE && zbtPathIsRightmost(path,depth-1))
+            split = ZBT_INNER_SIZE;
+        else
+            split = ZBT_INNER_SIZE/2;
+        sibling->node.n = ZBT_INNER_SIZE-split;
+        memcpy(sibling->key,parent->key+split,sizeof(zbtEntry)*sibling->node.n);
+        memcpy(sibling->count,parent->count+split,sizeof(unsigned long)*sibling->node.n);
+        memcpy(sibling->child,parent->child+split,sizeof(zbtNode*)*sibling->node.n);
+        parent->node.n = split;
+        if (pos < split)
+            zbtInnerInsertAt(parent,pos,&key,right,rcount);
+        else
+            zbtInnerInsertAt(sibling,pos-split,&key,right,rcount);
+
+        lcount = rcount = 0;
+        for (j = 0; j < parent->node.n; j++) lcount += parent->count[j];
+        for (j = 0; j < sibling->node.n; j++) rcount += sibling->count[j];
+        left = (zbtNode*)parent;
+        right = (zbtNode*)sibling;
+        depth--;
+    }
+
+    ///根节点分裂了，创建新的根节点
+    zbtInner *root = zbtCreateInner(zbt);
+    root->key[0] = *zbtNodeMin(left);
+    root->count[0] = lcount;
+    root->child[0] = left;
+    root->key[1] = *zbtNodeMin(right);
+    root->count[1] = rcount;
+    root->child[1] = right;
+    root->node.n = 2;
+    zbt->root = (zbtNode*)root;
+}
+
+/* 插入一个新的元素，调用者保证元素还不存在。B+树获得SDS字符串'ele'的所有权。 */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    zbtEntry key = {score, ele};
+    zbtPath path;
+    zbtLeaf *leaf, *right;
+    unsigned int pos, split;
+    unsigned long rank;
+    int j;
+
+    serverAssert(!isnan(score));
+    zbt->length++;
+    if (zbt->root == NULL) {
+        leaf = zbtCreateLeaf(zbt);
+        zbtLeafInsertAt(leaf,0,&key);
+        zbt->root = (zbtNode*)leaf;
+        zbt->head = zbt->tail = leaf;
+        return;
+    }
+
+    leaf = zbtDescend(zbt,zbtBeforeKey,&key,&path,&pos,&rank);
+    for (j = 0; j < path.depth; j++) path.node[j]->count[path.idx[j]]++;
+
+    if (leaf->node.n < ZBT_LEAF_SIZE) {
+        zbtLeafInsertAt(leaf,pos,&key);
+        if (pos == 0) zbtFixMin(&path,path.depth,&leaf->e[0]);
+        return;
+    }
+
+    /* 叶子节点已经满了，分裂成两个。在最后一个叶子的末尾追加时新叶子只放新元素，原因同zbtInsertChild()。 */
+    right = zbtCreateLeaf(zbt);
+    if (pos == ZBT_LEAF_SIZE && leaf->next == NULL)
+        split = ZBT_LEAF_SIZE;
+    else
+        split = ZBT_LEAF_SIZE/2;
+    right->node.n = ZBT_LEAF_SIZE-split;
+    memcpy(right->e,leaf->e+split,sizeof(zbtEntry)*right->node.n);
+    leaf->node.n = split;
+    if (pos < split)
+        zbtLeafInsertAt(leaf,pos,&key);
+    else
+        zbtLeafInsertAt(right,pos-split,&key);
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next) leaf->next->prev = right;
+    else zbt->tail = right;
+    leaf->next = right;
+
+    if (pos == 0) zbtFixMin(&path,path.depth,&leaf->e[0]);
+    zbtInsertChild(zbt,&path,path.depth,(zbtNode*)leaf,leaf->node.n,
+                   (zbtNode*)right,right->node.n);
+}
+
+///把节点right中的内容追加到它左边的节点left中，然后释放right
+static void zbtMergeNodes(zbtree *zbt, zbtNode *left, zbtNode *right) {
+    if (left->leaf) {
+        zbtLeaf *l = (zbtLeaf*)left, *r = (zbtLeaf*)right;
+        memcpy(l->e+left->n,r->e,sizeof(zbtEntry)*right->n);
+    } else {
+        zbtInner *l = (zbtInner*)left, *r = (zbtInner*)right;
+        memcpy(l->key+left->n,r->key,sizeof(zbtEntry)*right->n);
+        memcpy(l->count+left->n,r->count,sizeof(unsigned long)*right->n);
+        memcpy(l->child+left->n,r->child,sizeof(zbtNode*)*right->n);
+    }
+    left->n += right->n;
+    zbtFreeNode(zbt,right);
+}
+
+/* 深度为depth的节点x删除了元素或孩子之后调用：空的节点从父节点中删除，元素太少的节点和相邻的兄弟节点
+ * 能放进一个节点时就合并，然后对父节点重复这个过程。最后根节点只剩一个孩子时树减少一层。 */
+static void zbtRebalance(zbtree *zbt, zbtPath *path, int depth, zbtNode *x) {
+    while (depth > 0) {
+        zbtInner *parent = path->node[depth-1];
+        unsigned int idx = path->idx[depth-1], left, size;
+
+        if (x->n == 0) {
+            zbtFreeNode(zbt,x);
+            zbtInnerRemoveAt(parent,idx);
+            if (idx == 0 && parent->node.n)
+                zbtFixMin(path,depth-1,&parent->key[0]);
+        } else {
+            size = x->leaf ? ZBT_LEAF_SIZE : ZBT_INNER_SIZE;
+            if (x->n >= size/4) return;
+
+            ///和相邻的兄弟节点合并，先试右边的，右边放不下再试左边的
+            if (idx+1 < parent->node.n && x->n + parent->child[idx+1]->n <= size)
+                left = idx;
+            else if (idx > 0 && x->n + parent->child[idx-1]->n <= size)
+                left = idx-1;
+            else
+                return;
+
+            zbtMergeNodes(zbt,parent->child[left],parent->child[left+1]);
+            parent->count[left] += parent->count[left+1];
+            zbtInnerRemoveAt(parent,left+1);
+        }
+        x = (zbtNode*)parent;
+        depth--;
+    }
+
+    if (x->n == 0) {
+        ///删除了最后一个元素
+        zbtFreeNode(zbt,x);
+        zbt->root = NULL;
+        return;
+    }
+    while (!x->leaf && x->n == 1) {
+        zbt->root = ((zbtInner*)x)->child[0];
+        zbtFreeNode(zbt,x);
+        x = zbt->root;
+    }
+}
+
+/* 删除叶子节点中从pos开始的count个元素，路径path是zbtDescend()或zbtDescendRank()得到的。
+ * 元素的SDS字符串由调用者处理。 */
+static void zbtRemoveEntries(zbtree *zbt, zbtPath *path, zbtLeaf *leaf,
+                             unsigned int pos, unsigned int count)
+{
+    int j;
+
+    memmove(leaf->e+pos,leaf->e+pos+count,sizeof(zbtEntry)*(leaf->node.n-pos-count));
+    leaf->node.n -= count;
+    for (j = 0; j < path->depth; j++) path->node[j]->count[path->idx[j]] -= count;
+    zbt->length -= count;
+
+    if (pos == 0 && leaf->node.n) zbtFixMin(path,path->depth,&leaf->e[0]);
+    zbtRebalance(zbt,path,path->depth,(zbtNode*)leaf);
+}
+
+/* 删除分数和元素都匹配的元素，找到并删除时返回1，否则返回0。
+ * 如果'removed'为NULL，元素的SDS字符串被释放，否则通过'removed'返回给调用者。 */
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *removed) {
+    zbtEntry key = {score, ele};
+    zbtPath path;
+    zbtLeaf *leaf;
+    unsigned int pos;
+    unsigned long rank;
+
+    if (zbt->root == NULL) return 0;
+    leaf = zbtDescend(zbt,zbtBeforeKey,&key,&path,&pos,&rank);
+    if (pos == 0 || zbtCompare(&leaf->e[pos-1],score,ele) != 0) return 0;
+    pos--;
+
+    if (removed) *removed = leaf->e[pos].ele;
+    else sdsfree(leaf->e[pos].ele);
+    zbtRemoveEntries(zbt,&path,leaf,pos,1);
+    return 1;
+}
+
+/* 修改一个已经存在的元素的分数。新的分数仍然落在前后两个元素之间时直接修改，否则先删除再插入。 */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtEntry key = {curscore, ele}, *prev, *next;
+    zbtPath path;
+    zbtLeaf *leaf;
+    unsigned int pos;
+    unsigned long rank;
+
+    leaf = zbtDescend(zbt,zbtBeforeKey,&key,&path,&pos,&rank);
+    serverAssert(pos > 0 && zbtCompare(&leaf->e[pos-1],curscore,ele) == 0);
+    pos--;
+
+    if (pos > 0) prev = &leaf->e[pos-1];
+    else prev = leaf->prev ? &leaf->prev->e[leaf->prev->node.n-1] : NULL;
+    if (pos+1 < leaf->node.n) next = &leaf->e[pos+1];
+    else next = leaf->next ? &leaf->next->e[0] : NULL;
+
+    if ((prev == NULL || zbtCompare(prev,newscore,ele) < 0) &&
+        (next == NULL || zbtCompare(next,newscore,ele) > 0))
+    {
+        leaf->e[pos].score = newscore;
+        if (pos == 0) zbtFixMin(&path,path.depth,&leaf->e[0]);
+        return;
+    }
+
+    zbtRemoveEntries(zbt,&path,leaf,pos,1);
+    zbtInsert(zbt,newscore,ele);
+}
+
+/* 返回元素的排名（从1开始），元素不存在时返回0 */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    zbtEntry key = {score, ele};
+    zbtPath path;
+    zbtLeaf *leaf;
+    unsigned int pos;
+    unsigned long rank;
+
+    if (zbt->root == NULL) return 0;
+    leaf = zbtDescend(zbt,zbtBeforeKey,&key,&path,&pos,&rank);
+    if (pos == 0 || zbtCompare(&leaf->e[pos-1],score,ele) != 0) return 0;
+    return rank;
+}
+
+/* 返回排名为rank（从1开始）的元素，并把它的位置保存在it中，用来继续向前或者向后遍历 */
+zbtEntry *zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtIter *it) {
+    zbtPath path;
+    unsigned int pos;
+
+    if (rank == 0 || rank > zbt->length) return NULL;
+    it->leaf = zbtDescendRank(zbt,rank,&path,&pos);
+    it->idx = pos;
+    it->rank = rank;
+    return &it->leaf->e[pos];
+}
+
+///返回第一个元素，B+树为空时返回NULL
+zbtEntry *zbtHead(zbtree *zbt, zbtIter *it) {
+    if (zbt->length == 0) return NULL;
+    it->leaf = zbt->head;
+    it->idx = 0;
+    it->rank = 1;
+    return &it->leaf->e[0];
+}
+
+///返回最后一个元素，B+树为空时返回NULL
+zbtEntry *zbtTail(zbtree *zbt, zbtIter *it) {
+    if (zbt->length == 0) return NULL;
+    it->leaf = zbt->tail;
+    it->idx = it->leaf->node.n-1;
+    it->rank = zbt->length;
+    return &it->leaf->e[it->idx];
+}
+
+///移动到下一个元素并返回它，没有下一个元素时返回NULL
+zbtEntry *zbtNext(zbtIter *it) {
+    if (it->idx+1 >= it->leaf->node.n) {
+        if (it->leaf->next == NULL) {
+            it->idx = it->leaf->node.n;
+            return NULL;
+        }
+        it->leaf = it->leaf->next;
+        it->idx = 0;
+    } else {
+        it->idx++;
+    }
+    it->rank++;
+    return &it->leaf->e[it->idx];
+}
+
+///移动到上一个元素并返回它，没有上一个元素时返回NULL
+zbtEntry *zbtPrev(zbtIter *it) {
+    if (it->idx == 0) {
+        if (it->leaf->prev == NULL) return NULL;
+        it->leaf = it->leaf->prev;
+        it->idx = it->leaf->node.n;
+    }
+    it->idx--;
+    it->rank--;
+    return &it->leaf->e[it->idx];
+}
+
+/* 定位到第一个before()为假的元素并返回它。所有元素都满足before()时返回NULL，
+ * 这时it指向最后一个元素的后面，仍然可以用zbtPrev()取得最后一个元素。 */
+static zbtEntry *zbtSeek(zbtree *zbt, zbtBeforeFn *before, void *ctx, zbtIter *it) {
+    zbtPath path;
+    zbtLeaf *leaf;
+    unsigned int pos;
+    unsigned long rank;
+
+    leaf = zbtDescend(zbt,before,ctx,&path,&pos,&rank);
+    if (pos == leaf->node.n && leaf->next) {
+        leaf = leaf->next;
+        pos = 0;
+    }
+    it->leaf = leaf;
+    it->idx = pos;
+    it->rank = rank+1;
+    return pos < leaf->node.n ? &leaf->e[pos] : NULL;
+}
+
+///B+树中是否有元素在range范围内
+int zbtIsInRange(zbtree *zbt, zrangespec *range) {
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    if (!zslValueGteMin(zbt->tail->e[zbt->tail->node.n-1].score,range)) return 0;
+    if (!zslValueLteMax(zbt->head->e[0].score,range)) return 0;
+    return 1;
+}
+
+///返回第一个在range范围内的元素，没有时返回NULL
+zbtEntry *zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtIter *it) {
+    zbtEntry *e;
+
+    if (!zbtIsInRange(zbt,range)) return NULL;
+    e = zbtSeek(zbt,zbtBeforeMin,range,it);
+    serverAssert(e != NULL);
+    if (!zslValueLteMax(e->score,range)) return NULL;
+    return e;
+}
+
+///返回最后一个在range范围内的元素，没有时返回NULL
+zbtEntry *zbtLastInRange(zbtree *zbt, zrangespec *range, zbtIter *it) {
+    zbtEntry *e;
+
+    if (!zbtIsInRange(zbt,range)) return NULL;
+    zbtSeek(zbt,zbtBeforeMax,range,it);
+    e = zbtPrev(it);
+    serverAssert(e != NULL);
+    if (!zslValueGteMin(e->score,range)) return NULL;
+    return e;
+}
+
+///B+树中是否有元素在字典序范围range内
+int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range) {
+    int cmp = sdscmplex(range->min,range->max);
+    if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    if (!zslLexValueGteMin(zbt->tail->e[zbt->tail->node.n-1].ele,range)) return 0;
+    if (!zslLexValueLteMax(zbt->head->e[0].ele,range)) return 0;
+    return 1;
+}
+
+///返回第一个在字典序范围range内的元素，没有时返回NULL
+zbtEntry *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtIter *it) {
+    zbtEntry *e;
+
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
+    e = zbtSeek(zbt,zbtBeforeLexMin,range,it);
+    serverAssert(e != NULL);
+    if (!zslLexValueLteMax(e->ele,range)) return NULL;
+    return e;
+}
+
+///返回最后一个在字典序范围range内的元素，没有时返回NULL
+zbtEntry *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtIter *it) {
+    zbtEntry *e;
+
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
+    zbtSeek(zbt,zbtBeforeLexMax,range,it);
+    e = zbtPrev(it);
+    serverAssert(e != NULL);
+    if (!zslLexValueGteMin(e->ele,range)) return NULL;
+    return e;
+}
+
+/* 删除排名在[start, end]之间的元素（从1开始，包括两端），同时从字典中删除。
+ * 每次删除一个叶子节点中连续的一段，而不是一个一个地删除。 */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict) {
+    unsigned long removed = 0, todo;
+    zbtPath path;
+    zbtLeaf *leaf;
+    unsigned int pos, count, j;
+
+    if (end > zbt->length) end = zbt->length;
+    if (start == 0 || start > end) return 0;
+    todo = end-start+1;
+    while (removed < todo) {
+        leaf = zbtDescendRank(zbt,start,&path,&pos);
+        count = leaf->node.n-pos;
+        if (count > todo-removed) count = todo-removed;
+        for (j = pos; j < pos+count; j++) {
+            dictDelete(dict,leaf->e[j].ele);
+            sdsfree(leaf->e[j].ele);
+        }
+        zbtRemoveEntries(zbt,&path,leaf,pos,count);
+        removed += count;
+    }
+    return removed;
+}
+
+///删除分数在range范围内的元素，同时从字典中删除
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtIter first, last;
+
+    if (zbtFirstInRange(zbt,range,&first) == NULL) return 0;
+    zbtLastInRange(zbt,range,&last);
+    return zbtDeleteRangeByRank(zbt,first.rank,last.rank,dict);
+}
+
+///删除字典序在range范围内的元素，同时从字典中删除
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtIter first, last;
+
+    if (zbtFirstInLexRange(zbt,range,&first) == NULL) return 0;
+    zbtLastInLexRange(zbt,range,&last);
+    return zbtDeleteRangeByRank(zbt,first.rank,last.rank,dict);
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+
+/* 检查以x为根、深度为depth的子树：内部节点的key[i]就是child[i]的最小元素（共享同一个SDS），count[i]等于
+ * child[i]下面的元素个数，除了根节点没有空节点，并且所有叶子节点的深度相同。返回子树中的元素个数。 */
+static unsigned long zbtTestVerifyNode(zbtree *zbt, zbtNode *x, int depth, int *leafdepth, int *errors) {
+    unsigned long total = 0, count;
+    unsigned int j;
+
+    if (x->n == 0 && x != zbt->root) (*errors)++;
+    if (x->leaf) {
+        if (*leafdepth == -1) *leafdepth = depth;
+        else if (*leafdepth != depth) (*errors)++;
+        if (x->n > ZBT_LEAF_SIZE) (*errors)++;
+        return x->n;
+    }
+
+    zbtInner *inner = (zbtInner*)x;
+    if (x->n > ZBT_INNER_SIZE || (x == zbt->root && x->n < 2)) (*errors)++;
+    for (j = 0; j < x->n; j++) {
+        zbtEntry *min = zbtNodeMin(inner->child[j]);
+        if (inner->key[j].score != min->score || inner->key[j].ele != min->ele) (*errors)++;
+        count = zbtTestVerifyNode(zbt,inner->child[j],depth+1,leafdepth,errors);
+        if (inner->count[j] != count) (*errors)++;
+        total += count;
+    }
+    return total;
+}
+
+/* 检查B+树的结构：叶子链表按(score, ele)排序并且前后指针、head和tail正确，树的结构见上面，
+ * 节点个数和leaves、inners一致，zbtGetRank()和zbtGetElementByRank()的结果正确。返回发现的错误个数。 */
+static int zbtTestVerify(zbtree *zbt) {
+    zbtLeaf *leaf, *prevleaf = NULL;
+    zbtEntry *prev = NULL, *e;
+    zbtIter it;
+    unsigned long rank = 0, leaves = 0, j;
+    int errors = 0, leafdepth = -1;
+
+    if (zbt->root == NULL)
+        return (zbt->length || zbt->head || zbt->tail || zbt->leaves || zbt->inners) ? 1 : 0;
+    if (zbtTestVerifyNode(zbt,zbt->root,0,&leafdepth,&errors) != zbt->length) errors++;
+
+    for (leaf = zbt->head; leaf; leaf = leaf->next) {
+        if (leaf->prev != prevleaf) errors++;
+        for (j = 0; j < leaf->node.n; j++) {
+            e = &leaf->e[j];
+            if (prev && zbtCompare(prev,e->score,e->ele) >= 0) errors++;
+            prev = e;
+            rank++;
+            if (rank % 61 == 1) {
+                if (zbtGetRank(zbt,e->score,e->ele) != rank) errors++;
+                if (zbtGetElementByRank(zbt,rank,&it) != e || it.rank != rank) errors++;
+            }
+        }
+        prevleaf = leaf;
+        leaves++;
+    }
+    if (zbt->tail != prevleaf || rank != zbt->length || leaves != zbt->leaves) errors++;
+    return errors;
+}
+
+///比较B+树和跳跃表中的元素，元素的SDS字符串不同，只比较内容
+static int zbtTestCompare(zbtree *zbt, zskiplist *zsl) {
+    zskiplistNode *x = zsl->header->level[0].forward;
+    zbtIter it;
+    zbtEntry *e;
+    int errors = 0;
+
+    if (zbt->length != zsl->length) return 1;
+    for (e = zbtHead(zbt,&it); e != NULL; e = zbtNext(&it)) {
+        if (e->score != x->score || sdscmp(e->ele,x->ele) != 0) errors++;
+        x = x->level[0].forward;
+    }
+    x = zsl->tail;
+    for (e = zbtTail(zbt,&it); e != NULL; e = zbtPrev(&it)) {
+        if (e->score != x->score || sdscmp(e->ele,x->ele) != 0) errors++;
+        x = x->backward;
+    }
+    return errors;
+}
+
+///B+树中一个元素的位置和跳跃表中的节点是否是同一个元素
+static int zbtTestSame(zbtEntry *e, zbtIter *it, zskiplist *zsl, zskiplistNode *x) {
+    if (e == NULL || x == NULL) return e == NULL && x == NULL;
+    return e->score == x->score && sdscmp(e->ele,x->ele) == 0 &&
+           it->rank == zslGetRank(zsl,x->score,x->ele);
+}
+
+int zbtreeTest(int argc, char *argv[]) {
+    int errors = 0;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srandom(1234);
+
+    printf("B+ tree matches the skiplist under random operations: ");
+    {
+        zskiplist *zsl = zslCreate();
+        zbtree *zbt = zbtCreate();
+        dict *sldict = dictCreate(&zsetDictType,NULL);
+        dict *btdict = dictCreate(&zsetDictType,NULL);
+        int pool = 5000, ops = 300000, err = 0;
+        sds *names = zmalloc(sizeof(sds)*pool);
+        double *scores = zmalloc(sizeof(double)*pool);
+        char *present = zcalloc(pool);
+        zbtIter it;
+        zbtEntry *e;
+
+        for (int i = 0; i < pool; i++) names[i] = sdscatprintf(sdsempty(),"m%d",i);
+        for (int op = 0; op < ops; op++) {
+            int i = random() % pool, r = random() % 1000;
+            double score = random() % 200; ///很多相同的score，需要按ele排序
+
+            if (r < 550) {
+                if (!present[i]) {
+                    sds a = sdsdup(names[i]), b = sdsdup(names[i]);
+                    zslInsert(zsl,score,a);
+                    dictAdd(sldict,a,NULL);
+                    zbtInsert(zbt,score,b);
+                    dictAdd(btdict,b,NULL);
+                    present[i] = 1;
+                } else {
+                    /* zbtUpdateScore()可能重新插入传入的SDS，所以要传B+树自己的字符串 */
+                    zslUpdateScore(zsl,scores[i],names[i],score);
+                    zbtUpdateScore(zbt,scores[i],dictGetKey(dictFind(btdict,names[i])),score);
+                }
+                scores[i] = score;
+            } else if (r < 950) {
+                if (present[i]) {
+                    dictDelete(sldict,names[i]);
+                    dictDelete(btdict,names[i]);
+                    if (!zslDelete(zsl,scores[i],names[i],NULL)) err++;
+                    if (!zbtDelete(zbt,scores[i],names[i],NULL)) err++;
+                    present[i] = 0;
+                } else if (zbtDelete(zbt,score,names[i],NULL)) {
+                    err++;
+                }
+            } else if (r < 998) {
+                zrangespec spec = {score, score + random() % 20, random() % 2, random() % 2};
+                unsigned long rank = random() % (zbt->length+1) + 1;
+
+                e = zbtFirstInRange(zbt,&spec,&it);
+                if (!zbtTestSame(e,&it,zsl,zslFirstInRange(zsl,&spec))) err++;
+                e = zbtLastInRange(zbt,&spec,&it);
+                if (!zbtTestSame(e,&it,zsl,zslLastInRange(zsl,&spec))) err++;
+                e = zbtGetElementByRank(zbt,rank,&it);
+                if (!zbtTestSame(e,&it,zsl,zslGetElementByRank(zsl,rank))) err++;
+                if (present[i] && zbtGetRank(zbt,scores[i],names[i]) != zslGetRank(zsl,scores[i],names[i])) err++;
+            } else {
+                unsigned long start = random() % (zbt->length+1) + 1, end = start + random() % 100;
+                zrangespec spec = {score, score + random() % 3, random() % 2, random() % 2};
+
+                if (r == 998) {
+                    if (zbtDeleteRangeByRank(zbt,start,end,btdict) !=
+                        zslDeleteRangeByRank(zsl,start,end,sldict)) err++;
+                } else {
+                    if (zbtDeleteRangeByScore(zbt,&spec,btdict) !=
+                        zslDeleteRangeByScore(zsl,&spec,sldict)) err++;
+                }
+                for (int k = 0; k < pool; k++) present[k] = dictFind(btdict,names[k]) != NULL;
+            }
+            if (op % 10000 == 0) {
+                err += zbtTestVerify(zbt);
+                err += zbtTestCompare(zbt,zsl);
+            }
+        }
+        err += zbtTestVerify(zbt);
+        err += zbtTestCompare(zbt,zsl);
+        if (dictSize(btdict) != zbt->length) err++;
+
+        /* 所有元素的score相同时按字典序比较 */
+        for (int i = 0; i < pool; i++) {
+            if (present[i]) {
+                dictDelete(sldict,names[i]);
+                dictDelete(btdict,names[i]);
+                zslDelete(zsl,scores[i],names[i],NULL);
+                zbtDelete(zbt,scores[i],names[i],NULL);
+            }
+            zslInsert(zsl,0,sdsdup(names[i]));
+            zbtInsert(zbt,0,sdsdup(names[i]));
+        }
+        err += zbtTestVerify(zbt);
+        for (int op = 0; op < 2000; op++) {
+            zlexrangespec spec = {names[random() % pool], names[random() % pool], random() % 2, random() % 2};
+
+            e = zbtFirstInLexRange(zbt,&spec,&it);
+            if (!zbtTestSame(e,&it,zsl,zslFirstInLexRange(zsl,&spec))) err++;
+            e = zbtLastInLexRange(zbt,&spec,&it);
+            if (!zbtTestSame(e,&it,zsl,zslLastInLexRange(zsl,&spec))) err++;
+            if (op % 100 == 0) {
+                zbtEntry *first = zbtFirstInLexRange(zbt,&spec,&it);
+                if (first) {
+                    /* 删除时字典中没有这些元素，用一个空的字典 */
+                    dict *empty = dictCreate(&zsetDictType,NULL);
+                    zbtDeleteRangeByLex(zbt,&spec,empty);
+                    zslDeleteRangeByLex(zsl,&spec,empty);
+                    dictRelease(empty);
+                    err += zbtTestVerify(zbt);
+                    err += zbtTestCompare(zbt,zsl);
+                }
+            }
+        }
+
+        /* 按顺序追加时除了最后一个叶子节点都是满的，然后删除大部分元素，树应该收缩 */
+        zbtFree(zbt);
+        zbt = zbtCreate();
+        for (int i = 0; i < 500000; i++) zbtInsert(zbt,i,sdsfromlonglong(i));
+        err += zbtTestVerify(zbt);
+        if (zbt->leaves != (500000 + ZBT_LEAF_SIZE - 1) / ZBT_LEAF_SIZE) err++;
+        for (int i = 0; i < 500000; i++) {
+            if (i % 50 == 0) continue;
+            sds ele = sdsfromlonglong(i);
+            if (!zbtDelete(zbt,i,ele,NULL)) err++;
+            sdsfree(ele);
+        }
+        err += zbtTestVerify(zbt);
+        if (zbt->length != 10000 || zbt->leaves > 10000 / (ZBT_LEAF_SIZE / 4)) err++;
+        while (zbt->length) {
+            if (zbtDeleteRangeByRank(zbt,1,1 + random() % 1000,btdict) == 0) err++;
+        }
+        err += zbtTestVerify(zbt);
+
+        zslFree(zsl);
+        zbtFree(zbt);
+        dictRelease(sldict);
+        dictRelease(btdict);
+        for (int i = 0; i < pool; i++) sdsfree(names[i]);
+        zfree(names);
+        zfree(scores);
+        zfree(present);
+        errors += err;
+        printf("%s\n\n", err ? "FAILED" : "SUCCESS");
+    }
+
+    printf("Benchmark skiplist vs B+ tree with 1M elements:\n");
+    {
+        int n = 1000000;
+        double *scores = zmalloc(sizeof(double)*n);
+        sds *eles = zmalloc(sizeof(sds)*n);
+        unsigned long sum = 0;
+
+        for (int i = 0; i < n; i++) {
+            scores[i] = (double)random() / RAND_MAX * 1e9;
+            eles[i] = sdscatprintf(sdsempty(),"member:%d",i);
+        }
+        for (int type = 0; type < 2; type++) {
+            zskiplist *zsl = NULL;
+            zbtree *zbt = NULL;
+            size_t mem = zmalloc_used_memory();
+            long long start, zadd, zrange, range, rank;
+
+            /* 两种结构都不释放元素的SDS字符串，见下面 */
+            start = ustime();
+            if (type == 0) {
+                zsl = zslCreate();
+                for (int i = 0; i < n; i++) zslInsert(zsl,scores[i],eles[i]);
+            } else {
+                zbt = zbtCreate();
+                for (int i = 0; i < n; i++) zbtInsert(zbt,scores[i],eles[i]);
+            }
+            zadd = ustime()-start;
+            mem = zmalloc_used_memory()-mem;
+
+            start = ustime();
+            for (int i = 0; i < n; i += 10) {
+                unsigned long r = ((unsigned long)i * 7919) % n + 1;
+                if (type == 0) {
+                    zskiplistNode *x = zslGetElementByRank(zsl,r);
+                    for (int j = 0; x && j < 100; j++, x = x->level[0].forward) sum += x->score > 0;
+                } else {
+                    zbtIter it;
+                    zbtEntry *e = zbtGetElementByRank(zbt,r,&it);
+                    for (int j = 0; e && j < 100; j++, e = zbtNext(&it)) sum += e->score > 0;
+                }
+            }
+            zrange = ustime()-start;
+
+            start = ustime();
+            for (int i = 0; i < n; i++) {
+                zrangespec spec = {scores[i], scores[i] + 1e4, 0, 0};
+                if (type == 0) {
+                    zskiplistNode *x = zslFirstInRange(zsl,&spec);
+                    for (int j = 0; x && j < 10 && zslValueLteMax(x->score,&spec); j++) {
+                        sum += sdslen(x->ele);
+                        x = x->level[0].forward;
+                    }
+                } else {
+                    zbtIter it;
+                    zbtEntry *e = zbtFirstInRange(zbt,&spec,&it);
+                    for (int j = 0; e && j < 10 && zslValueLteMax(e->score,&spec); j++) {
+                        sum += sdslen(e->ele);
+                        e = zbtNext(&it);
+                    }
+                }
+            }
+            range = ustime()-start;
+
+            start = ustime();
+            for (int i = 0; i < n; i++) {
+                int k = ((unsigned long)i * 7919) % n;
+                sum += type == 0 ? zslGetRank(zsl,scores[k],eles[k]) : zbtGetRank(zbt,scores[k],eles[k]);
+            }
+            rank = ustime()-start;
+
+            printf("%s: %zu bytes, ZADD %lld usec, ZRANGE 100 %lld usec, ZRANGEBYSCORE LIMIT 10 %lld usec, ZRANK %lld usec\n",
+                type == 0 ? "skiplist" : "B+ tree ",mem,zadd,zrange,range,rank);
+
+            /* 第二次还要用这些元素，所以只释放结构本身 */
+            if (type == 0) {
+                zskiplistNode *x = zsl->header->level[0].forward;
+                while (x) {
+                    x->ele = NULL;
+                    x = x->level[0].forward;
+                }
+                zslFree(zsl);
+            } else {
+                zbtIter it;
+                for (zbtEntry *e = zbtHead(zbt,&it); e != NULL; e = zbtNext(&it)) e->ele = NULL;
+                zbtFree(zbt);
+            }
+        }
+        printf("(%lu)\n\n",sum & 1);
+        for (int i = 0; i < n; i++) sdsfree(eles[i]);
+        zfree(scores);
+        zfree(eles);
+    }
+    return errors;
+}
+#endif
+
+#endif /* USE_ZSET_BTREE */
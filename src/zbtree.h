@@ -0,0 +1,75 @@
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include "server.h"
+
+/* 按(score, ele)排序的B+树，可以代替跳跃表保存元素很多的有序集合，见zbtree.c。
+ * 实现只在定义了USE_ZSET_BTREE时编译：RDB、AOF重写、ZSCAN和主动碎片整理都还不支持这种结构，
+ * 所以它还没有作为有序集合的编码使用，这里只是底层的数据结构和测试。 */
+
+#define ZBT_LEAF_SIZE 62      ///每个叶子节点中的元素个数，叶子节点是1024个字节
+#define ZBT_INNER_SIZE 60     ///每个内部节点的孩子个数，大约2048个字节
+
+/* 叶子节点按(score, ele)的顺序连续保存元素，并且前后相连；
+ * 内部节点的key[i]是child[i]下面最小的元素，count[i]是child[i]下面的元素个数。 */
+typedef zsetPair zbtEntry;
+
+///叶子节点和内部节点共同的头部
+typedef struct zbtNode {
+    unsigned int leaf; ///是否是叶子节点
+    unsigned int n; ///叶子节点中的元素个数，或者内部节点的孩子个数
+} zbtNode;
+
+typedef struct zbtLeaf {
+    zbtNode node;
+    struct zbtLeaf *prev, *next; ///前后相邻的叶子节点
+    zbtEntry e[ZBT_LEAF_SIZE];
+} zbtLeaf;
+
+typedef struct zbtInner {
+    zbtNode node;
+    unsigned long count[ZBT_INNER_SIZE];
+    zbtNode *child[ZBT_INNER_SIZE];
+    zbtEntry key[ZBT_INNER_SIZE]; ///ele和叶子节点共享同一个SDS
+} zbtInner;
+
+typedef struct zbtree {
+    zbtNode *root;
+    zbtLeaf *head, *tail; ///第一个和最后一个叶子节点
+    unsigned long length; ///元素个数
+    unsigned long leaves, inners; ///叶子节点和内部节点的个数
+} zbtree;
+
+///B+树中的一个位置，rank是这个位置的排名（从1开始）
+typedef struct zbtIter {
+    zbtLeaf *leaf;
+    unsigned int idx;
+    unsigned long rank;
+} zbtIter;
+
+zbtree *zbtCreate(void); ///创建一棵空的B+树
+void zbtFree(zbtree *zbt); ///释放B+树和其中元素的SDS字符串
+void zbtInsert(zbtree *zbt, double score, sds ele); ///插入一个元素，B+树获得ele的所有权
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *removed); ///删除一个元素，removed为NULL时释放它的SDS字符串
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore); ///修改一个已经存在的元素的分数
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele); ///元素的排名（从1开始），不存在时返回0
+zbtEntry *zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtIter *it); ///排名为rank的元素
+zbtEntry *zbtHead(zbtree *zbt, zbtIter *it); ///第一个元素
+zbtEntry *zbtTail(zbtree *zbt, zbtIter *it); ///最后一个元素
+zbtEntry *zbtNext(zbtIter *it); ///后一个元素
+zbtEntry *zbtPrev(zbtIter *it); ///前一个元素
+int zbtIsInRange(zbtree *zbt, zrangespec *range); ///是否有元素的分数在range中
+zbtEntry *zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtIter *it); ///分数在range中的第一个元素
+zbtEntry *zbtLastInRange(zbtree *zbt, zrangespec *range, zbtIter *it); ///分数在range中的最后一个元素
+int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range); ///是否有元素在字典序的range中
+zbtEntry *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtIter *it); ///字典序的range中的第一个元素
+zbtEntry *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtIter *it); ///字典序的range中的最后一个元素
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict); ///删除排名在[start,end]中的元素
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict); ///删除分数在range中的元素
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict); ///删除字典序的range中的元素
+
+#ifdef REDIS_TEST
+int zbtreeTest(int argc, char *argv[]);
+#endif
+
+#endif // __ZBTREE_H
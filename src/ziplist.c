@@ -107,6 +107,7 @@
  * 因此0B表示其后是11个字节的字符串。 从第三个字节（48）到最后一个字节（64），只有“ Hello World”的ASCII字符。
  */
 
+#define ZMALLOC_TAG ZMALLOC_TAG_ZIPLIST ///分配分析中记为ziplist，见zmalloc.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -117,6 +118,10 @@
 #include "ziplist.h"
 #include "endianconv.h"
 #include "redisassert.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ZIPLIST_HAVE_X86_SIMD 1 ///ziplistFindIn()可以在运行时选择SSE2/AVX2实现的扫描
+#endif
 
 #define ZIP_END 255    ///ziplist的结尾标志
 
@@ -537,11 +542,11 @@ unsigned char *__ziplistCascadeUpdate(unsigned char *zl, unsigned char *p) {
 
             ///一个元素不是tail元素时，更新tail偏移量。
             if ((zl+intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))) != np) {
-                ZIPLIST_TAIL_OFFSET(zl) = ntrev32ifbe(intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))+extra);
+                ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))+extra);
             }
 
             ///移动next节点到新的位置
-            memmove(np+rawlensize, p+next.prevrawlensize, urlen-noffset-next.prevrawlensize-1);
+            memmove(np+rawlensize, np+next.prevrawlensize, curlen-noffset-next.prevrawlensize-1);
             ///将next节点的header以rawlen进行重新编码，并且更新节点中的prevrawlensize和prevrawlen信息
             zipStorePrevEntryLength(np,rawlen);
 
@@ -835,6 +840,106 @@ unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int sle
     return __ziplistInsert(zl,p,s,slen); ///进行插入操作
 }
 
+/* 把字符串s按节点的格式写入p，前驱节点的长度为prevlen，返回写入的节点的总长度。
+ * 和zipStorePrevEntryLength()一样，p为NULL时只计算需要的字节数。 */
+static unsigned int zipStoreEntry(unsigned char *p, unsigned int prevlen, unsigned char *s, unsigned int slen) {
+    unsigned char encoding = 0, *start = p;
+    long long value = 123456789;
+    unsigned int len;
+
+    len = zipTryEncoding(s,slen,&value,&encoding) ? zipIntSize(encoding) : slen; ///能转成整数的字符串按整数保存
+    if (p == NULL)
+        return zipStorePrevEntryLength(NULL,prevlen)+zipStoreEntryEncoding(NULL,encoding,slen)+len;
+    p += zipStorePrevEntryLength(p,prevlen);
+    p += zipStoreEntryEncoding(p,encoding,slen);
+    if (ZIP_IS_STR(encoding)) {
+        memcpy(p,s,slen);
+    } else {
+        zipSaveInteger(p,value,encoding);
+    }
+    return (p-start)+len;
+}
+
+/* 把count个字符串一次写入压缩表的头部或者尾部，结果和依次对s[0]到s[count-1]调用ziplistPush(zl,s[i],slen[i],where)相同，
+ * 所以写入头部时s[count-1]在最前面。
+ *
+ * 新节点的前驱节点长度在它们之间是连续的，所以先算出所有新节点的总长度，只调整一次大小、移动一次内存，再一次写入所有节点。
+ * 写入头部时只有原来的第一个节点的prevlen需要改成最后写入的新节点的长度，连锁更新也只需要从这一个接缝处检查一次。 */
+unsigned char *ziplistPushMany(unsigned char *zl, unsigned char **s, unsigned int *slen, unsigned int count, int where) {
+    size_t curlen = intrev32ifbe(ZIPLIST_BYTES(zl)), reqlen = 0, offset;
+    unsigned int i, j, zllen, prevlen = 0, lastlen;
+    int nextdiff = 0, forcelarge = 0;
+    unsigned char *p;
+    zlentry tail;
+
+    if (count == 0) return zl;
+    if (where == ZIPLIST_HEAD) {
+        p = ZIPLIST_ENTRY_HEAD(zl);
+    } else {
+        unsigned char *ptail = ZIPLIST_ENTRY_TAIL(zl);
+        p = ZIPLIST_ENTRY_END(zl);
+        if (ptail[0] != ZIP_END) prevlen = zipRawEntryLength(ptail); ///第一个新节点的前驱节点是原来的尾节点
+    }
+
+    ///计算所有新节点的总长度，lastlen为最后写入的那个新节点的长度
+    lastlen = prevlen;
+    for (i = 0; i < count; i++) {
+        j = (where == ZIPLIST_HEAD) ? count-1-i : i;
+        lastlen = zipStoreEntry(NULL,lastlen,s[j],slen[j]);
+        reqlen += lastlen;
+    }
+
+    ///写入头部时，原来的第一个节点的prevlen要能保存lastlen，和__ziplistInsert()一样不缩小prevlen，避免抖动
+    if (p[0] != ZIP_END) {
+        nextdiff = zipPrevLenByteDiff(p,lastlen);
+        if (nextdiff < 0) {
+            nextdiff = 0;
+            forcelarge = 1;
+        }
+    }
+
+    offset = p-zl;
+    zl = ziplistResize(zl,curlen+reqlen+nextdiff);
+    p = zl+offset;
+
+    if (p[0] != ZIP_END) {
+        memmove(p+reqlen,p-nextdiff,curlen-offset-1+nextdiff); ///原来的节点整体后移，同时给变长的prevlen腾出空间
+        if (forcelarge)
+            zipStorePrevEntryLengthLarge(p+reqlen,lastlen);
+        else
+            zipStorePrevEntryLength(p+reqlen,lastlen);
+
+        ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))+reqlen);
+        zipEntry(p+reqlen, &tail);
+        if (p[reqlen+tail.headersize+tail.len] != ZIP_END) {
+            ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))+nextdiff);
+        }
+    } else {
+        ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(offset+reqlen-lastlen); ///最后写入的新节点就是尾节点
+    }
+
+    ///原来的第一个节点变长了，从接缝处做一次连锁更新
+    if (nextdiff != 0) {
+        zl = __ziplistCascadeUpdate(zl,p+reqlen);
+        p = zl+offset;
+    }
+
+    ///一次写入所有的新节点
+    for (i = 0; i < count; i++) {
+        j = (where == ZIPLIST_HEAD) ? count-1-i : i;
+        prevlen = zipStoreEntry(p,prevlen,s[j],slen[j]);
+        p += prevlen;
+    }
+
+    ///ZIPLIST_INCR_LENGTH()假设每次只加1，这里一次加count，超过UINT16_MAX时保持UINT16_MAX
+    zllen = intrev16ifbe(ZIPLIST_LENGTH(zl));
+    if (zllen < UINT16_MAX) {
+        zllen = (zllen+count < UINT16_MAX) ? zllen+count : UINT16_MAX;
+        ZIPLIST_LENGTH(zl) = intrev16ifbe(zllen);
+    }
+    return zl;
+}
+
 /* Returns an offset to use for iterating with ziplistNext. When the given
  * index is negative, the list is traversed back to front. When the list
  * doesn't contain an element at the provided index, NULL is returned. */
@@ -933,6 +1038,86 @@ unsigned char *ziplistDelete(unsigned char *zl, unsigned char **p) {
     return zl;
 }
 
+/* ziplistDeleteMany()使用：把zl中除ps以外的节点按顺序写入dst，返回新压缩表的总字节数（不含结尾标识符），
+ * 新的尾节点偏移量保存在*tailoffset中。dst为NULL时只计算大小。
+ *
+ * 每个被删除的节点后面保留下来的节点的前驱节点变了，需要重写它的prevlen；和__ziplistCascadeUpdate()一样prevlen只增大
+ * 不缩小，重写后长度变了的节点，它后面的节点也要重写。其余连续的节点长度不变，整段直接拷贝。 */
+static size_t zipDeleteManyCopy(unsigned char *dst, unsigned char *zl, unsigned char **ps, unsigned int count,
+                                size_t *tailoffset) {
+    unsigned char *p = ps[0], *end;
+    unsigned int i = 0, prevlensize, prevlen, oldsize, newsize, rawlen, newlen;
+    size_t o = ps[0]-zl;
+    int rewrite = 1;
+
+    ZIP_DECODE_PREVLEN(p, prevlensize, prevlen); ///第一个被删除的节点前面的节点不变
+    *tailoffset = o-prevlen;
+    if (dst) memcpy(dst,zl,o);
+    while (p[0] != ZIP_END) {
+        if (i < count && p == ps[i]) { ///跳过被删除的节点
+            p += zipRawEntryLength(p);
+            i++;
+            rewrite = 1;
+            continue;
+        }
+        if (!rewrite) { ///长度不变的一段节点整段拷贝，段内最后一个节点的长度就是下一个被删除节点的prevlen
+            end = (i < count) ? ps[i] : ZIPLIST_ENTRY_END(zl);
+            if (dst) memcpy(dst+o,p,end-p);
+            o += end-p;
+            if (i < count) {
+                ZIP_DECODE_PREVLEN(end, prevlensize, prevlen);
+            } else {
+                prevlen = zipRawEntryLength(ZIPLIST_ENTRY_TAIL(zl));
+            }
+            *tailoffset = o-prevlen;
+            p = end;
+            continue;
+        }
+
+        ///重写prevlen为新的前驱节点的长度
+        rawlen = zipRawEntryLength(p);
+        ZIP_DECODE_PREVLENSIZE(p, oldsize);
+        newsize = zipStorePrevEntryLength(NULL,prevlen);
+        if (newsize < oldsize) newsize = oldsize;
+        newlen = rawlen-oldsize+newsize;
+        if (dst) {
+            if (newsize == 1)
+                zipStorePrevEntryLength(dst+o,prevlen);
+            else
+                zipStorePrevEntryLengthLarge(dst+o,prevlen);
+            memcpy(dst+o+newsize,p+oldsize,rawlen-oldsize);
+        }
+        *tailoffset = o;
+        o += newlen;
+        prevlen = newlen;
+        rewrite = (newlen != rawlen);
+        p += rawlen;
+    }
+    assert(i == count); ///ps中的节点必须按地址排列并且没有重复
+    return o;
+}
+
+/* 删除ps中的count个节点，ps必须按地址从小到大排列并且没有重复。
+ * 保留下来的节点只拷贝一次到新的内存中，prevlen的修改和连锁更新在拷贝的同时完成，
+ * 不需要像逐个调用ziplistDelete()那样每次都移动后面所有的内存并做一次连锁更新。 */
+unsigned char *ziplistDeleteMany(unsigned char *zl, unsigned char **ps, unsigned int count) {
+    unsigned char *nzl;
+    size_t bytes, tailoffset;
+    unsigned int zllen;
+
+    if (count == 0) return zl;
+    bytes = zipDeleteManyCopy(NULL,zl,ps,count,&tailoffset)+ZIPLIST_END_SIZE;
+    nzl = zmalloc(bytes);
+    zipDeleteManyCopy(nzl,zl,ps,count,&tailoffset);
+    ZIPLIST_BYTES(nzl) = intrev32ifbe(bytes);
+    ZIPLIST_TAIL_OFFSET(nzl) = intrev32ifbe(tailoffset);
+    nzl[bytes-1] = ZIP_END;
+    zllen = intrev16ifbe(ZIPLIST_LENGTH(zl));
+    if (zllen < UINT16_MAX) ZIPLIST_LENGTH(nzl) = intrev16ifbe(zllen-count);
+    zfree(zl);
+    return nzl;
+}
+
 ///在压缩表中删除从index开始，num个节点
 unsigned char *ziplistDeleteRange(unsigned char *zl, int index, unsigned int num) {
     unsigned char *p = ziplistIndex(zl,index); ///需要先定位index所指的地址
@@ -1016,6 +1201,209 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
     return NULL;
 }
 
+/* ziplistFindIn()使用的扫描函数：在[s,end)中查找第一个位置i，使得s[i] == first，并且之后的len个字节和str相同。
+ * 找到返回s+i，否则返回NULL。len至少为1。
+ * SIMD实现一次比较多个位置的第一个字节和最后一个字节，两个字节都相同的位置才需要调用memcmp。 */
+typedef unsigned char *zipScanFunction(unsigned char *s, unsigned char *end,
+                                       unsigned char first, unsigned char *str, unsigned int len);
+
+static unsigned char *zipScanScalar(unsigned char *s, unsigned char *end,
+                                    unsigned char first, unsigned char *str, unsigned int len) {
+    if ((size_t)(end - s) <= len) return NULL;
+    unsigned char *last = end - len - 1; ///最后一个可能的开始位置
+
+    while (s <= last) {
+        s = memchr(s,first,last - s + 1);
+        if (s == NULL) return NULL;
+        if (s[len] == str[len-1] && memcmp(s+1,str,len) == 0) return s;
+        s++;
+    }
+    return NULL;
+}
+
+#ifdef ZIPLIST_HAVE_X86_SIMD
+///SSE2实现：一次检查16个开始位置，剩下不足16个的位置交给标量实现
+__attribute__((target("sse2")))
+static unsigned char *zipScanSSE2(unsigned char *s, unsigned char *end,
+                                  unsigned char first, unsigned char *str, unsigned int len) {
+    __m128i f = _mm_set1_epi8((char)first);
+    __m128i l = _mm_set1_epi8((char)str[len-1]);
+
+    while ((size_t)(end - s) >= (size_t)len + 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s+len));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,f),_mm_cmpeq_epi8(b,l)));
+
+        while (mask) {
+            unsigned char *c = s + __builtin_ctz(mask);
+            if (memcmp(c+1,str,len) == 0) return c;
+            mask &= mask - 1;
+        }
+        s += 16;
+    }
+    return zipScanScalar(s,end,first,str,len);
+}
+
+///AVX2实现：一次检查32个开始位置
+__attribute__((target("avx2")))
+static unsigned char *zipScanAVX2(unsigned char *s, unsigned char *end,
+                                  unsigned char first, unsigned char *str, unsigned int len) {
+    __m256i f = _mm256_set1_epi8((char)first);
+    __m256i l = _mm256_set1_epi8((char)str[len-1]);
+
+    while ((size_t)(end - s) >= (size_t)len + 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s+len));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a,f),_mm256_cmpeq_epi8(b,l)));
+
+        while (mask) {
+            unsigned char *c = s + __builtin_ctz(mask);
+            if (memcmp(c+1,str,len) == 0) return c;
+            mask &= mask - 1;
+        }
+        s += 32;
+    }
+    return zipScanScalar(s,end,first,str,len);
+}
+#endif
+
+static unsigned char *zipScanResolve(unsigned char *s, unsigned char *end,
+                                     unsigned char first, unsigned char *str, unsigned int len);
+static zipScanFunction *zipScan = zipScanResolve; ///当前使用的扫描实现
+
+///第一次调用时根据CPU支持的指令集选择扫描的实现
+static unsigned char *zipScanResolve(unsigned char *s, unsigned char *end,
+                                     unsigned char first, unsigned char *str, unsigned int len) {
+    zipScanFunction *fn = zipScanScalar;
+
+#ifdef ZIPLIST_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fn = zipScanAVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        fn = zipScanSSE2;
+#endif
+    zipScan = fn;
+    return fn(s,end,first,str,len);
+}
+
+///在[s,end)中查找字节first后面紧跟len个字节str的位置，使用和ziplistFindIn()相同的扫描实现，packlist.c也使用它
+unsigned char *ziplistScan(unsigned char *s, unsigned char *end, unsigned char first, unsigned char *str, unsigned int len) {
+    return zipScan(s,end,first,str,len);
+}
+
+/* 和ziplistFind()相同，但是需要传入p所在的压缩表zl，结果和ziplistFind()完全一致。
+ * 不能编码成整数的字符串只可能和字符串节点相等，而相等的节点一定以“编码的最后一个字节 + vstr”结尾，
+ * 所以先用SIMD在p之后的字节中扫描这个字节序列，没有出现时直接返回NULL，不需要逐个解码节点；
+ * 出现时才从p开始逐个跳过节点，直到扫描到的位置，确认它正好是一个节点的内容，并且这个节点没有被skip跳过。
+ * 可以编码成整数的vstr和空字符串仍然使用ziplistFind()。 */
+unsigned char *ziplistFindIn(unsigned char *zl, unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip) {
+    unsigned char *end = zl + intrev32ifbe(ZIPLIST_BYTES(zl)) - ZIPLIST_END_SIZE;
+    unsigned char buf[5], *c; ///字符串编码最长5个字节
+    unsigned int skipcnt = 0, hlen;
+    unsigned char vencoding;
+    long long vll;
+
+    if (vlen == 0 || zipTryEncoding(vstr,vlen,&vll,&vencoding))
+        return ziplistFind(p,vstr,vlen,skip);
+
+    hlen = zipStoreEntryEncoding(buf,ZIP_STR_06B,vlen);
+    c = zipScan(p,end,buf[hlen-1],vstr,vlen);
+    while (c) {
+        unsigned int prevlensize, encoding, lensize, len;
+        unsigned char *q;
+
+        ///跳过c之前的节点，它们的内容不可能和vstr相等。c在最后一个节点的内容中时会走到ZIP_END
+        while (1) {
+            if (p[0] == ZIP_END) return NULL;
+            ZIP_DECODE_PREVLENSIZE(p, prevlensize);
+            ZIP_DECODE_LENGTH(p + prevlensize, encoding, lensize, len);
+            q = p + prevlensize + lensize;
+            if (q - 1 >= c) break;
+            skipcnt = skipcnt ? skipcnt - 1 : skip;
+            p = q + len;
+        }
+
+        if (q - 1 == c) {
+            ///c正好是节点编码的最后一个字节，内容已经在扫描时比较过了
+            if (skipcnt == 0 && ZIP_IS_STR(encoding) && len == vlen) return p;
+            c = zipScan(c+1,end,buf[hlen-1],vstr,vlen);
+        } else {
+            ///c在节点p的头部或者内容的中间，从p的内容之前重新扫描，p可能就是要找的节点
+            c = zipScan(q-1,end,buf[hlen-1],vstr,vlen);
+        }
+    }
+    return NULL;
+}
+
+///在[s,end)中查找字节first后面紧跟len个字节str的位置，len为0时只查找first
+static unsigned char *zipScanFrom(unsigned char *s, unsigned char *end, unsigned char first, unsigned char *str, unsigned int len) {
+    if (s >= end) return NULL;
+    if (len == 0) return memchr(s,first,end-s);
+    return zipScan(s,end,first,str,len);
+}
+
+/* 查找zl中所有和vstr值相等的节点，按从头到尾的顺序把它们的地址写入ps、下标写入indexes（两者都可以为NULL），
+ * 最多找max个，返回找到的个数。结果和对每个节点调用ziplistCompare()相同，packlistFindAll()在ziplist格式下使用它。
+ * 和ziplistFindIn()一样扫描“编码的最后一个字节 + 内容”，扫描到的位置正好是某个节点编码的最后一个字节时才需要确认：
+ * 字符串（包括空字符串）扫描编码的最后一个字节加上vstr；可以编码成整数的vstr只可能和整数节点相等，整数节点总是使用
+ * 最短的编码，所以直接扫描它的编码字节和整数的字节，不需要解码每个节点。 */
+unsigned int ziplistFindAll(unsigned char *zl, unsigned char *vstr, unsigned int vlen,
+                            unsigned char **ps, unsigned int *indexes, unsigned int max) {
+    unsigned char *p = ZIPLIST_ENTRY_HEAD(zl), *end = ZIPLIST_ENTRY_END(zl);
+    unsigned char buf[1+8], *str, *c; ///整数的编码字节加上最长8个字节的整数
+    unsigned int plen, idx = 0, found = 0;
+    unsigned char vencoding = 0, first;
+    long long vll;
+    int isstr = 1;
+
+    if (max == 0) return 0;
+    if (vlen && zipTryEncoding(vstr,vlen,&vll,&vencoding)) {
+        isstr = 0;
+        zipSaveInteger(buf,vll,vencoding);
+        first = vencoding;
+        str = buf;
+        plen = zipIntSize(vencoding);
+    } else {
+        unsigned int hlen = zipStoreEntryEncoding(buf,ZIP_STR_06B,vlen);
+        first = buf[hlen-1];
+        str = vstr;
+        plen = vlen;
+    }
+
+    c = zipScanFrom(p,end,first,str,plen);
+    while (c) {
+        unsigned int prevlensize, encoding, lensize, len;
+        unsigned char *q;
+
+        ///跳过c之前的节点，它们不可能和vstr相等。c在最后一个节点的内容中时会走到ZIP_END
+        while (1) {
+            if (p[0] == ZIP_END) return found;
+            ZIP_DECODE_PREVLENSIZE(p, prevlensize);
+            ZIP_DECODE_LENGTH(p + prevlensize, encoding, lensize, len);
+            q = p + prevlensize + lensize;
+            if (q - 1 >= c) break;
+            p = q + len;
+            idx++;
+        }
+
+        if (q - 1 == c) {
+            ///c正好是节点编码的最后一个字节，内容已经在扫描时比较过了
+            if (isstr ? (ZIP_IS_STR(encoding) && len == vlen) : encoding == vencoding) {
+                if (ps) ps[found] = p;
+                if (indexes) indexes[found] = idx;
+                if (++found == max) break;
+            }
+            c = zipScanFrom(c+1,end,first,str,plen);
+        } else {
+            ///c在节点p的头部，从p的编码的最后一个字节重新扫描
+            c = zipScanFrom(q-1,end,first,str,plen);
+        }
+    }
+    return found;
+}
+
 ///返回压缩表中的节点数量
 unsigned int ziplistLen(unsigned char *zl) {
     unsigned int len = 0;
@@ -1696,6 +2084,210 @@ int ziplistTest(int argc, char **argv) {
         zfree(zl);
     }
 
+    printf("Compare ziplistFindIn with ziplistFind:\n");
+    {
+        char buf[64];
+        int buflen;
+
+        for (int i = 0; i < 20000; i++) {
+            int len = rand() % 64;
+
+            zl = ziplistNew();
+            for (int j = 0; j < len; j++) {
+                ///字符集很小的短字符串，让扫描出现很多不在节点开头的候选位置
+                if (rand() % 4) buflen = randstring(buf,1,12);
+                else buflen = sprintf(buf,"%d",rand() % 100);
+                zl = ziplistPush(zl,(unsigned char*)buf,buflen,ZIPLIST_TAIL);
+            }
+            for (int j = 0; j < 16; j++) {
+                unsigned int skip = rand() % 3;
+                unsigned char *start = ziplistIndex(zl,len ? rand() % len : 0);
+                unsigned char *sstr;
+                unsigned int slen;
+                long long sval;
+
+                if (len && rand() % 2) {
+                    assert(ziplistGet(ziplistIndex(zl,rand() % len),&sstr,&slen,&sval));
+                    if (sstr) {
+                        buflen = slen;
+                        memcpy(buf,sstr,slen);
+                    } else {
+                        buflen = sprintf(buf,"%lld",sval);
+                    }
+                } else {
+                    buflen = randstring(buf,0,12);
+                }
+                if (start == NULL) continue;
+                assert(ziplistFindIn(zl,start,(unsigned char*)buf,buflen,skip) ==
+                       ziplistFind(start,(unsigned char*)buf,buflen,skip));
+            }
+            zfree(zl);
+        }
+
+        ///扫描到的位置在最后一个节点的内容中时，不能越过ZIP_END
+        zl = ziplistNew();
+        zl = ziplistPush(zl,(unsigned char*)"xyz",3,ZIPLIST_TAIL);
+        zl = ziplistPush(zl,(unsigned char*)"\003abcd",5,ZIPLIST_TAIL);
+        assert(ziplistFindIn(zl,ziplistIndex(zl,0),(unsigned char*)"abc",3,0) == NULL);
+        assert(ziplistFindAll(zl,(unsigned char*)"abc",3,NULL,NULL,2) == 0);
+        zfree(zl);
+        printf("SUCCESS\n\n");
+    }
+
+    printf("Compare ziplistFindAll with ziplistCompare:\n");
+    {
+        char buf[64];
+        int buflen;
+        unsigned char *ps[64], *p;
+        unsigned int idx[64];
+
+        for (int i = 0; i < 20000; i++) {
+            int len = rand() % 64;
+
+            zl = ziplistNew();
+            for (int j = 0; j < len; j++) {
+                switch (rand() % 4) {
+                case 0: buflen = randstring(buf,0,12); break;
+                case 1: buflen = sprintf(buf,"%d",rand() % 20); break;
+                case 2: buflen = sprintf(buf,"%d",rand() % 300 - 150); break;
+                default: buflen = sprintf(buf,"%lld",((long long)rand() << (rand() % 40)) * (rand() % 2 ? 1 : -1)); break;
+                }
+                zl = ziplistPush(zl,(unsigned char*)buf,buflen,ZIPLIST_TAIL);
+            }
+            for (int j = 0; j < 8; j++) {
+                unsigned char *sstr;
+                unsigned int slen, n = 0, max = 1 + rand() % 64, found;
+                long long sval;
+
+                if (len && rand() % 2) {
+                    assert(ziplistGet(ziplistIndex(zl,rand() % len),&sstr,&slen,&sval));
+                    if (sstr) {
+                        buflen = slen;
+                        memcpy(buf,sstr,slen);
+                    } else {
+                        buflen = sprintf(buf,"%lld",sval);
+                    }
+                } else {
+                    buflen = randstring(buf,0,3);
+                }
+                found = ziplistFindAll(zl,(unsigned char*)buf,buflen,ps,idx,max);
+                p = ziplistIndex(zl,0);
+                for (unsigned int k = 0; p && n < max; k++, p = ziplistNext(zl,p)) {
+                    if (!ziplistCompare(p,(unsigned char*)buf,buflen)) continue;
+                    assert(n < found && ps[n] == p && idx[n] == k);
+                    n++;
+                }
+                assert(n == found);
+            }
+            zfree(zl);
+        }
+        printf("SUCCESS\n\n");
+    }
+
+    printf("Benchmark ziplistFind vs ziplistFindIn:\n");
+    {
+        ///和有序集合一样成员和分值交替存放，共512个节点，查找最后一个成员和不存在的成员
+        char buf[32];
+        unsigned char *head;
+        long long start, iter = 100000;
+
+        zl = ziplistNew();
+        for (int i = 0; i < 256; i++) {
+            int buflen = sprintf(buf,"member:%d",i);
+            zl = ziplistPush(zl,(unsigned char*)buf,buflen,ZIPLIST_TAIL);
+            buflen = sprintf(buf,"%d",i*3);
+            zl = ziplistPush(zl,(unsigned char*)buf,buflen,ZIPLIST_TAIL);
+        }
+        head = ziplistIndex(zl,0);
+        const char *names[] = {"hit","miss"};
+        const char *needles[] = {"member:255","member:256"};
+
+        for (int k = 0; k < 2; k++) {
+            unsigned char *needle = (unsigned char*)needles[k];
+            unsigned int nlen = strlen(needles[k]);
+            unsigned char *r1 = NULL, *r2 = NULL;
+
+            start = usec();
+            for (long long i = 0; i < iter; i++)
+                r1 = ziplistFind(head,needle,nlen,1);
+            long long t1 = usec()-start;
+            start = usec();
+            for (long long i = 0; i < iter; i++)
+                r2 = ziplistFindIn(zl,head,needle,nlen,1);
+            long long t2 = usec()-start;
+            assert(r1 == r2 && (r1 != NULL) == (k == 0));
+            printf("%-4s: ziplistFind %lld usec, ziplistFindIn %lld usec (%lldx %s)\n",
+                names[k],t1,t2,iter,needles[k]);
+        }
+        zfree(zl);
+        printf("\n");
+    }
+
+    printf("Compare ziplistPushMany/DeleteMany with ziplistPush/Delete:\n");
+    {
+        ///节点长度集中在254字节附近，让prevlen在1字节和5字节之间变化，触发连锁更新
+        char bufs[32][300];
+        unsigned char *vals[32], *ps[32];
+        unsigned int lens[32];
+        zlentry e[128];
+
+        for (int i = 0; i < 20000; i++) {
+            unsigned char *zl1 = ziplistNew(), *zl2 = ziplistNew(), *p1, *p2;
+            int rounds = 1 + rand() % 4;
+
+            for (int r = 0; r < rounds; r++) {
+                unsigned int count = rand() % 32;
+                int where = (rand() & 1) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+
+                for (unsigned int j = 0; j < count; j++) {
+                    if (rand() % 4) lens[j] = randstring(bufs[j],1,6)+(rand() % 2 ? 240 : 0);
+                    else lens[j] = sprintf(bufs[j],"%d",rand() % 100000 - 50000);
+                    if (lens[j] > 6) memset(bufs[j]+6,'x',lens[j]-6);
+                    vals[j] = (unsigned char*)bufs[j];
+                    zl1 = ziplistPush(zl1,vals[j],lens[j],where);
+                }
+                zl2 = ziplistPushMany(zl2,vals,lens,count,where);
+            }
+            verify(zl2,e);
+            assert(ziplistLen(zl1) == ziplistLen(zl2));
+
+            ///随机删除一些节点，zl1按相同的下标从后向前逐个删除
+            unsigned int n = 0, idx[32], len;
+            for (p2 = ziplistIndex(zl2,0), len = 0; p2 && n < 32; p2 = ziplistNext(zl2,p2), len++) {
+                if (rand() % 3 == 0) {
+                    idx[n] = len;
+                    ps[n++] = p2;
+                }
+            }
+            for (int j = n-1; j >= 0; j--) {
+                p1 = ziplistIndex(zl1,idx[j]);
+                zl1 = ziplistDelete(zl1,&p1);
+            }
+            zl2 = ziplistDeleteMany(zl2,ps,n);
+            verify(zl2,e);
+
+            assert(ziplistLen(zl1) == ziplistLen(zl2));
+            p1 = ziplistIndex(zl1,0);
+            p2 = ziplistIndex(zl2,0);
+            while (p1 && p2) {
+                unsigned char *s1, *s2;
+                unsigned int l1, l2;
+                long long v1, v2;
+
+                assert(ziplistGet(p1,&s1,&l1,&v1) && ziplistGet(p2,&s2,&l2,&v2));
+                assert((s1 == NULL) == (s2 == NULL));
+                if (s1) assert(l1 == l2 && memcmp(s1,s2,l1) == 0);
+                else assert(v1 == v2);
+                p1 = ziplistNext(zl1,p1);
+                p2 = ziplistNext(zl2,p2);
+            }
+            assert(p1 == NULL && p2 == NULL);
+            zfree(zl1);
+            zfree(zl2);
+        }
+        printf("SUCCESS\n\n");
+    }
+
     printf("Stress with random payloads of different encoding:\n");
     {
         int i,j,len,where;
@@ -7,15 +7,21 @@
 unsigned char *ziplistNew(void); ///创建一个空的压缩表
 unsigned char *ziplistMerge(unsigned char **first, unsigned char **second); ///合并两个压缩表
 unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int slen, int where); ///在压缩表的头或者尾部插入一个节点
+unsigned char *ziplistPushMany(unsigned char *zl, unsigned char **s, unsigned int *slen, unsigned int count, int where); ///一次在头或者尾部插入count个节点
 unsigned char *ziplistIndex(unsigned char *zl, int index); ///查找index下标处的节点
 unsigned char *ziplistNext(unsigned char *zl, unsigned char *p);///获取p指向节点的下一个节点
 unsigned char *ziplistPrev(unsigned char *zl, unsigned char *p); ///获取p指向节点的前驱节点
 unsigned int ziplistGet(unsigned char *p, unsigned char **sval, unsigned int *slen, long long *lval); ///获取p所指向的节点信息
 unsigned char *ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen); ///在p所指的位置插入节点，如果p在压缩表，则插入p前面
 unsigned char *ziplistDelete(unsigned char *zl, unsigned char **p); //删除p所指的位置的节点
+unsigned char *ziplistDeleteMany(unsigned char *zl, unsigned char **ps, unsigned int count); ///一次删除ps中按地址排列的count个节点
 unsigned char *ziplistDeleteRange(unsigned char *zl, int index, unsigned int num); ///删除从index处开始的num个节点
 unsigned int ziplistCompare(unsigned char *p, unsigned char *s, unsigned int slen);  ///比较p所指的节点和s
 unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip); ///压缩表中寻找和vstr值相等的节点
+unsigned char *ziplistFindIn(unsigned char *zl, unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip); ///同ziplistFind，用SIMD扫描加速字符串的查找
+unsigned int ziplistFindAll(unsigned char *zl, unsigned char *vstr, unsigned int vlen,
+                            unsigned char **ps, unsigned int *indexes, unsigned int max); ///查找所有和vstr值相等的节点，最多max个
+unsigned char *ziplistScan(unsigned char *s, unsigned char *end, unsigned char first, unsigned char *str, unsigned int len); ///SIMD查找first加str的字节序列
 unsigned int ziplistLen(unsigned char *zl); ///获取压缩表的长度
 size_t ziplistBlobLen(unsigned char *zl); ///获取压缩表的二进制长度
 void ziplistRepr(unsigned char *zl);
@@ -1,3 +1,4 @@
+#include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -12,6 +13,8 @@ void zlibc_free(void *ptr) {
 
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "config.h"
 #include "zmalloc.h"
 #include "atomicvar.h"
@@ -32,29 +35,112 @@ void zlibc_free(void *ptr) {
 #define calloc(count,size) tc_calloc(count,size)
 #define realloc(ptr,size) tc_realloc(ptr,size)
 #define free(ptr) tc_free(ptr)
+#define posix_memalign(ptr,align,size) tc_posix_memalign(ptr,align,size)
 #elif defined(USE_JEMALLOC)
 #define malloc(size) je_malloc(size)
 #define calloc(count,size) je_calloc(count,size)
 #define realloc(ptr,size) je_realloc(ptr,size)
 #define free(ptr) je_free(ptr)
+#define posix_memalign(ptr,align,size) je_posix_memalign(ptr,align,size)
 #define mallocx(size,flags) je_mallocx(size,flags)
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
 #endif
 
+/* 已用内存的计数分成ZMALLOC_SHARDS个分片，每个分片独占一条缓存行，每个线程第一次分配内存时轮流分到一个分片，
+ * 之后只更新自己的分片。所有线程都更新同一个计数时，I/O线程、lazy free线程和主线程会在这条缓存行上互相争抢，
+ * 分片之后每个线程的原子操作基本都落在自己的缓存行上。
+ * 内存可能在一个线程中分配、在另一个线程中释放，所以单个分片的值可能“小于0”（无符号回绕），
+ * 但所有分片的和总是正确的，由zmalloc_used_memory()在读取时求和。
+ * 线程数超过分片数时，多个线程共用一个分片，所以分片的更新仍然需要原子操作。 */
+#define ZMALLOC_SHARDS 64
+
+typedef struct zmallocShard {
+    size_t used; ///这个分片上记录的内存变化量
+    char padding[64-sizeof(size_t)]; ///每个分片独占一条缓存行，避免伪共享
+} zmallocShard;
+
+#if defined(__ATOMIC_RELAXED)
+#define zmalloc_shard_incr(s,n) __atomic_add_fetch(&(s)->used,(n),__ATOMIC_RELAXED)
+#define zmalloc_shard_decr(s,n) __atomic_sub_fetch(&(s)->used,(n),__ATOMIC_RELAXED)
+#define zmalloc_shard_get(s) __atomic_load_n(&(s)->used,__ATOMIC_RELAXED)
+#define zmalloc_shards_assigned() __atomic_load_n(&used_memory_next_shard,__ATOMIC_RELAXED)
+#else
+#define zmalloc_shard_incr(s,n) __sync_add_and_fetch(&(s)->used,(n))
+#define zmalloc_shard_decr(s,n) __sync_sub_and_fetch(&(s)->used,(n))
+#define zmalloc_shard_get(s) __sync_add_and_fetch(&(s)->used,0)
+#define zmalloc_shards_assigned() __sync_add_and_fetch(&used_memory_next_shard,0)
+#endif
+
+static zmallocShard used_memory_shards[ZMALLOC_SHARDS] __attribute__((aligned(64)));
+static unsigned int used_memory_next_shard = 0; ///下一个线程分到的分片
+static __thread zmallocShard *used_memory_shard = NULL; ///当前线程使用的分片
+
+///返回当前线程使用的分片，第一次调用时分配一个
+static inline zmallocShard *zmalloc_thread_shard(void) {
+    if (used_memory_shard == NULL) {
+        unsigned int idx = __sync_fetch_and_add(&used_memory_next_shard,1);
+        used_memory_shard = &used_memory_shards[idx % ZMALLOC_SHARDS];
+    }
+    return used_memory_shard;
+}
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicIncr(used_memory,__n); \
+    zmalloc_shard_incr(zmalloc_thread_shard(),__n); \
 } while(0)
 
 #define update_zmalloc_stat_free(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicDecr(used_memory,__n); \
+    zmalloc_shard_decr(zmalloc_thread_shard(),__n); \
 } while(0)
 
-static size_t used_memory = 0;
-pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* 采样的内存分配分析。used_memory只是一个总数，看不出内存的分配和释放主要来自哪种数据结构。
+ * 开启之后（zmalloc_profile_set_rate()），每个线程平均每rate次分配记录一次：按调用方的标签（见zmalloc.h中的ZMALLOC_TAG）
+ * 和分配大小所在的2的幂区间累加，每次记录算作rate次分配，所以读到的是分配次数和字节数的估计值。
+ * 两次记录之间的间隔在1到2*rate-1之间随机选择，避免和固定周期的分配模式同步。
+ * 统计的是分配的流量而不是当前占用的内存：释放时不知道内存是哪个标签分配的。
+ * 没有开启时每次分配只多读一个全局变量。 */
+static unsigned int zmalloc_profile_rate = 0; ///采样率，0表示关闭
+static size_t zmalloc_profile_count[ZMALLOC_TAGS][ZMALLOC_PROFILE_BUCKETS]; ///估计的分配次数，按标签和大小区间
+static size_t zmalloc_profile_bytes[ZMALLOC_TAGS]; ///估计的分配字节数，按标签
+static __thread long zmalloc_profile_countdown = 0; ///当前线程距离下一次记录还有多少次分配
+static __thread uint32_t zmalloc_profile_seed = 0; ///当前线程生成采样间隔的随机数状态
+
+#if defined(__ATOMIC_RELAXED)
+#define zmalloc_profile_add(var,n) __atomic_add_fetch(&(var),(n),__ATOMIC_RELAXED)
+#define zmalloc_profile_load(var) __atomic_load_n(&(var),__ATOMIC_RELAXED)
+#define zmalloc_profile_store(var,n) __atomic_store_n(&(var),(n),__ATOMIC_RELAXED)
+#else
+#define zmalloc_profile_add(var,n) __sync_add_and_fetch(&(var),(n))
+#define zmalloc_profile_load(var) __sync_add_and_fetch(&(var),0)
+#define zmalloc_profile_store(var,n) do { __sync_synchronize(); (var) = (n); } while(0)
+#endif
+#define zmalloc_profile_get_rate() zmalloc_profile_load(zmalloc_profile_rate)
+
+///记录一次采样，并选择下一次采样的间隔
+static void zmalloc_profile_record(size_t size, int tag) {
+    unsigned int rate = zmalloc_profile_get_rate();
+    int bucket = size ? 64-__builtin_clzll(size) : 0; ///大小在[2^(bucket-1), 2^bucket)之间
+
+    if (rate == 0) return;
+    if (bucket >= ZMALLOC_PROFILE_BUCKETS) bucket = ZMALLOC_PROFILE_BUCKETS-1;
+    zmalloc_profile_add(zmalloc_profile_count[tag][bucket],rate);
+    zmalloc_profile_add(zmalloc_profile_bytes[tag],size*rate);
+
+    ///xorshift32，种子取线程本地变量的地址，不同线程的序列不同
+    if (zmalloc_profile_seed == 0) zmalloc_profile_seed = (uint32_t)(uintptr_t)&zmalloc_profile_seed | 1;
+    zmalloc_profile_seed ^= zmalloc_profile_seed << 13;
+    zmalloc_profile_seed ^= zmalloc_profile_seed >> 17;
+    zmalloc_profile_seed ^= zmalloc_profile_seed << 5;
+    zmalloc_profile_countdown = 1 + zmalloc_profile_seed % (2*(uint64_t)rate-1);
+}
+
+#define zmalloc_profile_sample(size,tag) do { \
+    if (__builtin_expect(zmalloc_profile_get_rate() != 0,0) && --zmalloc_profile_countdown <= 0) \
+        zmalloc_profile_record(size,tag); \
+} while(0)
 
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
@@ -67,9 +153,15 @@ static void (*zmalloc_oom_handler)(size_t) = zmalloc_default_oom;
 
 ///这个函数zmalloc为申请内存的方法，其中size为需要申请内存的长度，PREFIX_SIZE用来存储这里分配内存的大小也就是size的值
 void *zmalloc(size_t size) {
+    return zmalloc_tagged(size,ZMALLOC_TAG_OTHER);
+}
+
+///和zmalloc相同，tag是分配分析中记录的调用方标签
+void *zmalloc_tagged(size_t size, int tag) {
     void *ptr = malloc(size+PREFIX_SIZE);///申请长度为size + PREFIX_SIZE大小的内存，
 
     if (!ptr) zmalloc_oom_handler(size);///如果申请失败，则进行响应的处理
+    zmalloc_profile_sample(size,tag);
     
 ///如果在该操作系统上，size_t的大小为long long型，也就是占用8个字节，则直接在申请内存的头部前面的8个字节用来保存大小，
 ///从申请的位置开始存数据，否则需要计算size_t占的大小PREFIX_SIZE，进行内存分配
@@ -104,9 +196,14 @@ void zfree_no_tcache(void *ptr) {
 
 ///zcalloc函数为内存分配函数，它主要是y使用C语言的calloc函数进行内存分配，参数sized为需要分配的内存大小。
 void *zcalloc(size_t size) {
+    return zcalloc_tagged(size,ZMALLOC_TAG_OTHER);
+}
+
+void *zcalloc_tagged(size_t size, int tag) {
     void *ptr = calloc(1, size+PREFIX_SIZE); ///分配size+PREFIX_SIZE大小的内存空间，并进行初始化
 
     if (!ptr) zmalloc_oom_handler(size); ///如果没有分配成功，就进入异常处理函数。
+    zmalloc_profile_sample(size,tag);
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_alloc(zmalloc_size(ptr)); ///更新use_memory的大小
     return ptr; ///返回申请的内存
@@ -119,6 +216,10 @@ void *zcalloc(size_t size) {
 
 ///对已有的内存空间，进行重新分配，分配的方式为调用C语言的realloc()函数，参数*ptr为f原来的内存起始位置，size为新分配的内存大小
 void *zrealloc(void *ptr, size_t size) {
+    return zrealloc_tagged(ptr,size,ZMALLOC_TAG_OTHER);
+}
+
+void *zrealloc_tagged(void *ptr, size_t size, int tag) {
 #ifndef HAVE_MALLOC_SIZE
     void *realptr;
 #endif
@@ -129,7 +230,8 @@ void *zrealloc(void *ptr, size_t size) {
         zfree(ptr); ///如果新分配的空间大小为0，则直接将原来的空间释放掉
         return NULL; ///返回NULL值
     }
-    if (ptr == NULL) return zmalloc(size); ///如果原来的空间位置不存在，则只要重新分配一个size大小的空间即可
+    if (ptr == NULL) return zmalloc_tagged(size,tag); ///如果原来的空间位置不存在，则只要重新分配一个size大小的空间即可
+    zmalloc_profile_sample(size,tag); ///按新的大小记录
 #ifdef HAVE_MALLOC_SIZE
     oldsize = zmalloc_size(ptr); ///获取原来空间的大小
     newptr = realloc(ptr,size); ///重新进行内存分配
@@ -197,18 +299,644 @@ char *zstrdup(const char *s) {
     return p; ///返回拷贝完成后的字符串的首地址
 }
 
-///a设置已用内存的值
+/* 获取已用内存的值：对已经分给线程的分片求和，结果是精确的。
+ * 分片按顺序分给线程，还没有分出去的分片一直是0，所以只需要读取和线程数相同的缓存行，最多ZMALLOC_SHARDS条。 */
 size_t zmalloc_used_memory(void) {
-    size_t um;
-    atomicGet(used_memory,um);
+    unsigned int shards, j;
+    size_t um = 0;
+
+    shards = zmalloc_shards_assigned();
+    if (shards > ZMALLOC_SHARDS) shards = ZMALLOC_SHARDS;
+    for (j = 0; j < shards; j++) um += zmalloc_shard_get(&used_memory_shards[j]);
     return um;
 }
 
+///单调时钟的毫秒数，只用来判断缓存是否过期，精度不需要很高
+static long long zmalloc_clock_ms(void) {
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+#endif
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* 设置分配分析的采样率：平均每rate次分配记录一次，0表示关闭。同时清空之前的统计。
+ * 各个线程正在进行的采样间隔不会立即改变，最多再经过一个间隔就按新的采样率采样。 */
+void zmalloc_profile_set_rate(unsigned int rate) {
+    int tag, bucket;
+
+    for (tag = 0; tag < ZMALLOC_TAGS; tag++) {
+        for (bucket = 0; bucket < ZMALLOC_PROFILE_BUCKETS; bucket++)
+            zmalloc_profile_store(zmalloc_profile_count[tag][bucket],0);
+        zmalloc_profile_store(zmalloc_profile_bytes[tag],0);
+    }
+    zmalloc_profile_store(zmalloc_profile_rate,rate);
+}
+
+///读取分配分析的统计
+void zmalloc_profile_get(zmallocProfile *profile) {
+    int tag, bucket;
+
+    profile->rate = zmalloc_profile_get_rate();
+    for (tag = 0; tag < ZMALLOC_TAGS; tag++) {
+        for (bucket = 0; bucket < ZMALLOC_PROFILE_BUCKETS; bucket++)
+            profile->count[tag][bucket] = zmalloc_profile_load(zmalloc_profile_count[tag][bucket]);
+        profile->bytes[tag] = zmalloc_profile_load(zmalloc_profile_bytes[tag]);
+    }
+}
+
+///标签的名字，用于输出
+const char *zmalloc_tag_name(int tag) {
+    static const char *names[ZMALLOC_TAGS] = {
+        "other", "sds", "dict", "ziplist", "quicklist", "skiplist", "robj"
+    };
+    return (tag >= 0 && tag < ZMALLOC_TAGS) ? names[tag] : "unknown";
+}
+
 ///设置如果分配失败，处理异常的方式
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
     zmalloc_oom_handler = oom_handler;
 }
 
+/* ------------------------------- 大块内存 ---------------------------------- */
+
+/* 几百MB甚至几个GB的hash表如果用calloc分配，内存在第一次访问时才逐页缺页，扩容之后的rehash会引起集中的缺页，
+ * 查找时按4KB的页访问还会有大量的TLB miss。zcalloc_huge()把这样的内存单独映射：
+ * - 映射按2MB对齐。hugepage默认是ZMALLOC_HUGEPAGE_DEFAULT，不调用madvise，内核的透明大页设置为always时照常使用大页。
+ *   ZMALLOC_HUGEPAGE_YES用MADV_HUGEPAGE建议内核使用透明大页，设置为madvise时也会使用；ZMALLOC_HUGEPAGE_NO用MADV_NOHUGEPAGE
+ *   明确不使用：fork出子进程（RDB/AOF重写）之后，父进程每写一个大页都要复制整个2MB，而不是4KB，由调用方权衡之后选择；
+ * - numa_local开启时（默认开启），用mbind把内存优先放在调用线程所在的NUMA节点上。否则内存会落在第一次访问它的
+ *   线程所在的节点上，而负责预先缺页的后台线程可能运行在另一个节点上；
+ * - prefault开启时（默认关闭），由后台线程每次2MB地提前把内存缺页进来，前台线程可以同时读写这块内存。
+ *   释放内存时先把它从任务表中移除，如果后台线程正在处理它，只等待当前的2MB处理完成。
+ * 映射前面多保留一个页作为映射头，记录映射时madvise和mbind的结果，zmalloc_huge_get_info()直接读取，不需要再查询内核。
+ * fork时用pthread_atfork()拿住任务表的锁，子进程中没有后台线程，任务表和正在处理的映射都要清空，见zmalloc_huge_atfork_child()。
+ * mmap得到的内存本身就是0，不需要再清零。
+ */
+#if defined(__linux__) && !defined(ZMALLOC_HUGE_DISABLED)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE) && defined(SYS_mbind) && defined(SYS_getcpu)
+#define HAVE_HUGE_MAPPING 1
+#endif
+#endif
+
+#ifdef HAVE_HUGE_MAPPING
+#define ZMALLOC_HUGE_ALIGN (2*1024*1024) ///映射的对齐大小，也是后台线程每次预先缺页的大小
+#define ZMALLOC_HUGE_JOBS 16 ///同时等待预先缺页的映射数，超过时新的映射不再预先缺页
+#define ZMALLOC_MPOL_PREFERRED 1 ///<numaif.h>中的定义，这里直接使用系统调用，不依赖libnuma
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 ///Linux 5.14开始支持
+#endif
+
+typedef struct zhugeHeader {
+    size_t len; ///映射的长度，不包括映射头所在的页
+    int hugepage; ///MADV_HUGEPAGE是否成功
+    int node; ///mbind绑定的NUMA节点，没有绑定时为-1
+} zhugeHeader;
+
+typedef struct zhugeJob {
+    char *ptr; ///需要预先缺页的映射，NULL表示空闲
+    size_t len; ///映射的长度
+    size_t done; ///已经处理的长度
+} zhugeJob;
+
+static int huge_hugepage = ZMALLOC_HUGEPAGE_DEFAULT; ///对透明大页的建议，ZMALLOC_HUGEPAGE_*
+static int huge_prefault = 0; ///是否由后台线程预先缺页
+static int huge_numa_local = 1; ///是否放在调用线程所在的NUMA节点上
+static int huge_numa_nodes = 0; ///系统中是否有多个NUMA节点，0表示还没有检查，1表示只有一个，2表示多个
+static int huge_populate = 1; ///内核是否支持MADV_POPULATE_WRITE
+static pthread_mutex_t huge_mutex = PTHREAD_MUTEX_INITIALIZER; ///保护下面的任务表
+static pthread_cond_t huge_cond = PTHREAD_COND_INITIALIZER; ///有新的任务，或者后台线程处理完了一段内存
+static zhugeJob huge_jobs[ZMALLOC_HUGE_JOBS]; ///等待预先缺页的映射
+static char *huge_running = NULL; ///后台线程正在处理的映射，NULL表示没有
+static int huge_thread_started = 0; ///后台线程是否已经创建
+static int huge_atfork = 0; ///是否已经注册了fork的处理函数
+
+///映射的长度，按照ZMALLOC_HUGE_ALIGN向上取整
+static size_t zmalloc_huge_len(size_t size) {
+    return (size+ZMALLOC_HUGE_ALIGN-1) & ~((size_t)ZMALLOC_HUGE_ALIGN-1);
+}
+
+///映射头所在的页的大小
+static size_t zmalloc_huge_page(void) {
+    static size_t page = 0;
+
+    if (page == 0) page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+///ptr所在映射的映射头，位于ptr前面的一个页中
+static inline zhugeHeader *zmalloc_huge_header(void *ptr) {
+    return (zhugeHeader*)((char*)ptr-zmalloc_huge_page());
+}
+
+///让内核提前为[ptr,ptr+len)分配物理页，不改变内存中的内容
+static void zmalloc_huge_touch(char *ptr, size_t len) {
+    size_t off, page = zmalloc_huge_page();
+
+    if (huge_populate && madvise(ptr,len,MADV_POPULATE_WRITE) == 0) return;
+    huge_populate = 0;
+    ///老内核上逐页原子加0：和前台线程同时写同一个字节时也不会覆盖它写入的值
+    for (off = 0; off < len; off += page)
+        __atomic_fetch_add(ptr+off,0,__ATOMIC_RELAXED);
+}
+
+///后台线程：依次处理任务表中的映射，每次处理一段
+static void *zmalloc_huge_main(void *arg) {
+    ((void) arg);
+
+    pthread_mutex_lock(&huge_mutex);
+    while(1) {
+        int j, job = -1;
+        char *base, *p;
+        size_t len;
+
+        for (j = 0; j < ZMALLOC_HUGE_JOBS; j++) {
+            if (huge_jobs[j].ptr) {
+                job = j;
+                break;
+            }
+        }
+        if (job == -1) {
+            pthread_cond_wait(&huge_cond,&huge_mutex);
+            continue;
+        }
+        base = huge_jobs[job].ptr;
+        p = base + huge_jobs[job].done;
+        len = huge_jobs[job].len - huge_jobs[job].done;
+        if (len > ZMALLOC_HUGE_ALIGN) len = ZMALLOC_HUGE_ALIGN;
+        huge_running = base;
+        pthread_mutex_unlock(&huge_mutex);
+
+        zmalloc_huge_touch(p,len);
+
+        pthread_mutex_lock(&huge_mutex);
+        huge_running = NULL;
+        ///处理期间任务可能被zfree_huge()取消，任务表中的位置也可能已经给了新的映射
+        if (huge_jobs[job].ptr == base) {
+            huge_jobs[job].done += len;
+            if (huge_jobs[job].done == huge_jobs[job].len) huge_jobs[job].ptr = NULL;
+        }
+        pthread_cond_broadcast(&huge_cond);
+    }
+    return NULL;
+}
+
+/* fork之前拿到锁，保证fork时后台线程没有持有它，fork之后在父子进程中各自释放。
+ * 子进程中没有后台线程：任务表中的映射不再预先缺页，huge_running也不会再被清除，否则子进程中的zfree_huge()会一直等待。
+ * 子进程需要预先缺页时重新创建后台线程。 */
+static void zmalloc_huge_atfork_prepare(void) {
+    pthread_mutex_lock(&huge_mutex);
+}
+
+static void zmalloc_huge_atfork_parent(void) {
+    pthread_mutex_unlock(&huge_mutex);
+}
+
+static void zmalloc_huge_atfork_child(void) {
+    memset(huge_jobs,0,sizeof(huge_jobs));
+    huge_running = NULL;
+    huge_thread_started = 0;
+    pthread_mutex_unlock(&huge_mutex);
+}
+
+///把一个映射交给后台线程预先缺页。任务表满了或者无法创建线程时直接放弃，内存仍然可以正常使用
+static void zmalloc_huge_prefault(char *ptr, size_t len) {
+    int j;
+
+    pthread_mutex_lock(&huge_mutex);
+    if (!huge_thread_started) {
+        pthread_t tid;
+
+        if (!huge_atfork) {
+            pthread_atfork(zmalloc_huge_atfork_prepare,zmalloc_huge_atfork_parent,
+                           zmalloc_huge_atfork_child);
+            huge_atfork = 1;
+        }
+        if (pthread_create(&tid,NULL,zmalloc_huge_main,NULL) != 0) {
+            pthread_mutex_unlock(&huge_mutex);
+            return;
+        }
+        pthread_detach(tid);
+        huge_thread_started = 1;
+    }
+    for (j = 0; j < ZMALLOC_HUGE_JOBS; j++) {
+        if (huge_jobs[j].ptr == NULL) {
+            huge_jobs[j].ptr = ptr;
+            huge_jobs[j].len = len;
+            huge_jobs[j].done = 0;
+            pthread_cond_broadcast(&huge_cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&huge_mutex);
+}
+
+///把映射优先放在调用线程所在的NUMA节点上，返回绑定的节点。只有一个节点或者绑定失败时什么也不做，返回-1
+static int zmalloc_huge_bind_local(char *ptr, size_t len) {
+    unsigned long mask[16]; ///最多支持1024个节点
+    unsigned int cpu, node;
+
+    if (huge_numa_nodes == 0)
+        huge_numa_nodes = access("/sys/devices/system/node/node1",F_OK) == 0 ? 2 : 1;
+    if (huge_numa_nodes == 1) return -1;
+    if (syscall(SYS_getcpu,&cpu,&node,NULL) == -1) return -1;
+    if (node >= sizeof(mask)*8) return -1;
+    memset(mask,0,sizeof(mask));
+    mask[node/(sizeof(long)*8)] |= 1UL << (node%(sizeof(long)*8));
+    if (syscall(SYS_mbind,ptr,len,ZMALLOC_MPOL_PREFERRED,mask,sizeof(mask)*8,0) == -1) return -1;
+    return node;
+}
+#endif
+
+///分配size字节的内存并初始化为0，大于等于ZMALLOC_HUGE_THRESHOLD时单独映射，详见上面的说明
+void *zcalloc_huge(size_t size) {
+    return zcalloc_huge_tagged(size,ZMALLOC_TAG_OTHER);
+}
+
+void *zcalloc_huge_tagged(size_t size, int tag) {
+#ifdef HAVE_HUGE_MAPPING
+    if (size >= ZMALLOC_HUGE_THRESHOLD) {
+        size_t len = zmalloc_huge_len(size), page = zmalloc_huge_page(), head;
+        zhugeHeader *hdr;
+        char *map, *ptr;
+
+        ///多映射2MB和一个页，把首尾多余的部分还给系统，得到2MB对齐、前面有一个映射头的映射
+        map = mmap(NULL,page+len+ZMALLOC_HUGE_ALIGN,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if (map == MAP_FAILED) {
+            zmalloc_oom_handler(size);
+            return NULL;
+        }
+        ptr = (char*)(((uintptr_t)map+page+ZMALLOC_HUGE_ALIGN-1) & ~((uintptr_t)ZMALLOC_HUGE_ALIGN-1));
+        head = ptr-page-map;
+        if (head) munmap(map,head);
+        if (ZMALLOC_HUGE_ALIGN-head) munmap(ptr+len,ZMALLOC_HUGE_ALIGN-head);
+
+        hdr = zmalloc_huge_header(ptr);
+        hdr->len = len;
+        hdr->hugepage = huge_hugepage == ZMALLOC_HUGEPAGE_YES && madvise(ptr,len,MADV_HUGEPAGE) == 0;
+        if (huge_hugepage == ZMALLOC_HUGEPAGE_NO) madvise(ptr,len,MADV_NOHUGEPAGE);
+        hdr->node = huge_numa_local ? zmalloc_huge_bind_local(ptr,len) : -1;
+        update_zmalloc_stat_alloc(page+len);
+        zmalloc_profile_sample(size,tag);
+        if (huge_prefault) zmalloc_huge_prefault(ptr,len);
+        return ptr;
+    }
+#endif
+    return zcalloc_tagged(size,tag);
+}
+
+///释放zcalloc_huge()分配的内存，size必须和分配时相同
+void zfree_huge(void *ptr, size_t size) {
+#ifdef HAVE_HUGE_MAPPING
+    if (ptr && size >= ZMALLOC_HUGE_THRESHOLD) {
+        size_t len = zmalloc_huge_header(ptr)->len, page = zmalloc_huge_page();
+        int j;
+
+        /* 如果还在等待预先缺页，先从任务表中移除，后台线程不会再处理它剩下的部分。
+         * 后台线程正在处理它时，只需要等待当前这一段完成，之后才能解除映射。 */
+        pthread_mutex_lock(&huge_mutex);
+        for (j = 0; j < ZMALLOC_HUGE_JOBS; j++) {
+            if (huge_jobs[j].ptr == ptr) {
+                huge_jobs[j].ptr = NULL;
+                break;
+            }
+        }
+        while (huge_running == ptr) pthread_cond_wait(&huge_cond,&huge_mutex);
+        pthread_mutex_unlock(&huge_mutex);
+
+        update_zmalloc_stat_free(page+len);
+        munmap((char*)ptr-page,page+len);
+        return;
+    }
+#endif
+    ((void) size);
+    zfree(ptr);
+}
+
+///设置新分配的大块内存对透明大页的建议（ZMALLOC_HUGEPAGE_*）、是否由后台线程预先缺页，以及是否放在调用线程所在的NUMA节点上
+void zmalloc_huge_config(int hugepage, int prefault, int numa_local) {
+#ifdef HAVE_HUGE_MAPPING
+    huge_hugepage = hugepage;
+    huge_prefault = prefault;
+    huge_numa_local = numa_local;
+#else
+    ((void) hugepage);
+    ((void) prefault);
+    ((void) numa_local);
+#endif
+}
+
+///获取zcalloc_huge()分配的内存的状态，size必须和分配时相同。只读取映射头，不查询内核
+void zmalloc_huge_get_info(void *ptr, size_t size, zmallocHugeInfo *info) {
+    memset(info,0,sizeof(*info));
+    info->node = -1;
+    info->size = size;
+#ifdef HAVE_HUGE_MAPPING
+    if (ptr && size >= ZMALLOC_HUGE_THRESHOLD) {
+        zhugeHeader *hdr = zmalloc_huge_header(ptr);
+
+        info->mapped = 1;
+        info->hugepage = hdr->hugepage;
+        info->node = hdr->node;
+        info->size = hdr->len;
+    }
+#else
+    ((void) ptr);
+#endif
+}
+
+/* ------------------------------- slab分配器 ---------------------------------- */
+
+/* robj、dictEntry、listNode、跳跃表节点这类小对象数量极多，大小固定，分配和释放都很频繁。
+ * zslab_alloc()把不超过ZSLAB_MAX_SIZE的大小分成ZSLAB_CLASSES个大小类，每个大小类是一个对象池：
+ * - 对象池向分配器申请ZSLAB_CHUNK_SIZE大小、按ZSLAB_CHUNK_SIZE对齐的块，再把块切成这个大小类的对象。
+ *   对象的地址向下对齐就是块头，块头记录了大小类，所以释放时不需要传入大小，也不需要PREFIX_SIZE；
+ * - 每个线程为每个大小类保留一个本地的空闲链表，分配和释放通常只操作本地链表，不加锁。
+ *   本地链表空了，或者长度超过ZSLAB_CACHE_MAX时，才加锁和对象池一次交换ZSLAB_BATCH个对象；
+ * - 还给对象池的对象放回所属块自己的空闲链表，有空闲对象的块串成一个链表，分配时优先使用。
+ *   一个块中切出的对象全部还回来时（最新的块除外），块立即还给分配器，FLUSHALL或者大量DEL之后RSS也会下降；
+ * - used_memory按对象所属大小类的大小精确计数，和zmalloc一样在分配和释放时更新。
+ *   对象池中空闲的对象和块中还没有切分的部分不计入used_memory，作为碎片由zmalloc_get_allocator_info()报告。
+ *   线程本地链表中的对象不在统计范围内，算作已经分配出去，每个线程每个大小类最多ZSLAB_CACHE_MAX个。 */
+#ifndef ZSLAB_DISABLED
+#define ZSLAB_CHUNK_SIZE (64*1024) ///每个块的大小，也是块的对齐大小
+#define ZSLAB_CHUNK_HEADER 64 ///块头占用的字节数，让第一个对象从缓存行的边界开始
+#define ZSLAB_CLASSES 36 ///大小类的个数：8到128按8字节，到256按16字节，到1024按64字节
+#define ZSLAB_BATCH 32 ///线程本地链表和对象池之间一次交换的对象数
+#define ZSLAB_CACHE_MAX 64 ///线程本地链表的最大长度
+#define ZSLAB_MAGIC 0x5a534c42 ///块头中的标记，释放时检查，不是zslab_alloc()分配的内存直接报错
+
+typedef struct zslabChunk {
+    unsigned int magic; ///ZSLAB_MAGIC
+    unsigned int cls; ///块中对象所属的大小类
+    unsigned int carved; ///已经从块中切出的对象数
+    unsigned int nfree; ///块的空闲链表的长度
+    void *free; ///还给对象池的、属于这个块的空闲对象，对象的前8个字节是下一个空闲对象的指针
+    struct zslabChunk *prev, *next; ///有空闲对象的块组成的双向链表
+} zslabChunk;
+
+typedef struct zslabPool {
+    pthread_mutex_t lock; ///保护下面的字段，以及这个大小类的所有块头
+    zslabChunk *partial; ///有空闲对象的块
+    size_t nfree; ///所有块的空闲链表的总长度
+    zslabChunk *current; ///最新的块，还在从中切分对象
+    char *pos; ///最新的块中还没有切分的部分的起始位置
+    char *end; ///最新的块的结束位置
+    size_t reserved; ///向分配器申请的块的总字节数
+} zslabPool;
+
+typedef struct zslabCache {
+    void *head; ///线程本地的空闲链表
+    unsigned int count; ///链表的长度
+} zslabCache;
+
+static zslabPool zslab_pools[ZSLAB_CLASSES];
+static pthread_once_t zslab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t zslab_key; ///线程退出时通过这个key的析构函数把本地链表还给对象池
+static __thread zslabCache zslab_cache[ZSLAB_CLASSES];
+static __thread int zslab_cache_registered = 0;
+
+///size所属的大小类
+static inline unsigned int zslab_class(size_t size) {
+    if (size <= 128) return size ? (size-1)/8 : 0;
+    if (size <= 256) return 16+(size-129)/16;
+    return 24+(size-257)/64;
+}
+
+///大小类cls的对象大小
+static inline size_t zslab_class_size(unsigned int cls) {
+    if (cls < 16) return (cls+1)*8;
+    if (cls < 24) return 128+(cls-15)*16;
+    return 256+(cls-23)*64;
+}
+
+///对象所在的块，块头的标记不对时说明这不是zslab_alloc()分配的内存，继续使用会破坏对象池，直接报错
+static inline zslabChunk *zslab_chunk(void *ptr) {
+    zslabChunk *chunk = (zslabChunk*)((uintptr_t)ptr & ~(uintptr_t)(ZSLAB_CHUNK_SIZE-1));
+
+    if (chunk->magic != ZSLAB_MAGIC) {
+        fprintf(stderr, "zslab: %p was not allocated by zslab_alloc()\n", ptr);
+        fflush(stderr);
+        abort();
+    }
+    return chunk;
+}
+
+///在持有对象池的锁的情况下调用：把块从有空闲对象的块的链表中移除
+static void zslab_unlink(zslabPool *pool, zslabChunk *chunk) {
+    if (chunk->prev) chunk->prev->next = chunk->next;
+    else pool->partial = chunk->next;
+    if (chunk->next) chunk->next->prev = chunk->prev;
+    chunk->prev = chunk->next = NULL;
+}
+
+///在持有对象池的锁的情况下调用：块中切出的对象全部空闲，并且不是最新的块时，把它还给分配器
+static void zslab_release_chunk(zslabPool *pool, zslabChunk *chunk) {
+    if (chunk == pool->current || chunk->nfree != chunk->carved) return;
+    if (chunk->nfree) zslab_unlink(pool,chunk);
+    pool->nfree -= chunk->nfree;
+    pool->reserved -= ZSLAB_CHUNK_SIZE;
+    chunk->magic = 0;
+    free(chunk);
+}
+
+///把线程本地链表头部的count个对象还给对象池，每个对象放回所属块的空闲链表
+static void zslab_release(unsigned int cls, unsigned int count) {
+    zslabCache *cache = &zslab_cache[cls];
+    zslabPool *pool = &zslab_pools[cls];
+    unsigned int j;
+
+    pthread_mutex_lock(&pool->lock);
+    for (j = 0; j < count; j++) {
+        void *obj = cache->head;
+        zslabChunk *chunk = zslab_chunk(obj);
+
+        cache->head = *(void**)obj;
+        *(void**)obj = chunk->free;
+        chunk->free = obj;
+        if (chunk->nfree++ == 0) {
+            chunk->prev = NULL;
+            chunk->next = pool->partial;
+            if (pool->partial) pool->partial->prev = chunk;
+            pool->partial = chunk;
+        }
+        pool->nfree++;
+        zslab_release_chunk(pool,chunk);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    cache->count -= count;
+}
+
+///线程退出时调用，把所有的本地链表还给对象池，否则这些对象就不能再被其他线程使用了
+static void zslab_thread_exit(void *arg) {
+    unsigned int cls;
+
+    ((void) arg);
+    for (cls = 0; cls < ZSLAB_CLASSES; cls++) {
+        if (zslab_cache[cls].count) zslab_release(cls,zslab_cache[cls].count);
+    }
+}
+
+/* fork时其他线程可能正持有对象池的锁，子进程中这个锁永远不会被释放。
+ * 和分配器自己的做法一样，fork之前拿到所有的锁，fork之后在父子进程中各自释放。 */
+static void zslab_atfork_prepare(void) {
+    unsigned int cls;
+
+    for (cls = 0; cls < ZSLAB_CLASSES; cls++) pthread_mutex_lock(&zslab_pools[cls].lock);
+}
+
+static void zslab_atfork_release(void) {
+    unsigned int cls;
+
+    for (cls = 0; cls < ZSLAB_CLASSES; cls++) pthread_mutex_unlock(&zslab_pools[cls].lock);
+}
+
+static void zslab_init(void) {
+    unsigned int cls;
+
+    for (cls = 0; cls < ZSLAB_CLASSES; cls++) pthread_mutex_init(&zslab_pools[cls].lock,NULL);
+    pthread_key_create(&zslab_key,zslab_thread_exit);
+    pthread_atfork(zslab_atfork_prepare,zslab_atfork_release,zslab_atfork_release);
+}
+
+/* 线程本地链表空了，从对象池取ZSLAB_BATCH个对象：先从有空闲对象的块中取，没有时从最新的块切分，
+ * 最新的块用完时申请新的块。被替换下来的块如果已经全部空闲，直接还给分配器。
+ * 返回取到的对象数，申请新的块失败并且一个对象都没有取到时返回0。 */
+static unsigned int zslab_refill(unsigned int cls) {
+    zslabCache *cache = &zslab_cache[cls];
+    zslabPool *pool = &zslab_pools[cls];
+    size_t size = zslab_class_size(cls);
+    unsigned int n;
+    void *obj;
+
+    if (!zslab_cache_registered) {
+        pthread_once(&zslab_once,zslab_init);
+        pthread_setspecific(zslab_key,zslab_cache); ///值不为NULL时线程退出才会调用析构函数
+        zslab_cache_registered = 1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (n = 0; n < ZSLAB_BATCH; n++) {
+        if (pool->partial) {
+            zslabChunk *chunk = pool->partial;
+
+            obj = chunk->free;
+            chunk->free = *(void**)obj;
+            if (--chunk->nfree == 0) zslab_unlink(pool,chunk);
+            pool->nfree--;
+        } else {
+            if ((size_t)(pool->end - pool->pos) < size) {
+                zslabChunk *old = pool->current;
+                void *mem;
+
+                if (posix_memalign(&mem,ZSLAB_CHUNK_SIZE,ZSLAB_CHUNK_SIZE) != 0) break;
+                memset(mem,0,sizeof(zslabChunk));
+                ((zslabChunk*)mem)->magic = ZSLAB_MAGIC;
+                ((zslabChunk*)mem)->cls = cls;
+                pool->current = mem;
+                pool->pos = (char*)mem+ZSLAB_CHUNK_HEADER;
+                pool->end = (char*)mem+ZSLAB_CHUNK_SIZE;
+                pool->reserved += ZSLAB_CHUNK_SIZE;
+                if (old) zslab_release_chunk(pool,old);
+            }
+            obj = pool->pos;
+            pool->pos += size;
+            pool->current->carved++;
+        }
+        *(void**)obj = cache->head;
+        cache->head = obj;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    cache->count += n;
+    return n;
+}
+
+///从大小类对应的对象池中分配一个对象，size不能超过ZSLAB_MAX_SIZE。分配的内存必须用zslab_free()释放
+void *zslab_alloc(size_t size) {
+    return zslab_alloc_tagged(size,ZMALLOC_TAG_OTHER);
+}
+
+void *zslab_alloc_tagged(size_t size, int tag) {
+    unsigned int cls;
+    zslabCache *cache;
+    void *obj;
+
+    if (size > ZSLAB_MAX_SIZE) {
+        fprintf(stderr, "zslab: %zu bytes exceeds the largest size class\n", size);
+        fflush(stderr);
+        abort();
+    }
+    cls = zslab_class(size);
+    cache = &zslab_cache[cls];
+    if (cache->head == NULL && zslab_refill(cls) == 0) {
+        zmalloc_oom_handler(size); ///和zmalloc一样，处理函数返回时把NULL交给调用者
+        return NULL;
+    }
+    obj = cache->head;
+    cache->head = *(void**)obj;
+    cache->count--;
+
+    update_zmalloc_stat_alloc(zslab_class_size(cls));
+    zmalloc_profile_sample(size,tag);
+    return obj;
+}
+
+///释放zslab_alloc()分配的对象，对象放回当前线程的本地链表，可以在和分配时不同的线程中释放
+void zslab_free(void *ptr) {
+    unsigned int cls;
+    zslabCache *cache;
+
+    if (ptr == NULL) return;
+    cls = zslab_chunk(ptr)->cls;
+    update_zmalloc_stat_free(zslab_class_size(cls));
+
+    cache = &zslab_cache[cls];
+    *(void**)ptr = cache->head;
+    cache->head = ptr;
+    if (++cache->count > ZSLAB_CACHE_MAX) zslab_release(cls,ZSLAB_BATCH);
+}
+
+///zslab_alloc()分配的对象实际占用的大小，也就是它计入used_memory的大小
+size_t zslab_size(void *ptr) {
+    return zslab_class_size(zslab_chunk(ptr)->cls);
+}
+
+/* 获取slab分配器的状态：reserved为向分配器申请的块的总大小，used为其中除去对象池中的空闲对象和还没有切分的部分之后的大小，
+ * 也就是分配出去的对象、线程本地链表中的对象，以及块头和块尾不够一个对象的部分。 */
+void zslab_get_info(size_t *used, size_t *reserved) {
+    unsigned int cls;
+
+    *used = *reserved = 0;
+    pthread_once(&zslab_once,zslab_init);
+    for (cls = 0; cls < ZSLAB_CLASSES; cls++) {
+        zslabPool *pool = &zslab_pools[cls];
+
+        pthread_mutex_lock(&pool->lock);
+        *reserved += pool->reserved;
+        *used += pool->reserved - pool->nfree*zslab_class_size(cls) - (pool->end - pool->pos);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+#else
+void zslab_get_info(size_t *used, size_t *reserved) {
+    *used = *reserved = 0;
+}
+#endif
+
+///slab分配器中空闲的字节数
+static size_t zslab_free_bytes(void) {
+    size_t used, reserved;
+
+    zslab_get_info(&used,&reserved);
+    return reserved-used;
+}
+
 /* Get the RSS information in an OS-specific way.
  *
  * WARNING: the function zmalloc_get_rss() is not designed to be fast
@@ -225,7 +953,7 @@ void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
 #include <sys/stat.h>
 #include <fcntl.h>
 
-size_t zmalloc_get_rss(void) {
+static size_t zmalloc_read_rss(void) {
     int page = sysconf(_SC_PAGESIZE);
     size_t rss;
     char buf[4096];
@@ -265,7 +993,7 @@ size_t zmalloc_get_rss(void) {
 #include <mach/task.h>
 #include <mach/mach_init.h>
 
-size_t zmalloc_get_rss(void) {
+static size_t zmalloc_read_rss(void) {
     task_t task = MACH_PORT_NULL;
     struct task_basic_info t_info;
     mach_msg_type_number_t t_info_count = TASK_BASIC_INFO_COUNT;
@@ -282,7 +1010,7 @@ size_t zmalloc_get_rss(void) {
 #include <sys/user.h>
 #include <unistd.h>
 
-size_t zmalloc_get_rss(void) {
+static size_t zmalloc_read_rss(void) {
     struct kinfo_proc info;
     size_t infolen = sizeof(info);
     int mib[4];
@@ -297,7 +1025,7 @@ size_t zmalloc_get_rss(void) {
     return 0L;
 }
 #else
-size_t zmalloc_get_rss(void) {
+static size_t zmalloc_read_rss(void) {
     /* If we can't get the RSS in an OS-specific way for this system just
      * return the memory usage we estimated in zmalloc()..
      *
@@ -309,25 +1037,67 @@ size_t zmalloc_get_rss(void) {
 
 #if defined(USE_JEMALLOC)
 
-int zmalloc_get_allocator_info(size_t *allocated,
-                               size_t *active,
-                               size_t *resident) {
+/* 按名字调用mallctl每次都要解析名字、逐级查找，先用mallctlnametomib把名字转换成MIB，
+ * 之后用mallctlbymib直接读取。转换失败时退回按名字读取。 */
+#define ZMALLOC_JE_EPOCH 0
+#define ZMALLOC_JE_RESIDENT 1
+#define ZMALLOC_JE_ACTIVE 2
+#define ZMALLOC_JE_ALLOCATED 3
+
+static struct {
+    const char *name;
+    size_t mib[4];
+    size_t miblen; ///0表示转换失败
+} zmalloc_je_stats[] = {
+    {"epoch", {0}, 0},
+    {"stats.resident", {0}, 0},
+    {"stats.active", {0}, 0},
+    {"stats.allocated", {0}, 0}
+};
+static pthread_once_t zmalloc_je_once = PTHREAD_ONCE_INIT;
+
+static void zmalloc_je_init(void) {
+    size_t j;
+
+    for (j = 0; j < sizeof(zmalloc_je_stats)/sizeof(zmalloc_je_stats[0]); j++) {
+        zmalloc_je_stats[j].miblen = 4;
+        if (je_mallctlnametomib(zmalloc_je_stats[j].name,zmalloc_je_stats[j].mib,
+                                &zmalloc_je_stats[j].miblen) != 0)
+            zmalloc_je_stats[j].miblen = 0;
+    }
+}
+
+static void zmalloc_je_ctl(int idx, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
+    if (zmalloc_je_stats[idx].miblen)
+        je_mallctlbymib(zmalloc_je_stats[idx].mib,zmalloc_je_stats[idx].miblen,oldp,oldlenp,newp,newlen);
+    else
+        je_mallctl(zmalloc_je_stats[idx].name,oldp,oldlenp,newp,newlen);
+}
+
+static int zmalloc_read_allocator_info(size_t *allocated,
+                                      size_t *active,
+                                      size_t *resident) {
     uint64_t epoch = 1;
-    size_t sz;
+    size_t sz, slab_free;
     *allocated = *resident = *active = 0;
+    pthread_once(&zmalloc_je_once,zmalloc_je_init);
     /* Update the statistics cached by mallctl. */
     sz = sizeof(epoch);
-    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    zmalloc_je_ctl(ZMALLOC_JE_EPOCH, &epoch, &sz, &epoch, sz);
     sz = sizeof(size_t);
     /* Unlike RSS, this does not include RSS from shared libraries and other non
      * heap mappings. */
-    je_mallctl("stats.resident", resident, &sz, NULL, 0);
+    zmalloc_je_ctl(ZMALLOC_JE_RESIDENT, resident, &sz, NULL, 0);
     /* Unlike resident, this doesn't not include the pages jemalloc reserves
      * for re-use (purge will clean that). */
-    je_mallctl("stats.active", active, &sz, NULL, 0);
+    zmalloc_je_ctl(ZMALLOC_JE_ACTIVE, active, &sz, NULL, 0);
     /* Unlike zmalloc_used_memory, this matches the stats.resident by taking
      * into account all allocations done by this process (not only zmalloc). */
-    je_mallctl("stats.allocated", allocated, &sz, NULL, 0);
+    zmalloc_je_ctl(ZMALLOC_JE_ALLOCATED, allocated, &sz, NULL, 0);
+    /* slab分配器的块对jemalloc来说整个都是已分配的，其中空闲的对象并没有被使用，
+     * 从allocated中减去，这部分就和jemalloc自己的碎片一起体现在active/allocated中。 */
+    slab_free = zslab_free_bytes();
+    if (*allocated > slab_free) *allocated -= slab_free;
     return 1;
 }
 
@@ -353,10 +1123,18 @@ int jemalloc_purge() {
 
 #else
 
-int zmalloc_get_allocator_info(size_t *allocated,
-                               size_t *active,
-                               size_t *resident) {
+static int zmalloc_read_allocator_info(size_t *allocated,
+                                      size_t *active,
+                                      size_t *resident) {
+    size_t slab_free = zslab_free_bytes();
+
     *allocated = *resident = *active = 0;
+    /* 其他分配器没有这些统计，只能报告slab分配器的碎片：allocated是zmalloc计数的已用内存，
+     * active再加上slab分配器中空闲的字节。resident为0，由调用方使用RSS代替。 */
+    if (slab_free) {
+        *allocated = zmalloc_used_memory();
+        *active = *allocated + slab_free;
+    }
     return 1;
 }
 
@@ -389,7 +1167,7 @@ int jemalloc_purge() {
  * Example: zmalloc_get_smap_bytes_by_field("Rss:",-1);
  */
 #if defined(HAVE_PROC_SMAPS)
-size_t zmalloc_get_smap_bytes_by_field(char *field, long pid) {
+static size_t zmalloc_read_smap_bytes_by_field(char *field, long pid) {
     char line[1024];
     size_t bytes = 0;
     int flen = strlen(field);
@@ -424,7 +1202,7 @@ size_t zmalloc_get_smap_bytes_by_field(char *field, long pid) {
  * Note that AnonHugePages is a no-op as THP feature
  * is not supported in this platform
  */
-size_t zmalloc_get_smap_bytes_by_field(char *field, long pid) {
+static size_t zmalloc_read_smap_bytes_by_field(char *field, long pid) {
 #if defined(__APPLE__)
     struct proc_regioninfo pri;
     if (proc_pidinfo(pid, PROC_PIDREGIONINFO, 0, &pri, PROC_PIDREGIONINFO_SIZE) ==
@@ -445,6 +1223,262 @@ size_t zmalloc_get_smap_bytes_by_field(char *field, long pid) {
 }
 #endif
 
+/* ------------------------------- 后台采样 ---------------------------------- */
+
+/* zmalloc_get_rss()、zmalloc_get_allocator_info()和zmalloc_get_smap_bytes_by_field()原来每次调用都同步读取：
+ * 打开并解析/proc/self/stat，让jemalloc合并所有arena的统计，或者遍历/proc/self/smaps中的每个映射，
+ * 最后一个在几十GB的进程中需要几百毫秒，而它们都是在主线程中调用的。
+ * 现在第一次调用时启动一个后台线程，每ZMALLOC_SAMPLER_PERIOD毫秒读取一次RSS和分配器的统计并缓存起来，
+ * 这三个函数直接返回缓存的值，只需要加一次锁：
+ * - smaps的统计开销最大，只在最近ZMALLOC_SAMPLER_SMAPS_IDLE毫秒内有人读取过时才刷新，刷新周期是采样周期的
+ *   ZMALLOC_SAMPLER_SMAPS_RATIO倍。优先读取/proc/self/smaps_rollup（Linux 4.14开始支持），内核直接给出汇总的结果；
+ * - 缓存的RSS和分配器统计超过两个采样周期没有更新（比如后台线程没有被调度）时，退回同步读取，它们的读取开销不大；
+ * - smaps的统计只要有缓存就直接返回，不管它有多旧，zmalloc_get_smap_bytes_by_field_age()同时返回它的年龄。
+ *   超过一个刷新周期的缓存被读取时（比如每30秒执行一次INFO，后台线程在闲置期间停止了刷新），通知后台线程在下一次采样时刷新，
+ *   而不是在调用线程中同步遍历smaps。只有第一次读取时还没有缓存，才同步读取一次并存入缓存；
+ * - fork时用pthread_atfork()拿住锁，避免子进程继承一把被后台线程持有、永远不会释放的锁。
+ *   子进程（RDB/AOF重写）中关闭后台采样，不启动自己的后台线程，每次调用都同步读取自己的统计。
+ *   后台线程是否在当前进程中运行由running记录，子进程的fork处理函数把它清零，读取统计时不需要调用getpid()；
+ * - zmalloc_sampler_config(0)关闭后台采样，每次调用都同步读取，和原来相同。 */
+#define ZMALLOC_SAMPLER_PERIOD 100 ///默认的采样周期（毫秒），和serverCron默认的频率相同
+#define ZMALLOC_SAMPLER_SMAPS_RATIO 10 ///smaps的刷新周期是采样周期的多少倍
+#define ZMALLOC_SAMPLER_SMAPS_IDLE 10000 ///超过这么多毫秒没有人读取smaps的统计，就不再刷新
+
+static char *zmalloc_smaps_fields[] = {
+    "Rss:", "Pss:", "Shared_Clean:", "Shared_Dirty:", "Private_Clean:",
+    "Private_Dirty:", "AnonHugePages:", "Swap:"
+};
+#define ZMALLOC_SMAPS_FIELDS (int)(sizeof(zmalloc_smaps_fields)/sizeof(zmalloc_smaps_fields[0]))
+
+static struct {
+    pthread_mutex_t lock; ///保护下面所有的字段
+    int period; ///采样周期（毫秒），0表示关闭后台采样
+    int running; ///当前进程中是否有后台线程在运行，fork出的子进程中为0
+    int atfork; ///是否已经注册了fork的处理函数
+    long long rss_time; ///缓存的RSS的读取时间，0表示没有缓存
+    size_t rss;
+    long long alloc_time; ///缓存的分配器统计的读取时间，0表示没有缓存
+    int alloc_ret; ///zmalloc_read_allocator_info()的返回值
+    size_t allocated, active, resident;
+    long long smaps_time; ///缓存的smaps统计的读取时间，0表示没有缓存
+    long long smaps_wanted; ///最近一次读取smaps统计的时间
+    int smaps_refresh; ///有人读到了过期的smaps统计，后台线程下一次采样时刷新
+    size_t smaps[ZMALLOC_SMAPS_FIELDS]; ///按zmalloc_smaps_fields的顺序
+} zmalloc_sampler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .period = ZMALLOC_SAMPLER_PERIOD
+};
+
+///一次读出zmalloc_smaps_fields中所有的字段
+static void zmalloc_read_smaps(size_t *values) {
+    int j;
+
+    memset(values,0,sizeof(size_t)*ZMALLOC_SMAPS_FIELDS);
+#if defined(HAVE_PROC_SMAPS)
+    char line[1024];
+    FILE *fp = fopen("/proc/self/smaps_rollup","r");
+
+    if (!fp) fp = fopen("/proc/self/smaps","r");
+    if (!fp) return;
+    while(fgets(line,sizeof(line),fp) != NULL) {
+        for (j = 0; j < ZMALLOC_SMAPS_FIELDS; j++) {
+            int flen = strlen(zmalloc_smaps_fields[j]);
+
+            if (strncmp(line,zmalloc_smaps_fields[j],flen) == 0) {
+                values[j] += strtol(line+flen,NULL,10) * 1024;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+#else
+    for (j = 0; j < ZMALLOC_SMAPS_FIELDS; j++)
+        values[j] = zmalloc_read_smap_bytes_by_field(zmalloc_smaps_fields[j],-1);
+#endif
+}
+
+static void *zmalloc_sampler_main(void *arg) {
+    size_t rss, allocated, active, resident, smaps[ZMALLOC_SMAPS_FIELDS];
+    int period, alloc_ret, read_smaps;
+    struct timespec ts;
+    long long now;
+
+    ((void) arg);
+    while(1) {
+        pthread_mutex_lock(&zmalloc_sampler.lock);
+        period = zmalloc_sampler.period;
+        if (period == 0) {
+            zmalloc_sampler.running = 0;
+            zmalloc_sampler.rss_time = zmalloc_sampler.alloc_time = zmalloc_sampler.smaps_time = 0;
+            pthread_mutex_unlock(&zmalloc_sampler.lock);
+            return NULL;
+        }
+        now = zmalloc_clock_ms();
+        read_smaps = zmalloc_sampler.smaps_refresh ||
+                     (now - zmalloc_sampler.smaps_wanted < ZMALLOC_SAMPLER_SMAPS_IDLE &&
+                      now - zmalloc_sampler.smaps_time >= (long long)period*ZMALLOC_SAMPLER_SMAPS_RATIO);
+        zmalloc_sampler.smaps_refresh = 0;
+        pthread_mutex_unlock(&zmalloc_sampler.lock);
+
+        ///读取的过程不持有锁，读取的函数调用不会被后台线程阻塞
+        rss = zmalloc_read_rss();
+        alloc_ret = zmalloc_read_allocator_info(&allocated,&active,&resident);
+        if (read_smaps) zmalloc_read_smaps(smaps);
+
+        pthread_mutex_lock(&zmalloc_sampler.lock);
+        now = zmalloc_clock_ms();
+        zmalloc_sampler.rss = rss;
+        zmalloc_sampler.rss_time = now;
+        zmalloc_sampler.alloc_ret = alloc_ret;
+        zmalloc_sampler.allocated = allocated;
+        zmalloc_sampler.active = active;
+        zmalloc_sampler.resident = resident;
+        zmalloc_sampler.alloc_time = now;
+        if (read_smaps) {
+            memcpy(zmalloc_sampler.smaps,smaps,sizeof(smaps));
+            zmalloc_sampler.smaps_time = now;
+        }
+        pthread_mutex_unlock(&zmalloc_sampler.lock);
+
+        ts.tv_sec = period/1000;
+        ts.tv_nsec = (long)(period%1000)*1000000;
+        nanosleep(&ts,NULL);
+    }
+    return NULL;
+}
+
+/* fork之前拿到锁，保证fork时后台线程没有持有它，fork之后在父子进程中各自释放。
+ * 子进程中没有后台线程，也不再启动，缓存是父进程的，全部作废。 */
+static void zmalloc_sampler_atfork_prepare(void) {
+    pthread_mutex_lock(&zmalloc_sampler.lock);
+}
+
+static void zmalloc_sampler_atfork_parent(void) {
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+}
+
+static void zmalloc_sampler_atfork_child(void) {
+    zmalloc_sampler.period = 0;
+    zmalloc_sampler.running = 0;
+    zmalloc_sampler.smaps_refresh = 0;
+    zmalloc_sampler.rss_time = zmalloc_sampler.alloc_time = zmalloc_sampler.smaps_time = 0;
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+}
+
+/* 在持有锁的情况下调用：后台采样开启时，如果当前进程中后台线程还没有运行就启动它。
+ * 返回当前进程中是否有后台线程在运行。 */
+static int zmalloc_sampler_running(void) {
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    if (zmalloc_sampler.period == 0) return 0;
+    if (zmalloc_sampler.running) return 1;
+
+    ///没有启动过，或者后台线程因为关闭采样已经退出
+    zmalloc_sampler.rss_time = zmalloc_sampler.alloc_time = zmalloc_sampler.smaps_time = 0;
+    if (!zmalloc_sampler.atfork) {
+        pthread_atfork(zmalloc_sampler_atfork_prepare,zmalloc_sampler_atfork_parent,
+                       zmalloc_sampler_atfork_child);
+        zmalloc_sampler.atfork = 1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid,&attr,zmalloc_sampler_main,NULL) == 0) zmalloc_sampler.running = 1;
+    pthread_attr_destroy(&attr);
+    return zmalloc_sampler.running;
+}
+
+///缓存的时间为t的值是否还可以使用，最多允许晚两个周期（毫秒）
+static inline int zmalloc_sampler_fresh(long long t, long long period) {
+    return t && zmalloc_clock_ms() - t <= period*2;
+}
+
+/* 设置后台采样的周期（毫秒），0表示关闭后台采样，之后每次调用都同步读取。
+ * 后台线程在第一次读取统计时才启动，设置的周期从下一次采样开始生效。 */
+void zmalloc_sampler_config(int period_ms) {
+    pthread_mutex_lock(&zmalloc_sampler.lock);
+    zmalloc_sampler.period = period_ms > 0 ? period_ms : 0;
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+}
+
+///获取进程的RSS，见上面的说明
+size_t zmalloc_get_rss(void) {
+    size_t rss = 0;
+    int cached = 0;
+
+    pthread_mutex_lock(&zmalloc_sampler.lock);
+    if (zmalloc_sampler_running() && zmalloc_sampler_fresh(zmalloc_sampler.rss_time,zmalloc_sampler.period)) {
+        rss = zmalloc_sampler.rss;
+        cached = 1;
+    }
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+    return cached ? rss : zmalloc_read_rss();
+}
+
+///获取分配器的统计，见上面的说明
+int zmalloc_get_allocator_info(size_t *allocated,
+                               size_t *active,
+                               size_t *resident) {
+    int ret = -1;
+
+    pthread_mutex_lock(&zmalloc_sampler.lock);
+    if (zmalloc_sampler_running() && zmalloc_sampler_fresh(zmalloc_sampler.alloc_time,zmalloc_sampler.period)) {
+        *allocated = zmalloc_sampler.allocated;
+        *active = zmalloc_sampler.active;
+        *resident = zmalloc_sampler.resident;
+        ret = zmalloc_sampler.alloc_ret;
+    }
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+    return ret != -1 ? ret : zmalloc_read_allocator_info(allocated,active,resident);
+}
+
+///获取smaps中指定字段的和，参数见zmalloc_read_smap_bytes_by_field()。当前进程（pid为-1）的常用字段使用后台线程缓存的值
+size_t zmalloc_get_smap_bytes_by_field(char *field, long pid) {
+    if (pid != -1) return zmalloc_read_smap_bytes_by_field(field,pid);
+    return zmalloc_get_smap_bytes_by_field_age(field,NULL);
+}
+
+/* 获取当前进程smaps中指定字段的和，见上面的说明。age不为NULL时设置为返回值的年龄（毫秒），同步读取的值年龄为0。
+ * 缓存过期时仍然返回缓存的值，并通知后台线程尽快刷新。 */
+size_t zmalloc_get_smap_bytes_by_field_age(char *field, long long *age) {
+    size_t values[ZMALLOC_SMAPS_FIELDS], bytes = 0;
+    long long now;
+    int j, cached = 0;
+
+    if (age) *age = 0;
+    for (j = 0; j < ZMALLOC_SMAPS_FIELDS; j++)
+        if (!strcmp(field,zmalloc_smaps_fields[j])) break;
+    if (j == ZMALLOC_SMAPS_FIELDS) return zmalloc_read_smap_bytes_by_field(field,-1);
+
+    pthread_mutex_lock(&zmalloc_sampler.lock);
+    if (zmalloc_sampler_running()) {
+        now = zmalloc_clock_ms();
+        zmalloc_sampler.smaps_wanted = now;
+        if (zmalloc_sampler.smaps_time) {
+            bytes = zmalloc_sampler.smaps[j];
+            cached = 1;
+            if (age) *age = now - zmalloc_sampler.smaps_time;
+            if (now - zmalloc_sampler.smaps_time >
+                (long long)zmalloc_sampler.period*ZMALLOC_SAMPLER_SMAPS_RATIO)
+                zmalloc_sampler.smaps_refresh = 1;
+        } else {
+            cached = -1; ///还没有缓存，同步读取所有的字段并存入缓存
+        }
+    }
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+    if (cached == 1) return bytes;
+    if (cached == 0) return zmalloc_read_smap_bytes_by_field(field,-1);
+
+    zmalloc_read_smaps(values);
+    pthread_mutex_lock(&zmalloc_sampler.lock);
+    if (zmalloc_sampler.running && zmalloc_sampler.smaps_time == 0) {
+        memcpy(zmalloc_sampler.smaps,values,sizeof(values));
+        zmalloc_sampler.smaps_time = zmalloc_clock_ms();
+    }
+    pthread_mutex_unlock(&zmalloc_sampler.lock);
+    return values[j];
+}
+
 size_t zmalloc_get_private_dirty(long pid) {
     return zmalloc_get_smap_bytes_by_field("Private_Dirty:",pid);
 }
@@ -506,7 +1540,229 @@ size_t zmalloc_get_memory_size(void) {
 }
 
 #ifdef REDIS_TEST
+#include <assert.h>
+#include <limits.h>
+#include <sys/wait.h>
 #define UNUSED(x) ((void)(x))
+#define ZMALLOC_BENCH_OPS 2000000
+
+///多线程基准测试的线程：反复分配和释放大小不同的小块内存，最多同时持有64块
+static void *zmalloc_bench_thread(void *arg) {
+    void *ptrs[64];
+    long j;
+
+    for (j = 0; j < ZMALLOC_BENCH_OPS; j++) {
+        if (j >= 64) zfree(ptrs[j & 63]);
+        ptrs[j & 63] = zmalloc(16 + (j & 127));
+    }
+    for (j = 0; j < 64; j++) zfree(ptrs[j]);
+    return arg;
+}
+
+///对比不同线程数下分配和释放的吞吐量
+static void zmalloc_bench(void) {
+    int threads[] = {1, 2, 4, 8}, i, j;
+    size_t start_used = zmalloc_used_memory(), sum = 0;
+    struct timespec start, end;
+    long long us;
+
+    for (i = 0; i < (int)(sizeof(threads)/sizeof(threads[0])); i++) {
+        pthread_t tids[8];
+
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        for (j = 0; j < threads[i]; j++)
+            pthread_create(&tids[j],NULL,zmalloc_bench_thread,NULL);
+        for (j = 0; j < threads[i]; j++) pthread_join(tids[j],NULL);
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        us = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+        printf("%d thread(s): %d alloc/free pairs in %lld ms (%.02f M pairs/sec)\n",
+            threads[i], threads[i]*ZMALLOC_BENCH_OPS, us/1000,
+            (double)threads[i]*ZMALLOC_BENCH_OPS/us);
+        assert(zmalloc_used_memory() == start_used);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (j = 0; j < ZMALLOC_BENCH_OPS; j++) sum += zmalloc_used_memory();
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    us = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+    printf("zmalloc_used_memory(): %d calls in %lld ms\n", ZMALLOC_BENCH_OPS, us/1000);
+    UNUSED(sum);
+}
+
+#ifndef ZSLAB_DISABLED
+///在另一个线程中释放主线程分配的slab对象
+static void *zslab_test_free_thread(void *arg) {
+    void **ptrs = arg;
+    int j;
+
+    for (j = 0; j < 10000; j++) zslab_free(ptrs[j]);
+    return NULL;
+}
+
+///slab分配器的测试：used_memory按大小类精确计数，跨线程释放，以及和zmalloc的对比
+static void zslab_test(void) {
+    size_t sizes[] = {16, 24, 40, 129, 536, ZSLAB_MAX_SIZE}, start_used, expected = 0;
+    size_t used, reserved, allocated, active, resident;
+    void **ptrs = zmalloc(sizeof(void*)*10000);
+    struct timespec start, end;
+    pthread_t tid;
+    long long us;
+    int j;
+
+    start_used = zmalloc_used_memory();
+    for (j = 0; j < 10000; j++) {
+        size_t size = sizes[j % 6];
+
+        ptrs[j] = zslab_alloc(size);
+        assert(zslab_size(ptrs[j]) >= size && zslab_size(ptrs[j]) < size+64);
+        memset(ptrs[j],j,size);
+        expected += zslab_size(ptrs[j]);
+    }
+    assert(zmalloc_used_memory()-start_used == expected);
+    zslab_get_info(&used,&reserved);
+    zmalloc_get_allocator_info(&allocated,&active,&resident);
+    printf("Allocated 10000 slab objects; used: %zu, slab used: %zu, slab reserved: %zu, "
+           "allocator allocated: %zu, active: %zu\n", zmalloc_used_memory(), used, reserved,
+           allocated, active);
+    pthread_create(&tid,NULL,zslab_test_free_thread,ptrs);
+    pthread_join(tid,NULL);
+    assert(zmalloc_used_memory() == start_used);
+    ///线程退出时本地链表还给了对象池，全部空闲的块已经还给分配器，每个大小类只剩下最新的块和本线程本地链表中的对象所在的块
+    zslab_get_info(&used,&reserved);
+    assert(reserved <= 6*3*ZSLAB_CHUNK_SIZE);
+    printf("Freed slab objects in another thread; used: %zu, slab reserved: %zu\n",
+           zmalloc_used_memory(), reserved);
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (j = 0; j < ZMALLOC_BENCH_OPS; j++) {
+        if (j >= 64) zfree(ptrs[j & 63]);
+        ptrs[j & 63] = zmalloc(24);
+    }
+    for (j = 0; j < 64; j++) zfree(ptrs[j]);
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    us = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+    printf("zmalloc(24)/zfree: %d pairs in %lld ms\n", ZMALLOC_BENCH_OPS, us/1000);
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (j = 0; j < ZMALLOC_BENCH_OPS; j++) {
+        if (j >= 64) zslab_free(ptrs[j & 63]);
+        ptrs[j & 63] = zslab_alloc(24);
+    }
+    for (j = 0; j < 64; j++) zslab_free(ptrs[j]);
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    us = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+    printf("zslab_alloc(24)/zslab_free: %d pairs in %lld ms\n", ZMALLOC_BENCH_OPS, us/1000);
+    assert(zmalloc_used_memory() == start_used);
+    zfree(ptrs);
+}
+#endif
+///分配分析：采样率为1时计数是精确的，再对比关闭和1/1000采样时分配的耗时
+static void zmalloc_profile_test(void) {
+    static zmallocProfile profile;
+    void *ptrs[64];
+    struct timespec start, end;
+    long long us[2] = {LLONG_MAX, LLONG_MAX}, elapsed;
+    unsigned int rates[2] = {0, 1000};
+    size_t sampled = 0;
+    int i, j;
+
+    zmalloc_profile_set_rate(1);
+    for (j = 0; j < 1000; j++) zfree(zmalloc_tagged(100,ZMALLOC_TAG_SDS));
+    zmalloc_profile_get(&profile);
+    assert(profile.count[ZMALLOC_TAG_SDS][7] == 1000 && profile.bytes[ZMALLOC_TAG_SDS] == 100000);
+    printf("Profiled 1000 sds allocations of 100 bytes: count %zu, bytes %zu\n",
+        profile.count[ZMALLOC_TAG_SDS][7], profile.bytes[ZMALLOC_TAG_SDS]);
+
+    ///交替运行几轮，各取最快的一次，减少预热和频率变化的影响
+    for (i = 0; i < 6; i++) {
+        zmalloc_profile_set_rate(rates[i&1]);
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        for (j = 0; j < ZMALLOC_BENCH_OPS; j++) {
+            if (j >= 64) zfree(ptrs[j & 63]);
+            ptrs[j & 63] = zmalloc(16 + (j & 127));
+        }
+        for (j = 0; j < 64; j++) zfree(ptrs[j]);
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        elapsed = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+        if (elapsed < us[i&1]) us[i&1] = elapsed;
+    }
+    zmalloc_profile_get(&profile);
+    for (j = 0; j < ZMALLOC_PROFILE_BUCKETS; j++) sampled += profile.count[ZMALLOC_TAG_OTHER][j];
+    printf("%d alloc/free pairs with profiling off: %lld us, with 1/1000 sampling: %lld us (%+.02f%%), "
+           "estimated allocations in the last round: %zu\n", ZMALLOC_BENCH_OPS, us[0], us[1],
+           (double)(us[1]-us[0])*100/us[0], sampled);
+    zmalloc_profile_set_rate(0);
+}
+
+///对比同步读取和后台采样缓存的RSS、分配器统计和smaps统计的耗时
+static void zmalloc_sampler_test(void) {
+    size_t allocated, active, resident, sum = 0;
+    struct timespec start, end;
+    long long us[2][3];
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        zmalloc_sampler_config(i ? ZMALLOC_SAMPLER_PERIOD : 0);
+        if (i) {
+            ///第一次调用启动后台线程，等它完成第一次采样
+            zmalloc_get_smap_bytes_by_field("Rss:",-1);
+            usleep(ZMALLOC_SAMPLER_PERIOD*1000*2);
+        }
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        for (j = 0; j < 100; j++) sum += zmalloc_get_rss();
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        us[i][0] = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        for (j = 0; j < 100; j++) sum += zmalloc_get_allocator_info(&allocated,&active,&resident);
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        us[i][1] = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        for (j = 0; j < 100; j++) sum += zmalloc_get_smap_bytes_by_field("Rss:",-1);
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        us[i][2] = (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000;
+    }
+    printf("100 calls, synchronous vs sampled: rss %lld/%lld us, allocator info %lld/%lld us, "
+           "smaps Rss %lld/%lld us\n", us[0][0], us[1][0], us[0][1], us[1][1], us[0][2], us[1][2]);
+    printf("RSS: %zu, smaps Rss: %zu\n", zmalloc_get_rss(), zmalloc_get_smap_bytes_by_field("Rss:",-1));
+
+    ///过期的smaps缓存直接返回并带上年龄，后台线程在下一次采样时刷新它
+    {
+        long long age;
+
+        pthread_mutex_lock(&zmalloc_sampler.lock);
+        zmalloc_sampler.smaps_time = zmalloc_clock_ms()-30000;
+        pthread_mutex_unlock(&zmalloc_sampler.lock);
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        zmalloc_get_smap_bytes_by_field_age("Rss:",&age);
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        assert(age >= 30000); ///smaps_refresh会被后台线程并发清掉，刷新是否发生由下面的年龄检查确认
+        printf("Stale smaps read: age %lld ms in %lld us\n", age,
+               (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000);
+        usleep(ZMALLOC_SAMPLER_PERIOD*1000*3);
+        zmalloc_get_smap_bytes_by_field_age("Rss:",&age);
+        assert(age < ZMALLOC_SAMPLER_PERIOD*ZMALLOC_SAMPLER_SMAPS_RATIO);
+        printf("After the background refresh: age %lld ms\n", age);
+    }
+
+    ///后台线程一直在采样的时候反复fork，子进程中读取统计不能死锁，也不能启动自己的后台线程
+    for (j = 0; j < 50; j++) {
+        int status;
+        pid_t child = fork();
+
+        if (child == 0) {
+            zmalloc_get_private_dirty(-1);
+            zmalloc_get_rss();
+            _exit(zmalloc_sampler.running == 0 ? 0 : 1);
+        }
+        assert(child > 0);
+        assert(waitpid(child,&status,0) == child);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        usleep(1000);
+    }
+    printf("50 forks with the sampler running: ok\n");
+    UNUSED(sum);
+}
+
 int zmalloc_test(int argc, char **argv) {
     void *ptr;
 
@@ -519,6 +1775,94 @@ int zmalloc_test(int argc, char **argv) {
     printf("Reallocated to 456 bytes; used: %zu\n", zmalloc_used_memory());
     zfree(ptr);
     printf("Freed pointer; used: %zu\n", zmalloc_used_memory());
+
+    {
+        size_t size = ZMALLOC_HUGE_THRESHOLD*4+123, j;
+        size_t used = zmalloc_used_memory(); ///其他测试留下的内存也计入used_memory，只检查这里的增量
+        zmallocHugeInfo info;
+        char *huge;
+
+        zmalloc_huge_config(ZMALLOC_HUGEPAGE_YES,1,1);
+        huge = zcalloc_huge(size);
+        for (j = 0; j < size; j += 4096) assert(huge[j] == 0);
+        huge[size-1] = 1;
+        zmalloc_huge_get_info(huge,size,&info);
+        printf("Allocated %zu bytes with zcalloc_huge; used: %zu, mapped: %d, "
+               "hugepage: %d, node: %d\n", size,
+               zmalloc_used_memory(), info.mapped, info.hugepage, info.node);
+        zfree_huge(huge,size);
+        printf("Freed huge pointer; used: %zu\n", zmalloc_used_memory());
+
+        ///预先缺页还没有完成时释放，只需要等待正在处理的2MB，不会等待整个映射
+        {
+            size_t big = (size_t)256*1024*1024;
+            struct timespec start, end;
+            char *other;
+
+            huge = zcalloc_huge(big);
+            other = zcalloc_huge(size);
+            zmalloc_huge_get_info(other,size,&info);
+            printf("Second mapping: hugepage: %d\n", info.hugepage);
+            clock_gettime(CLOCK_MONOTONIC,&start);
+            zfree_huge(huge,big);
+            clock_gettime(CLOCK_MONOTONIC,&end);
+            printf("Freed %zu bytes while prefaulting in %lld us\n", big,
+                   (end.tv_sec-start.tv_sec)*1000000LL + (end.tv_nsec-start.tv_nsec)/1000);
+            zfree_huge(other,size);
+        }
+
+        ///默认不调用madvise，映射头中记录的是映射时的设置
+        zmalloc_huge_config(ZMALLOC_HUGEPAGE_DEFAULT,0,1);
+        huge = zcalloc_huge(size);
+        zmalloc_huge_get_info(huge,size,&info);
+        assert(!info.hugepage);
+        zfree_huge(huge,size);
+
+        ///fork之后子进程中没有后台线程，预先缺页还没有完成的映射也可以立即释放，需要时重新创建后台线程
+        {
+            size_t big = (size_t)256*1024*1024;
+            int status;
+            pid_t pid;
+
+            zmalloc_huge_config(ZMALLOC_HUGEPAGE_DEFAULT,1,1);
+            huge = zcalloc_huge(big);
+            usleep(1000); ///让后台线程开始处理，fork时它很可能正在处理这个映射
+            pid = fork();
+            if (pid == 0) {
+                char *child;
+
+                zfree_huge(huge,big);
+                child = zcalloc_huge(size);
+#ifdef HAVE_HUGE_MAPPING
+                {
+                    ///子进程中重新创建的后台线程会把最后一页也缺页进来
+                    unsigned char vec;
+                    int tries = 0;
+                    char *last = child+zmalloc_huge_len(size)-zmalloc_huge_page();
+
+                    while (mincore(last,zmalloc_huge_page(),&vec) == 0 && !(vec & 1) && tries++ < 5000)
+                        usleep(1000);
+                    if (!(vec & 1)) _exit(1);
+                }
+#endif
+                zfree_huge(child,size);
+                _exit(0);
+            }
+            assert(pid != -1);
+            assert(waitpid(pid,&status,0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            zfree_huge(huge,big);
+            zmalloc_huge_config(ZMALLOC_HUGEPAGE_DEFAULT,0,1);
+            printf("Freed prefaulting mappings after fork\n");
+        }
+        assert(zmalloc_used_memory() == used);
+    }
+
+#ifndef ZSLAB_DISABLED
+    zslab_test();
+#endif
+    zmalloc_profile_test();
+    zmalloc_sampler_test();
+    zmalloc_bench();
     return 0;
 }
 #endif
@@ -55,13 +55,94 @@ char *zstrdup(const char *s); ///字符串拷贝，调用C语言的memcpy()函
 size_t zmalloc_used_memory(void); ///计算已用内存的大小
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)); ///发生内存泄漏的处理方法
 
+/* 采样的内存分配分析，按调用方的标签和分配大小统计分配的流量，见zmalloc.c中的说明。
+ * 一个源文件在包含zmalloc.h之前定义ZMALLOC_TAG，这个文件中的zmalloc、zcalloc、zrealloc、zslab_alloc和zcalloc_huge
+ * 就会带上这个标签，没有定义的文件记为ZMALLOC_TAG_OTHER。 */
+#define ZMALLOC_TAG_OTHER 0
+#define ZMALLOC_TAG_SDS 1
+#define ZMALLOC_TAG_DICT 2
+#define ZMALLOC_TAG_ZIPLIST 3
+#define ZMALLOC_TAG_QUICKLIST 4
+#define ZMALLOC_TAG_SKIPLIST 5
+#define ZMALLOC_TAG_ROBJ 6
+#define ZMALLOC_TAGS 7
+#define ZMALLOC_PROFILE_BUCKETS 24 ///大小区间的个数，区间i是[2^(i-1), 2^i)，最后一个区间包括所有更大的分配
 
+typedef struct zmallocProfile {
+    unsigned int rate; ///采样率，0表示没有开启
+    size_t count[ZMALLOC_TAGS][ZMALLOC_PROFILE_BUCKETS]; ///估计的分配次数，按标签和大小区间
+    size_t bytes[ZMALLOC_TAGS]; ///估计的分配字节数，按标签
+} zmallocProfile;
+
+void *zmalloc_tagged(size_t size, int tag);
+void *zcalloc_tagged(size_t size, int tag);
+void *zrealloc_tagged(void *ptr, size_t size, int tag);
+void zmalloc_profile_set_rate(unsigned int rate); ///平均每rate次分配采样一次，0表示关闭，同时清空之前的统计
+void zmalloc_profile_get(zmallocProfile *profile); ///读取分配分析的统计
+const char *zmalloc_tag_name(int tag); ///标签的名字
+
+/* 大块内存的分配，用于字典的hash表这类很大、并且会被随机访问的数组。
+ * 不小于ZMALLOC_HUGE_THRESHOLD的内存单独使用mmap映射，可以选择建议内核使用透明大页、放在当前线程所在的NUMA节点上，
+ * 并由后台线程预先触发缺页。小于这个大小的内存和zcalloc相同。
+ * 释放时必须传入分配时的大小，由调用方记录。
+ * 开启了主动碎片整理时（HAVE_DEFRAG），碎片整理会把hash表交给jemalloc重新分配，它必须是jemalloc直接分配的，
+ * 所以这时不单独映射，zcalloc_huge和zfree_huge就是zcalloc和zfree。编译时定义ZMALLOC_HUGE_DISABLED也可以关闭。 */
+#define ZMALLOC_HUGE_THRESHOLD (2*1024*1024)
+#if defined(HAVE_DEFRAG) && !defined(ZMALLOC_HUGE_DISABLED)
+#define ZMALLOC_HUGE_DISABLED
+#endif
+
+///zmalloc_huge_config()的hugepage参数
+#define ZMALLOC_HUGEPAGE_DEFAULT 0 ///不调用madvise，由内核的透明大页设置决定（默认）
+#define ZMALLOC_HUGEPAGE_YES 1 ///用MADV_HUGEPAGE建议内核使用透明大页
+#define ZMALLOC_HUGEPAGE_NO 2 ///用MADV_NOHUGEPAGE明确不使用透明大页
+
+typedef struct zmallocHugeInfo {
+    int mapped; ///是否是单独映射的（也就是大小不小于ZMALLOC_HUGE_THRESHOLD）
+    int hugepage; ///映射时是否成功建议了内核使用透明大页
+    int node; ///映射时绑定的NUMA节点，没有绑定时为-1
+    size_t size; ///映射的字节数
+} zmallocHugeInfo;
+
+void *zcalloc_huge(size_t size); ///分配大块内存，内容初始化为0
+void *zcalloc_huge_tagged(size_t size, int tag);
+void zfree_huge(void *ptr, size_t size); ///释放zcalloc_huge分配的内存，size为分配时的大小
+void zmalloc_huge_config(int hugepage, int prefault, int numa_local); ///设置透明大页的建议（ZMALLOC_HUGEPAGE_*）、是否后台预先缺页、是否放在当前的NUMA节点上
+void zmalloc_huge_get_info(void *ptr, size_t size, zmallocHugeInfo *info); ///获取zcalloc_huge分配的内存的状态
+
+/* 小对象的slab分配器，用于robj、dictEntry、listNode、跳跃表节点这类大小固定、数量很多的对象。
+ * 对象按大小类放在各自的对象池中，每个线程有本地的空闲链表，分配的大小不能超过ZSLAB_MAX_SIZE。
+ * zslab_alloc()分配的内存必须用zslab_free()释放，它的大小用zslab_size()获取，不能混用zfree()和zmalloc_size()。
+ * 开启了主动碎片整理时（HAVE_DEFRAG），碎片整理会把这些对象逐个交给jemalloc重新分配，
+ * 它们必须是jemalloc直接分配的，所以这时zslab_*就是zmalloc、zfree和zmalloc_size。
+ * 编译时定义ZSLAB_DISABLED也可以关闭slab分配器。 */
+#define ZSLAB_MAX_SIZE 1024
+#if defined(HAVE_DEFRAG) && !defined(ZSLAB_DISABLED)
+#define ZSLAB_DISABLED
+#endif
+
+#ifdef ZSLAB_DISABLED
+#define zslab_alloc_tagged(size,tag) zmalloc_tagged(size,tag)
+#define zslab_free(ptr) zfree(ptr)
+#define zslab_size(ptr) zmalloc_size(ptr)
+#else
+void *zslab_alloc(size_t size); ///从size所属大小类的对象池中分配一个对象
+void *zslab_alloc_tagged(size_t size, int tag);
+void zslab_free(void *ptr); ///释放zslab_alloc()分配的对象
+size_t zslab_size(void *ptr); ///对象所属大小类的大小，也就是它计入used_memory的大小
+#endif
+void zslab_get_info(size_t *used, size_t *reserved); ///块中已经使用的字节数，以及向分配器申请的块的总大小
+
+/* RSS、分配器统计和smaps统计默认由后台线程周期性地读取并缓存，下面的zmalloc_get_*函数直接返回缓存的值。
+ * period_ms为采样周期，0表示关闭后台采样，每次调用都同步读取。 */
+void zmalloc_sampler_config(int period_ms);
 size_t zmalloc_get_rss(void); ///
 int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
 void set_jemalloc_bg_thread(int enable);
 int jemalloc_purge();
 size_t zmalloc_get_private_dirty(long pid);
 size_t zmalloc_get_smap_bytes_by_field(char *field, long pid);
+size_t zmalloc_get_smap_bytes_by_field_age(char *field, long long *age); ///当前进程smaps统计的缓存值，age为它的年龄（毫秒）
 size_t zmalloc_get_memory_size(void);
 void zlibc_free(void *ptr);
 
@@ -81,4 +162,15 @@ size_t zmalloc_usable(void *ptr);
 int zmalloc_test(int argc, char **argv);
 #endif
 
+///定义了ZMALLOC_TAG的源文件中，分配函数带上这个标签
+#if defined(ZMALLOC_TAG)
+#define zmalloc(size) zmalloc_tagged(size,ZMALLOC_TAG)
+#define zcalloc(size) zcalloc_tagged(size,ZMALLOC_TAG)
+#define zrealloc(ptr,size) zrealloc_tagged(ptr,size,ZMALLOC_TAG)
+#define zcalloc_huge(size) zcalloc_huge_tagged(size,ZMALLOC_TAG)
+#define zslab_alloc(size) zslab_alloc_tagged(size,ZMALLOC_TAG)
+#elif defined(ZSLAB_DISABLED)
+#define zslab_alloc(size) zmalloc(size)
+#endif
+
 #endif /* __ZMALLOC_H */